@@ -8,21 +8,17 @@
  */
 #include "bc_usart.h"
 
-/* pgmspace.h
- * Provides macros and functions for saving and reading data out of
- * flash.
- */
-#include <avr/pgmspace.h>
-
 /* stdint.h
  * Defines fixed-width integer types like uint8_t
  */
 #include <stdint.h>
 
-/* avr/io.h
- * Device-specific port definitions
+/* bc_hal.h
+ * Provides the ADC and timer 0 through the hal_adc functions, flash
+ * access, the ISR() macro for the ADC conversion complete interrupt,
+ * and ATOMIC_BLOCK() for reading counters shared with it.
  */
-#include <avr/io.h>
+#include "bc_hal.h"
 
 /* bc_logger.h
  * Provides logger_msg and logger_msg_p for log messages tagged with
@@ -30,28 +26,149 @@
  */
 #include "bc_logger.h"
 
+/* bc_clock.h
+ * Provides clock_fosc() for working out timer 0 sample rates.
+ */
+#include "bc_clock.h"
+
 #include "bc_adc.h"
 
+/* bc_stats.h
+ * Provides the markers that time the conversion complete interrupt.
+ */
+#include "bc_stats.h"
+
+/* bc_sched.h
+ * Provides sched_ready() for waking adc_stream_drain().
+ */
+#include "bc_sched.h"
+
+/* bc_job.h
+ * Provides job_start() for long averages.
+ */
+#include "bc_job.h"
+
 /* The voltage measurement calibration factors
  */
 adc_cal_t volt_calfactor = {
     1, // Slope (mV/count)
-    0  // Offset (mV)
+    0, // Offset (mV)
+    ADC_CAL_QBITS // Slope fraction bits
 };
 adc_cal_t *volt_calfactor_ptr = &volt_calfactor;
 
-/* cmd_vslope(uint16_t vslope)
+/* The voltage sample stream
+ */
+adc_stream_t adc_stream;
+adc_stream_t *adc_stream_ptr = &adc_stream;
+
+/* The scan list and scanner state.  Entry n starts out on channel n.
+ * On the Butterfly, ADC0 is the temperature sensor, ADC1 the voltage
+ * reader, and ADC2 the light sensor.
+ */
+adc_scan_t adc_scan;
+adc_scan_t *adc_scan_ptr = &adc_scan;
+
+/* The single measurement filter
+ */
+adc_filter_t adc_filter = {
+    adc_filter_NONE, // Mode
+    0, // Extra bits
+    2, // Exponential filter weight shift
+    0, // Exponential filter state
+    0  // Exponential filter not started
+};
+adc_filter_t *adc_filter_ptr = &adc_filter;
+
+/* Filter names printed by filtbench?, in adc_filter_mode_t order.
+ */
+const char adc_filter_name[adc_filter_COUNT][8] PROGMEM = {
+    "none",
+    "boxcar",
+    "ema",
+    "median"
+};
+
+/* Timer 0 prescaler settings, in the order of their clock select bits.
+ * The first entry is selected with CS0[2:0] = 1.
+ */
+const uint16_t adc_stream_prescaler[] PROGMEM = {1, 8, 64, 256, 1024};
+
+/* Calibration points recorded by vcalpt
+ */
+typedef struct adc_calpoint_struct {
+    uint16_t counts; // Filtered counts measured at the point
+    uint16_t mv; // The voltage applied at the point
+    uint8_t bits; // The filter's extra bits when the counts were measured
+} adc_calpoint_t;
+
+adc_calpoint_t adc_calpoint[2];
+uint8_t adc_calpoint_valid; // Bit n is set when point n + 1 is recorded
+
+/* cmd_vslope(vslope)
  * Set the voltage measurement's slope calibration factor.
  */
-void cmd_vslope(uint16_t vslope) {
+command_status_t cmd_vslope(command_arg_t *argv) {
+    uint16_t vslope = argv[0].u16;
     volt_calfactor_ptr -> cal_slope = vslope;
+    return command_status_OK;
 }
 
-/* cmd_voffset(uint16_t voffset)
+/* cmd_voffset(voffset)
  * Set the voltage measurement's offset calibration factor.
  */
-void cmd_voffset(uint16_t voffset) {
+command_status_t cmd_voffset(command_arg_t *argv) {
+    int16_t voffset = argv[0].s16;
     volt_calfactor_ptr -> cal_offset = voffset;
+    return command_status_OK;
+}
+
+/* cmd_vcal(slope, offset)
+ * Set the voltage measurement's slope and offset calibration factors.
+ */
+command_status_t cmd_vcal(command_arg_t *argv) {
+    volt_calfactor_ptr -> cal_slope = argv[0].u16;
+    volt_calfactor_ptr -> cal_offset = argv[1].s16;
+    return command_status_OK;
+}
+
+/* adc_qbits_check( fraction bits )
+ * Log an error and return 1 if there are too many fraction bits.
+ */
+static uint8_t adc_qbits_check( uint16_t qbits ) {
+    if (qbits > ADC_CAL_MAXQBITS) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Slopes can have at most %u fraction bits.\r\n"),
+            ADC_CAL_MAXQBITS);
+        return 1;
+    }
+    return 0;
+}
+
+/* cmd_vqbits(qbits)
+ * Set the number of fraction bits in the voltage measurement's slope.
+ */
+command_status_t cmd_vqbits(command_arg_t *argv) {
+    uint16_t qbits = argv[0].u16;
+    if (adc_qbits_check(qbits)) {
+        return command_status_FAILED;
+    }
+    volt_calfactor_ptr -> cal_qbits = (uint8_t)qbits;
+    return command_status_OK;
+}
+
+/* cmd_vcal_q()
+ * Report the voltage measurement's calibration factors.
+ */
+command_status_t cmd_vcal_q(command_arg_t *argv) {
+    usart_puts_p(PSTR("0x"));
+    usart_put_hex16(volt_calfactor_ptr -> cal_slope);
+    usart_putc(' ');
+    usart_put_s16(volt_calfactor_ptr -> cal_offset);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(volt_calfactor_ptr -> cal_qbits);
+    usart_put_crlf();
+    return command_status_OK;
 }
 
 /* adc_init(void)
@@ -59,43 +176,36 @@ void cmd_voffset(uint16_t voffset) {
  *     Set the default ADC mux position to 1: the voltage reader
  */
 void adc_init(void) {
-    logger_msg_p("adc",log_level_INFO, PSTR("Initializing ADC.\r\n"));
-    /* The butterfly has Vcc connected to AVcc via a low-pass filter.
-     * It also has a shunt capacitor at the Aref pin.  So I can use the
-     * voltage at AVcc as the reference. */
-    ADMUX = (0<<REFS1) | (1<<REFS0);
-
-    /* Right-justify the data in the high and low registers by clearing
-     * ADLAR.  This is a 10-bit ADC. */
-    ADMUX &= ~(_BV(ADLAR));
-
-    /* The butterfly's voltage reader is connected to ADC1 on pin 60.
-     * This makes a nice initialization value. */
-    ADMUX |= 1;
-
-    /* Enable the ADC and set the fosc --> fsar prescaler.
-     * The SAR conversion requires between 50 and 200kHz for 10-bit
-     * resolution, but can be set as high as fosc/2 for lower resolution.
-     * Set the prescaler to 8 to get fsar = 125kHz.
-     * Normal conversions take 13 cycles, or 13*8us = 104us for
-     * fsar = 125kHz.  The maximum conversion rate is thus fsar / 13
-     * or 9.6kHz for fsar = 125kHz. 
-     * 
-     * ADCSRA = (1<<ADEN) | (1<<ADPS1) | (1<<ADPS0); fsar = 125kHz
-     */
-    ADCSRA = (1<<ADEN) | (1<<ADPS1) | (1<<ADPS0);
-
-    /* Disable auto-triggering.  We'll trigger the ADC manually. */
-    ADCSRA &= ~(_BV(ADATE));
-
-    /* The first ADC conversion will take 25 ADC clock cycles instead of
-     * the normal 13.  The first one initializes the ADC. Take a single
-     * conversion for this initialization step. */
-    ADCSRA |= (1<<ADSC);
-
-    /* The ADIF bit in the ADCSRA register will be set when the conversion
-     * is finished. Wait for conversion to finish. */
-    while(!(ADCSRA & (1<<ADIF)));
+    logger_msg_p(log_system_ADC,log_level_INFO, PSTR("Initializing ADC.\r\n"));
+    /* Use AVcc as the reference with right-justified results, select
+     * the voltage reader on ADC1, set fsar to 125kHz and run the first
+     * conversion.  Normal conversions take 13 fsar cycles, or 104us. */
+    hal_adc_init();
+    adcblock_init(&(adc_stream_ptr -> blocks));
+    for (uint8_t slot = 0; slot < ADC_SCAN_SLOTS; slot++) {
+        adc_scan_ptr -> entry[slot].channel = slot;
+        adc_scan_ptr -> entry[slot].samples = 1;
+        adc_scan_ptr -> entry[slot].cal.cal_slope = 1;
+        adc_scan_ptr -> entry[slot].cal.cal_offset = 0;
+        adc_scan_ptr -> entry[slot].cal.cal_qbits = ADC_CAL_QBITS;
+    }
+}
+
+/* adc_clock_update(void)
+ * The ADPS bits select a prescaler of 2 to the power of their value,
+ * and hal_adc_init() set them up for the 1MHz clock.
+ */
+void adc_clock_update(void) {
+    uint32_t prescale = clock_fosc() / ADC_SAR_FREQUENCY;
+    uint8_t adps = 0;
+    while ((prescale > 1) && (adps < 7)) {
+        prescale >>= 1;
+        adps++;
+    }
+    hal_adc_prescaler(adps);
+    if (adc_stream_ptr -> running) {
+        adc_stream_start(adc_stream_ptr -> rate, adc_stream_ptr -> format);
+    }
 }
 
 /* Set the mux channel for the ADC input.
@@ -108,47 +218,864 @@ void adc_init(void) {
  * DDRF.  See section 13.3 of the datasheet. 
  */
 void adc_mux(uint8_t channel) {
-    ADMUX &= (1<<REFS1) | (1<<REFS0) | (1<<ADLAR);
-    ADMUX |= channel;
+    hal_adc_mux(channel);
 }
 
 /* adc_read() 
  * Return a measurement made with the ADC.
  */
 uint16_t adc_read(void) {
-    uint16_t adc_temp = 0;
+    /* Timer 0 is triggering conversions, and the ADC interrupt is
+     * taking the results.  Don't start another one. */
+    if (adc_stream_ptr -> running) {
+        return adc_stream_ptr -> last;
+    }
+    return hal_adc_convert();
+}
+
+/* adc_claim()
+ * Return the oldest finished block of streamed samples.
+ */
+uint16_t *adc_claim(void) {
+    return adcblock_claim(&(adc_stream_ptr -> blocks));
+}
+
+/* adc_release()
+ * Hand the claimed block back to the ADC interrupt.
+ */
+void adc_release(void) {
+    adcblock_release(&(adc_stream_ptr -> blocks));
+}
+
+/* adc_boxcar( sample source )
+ * Sum 4^bits samples and shift the sum down by bits.  The sum of 64
+ * 10-bit samples fits in 16 bits.
+ */
+static uint16_t adc_boxcar( adc_source_t source ) {
+    uint16_t sum = 0;
+    uint8_t count;
+    uint8_t samples = 1 << (2 * (adc_filter_ptr -> bits));
+    for (count = 0; count < samples; count++) {
+        sum += source();
+    }
+    return sum >> (adc_filter_ptr -> bits);
+}
+
+/* adc_ema( sample source )
+ * Move the average 1/2^ema_shift of the way toward each of 4^bits
+ * samples.  The average is kept with ADC_EMA_FRACTION fraction bits,
+ * and the first sample ever seeds it.
+ */
+static uint16_t adc_ema( adc_source_t source ) {
+    uint16_t scaled; // Sample with fraction bits
+    uint16_t state = adc_filter_ptr -> ema_state;
+    uint8_t shift = adc_filter_ptr -> ema_shift;
+    uint8_t count;
+    uint8_t samples = 1 << (2 * (adc_filter_ptr -> bits));
+    for (count = 0; count < samples; count++) {
+        scaled = source() << ADC_EMA_FRACTION;
+        if (adc_filter_ptr -> ema_valid == 0) {
+            state = scaled;
+            adc_filter_ptr -> ema_valid = 1;
+        }
+        // Keep the difference unsigned so the shift is well defined
+        else if (scaled >= state) {
+            state += (scaled - state) >> shift;
+        }
+        else {
+            state -= (state - scaled) >> shift;
+        }
+    }
+    adc_filter_ptr -> ema_state = state;
+    return state >> (ADC_EMA_FRACTION - (adc_filter_ptr -> bits));
+}
+
+/* adc_median( sample source )
+ * Insertion sort ADC_MEDIAN_SIZE samples as they arrive and take the
+ * middle one.
+ */
+static uint16_t adc_median( adc_source_t source ) {
+    uint16_t sorted[ADC_MEDIAN_SIZE];
+    uint16_t sample;
+    uint8_t count;
+    uint8_t index;
+    for (count = 0; count < ADC_MEDIAN_SIZE; count++) {
+        sample = source();
+        for (index = count; (index > 0) && (sorted[index - 1] > sample);
+             index--) {
+            sorted[index] = sorted[index - 1];
+        }
+        sorted[index] = sample;
+    }
+    return sorted[ADC_MEDIAN_SIZE / 2] << (adc_filter_ptr -> bits);
+}
+
+/* adc_filter_run( mode, sample source )
+ * Dispatch to the filter for mode.
+ */
+uint16_t adc_filter_run( adc_filter_mode_t mode, adc_source_t source ) {
+    switch( mode ) {
+        case adc_filter_BOXCAR:
+            return adc_boxcar(source);
+        case adc_filter_EMA:
+            return adc_ema(source);
+        case adc_filter_MEDIAN:
+            return adc_median(source);
+        default:
+            return source();
+    }
+}
+
+/* adc_filter_bits()
+ * The NONE filter doesn't add any bits, whatever the setting.
+ */
+uint8_t adc_filter_bits(void) {
+    if (adc_filter_ptr -> mode == adc_filter_NONE) {
+        return 0;
+    }
+    return adc_filter_ptr -> bits;
+}
 
-    /* Enable the ADC.  It seems like I already did this in adc_init(),
-     * but the part locks up if I don't also do it here. */
-    ADCSRA |= _BV(ADEN);
+/* adc_measure()
+ * Make a filtered measurement from the currently selected channel.
+ */
+uint16_t adc_measure(void) {
+    return adc_filter_run(adc_filter_ptr -> mode,&adc_read);
+}
 
-    ADCSRA |= (1<<ADSC);  // Do a single conversion
-    while(!(ADCSRA & (1<<ADIF)));  // Wait for the conversion to finish
-    adc_temp = ADCL;            // Read the lower 8 bits
-    adc_temp += (ADCH << 8);    // Add the upper 2 bits
-    return adc_temp;
+/* adc_scale( pointer to calibration, raw counts, extra bits )
+ * Returns counts times the slope in mV, without the offset or any
+ * limit.  The product of 13-bit filtered counts and a 16-bit slope
+ * needs 29 bits.  Adding half of the divisor before shifting rounds to
+ * the nearest mV instead of always rounding down.
+ */
+static int32_t adc_scale( adc_cal_t *cal_ptr, uint16_t counts, uint8_t bits ) {
+    uint8_t shift = (cal_ptr -> cal_qbits) + bits;
+    uint32_t product = (uint32_t)counts * cal_ptr -> cal_slope;
+    if (shift > 0) {
+        product += (uint32_t)1 << (shift - 1);
+    }
+    return (int32_t)(product >> shift);
+}
+
+/* adc_calibrate( pointer to calibration, raw counts, extra bits )
+ * Add the offset to the scaled counts and keep the result in range.
+ */
+int16_t adc_calibrate( adc_cal_t *cal_ptr, uint16_t counts, uint8_t bits ) {
+    int32_t result;
+    result = adc_scale(cal_ptr,counts,bits) + cal_ptr -> cal_offset;
+    if (result > INT16_MAX) {
+        return INT16_MAX;
+    }
+    if (result < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t)result;
+}
+
+/* adc_autocal( pointer to calibration, counts 1, mV 1, counts 2, mV 2,
+ *              extra bits )
+ * slope = (mV 2 - mV 1) / (counts 2 - counts 1), with fraction bits.
+ * Try the most fraction bits first, and drop one at a time until the
+ * shifted voltage difference fits in 31 bits and the slope fits in 16.
+ * Then pick the offset that puts point 1 on the line.
+ */
+uint8_t adc_autocal( adc_cal_t *cal_ptr, uint16_t counts1, uint16_t mv1,
+                     uint16_t counts2, uint16_t mv2, uint8_t bits ) {
+    adc_cal_t cal;
+    uint16_t swap;
+    uint16_t dcounts;
+    uint32_t dmv;
+    uint32_t slope = 0;
+    int32_t offset;
+    int8_t qbits;
+    if (counts2 < counts1) {
+        // Put the points in order
+        swap = counts1; counts1 = counts2; counts2 = swap;
+        swap = mv1; mv1 = mv2; mv2 = swap;
+    }
+    if ((counts2 == counts1) || (mv2 <= mv1)) {
+        return 1;
+    }
+    dcounts = counts2 - counts1;
+    dmv = mv2 - mv1;
+    for (qbits = ADC_CAL_MAXQBITS; qbits >= 0; qbits--) {
+        if (dmv > (0x7fffffffUL >> (qbits + bits))) {
+            continue;
+        }
+        slope = ((dmv << (qbits + bits)) + (dcounts / 2)) / dcounts;
+        if ((slope > 0) && (slope <= 0xffff)) {
+            break;
+        }
+    }
+    if (qbits < 0) {
+        return 1;
+    }
+    cal.cal_slope = (uint16_t)slope;
+    cal.cal_qbits = (uint8_t)qbits;
+    cal.cal_offset = 0;
+    /* Use the scaled counts before they're limited to the int16_t
+     * range, or a steep line far from zero gets the wrong offset. */
+    offset = (int32_t)mv1 - adc_scale(&cal,counts1,bits);
+    if ((offset > INT16_MAX) || (offset < INT16_MIN)) {
+        return 1;
+    }
+    cal.cal_offset = (int16_t)offset;
+    *cal_ptr = cal;
+    return 0;
+}
+
+/* adc_scan_busy()
+ * Log an error and return 1 if the scan owns the ADC.
+ */
+static uint8_t adc_scan_busy(void) {
+    if (adc_scan_ptr -> running) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("The ADC is scanning.  Use scan? or stop the scan.\r\n"));
+        return 1;
+    }
+    return 0;
+}
+
+/* adc_stream_busy( nonzero if the measurement combines several reads )
+ * Log an error and return 1 if the stream owns the ADC and the
+ * measurement would combine several reads.  adc_read() only returns
+ * the stream's latest sample then, so a filter or average would see the
+ * same sample over and over.
+ */
+static uint8_t adc_stream_busy( uint8_t combined ) {
+    if ((adc_stream_ptr -> running) && combined) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("The ADC is streaming.  Stop the stream or the filter.\r\n"));
+        return 1;
+    }
+    return 0;
+}
+
+/* adc_measure_busy()
+ * Log an error and return 1 if adc_measure() can't be used right now.
+ */
+static uint8_t adc_measure_busy(void) {
+    return adc_scan_busy() ||
+           adc_stream_busy(adc_filter_ptr -> mode != adc_filter_NONE);
 }
 
 /* cmd_vcounts_q()
  * Query the raw ADC counts from the voltage measurement.
  */
-void cmd_vcounts_q(uint16_t nonval) {
+command_status_t cmd_vcounts_q(command_arg_t *argv) {
     uint16_t adc_temp = 0;
-    adc_temp = adc_read();
-    usart_printf_p(PSTR("0x%x\r\n"),adc_temp);
+    if (adc_measure_busy()) {
+        return command_status_FAILED;
+    }
+    adc_temp = adc_measure();
+    usart_puts_p(PSTR("0x"));
+    usart_put_hex16(adc_temp);
+    usart_put_crlf();
+    return command_status_OK;
 }
 
 /* cmd_volt_q()
  * Query the calibrated voltage measurement.  The voltage in mV is arrived
  * at with:
- * mV = ((ADC counts) * vslope >> 16) - voffset 
- * Notice that voffset is assumed to be positive -- all these numbers are
- * unsigned 16-bit integers. */
-void cmd_volt_q(uint16_t nonval) {
+ * mV = ((ADC counts) * vslope >> (qbits + filter bits)) + voffset 
+ * The offset is signed, so the result can be negative. */
+command_status_t cmd_volt_q(command_arg_t *argv) {
     uint16_t raw_counts = 0;
-    uint16_t result_mv = 0;
-    raw_counts = adc_read();
-    result_mv = ((raw_counts * volt_calfactor_ptr -> cal_slope) >> 4) +
-                volt_calfactor_ptr -> cal_offset;
-    usart_printf_p(PSTR("%u\r\n"),result_mv);
+    int16_t result_mv = 0;
+    if (adc_measure_busy()) {
+        return command_status_FAILED;
+    }
+    raw_counts = adc_measure();
+    result_mv = adc_calibrate(volt_calfactor_ptr,raw_counts,
+                              adc_filter_bits());
+    usart_put_s16(result_mv);
+    usart_put_crlf();
+    return command_status_OK;
+}
+
+/* adc_average_step( pointer to job )
+ * Take one filtered measurement each step.  done counts the
+ * measurements, acc sums them, and pos holds the filter bits they were
+ * made with.  A sum of 65535 13-bit measurements fits in 32 bits.
+ * Stop if the scan or the stream takes the ADC or the filter bits
+ * change, since the measurements would no longer be comparable.
+ */
+static job_status_t adc_average_step( job_t *job_ptr ) {
+    uint16_t counts;
+    if ((adc_scan_ptr -> running) || (adc_stream_ptr -> running) ||
+        (adc_filter_bits() != (job_ptr -> pos))) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Averaging stopped.  The ADC setup changed.\r\n"));
+        job_reply_done(job_ptr);
+        usart_put_crlf();
+        return job_status_DONE;
+    }
+    job_ptr -> acc += adc_measure();
+    (job_ptr -> done)++;
+    if ((job_ptr -> done) < (job_ptr -> total)) {
+        return job_status_RUNNING;
+    }
+    counts = (uint16_t)((job_ptr -> acc) / (job_ptr -> total));
+    job_reply_done(job_ptr);
+    usart_putc(' ');
+    usart_put_s16(adc_calibrate(volt_calfactor_ptr,counts,job_ptr -> pos));
+    usart_put_crlf();
+    return job_status_DONE;
+}
+
+/* cmd_vavg()
+ * Called by the remote command "vavg."
+ */
+command_status_t cmd_vavg(command_arg_t *argv) {
+    uint16_t samples = argv[0].u16;
+    if (adc_scan_busy() || adc_stream_busy(1)) {
+        return command_status_FAILED;
+    }
+    if (samples == 0) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Average at least one measurement.\r\n"));
+        return command_status_FAILED;
+    }
+    if (job_start(&adc_average_step,samples,adc_filter_bits()) == 0) {
+        return command_status_FAILED;
+    }
+    return command_status_OK;
+}
+
+/* cmd_vcalpt(point, mV)
+ * Measure the voltage reader with the current filter and record it as
+ * a calibration point.  Both points have to be measured with the same
+ * filter bits, since the counts are compared directly.
+ */
+command_status_t cmd_vcalpt(command_arg_t *argv) {
+    uint16_t point = argv[0].u16;
+    adc_calpoint_t *point_ptr;
+    if ((point == 0) || (point > 2)) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Calibration point %u is not 1 or 2.\r\n"),point);
+        return command_status_FAILED;
+    }
+    if (argv[1].u16 > INT16_MAX) {
+        // adc_calibrate() can't return more than this
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Calibration point %u mV is more than %u.\r\n"),
+            argv[1].u16,INT16_MAX);
+        return command_status_FAILED;
+    }
+    if (adc_measure_busy()) {
+        return command_status_FAILED;
+    }
+    point_ptr = &adc_calpoint[point - 1];
+    point_ptr -> counts = adc_measure();
+    point_ptr -> mv = argv[1].u16;
+    point_ptr -> bits = adc_filter_bits();
+    adc_calpoint_valid |= (1 << (point - 1));
+    logger_msg_p(log_system_ADC,log_level_INFO,
+        PSTR("Point %u is 0x%x counts at %u mV.\r\n"),
+        point,point_ptr -> counts,point_ptr -> mv);
+    if ((point != 2) || ((adc_calpoint_valid & 1) == 0)) {
+        return command_status_OK;
+    }
+    adc_calpoint_valid = 0;
+    if (adc_calpoint[0].bits != adc_calpoint[1].bits) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("The filter changed between points.  Record both again.\r\n"));
+        return command_status_FAILED;
+    }
+    if (adc_autocal(volt_calfactor_ptr,adc_calpoint[0].counts,adc_calpoint[0].mv,
+                    adc_calpoint[1].counts,adc_calpoint[1].mv,
+                    adc_calpoint[1].bits) != 0) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("The points don't give a usable slope.\r\n"));
+        return command_status_FAILED;
+    }
+    logger_msg_p(log_system_ADC,log_level_INFO,
+        PSTR("Calibrated: slope 0x%x offset %d with %u fraction bits.\r\n"),
+        volt_calfactor_ptr -> cal_slope,volt_calfactor_ptr -> cal_offset,
+        volt_calfactor_ptr -> cal_qbits);
+    return command_status_OK;
+}
+
+/* cmd_filter(mode, bits, shift)
+ * Set up the single measurement filter.  Changing the filter restarts
+ * the exponential average.
+ */
+command_status_t cmd_filter(command_arg_t *argv) {
+    uint16_t mode = argv[0].u16;
+    uint16_t bits = argv[1].u16;
+    uint16_t shift = argv[2].u16;
+    if (mode >= adc_filter_COUNT) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Filter mode %u is not between 0 and %u.\r\n"),
+            mode,adc_filter_COUNT - 1);
+        return command_status_FAILED;
+    }
+    if (bits > ADC_FILTER_MAXBITS) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Filters can add at most %u bits.\r\n"),ADC_FILTER_MAXBITS);
+        return command_status_FAILED;
+    }
+    if ((shift == 0) || (shift > ADC_EMA_FRACTION)) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Filter weight shift %u is not between 1 and %u.\r\n"),
+            shift,ADC_EMA_FRACTION);
+        return command_status_FAILED;
+    }
+    adc_filter_ptr -> mode = (adc_filter_mode_t)mode;
+    adc_filter_ptr -> bits = (uint8_t)bits;
+    adc_filter_ptr -> ema_shift = (uint8_t)shift;
+    adc_filter_ptr -> ema_valid = 0;
+    return command_status_OK;
+}
+
+/* cmd_filter_q()
+ * Report the filter configuration.
+ */
+command_status_t cmd_filter_q(command_arg_t *argv) {
+    usart_puts_p(PSTR("0x"));
+    usart_put_hex16(adc_filter_ptr -> mode);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(adc_filter_ptr -> bits);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(adc_filter_ptr -> ema_shift);
+    usart_put_crlf();
+    return command_status_OK;
+}
+
+/* The made-up sample fed to the filters by filtbench?
+ */
+static uint16_t adc_bench_sample;
+
+/* adc_bench_source()
+ * Return a new made-up sample.  Stepping by an odd number keeps the
+ * median filter's sort from getting its best or worst case every time.
+ */
+static uint16_t adc_bench_source(void) {
+    adc_bench_sample = (adc_bench_sample + 0x137) & 0x3ff;
+    return adc_bench_sample;
+}
+
+/* cmd_filtbench_q()
+ * Timer 1 counts system clock cycles, so the difference between
+ * timestamps is the filter's cost in cycles.  That includes the calls
+ * to the made-up source, which stand in for reading the ADC result.
+ * Each filter is timed a few times and the fastest run is kept, since
+ * interrupts can land in the middle.  The rate adds the conversions
+ * the filter would wait for.
+ */
+command_status_t cmd_filtbench_q(command_arg_t *argv) {
+    adc_filter_t saved = *adc_filter_ptr; // Keep the real average
+    uint16_t start;
+    uint16_t cycles;
+    uint16_t fastest;
+    uint32_t total;
+    uint8_t samples;
+    uint8_t mode;
+    uint8_t run;
+    for (mode = 0; mode < adc_filter_COUNT; mode++) {
+        fastest = 0xffff;
+        for (run = 0; run < 4; run++) {
+            start = clock_timestamp();
+            adc_filter_run((adc_filter_mode_t)mode,&adc_bench_source);
+            cycles = clock_timestamp() - start;
+            if (cycles < fastest) {
+                fastest = cycles;
+            }
+        }
+        switch( mode ) {
+            case adc_filter_BOXCAR:
+            case adc_filter_EMA:
+                samples = 1 << (2 * (adc_filter_ptr -> bits));
+                break;
+            case adc_filter_MEDIAN:
+                samples = ADC_MEDIAN_SIZE;
+                break;
+            default:
+                samples = 1;
+                break;
+        }
+        total = fastest + ((uint32_t)samples * ADC_CONVERSION_CLOCKS *
+                           (clock_fosc() / ADC_SAR_FREQUENCY));
+        usart_puts_p(adc_filter_name[mode]);
+        usart_putc(' ');
+        usart_put_u16(fastest);
+        usart_putc(' ');
+        // total is at least one conversion, so the rate fits in 16 bits
+        usart_put_u16((uint16_t)(clock_fosc() / total));
+        usart_put_crlf();
+    }
+    *adc_filter_ptr = saved;
+    return command_status_OK;
+}
+
+/* adc_stream_start( rate, format )
+ * Timer 0 runs in CTC mode and its compare match A triggers each
+ * conversion.  Pick the smallest prescaler that lets the 8-bit compare
+ * value reach the rate, since that gives the finest rate steps.
+ */
+uint16_t adc_stream_start( uint16_t rate, adc_stream_format_t format ) {
+    uint16_t prescale = 0;
+    uint32_t top = 0; // Timer 0 counts per sample
+    uint8_t index;
+    if (rate == 0) {
+        return 0;
+    }
+    for (index = 0; index < sizeof(adc_stream_prescaler)/sizeof(uint16_t);
+         index++) {
+        memcpy_P(&prescale,&adc_stream_prescaler[index],sizeof(uint16_t));
+        top = ((clock_fosc() / prescale) + (rate / 2)) / rate;
+        if (top <= 256) {
+            break;
+        }
+    }
+    if ((top == 0) || (top > 256)) {
+        // The rate is out of timer 0's reach
+        return 0;
+    }
+    adc_scan_stop();
+    adc_stream_stop();
+    adcblock_init(&(adc_stream_ptr -> blocks));
+    adc_stream_ptr -> sequence = 0;
+    adc_stream_ptr -> format = format;
+    adc_stream_ptr -> rate = (uint16_t)((clock_fosc() / prescale) / top);
+    adc_stream_ptr -> running = 1;
+    // The first prescaler is selected with clock select bits 1
+    hal_adc_timer_start(index + 1,(uint16_t)top);
+    return adc_stream_ptr -> rate;
+}
+
+/* adc_stream_stop(void)
+ * Stop timer 0 and turn off auto triggering.  The block count and the
+ * overruns are kept for streamstat? until the next start.
+ */
+void adc_stream_stop(void) {
+    hal_adc_timer_stop();
+    adc_stream_ptr -> running = 0;
+    adcblock_empty(&(adc_stream_ptr -> blocks));
+}
+
+/* adc_stream_put( byte, pointer to checksum )
+ * Send one byte of a binary block and add it to the checksum.
+ */
+static void adc_stream_put( uint8_t data, uint8_t *checksum_ptr ) {
+    *checksum_ptr += data;
+    usart_putc(data);
+}
+
+/* adc_stream_drain(void)
+ * Blocks are sent straight from where the ADC interrupt wrote them and
+ * are only released after they've been handed to the transmit queue, so
+ * a slow link shows up as overruns rather than as lost characters.
+ */
+void adc_stream_drain(void) {
+    uint8_t checksum = 0;
+    uint8_t count;
+    uint16_t *block;
+    while ((block = adc_claim()) != NULL) {
+        if (adc_stream_ptr -> format == adc_stream_format_BINARY) {
+            checksum = 0;
+            usart_putc(ADC_STREAM_SYNC);
+            adc_stream_put((uint8_t)(adc_stream_ptr -> sequence),&checksum);
+            adc_stream_put((uint8_t)((adc_stream_ptr -> sequence) >> 8),
+                &checksum);
+            adc_stream_put(ADCBLOCK_SIZE,&checksum);
+        }
+        else {
+            usart_puts_p(PSTR("s "));
+            usart_put_hex16(adc_stream_ptr -> sequence);
+        }
+        for (count = 0; count < ADCBLOCK_SIZE; count++) {
+            if (adc_stream_ptr -> format == adc_stream_format_BINARY) {
+                adc_stream_put((uint8_t)block[count],&checksum);
+                adc_stream_put((uint8_t)(block[count] >> 8),&checksum);
+            }
+            else {
+                usart_putc(' ');
+                usart_put_hex16(block[count]);
+            }
+        }
+        if (adc_stream_ptr -> format == adc_stream_format_BINARY) {
+            usart_putc(checksum);
+        }
+        else {
+            usart_put_crlf();
+        }
+        adc_release();
+        (adc_stream_ptr -> sequence)++;
+    }
+}
+
+/* cmd_stream(rate, format)
+ * Start or stop the voltage sample stream.
+ */
+command_status_t cmd_stream(command_arg_t *argv) {
+    uint16_t rate = argv[0].u16;
+    uint16_t format = argv[1].u16;
+    if (rate == 0) {
+        adc_stream_stop();
+        logger_msg_p(log_system_ADC,log_level_INFO,
+            PSTR("Stopped streaming.\r\n"));
+        return command_status_OK;
+    }
+    if (format > adc_stream_format_BINARY) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Stream format %u is not 0 (hex) or 1 (binary).\r\n"),format);
+        return command_status_FAILED;
+    }
+    if ((rate > ADC_STREAM_MAXRATE) ||
+        (adc_stream_start(rate,(adc_stream_format_t)format) == 0)) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Can't stream at %u Hz.\r\n"),rate);
+        return command_status_FAILED;
+    }
+    logger_msg_p(log_system_ADC,log_level_INFO,
+        PSTR("Streaming at %u Hz.\r\n"),adc_stream_ptr -> rate);
+    return command_status_OK;
+}
+
+/* cmd_streamstat_q()
+ * Report the sample stream statistics.
+ */
+command_status_t cmd_streamstat_q(command_arg_t *argv) {
+    uint16_t overruns;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        overruns = adc_stream_ptr -> blocks.overruns;
+    }
+    usart_put_u16((adc_stream_ptr -> running) ? (adc_stream_ptr -> rate) : 0);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(adc_stream_ptr -> sequence);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(overruns);
+    usart_put_crlf();
+    return command_status_OK;
+}
+
+/* adc_scan_start( number of entries )
+ * The ADC interrupt starts each conversion after the first, so the
+ * scan runs as fast as the conversions and the interrupt allow.  Clear
+ * the results of the last scan, so scan? shows a zero stamp for an
+ * entry until this scan has finished it.
+ */
+uint8_t adc_scan_start( uint8_t length ) {
+    uint8_t slot;
+    if ((length == 0) || (length > ADC_SCAN_SLOTS)) {
+        return 1;
+    }
+    adc_stream_stop();
+    adc_scan_stop();
+    for (slot = 0; slot < ADC_SCAN_SLOTS; slot++) {
+        adc_scan_ptr -> entry[slot].total = 0;
+        adc_scan_ptr -> entry[slot].stamp = 0;
+    }
+    adc_scan_ptr -> length = length;
+    adc_scan_ptr -> index = 0;
+    adc_scan_ptr -> count = 0;
+    adc_scan_ptr -> sum = 0;
+    adc_scan_ptr -> sweeps = 0;
+    adc_mux(adc_scan_ptr -> entry[0].channel);
+    adc_scan_ptr -> discard = 1;
+    adc_scan_ptr -> running = 1;
+    hal_adc_irq_start();
+    return 0;
+}
+
+/* adc_scan_stop(void)
+ * Let a conversion that's already started finish, so it can't be
+ * mistaken for the next single conversion.
+ */
+void adc_scan_stop(void) {
+    if (adc_scan_ptr -> running == 0) {
+        return;
+    }
+    hal_adc_irq_stop();
+    adc_scan_ptr -> running = 0;
+    adc_mux(1); // Back to the voltage reader
+}
+
+/* adc_scan_slot( slot number )
+ * Log an error and return 1 if slot isn't in the scan list.
+ */
+static uint8_t adc_scan_slot( uint16_t slot ) {
+    if (slot >= ADC_SCAN_SLOTS) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Scan entry %u is not between 0 and %u.\r\n"),
+            slot,ADC_SCAN_SLOTS - 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* cmd_scanch(slot, channel, samples)
+ * Set the channel and number of samples for a scan list entry.  The
+ * interrupt reads both while the scan runs, and a sum taken with the
+ * old count would be averaged with the new one, so only allow this
+ * while the scan is stopped.
+ */
+command_status_t cmd_scanch(command_arg_t *argv) {
+    uint16_t slot = argv[0].u16;
+    uint16_t channel = argv[1].u16;
+    uint16_t samples = argv[2].u16;
+    if (adc_scan_slot(slot) || adc_scan_busy()) {
+        return command_status_FAILED;
+    }
+    if (channel > 7) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("ADC channel %u is not between 0 and 7.\r\n"),channel);
+        return command_status_FAILED;
+    }
+    if ((samples == 0) || (samples > ADC_SCAN_MAXSAMPLES)) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Sample count %u is not between 1 and %u.\r\n"),
+            samples,ADC_SCAN_MAXSAMPLES);
+        return command_status_FAILED;
+    }
+    adc_scan_ptr -> entry[slot].channel = (uint8_t)channel;
+    adc_scan_ptr -> entry[slot].samples = (uint8_t)samples;
+    return command_status_OK;
+}
+
+/* cmd_scancal(slot, slope, offset)
+ * Set the calibration factors for a scan list entry.  Only scan? uses
+ * them, so there's no need to stop the interrupt.
+ */
+command_status_t cmd_scancal(command_arg_t *argv) {
+    uint16_t slot = argv[0].u16;
+    if (adc_scan_slot(slot)) {
+        return command_status_FAILED;
+    }
+    adc_scan_ptr -> entry[slot].cal.cal_slope = argv[1].u16;
+    adc_scan_ptr -> entry[slot].cal.cal_offset = argv[2].s16;
+    return command_status_OK;
+}
+
+/* cmd_scanq(slot, qbits)
+ * Set the number of fraction bits in a scan list entry's slope.
+ */
+command_status_t cmd_scanq(command_arg_t *argv) {
+    uint16_t slot = argv[0].u16;
+    uint16_t qbits = argv[1].u16;
+    if (adc_scan_slot(slot) || adc_qbits_check(qbits)) {
+        return command_status_FAILED;
+    }
+    adc_scan_ptr -> entry[slot].cal.cal_qbits = (uint8_t)qbits;
+    return command_status_OK;
+}
+
+/* cmd_scan(length)
+ * Start or stop the scan.
+ */
+command_status_t cmd_scan(command_arg_t *argv) {
+    uint16_t length = argv[0].u16;
+    if (length == 0) {
+        adc_scan_stop();
+        logger_msg_p(log_system_ADC,log_level_INFO,
+            PSTR("Stopped scanning.\r\n"));
+        return command_status_OK;
+    }
+    if ((length > ADC_SCAN_SLOTS) || adc_scan_start((uint8_t)length)) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Scan length %u is not between 0 and %u.\r\n"),
+            length,ADC_SCAN_SLOTS);
+        return command_status_FAILED;
+    }
+    logger_msg_p(log_system_ADC,log_level_INFO,
+        PSTR("Scanning %u entries.\r\n"),length);
+    return command_status_OK;
+}
+
+/* cmd_scan_q()
+ * Copy each entry out with interrupts off so its sum and timestamp
+ * belong to the same pass, then average and calibrate it.
+ */
+command_status_t cmd_scan_q(command_arg_t *argv) {
+    adc_scan_entry_t entry;
+    uint16_t counts;
+    uint16_t sweeps;
+    uint8_t slot;
+    if (adc_scan_ptr -> running == 0) {
+        logger_msg_p(log_system_ADC,log_level_ERROR,
+            PSTR("Not scanning.  Start a scan with the scan command.\r\n"));
+        return command_status_FAILED;
+    }
+    for (slot = 0; slot < (adc_scan_ptr -> length); slot++) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            entry = adc_scan_ptr -> entry[slot];
+        }
+        counts = entry.total / entry.samples;
+        usart_put_u16(entry.channel);
+        usart_putc(' ');
+        usart_put_s16(adc_calibrate(&(entry.cal),counts,0));
+        usart_puts_p(PSTR(" 0x"));
+        usart_put_hex16(counts);
+        usart_puts_p(PSTR(" 0x"));
+        usart_put_hex32(entry.stamp);
+        usart_put_crlf();
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sweeps = adc_scan_ptr -> sweeps;
+    }
+    usart_puts_p(PSTR("sweeps 0x"));
+    usart_put_hex16(sweeps);
+    usart_put_crlf();
+    return command_status_OK;
+}
+
+/* adc_scan_sample( sample )
+ * Called by the ADC interrupt while scanning.  Add the sample to the
+ * current entry, move on to the next entry when this one has all its
+ * samples, and start the next conversion.
+ */
+static void adc_scan_sample( uint16_t sample ) {
+    adc_scan_entry_t *entry_ptr =
+        &(adc_scan_ptr -> entry[adc_scan_ptr -> index]);
+    if (adc_scan_ptr -> discard) {
+        // This conversion started right after a mux change
+        adc_scan_ptr -> discard = 0;
+    }
+    else {
+        adc_scan_ptr -> sum += sample;
+        (adc_scan_ptr -> count)++;
+        if ((adc_scan_ptr -> count) >= (entry_ptr -> samples)) {
+            entry_ptr -> total = adc_scan_ptr -> sum;
+            entry_ptr -> stamp = clock_now();
+            adc_scan_ptr -> sum = 0;
+            adc_scan_ptr -> count = 0;
+            (adc_scan_ptr -> index)++;
+            if ((adc_scan_ptr -> index) >= (adc_scan_ptr -> length)) {
+                adc_scan_ptr -> index = 0;
+                (adc_scan_ptr -> sweeps)++;
+            }
+            if ((adc_scan_ptr -> length) > 1) {
+                adc_mux(adc_scan_ptr -> entry[adc_scan_ptr -> index].channel);
+                adc_scan_ptr -> discard = 1;
+            }
+        }
+    }
+    hal_adc_start(); // Start the next conversion
+}
+
+/* -------------------------- Interrupts ------------------------------- */
+
+/* Interrupt on ADC conversion complete.  Only enabled while streaming
+ * or scanning.  When streaming, store the sample in the block being
+ * filled.  adcblock_put() counts it as an overrun if the main loop
+ * still has both blocks.
+ */
+ISR(ADC_vect) {
+    uint16_t sample = hal_adc_result();
+    STATS_ISR_ENTER();
+    if (adc_scan_ptr -> running) {
+        adc_scan_sample(sample);
+    }
+    else {
+        // Re-arm the trigger so the next compare match starts a conversion
+        hal_adc_timer_ack();
+        adc_stream_ptr -> last = sample;
+        if (adcblock_put(&(adc_stream_ptr -> blocks),sample) ==
+            adcblock_status_FINISHED) {
+            sched_ready(sched_id_STREAM);
+        }
+    }
+    STATS_ISR_EXIT(stats_isr_ADC);
 }
@@ -2,21 +2,218 @@
  * 
  * Used to set up the ADC for the buttcom project. 
  */
+#ifndef ADC_H
+#define ADC_H
+
+/* bc_command.h
+ * Defines command_arg_t, the argument passed to remote command functions.
+ */
+#include "bc_command.h"
+
+/* bc_adcblock.h
+ * Defines adcblock_t, the double-buffered sample blocks filled by the
+ * ADC conversion complete interrupt.
+ */
+#include "bc_adcblock.h"
 
 
 /* ADC measurement calibration structure. 
+ *
+ * The slope is an unsigned fixed-point number with cal_qbits fraction
+ * bits, in mV per count.  The default of 4 fraction bits gives slopes
+ * from 1/16 to 4095 mV per count.  More fraction bits give finer
+ * slope steps but a smaller range.  The offset is a signed number of
+ * mV added after the slope.
  */
 typedef struct adc_cal_struct { 
     uint16_t cal_slope; // Slope calibration factor
-    uint16_t cal_offset; // Offset calibration factor
+    int16_t cal_offset; // Offset calibration factor
+    uint8_t cal_qbits; // Number of fraction bits in cal_slope
 } adc_cal_t;
 
+/* Define the number of slope fraction bits set up by default, and the
+ * most allowed.
+ */
+#define ADC_CAL_QBITS 4
+#define ADC_CAL_MAXQBITS 15
+
+/* Define the number of entries in the scan list.
+ */
+#define ADC_SCAN_SLOTS 4
+
+/* Define the most samples averaged for each scan list entry.  The sum
+ * of 64 10-bit samples fits in 16 bits.
+ */
+#define ADC_SCAN_MAXSAMPLES 64
+
+/* Scan list entry structure.
+ *
+ * The scan interrupt fills in total and stamp each time it finishes
+ * the entry's samples.  Everything else is only changed while the scan
+ * is stopped.
+ */
+typedef struct adc_scan_entry_struct {
+    uint8_t channel; // ADC mux channel (0-7)
+    uint8_t samples; // Number of samples averaged
+    adc_cal_t cal; // Slope and offset for this channel
+    uint16_t total; // Sum of the latest samples
+    uint32_t stamp; // clock_now() when the latest sum finished
+} adc_scan_entry_t;
+
+/* Scanner state structure.
+ *
+ * While the scan runs, every conversion is started by the ADC
+ * interrupt.  It works through the samples for the entry at index,
+ * then switches the mux to the next entry and starts over at the top of
+ * the list after the last one.  The first conversion after each mux
+ * change is thrown away, since the sample and hold capacitor may not
+ * have settled to the new channel.
+ */
+typedef struct adc_scan_struct {
+    adc_scan_entry_t entry[ADC_SCAN_SLOTS];
+    uint8_t length; // Number of entries being scanned
+    uint8_t running; // 1 while the interrupt is scanning
+    volatile uint8_t index; // Entry being sampled
+    uint8_t discard; // 1 if the next conversion should be thrown away
+    uint8_t count; // Samples taken for the current entry
+    uint16_t sum; // Sum of the samples taken for the current entry
+    volatile uint16_t sweeps; // Counts trips through the whole list
+} adc_scan_t;
+
+/* Define the most extra bits of resolution the filters can give.  Each
+ * extra bit takes 4 times as many samples.  The boxcar sum of 4^3 = 64
+ * 10-bit samples just fits in 16 bits.
+ */
+#define ADC_FILTER_MAXBITS 3
+
+/* Define the number of samples the median filter sorts.  It must be
+ * odd.  The samples are held on the stack while they're sorted.
+ */
+#define ADC_MEDIAN_SIZE 9
+
+/* Define the number of fraction bits in the exponential filter's
+ * state.  This must be at least ADC_FILTER_MAXBITS, and the state has
+ * to fit a 10-bit sample shifted up by this much.
+ */
+#define ADC_EMA_FRACTION 6
+
+/* Define the ADC clock.  10-bit conversions need it between 50 and
+ * 200kHz, and adc_clock_update() picks the prescaler that gives this at
+ * either system clock.
+ */
+#define ADC_SAR_FREQUENCY 125000UL
+
+/* Define the number of ADC clock cycles taken by one conversion.  Used
+ * to estimate output rates.
+ */
+#define ADC_CONVERSION_CLOCKS 13
+
+/* Filters for single measurements.  The raw counts returned by
+ * adc_measure() have (10 + bits) bits of resolution for every mode but
+ * NONE, so the filters can be swapped without recalibrating.
+ *
+ * NONE -- A single conversion with 10 bits of resolution.
+ * BOXCAR -- Sum 4^bits conversions and shift the sum down by bits.
+ *           This is the oversample and decimate method from Atmel's
+ *           AVR121 application note, and needs some noise on the input
+ *           to work.
+ * EMA -- Run 4^bits conversions through an exponential moving average
+ *        with a weight of 1/2^ema_shift.  The average carries over from
+ *        one measurement to the next.
+ * MEDIAN -- Take the median of ADC_MEDIAN_SIZE conversions to reject
+ *           spikes.  This doesn't add resolution, so the median is
+ *           shifted up by bits.
+ */
+typedef enum adc_filter_mode {
+    adc_filter_NONE,
+    adc_filter_BOXCAR,
+    adc_filter_EMA,
+    adc_filter_MEDIAN,
+    adc_filter_COUNT // Number of modes.  Must be last.
+} adc_filter_mode_t;
+
+/* Filter configuration structure.
+ */
+typedef struct adc_filter_struct {
+    adc_filter_mode_t mode; // The filter applied by adc_measure()
+    uint8_t bits; // Extra bits of resolution
+    uint8_t ema_shift; // The exponential filter's weight is 1/2^ema_shift
+    uint16_t ema_state; // The exponential filter's average, with fraction bits
+    uint8_t ema_valid; // 0 until the average has been started
+} adc_filter_t;
+
+/* adc_source_t is a function that returns one 10-bit sample.  The
+ * filters call adc_read() through this, and the benchmark gives them
+ * made-up samples instead.
+ */
+typedef uint16_t (*adc_source_t)(void);
+
+/* Define the fastest sample rate (Hz) accepted by the stream command.
+ * Conversions take 104us, but the serial link runs out long before
+ * that: a binary block costs 2 bytes per sample plus 5 bytes of
+ * framing, so 9600 baud keeps up with about 410 samples per second.
+ * Faster rates are allowed and will show up as overruns.
+ */
+#define ADC_STREAM_MAXRATE 2000
+
+/* Binary stream block layout.  Multi-byte values are little-endian.
+ *
+ * 0  ADC_STREAM_SYNC
+ * 1  Block sequence number low byte
+ * 2  Block sequence number high byte
+ * 3  Number of samples (n)
+ * 4  Samples, 2 bytes each
+ * 4+2n  Checksum -- 8-bit sum of bytes 1 through 3+2n
+ *
+ * Hex blocks are a line of text:
+ * s <sequence> <sample> <sample> ...
+ * with everything in hex.  Gaps in the sequence number mean blocks were
+ * lost on the link.  Samples lost on the AVR are counted by streamstat?
+ */
+#define ADC_STREAM_SYNC 0xa6
+
+/* Stream block formats */
+typedef enum adc_stream_format {
+    adc_stream_format_HEX,
+    adc_stream_format_BINARY
+} adc_stream_format_t;
+
+/* Sample stream structure.
+ *
+ * The ADC conversion complete interrupt fills the blocks, and
+ * adc_stream_drain() sends and releases them.  Each block is sent as
+ * one stream block of ADCBLOCK_SIZE samples.
+ */
+typedef struct adc_stream_struct {
+    adcblock_t blocks; // Samples waiting to be sent
+    volatile uint16_t last; // The most recent sample
+    uint8_t running; // 1 while timer 0 is triggering conversions
+    adc_stream_format_t format; // How blocks are sent
+    uint16_t rate; // The sample rate actually set up (Hz)
+    uint16_t sequence; // Counts blocks sent
+} adc_stream_t;
+
+/* The voltage calibration, measurement filter, and scan list are
+ * defined in bc_adc.c.  The configuration store reads and writes them
+ * directly.
+ */
+extern adc_cal_t volt_calfactor;
+extern adc_filter_t adc_filter;
+extern adc_scan_t adc_scan;
+
 /* adc_init(void)
  * Initialize the Butterfly's 10-bit SAR ADC module.
  *     Set the default ADC mux position to 1: the voltage reader
  */
 void adc_init(void);
 
+/* adc_clock_update(void)
+ * Set the ADC prescaler for the system clock, and restart any sample
+ * stream so timer 0 triggers at the same rate.  Call this after
+ * changing the clock mode.
+ */
+void adc_clock_update(void);
+
 /* adc_mux(uint8_t channel)
  * Set the ADCs input channel.
  */
@@ -25,31 +222,224 @@ void adc_mux(uint8_t channel);
 
 /* adc_read(void)
  * Get a single 16-bit measurement from the currently selected ADC
- * channel.  The ADC has 10 bits of resolution.
+ * channel.  The ADC has 10 bits of resolution.  While streaming, this
+ * returns the most recent streamed sample instead, so reading it again
+ * doesn't give a new sample.  The commands that filter or average
+ * several reads refuse to run while the stream does, unless the filter
+ * mode is none.
  */
 uint16_t adc_read(void);
 
+/* adc_calibrate( pointer to calibration, raw counts, extra bits )
+ * Apply a slope and offset to raw counts with (10 + bits) bits of
+ * resolution.  Returns millivolts, rounded to the nearest and limited
+ * to the int16_t range:
+ * mV = ((raw counts) * slope >> (qbits + bits)) + offset
+ */
+int16_t adc_calibrate( adc_cal_t *cal_ptr, uint16_t counts, uint8_t bits );
+
+/* adc_autocal( pointer to calibration, counts 1, mV 1, counts 2, mV 2,
+ *              extra bits )
+ * Work out the slope and offset that put two measured points on the
+ * line through them.  The counts have (10 + bits) bits of resolution.
+ * The slope gets as many fraction bits as it can hold.  Returns 1 and
+ * leaves the calibration alone if the points don't give a positive
+ * slope that fits.
+ */
+uint8_t adc_autocal( adc_cal_t *cal_ptr, uint16_t counts1, uint16_t mv1,
+                     uint16_t counts2, uint16_t mv2, uint8_t bits );
+
+/* adc_scan_start( number of entries )
+ * Start scanning the first length entries of the scan list, starting
+ * with every total and stamp cleared.  Stops the sample stream if it's
+ * running.  Returns 1 if length is out of range.
+ */
+uint8_t adc_scan_start( uint8_t length );
+
+/* adc_scan_stop(void)
+ * Stop scanning and put the mux back on the voltage reader.
+ */
+void adc_scan_stop(void);
+
+/* adc_measure(void)
+ * Make a measurement with the configured filter.  Returns raw counts
+ * with (10 + adc_filter_bits()) bits of resolution.
+ */
+uint16_t adc_measure(void);
+
+/* adc_filter_bits(void)
+ * Returns the number of bits of resolution adc_measure() adds to the
+ * ADC's 10.
+ */
+uint8_t adc_filter_bits(void);
+
+/* adc_filter_run( mode, sample source )
+ * Run one measurement through a filter using the configured number of
+ * extra bits.
+ */
+uint16_t adc_filter_run( adc_filter_mode_t mode, adc_source_t source );
+
+/* adc_claim(void)
+ * Returns a pointer to the oldest finished block of ADCBLOCK_SIZE
+ * streamed samples, or NULL if there isn't one yet.  The samples stay
+ * put until adc_release() is called, so use them in place.
+ */
+uint16_t *adc_claim(void);
+
+/* adc_release(void)
+ * Hand the block returned by adc_claim() back to the ADC interrupt.
+ */
+void adc_release(void);
+
 /* cmd_vcounts_q()
  * Query the raw ADC reading from the voltage measurement -- before
- * slope and offset are applied.
+ * slope and offset are applied.  The reading is filtered, so it has
+ * 10 + adc_filter_bits() bits of resolution.  Refused while the stream
+ * runs unless the filter mode is none.
  */
-void cmd_vcounts_q(uint16_t nonval);
+command_status_t cmd_vcounts_q(command_arg_t *argv);
 
 /* cmd_volt_q(void)
  * Query the voltage measurement.  Returns a calibrated value in
- * millivolts. 
+ * millivolts, which may be negative.
+ */
+command_status_t cmd_volt_q(command_arg_t *argv);
+
+/* cmd_vavg()
+ * Called by the remote command "vavg."  Starts a job that averages many
+ * voltage measurements.  The job's completion message carries the
+ * calibrated average in millivolts.  Refused while the stream runs, and
+ * stopped if the stream starts.
  */
-void cmd_volt_q(uint16_t nonval);
+command_status_t cmd_vavg(command_arg_t *argv);
 
 /* cmd_vslope
  * Set the voltage measurement slope factor.  ADC data will be multiplied
- * by this factor before being downshifted by 4 bits and given an offset.
+ * by this factor before being downshifted by the slope's fraction bits
+ * (plus any extra filter bits) and given an offset.
  * The ultimate output will be in 1 bit = 1 mV.
  */
-void cmd_vslope(uint16_t vslope);
+command_status_t cmd_vslope(command_arg_t *argv);
 
 /* cmd_voffset
- * Set the offset adjustment in mV.  This will be subtracted from the
+ * Set the signed offset adjustment in mV.  This will be added to the
  * slope-corrected voltage output.
  */
-void cmd_voffset(uint16_t voffset);
+command_status_t cmd_voffset(command_arg_t *argv);
+
+/* cmd_vcal
+ * Set both the voltage measurement slope and offset factors in one
+ * command.  The first argument is the slope and the second the offset.
+ */
+command_status_t cmd_vcal(command_arg_t *argv);
+
+/* cmd_vqbits
+ * Set the number of fraction bits in the voltage measurement slope.
+ * The slope itself isn't changed, so set it again afterwards.
+ */
+command_status_t cmd_vqbits(command_arg_t *argv);
+
+/* cmd_vcal_q
+ * Query the voltage measurement slope, offset, and slope fraction
+ * bits.
+ */
+command_status_t cmd_vcal_q(command_arg_t *argv);
+
+/* cmd_vcalpt
+ * Record a calibration point for the voltage measurement.  The
+ * arguments are the point number (1 or 2) and the voltage in decimal
+ * mV that's applied to the input right now, up to 32767.  Recording
+ * point 2 after point 1 works out and sets the slope and offset.
+ */
+command_status_t cmd_vcalpt(command_arg_t *argv);
+
+/* adc_stream_start( rate, format )
+ * Start timer 0 triggering conversions at rate (Hz).  Returns the rate
+ * actually set up, which is as close as timer 0 can get, or 0 if the
+ * rate can't be reached.
+ */
+uint16_t adc_stream_start( uint16_t rate, adc_stream_format_t format );
+
+/* adc_stream_stop(void)
+ * Stop timer 0 and go back to single conversions.  Samples that haven't
+ * been sent yet are thrown away, but streamstat? still reports the
+ * stream that stopped.
+ */
+void adc_stream_stop(void);
+
+/* adc_stream_drain(void)
+ * Send every finished block of samples.  Call this from the main loop.
+ */
+void adc_stream_drain(void);
+
+/* cmd_stream
+ * Called by the remote command "stream."  The first argument is the
+ * sample rate in decimal Hz, or 0 to stop.  The second is the block
+ * format: 0 for hex, 1 for binary.
+ */
+command_status_t cmd_stream(command_arg_t *argv);
+
+/* cmd_streamstat_q
+ * Called by the remote command "streamstat?"  Returns the sample rate,
+ * the number of blocks sent, and the number of samples lost to
+ * overruns.  After the stream stops the rate is 0, and the counts are
+ * from the last stream until the next one starts.
+ */
+command_status_t cmd_streamstat_q(command_arg_t *argv);
+
+/* cmd_filter
+ * Called by the remote command "filter."  The arguments are the filter
+ * mode (adc_filter_mode_t), the number of extra bits, and the
+ * exponential filter's weight shift.
+ */
+command_status_t cmd_filter(command_arg_t *argv);
+
+/* cmd_filter_q
+ * Called by the remote command "filter?"  Returns the filter mode, the
+ * number of extra bits, and the weight shift.
+ */
+command_status_t cmd_filter_q(command_arg_t *argv);
+
+/* cmd_filtbench_q
+ * Called by the remote command "filtbench?"  Times each filter mode
+ * with the configured number of extra bits on made-up samples, and
+ * returns a line for each mode with its name, the filter's cycles per
+ * measurement, and the fastest measurement rate in Hz once the
+ * conversions themselves are included.
+ */
+command_status_t cmd_filtbench_q(command_arg_t *argv);
+
+/* cmd_scanch
+ * Called by the remote command "scanch."  The arguments are the scan
+ * list entry, the mux channel, and the number of samples to average.
+ * Refused while the scan is running.
+ */
+command_status_t cmd_scanch(command_arg_t *argv);
+
+/* cmd_scancal
+ * Called by the remote command "scancal."  The arguments are the scan
+ * list entry and its slope and signed offset calibration factors.
+ */
+command_status_t cmd_scancal(command_arg_t *argv);
+
+/* cmd_scanq
+ * Called by the remote command "scanq."  The arguments are the scan
+ * list entry and the number of fraction bits in its slope.
+ */
+command_status_t cmd_scanq(command_arg_t *argv);
+
+/* cmd_scan
+ * Called by the remote command "scan."  Scans the given number of
+ * entries from the top of the list, or stops scanning if it's 0.
+ */
+command_status_t cmd_scan(command_arg_t *argv);
+
+/* cmd_scan_q
+ * Called by the remote command "scan?"  Returns a line for each entry
+ * being scanned: the channel, the calibrated signed millivolts, the averaged
+ * raw counts, and the 32kHz tick of the last sample, followed by the
+ * number of trips through the list.
+ */
+command_status_t cmd_scan_q(command_arg_t *argv);
+
+#endif // End the include guard
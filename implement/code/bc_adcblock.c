@@ -0,0 +1,80 @@
+/* bc_adcblock.c
+ *
+ * Double-buffered blocks of ADC samples.
+ */
+
+/* stddef.h
+ * Defines NULL
+ */
+#include <stddef.h>
+
+#include "bc_adcblock.h"
+
+/* adcblock_init( pointer to blocks )
+ * Empty all the blocks and clear the overrun counter.
+ */
+void adcblock_init( adcblock_t *adcblock_ptr ) {
+    adcblock_empty(adcblock_ptr);
+    adcblock_ptr -> overruns = 0;
+    return;
+}
+
+/* adcblock_empty( pointer to blocks )
+ * Throw away the samples but keep the overrun counter.
+ */
+void adcblock_empty( adcblock_t *adcblock_ptr ) {
+    adcblock_ptr -> head = 0;
+    adcblock_ptr -> tail = 0;
+    adcblock_ptr -> fill = 0;
+    return;
+}
+
+/* adcblock_put( pointer to blocks, sample )
+ * Samples are only written to the block at the head.  If the consumer
+ * still has every block, the sample is counted and thrown away.
+ */
+adcblock_status_t adcblock_put( adcblock_t *adcblock_ptr, uint16_t sample ) {
+    if (adcblock_ready(adcblock_ptr) >= ADCBLOCK_COUNT) {
+        (adcblock_ptr -> overruns)++;
+        return adcblock_status_OVERRUN;
+    }
+    adcblock_ptr -> sample[(adcblock_ptr -> head) & (ADCBLOCK_COUNT - 1)]
+        [adcblock_ptr -> fill] = sample;
+    (adcblock_ptr -> fill)++;
+    if ((adcblock_ptr -> fill) < ADCBLOCK_SIZE) {
+        return adcblock_status_STORED;
+    }
+    adcblock_ptr -> fill = 0;
+    /* Only move the head after the block is full.  The consumer may be
+     * looking at it from the main loop. */
+    (adcblock_ptr -> head)++;
+    return adcblock_status_FINISHED;
+}
+
+/* adcblock_ready( pointer to blocks )
+ * Returns the number of finished blocks waiting to be released.
+ */
+uint8_t adcblock_ready( adcblock_t *adcblock_ptr ) {
+    return (uint8_t)((adcblock_ptr -> head) - (adcblock_ptr -> tail));
+}
+
+/* adcblock_claim( pointer to blocks )
+ * Returns the block at the tail without copying it.
+ */
+uint16_t *adcblock_claim( adcblock_t *adcblock_ptr ) {
+    if (adcblock_ready(adcblock_ptr) == 0) {
+        return NULL;
+    }
+    return adcblock_ptr -> sample[(adcblock_ptr -> tail) & (ADCBLOCK_COUNT - 1)];
+}
+
+/* adcblock_release( pointer to blocks )
+ * Moving the tail frees the block for the producer.
+ */
+void adcblock_release( adcblock_t *adcblock_ptr ) {
+    if (adcblock_ready(adcblock_ptr) == 0) {
+        return;
+    }
+    (adcblock_ptr -> tail)++;
+    return;
+}
@@ -0,0 +1,95 @@
+/* bc_adcblock.h
+ *
+ * Double-buffered blocks of ADC samples.  The ADC conversion complete
+ * interrupt fills one block with adcblock_put() while the main loop
+ * works on the other.  The main loop gets a finished block with
+ * adcblock_claim(), uses it in place, and hands it back with
+ * adcblock_release().
+ *
+ * Nothing in here touches the hardware, so the blocks can be compiled
+ * with the native gcc and driven with made-up samples on a PC.
+ */
+#ifndef ADCBLOCK_H
+#define ADCBLOCK_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint8_t
+ */
+#include <stdint.h>
+
+/* Define the number of samples in each block.
+ */
+#ifndef ADCBLOCK_SIZE
+#define ADCBLOCK_SIZE 16
+#endif
+
+/* Define the number of blocks.  Two makes a ping-pong pair.  The head
+ * and tail are free-running 8-bit counters, so this must be a power of
+ * 2 no larger than 128.
+ */
+#ifndef ADCBLOCK_COUNT
+#define ADCBLOCK_COUNT 2
+#endif
+
+/* Values returned by adcblock_put() */
+typedef enum adcblock_status {
+    adcblock_status_STORED, // The sample went into the block being filled
+    adcblock_status_FINISHED, // The sample finished a block
+    adcblock_status_OVERRUN // Every block is waiting to be released
+} adcblock_status_t;
+
+/* ADC block structure.
+ *
+ * The blocks are used in order, like the characters in a txqueue_t.
+ * The head counts blocks finished by the producer and is only written
+ * by adcblock_put().  The tail counts blocks released by the consumer
+ * and is only written by adcblock_release().  The block at the tail is
+ * the one handed out by adcblock_claim(), and the block at the head is
+ * the one being filled.  The producer only writes to the head block
+ * while (head - tail) is less than ADCBLOCK_COUNT, so a claimed block
+ * is never written until it's released.
+ */
+typedef struct adcblock_struct {
+    uint16_t sample[ADCBLOCK_COUNT][ADCBLOCK_SIZE];
+    volatile uint8_t head; // Counts blocks finished
+    volatile uint8_t tail; // Counts blocks released
+    uint8_t fill; // Number of samples in the block at the head
+    volatile uint16_t overruns; // Samples lost because no block was free
+} adcblock_t;
+
+/* adcblock_init( pointer to blocks )
+ * Empty all the blocks and clear the overrun counter.
+ */
+void adcblock_init( adcblock_t *adcblock_ptr );
+
+/* adcblock_empty( pointer to blocks )
+ * Empty all the blocks without clearing the overrun counter, so it can
+ * still be read after the producer stops.
+ */
+void adcblock_empty( adcblock_t *adcblock_ptr );
+
+/* adcblock_put( pointer to blocks, sample )
+ * Add a sample to the block being filled.  Call this from the producer
+ * only.
+ */
+adcblock_status_t adcblock_put( adcblock_t *adcblock_ptr, uint16_t sample );
+
+/* adcblock_ready( pointer to blocks )
+ * Returns the number of finished blocks waiting to be released.
+ */
+uint8_t adcblock_ready( adcblock_t *adcblock_ptr );
+
+/* adcblock_claim( pointer to blocks )
+ * Returns a pointer to the oldest finished block's ADCBLOCK_SIZE
+ * samples, or NULL if no block is finished.  Claiming the same block
+ * twice returns the same pointer.  Call this from the consumer only.
+ */
+uint16_t *adcblock_claim( adcblock_t *adcblock_ptr );
+
+/* adcblock_release( pointer to blocks )
+ * Give the block returned by adcblock_claim() back to the producer.
+ * Does nothing if no block is finished.
+ */
+void adcblock_release( adcblock_t *adcblock_ptr );
+
+#endif // End the include guard
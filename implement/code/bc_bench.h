@@ -0,0 +1,86 @@
+/* bc_bench.h
+ *
+ * Markers for the cycle-count benchmark run by "make bench".
+ *
+ * Building with -DBENCH turns each marker into a single write to a
+ * general purpose I/O register: BENCH_START() writes the point's ID to
+ * GPIOR0 and BENCH_END() writes it to GPIOR1.  bc_bench_sim.c runs the
+ * firmware under simavr, watches those registers, and counts the
+ * cycles between the two writes.  Interrupts don't need markers -- the
+ * simulator reports when each one is raised, entered and left.
+ *
+ * The PC build with -DBENCH times the same points with the PC's
+ * monotonic clock instead, in bc_hal_linux.c, and bench/host_scripts.c
+ * runs the same scripts through it.  Those times are PC nanoseconds,
+ * only good for comparing builds on the same PC.
+ *
+ * Without -DBENCH the markers compile to nothing.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Points measured by the benchmark.  The names printed in the reports
+ * are in bench_names in bc_bench_sim.c and bench/host_scripts.c, which
+ * must be kept in the same order.  0 isn't used, so a cleared register never looks like a
+ * marker.
+ */
+typedef enum bench_id {
+    bench_id_NONE,
+    bench_id_PBUFFER, // process_pbuffer() handling one queued line
+    bench_id_COMMAND_FIND, // command_find() looking up a name
+    bench_id_PARSE_HEX, // parse_hex() converting one argument
+    bench_id_PARSE_DEC, // parse_dec() converting one argument
+    bench_id_LOGGER_WRITE, // logger_write_p() formatting and queueing
+    bench_id_COUNT // Number of points.  Must be last.
+} bench_id_t;
+
+#if defined(BENCH) && defined(__AVR__)
+
+/* avr/io.h
+ * Defines GPIOR0 and GPIOR1.
+ */
+#include <avr/io.h>
+
+#define BENCH_START( id ) (GPIOR0 = (id))
+#define BENCH_END( id ) (GPIOR1 = (id))
+
+#elif defined(BENCH)
+
+/* stdint.h
+ * Defines fixed-width integer types like uint64_t
+ */
+#include <stdint.h>
+
+/* Times for one point in nanoseconds, kept by bc_hal_linux.c
+ */
+typedef struct bench_host_stat {
+    uint32_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t total;
+} bench_host_stat_t;
+
+extern bench_host_stat_t bench_host_stats[bench_id_COUNT];
+
+/* bench_host_start( point )
+ * Note the time the point was started.
+ */
+void bench_host_start( bench_id_t id );
+
+/* bench_host_end( point )
+ * Add the time since the point was started to its stats.  Does nothing
+ * if the point wasn't started.
+ */
+void bench_host_end( bench_id_t id );
+
+#define BENCH_START( id ) bench_host_start(id)
+#define BENCH_END( id ) bench_host_end(id)
+
+#else
+
+#define BENCH_START( id ) do {} while (0)
+#define BENCH_END( id ) do {} while (0)
+
+#endif
+
+#endif // End the include guard
@@ -0,0 +1,463 @@
+/* bc_bench_sim.c
+ *
+ * Runs the firmware under simavr and reports how many cycles the code
+ * between the markers in bc_bench.h takes, and how long the interrupts
+ * take to start and to finish.  Built and run by "make bench":
+ *
+ *     bc_bench_sim <firmware.elf> <script.cmd> [script.cmd...]
+ *
+ * Each script starts a fresh simulated Butterfly.  The lines of a script
+ * are typed into the USART one character per character time at 9600
+ * baud, and each line waits until the firmware has been quiet for
+ * BENCH_QUIET_CYCLES before the next one is sent.  Lines starting with #
+ * are comments.  The firmware's replies go to stderr so they can be
+ * checked by eye.
+ *
+ * The report on stdout is one line per point, with whitespace-separated
+ * columns and # comment lines, so it can be diffed between builds or
+ * read by a script:
+ *
+ *     script  point  count  min  max  mean  total
+ *
+ * All times are in system clock cycles.  Times for the marked points
+ * include any interrupts that ran in between the markers.  For the
+ * interrupts, "isr" lines are the time from entering to leaving the
+ * handler, and "latency" lines are the time from the interrupt being
+ * raised to its handler being entered.  The "irqoff" line is the longest
+ * stretch with interrupts disabled after main() first enables them,
+ * including the time spent in handlers.
+ */
+
+// ----------------------- Include files ------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* simavr
+ * The simulator core, the ELF loader and the USART model.
+ */
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_interrupts.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_uart.h>
+
+/* bc_bench.h
+ * Provides the IDs written to the marker registers.
+ */
+#include "bc_bench.h"
+
+/* Define the part and clock to use when the ELF doesn't say.  Setting
+ * them in the ELF needs simavr's avr_mcu_section.h in the firmware.
+ */
+#define BENCH_MCU "atmega169p"
+#define BENCH_FREQUENCY 1000000UL
+
+/* Define the data space addresses of the marker registers.  These are
+ * the I/O addresses of GPIOR0 and GPIOR1 plus 0x20.
+ */
+#define BENCH_GPIOR0 0x3e
+#define BENCH_GPIOR1 0x4a
+
+/* Define the cycles between characters sent to the USART.  One start
+ * bit, 8 data bits and one stop bit at 9600 baud.
+ */
+#define BENCH_CHAR_CYCLES (BENCH_FREQUENCY * 10 / 9600)
+
+/* Define how long the firmware has to go without sending anything
+ * before it's done with a line.  About 20 character times.
+ */
+#define BENCH_QUIET_CYCLES (BENCH_CHAR_CYCLES * 20)
+
+/* Define the longest any one line is allowed to run.  One second.
+ */
+#define BENCH_LINE_CYCLES BENCH_FREQUENCY
+
+/* Define the cycles to let the firmware start up before the first line.
+ */
+#define BENCH_BOOT_CYCLES (BENCH_FREQUENCY / 10)
+
+/* Define the longest script line
+ */
+#define BENCH_LINESIZE 80
+
+/* Names for the points in bc_bench.h, in the same order as bench_id_t.
+ */
+static const char *bench_names[bench_id_COUNT] = {
+    "none",
+    "pbuffer",
+    "command_find",
+    "parse_hex",
+    "parse_dec",
+    "logger_write"
+};
+
+/* Interrupts to time.  Vector numbers are from the ATmega169P
+ * datasheet's reset and interrupt vector table.
+ */
+typedef struct bench_vector {
+    uint8_t vector;
+    const char *name;
+} bench_vector_t;
+
+static const bench_vector_t bench_vectors[] = {
+    {13, "usart0_rx"},
+    {14, "usart0_udre"},
+    {19, "adc"}
+};
+
+#define BENCH_VECTORS (sizeof(bench_vectors) / sizeof(bench_vectors[0]))
+
+/* Cycle counts collected for one point
+ */
+typedef struct bench_stat {
+    uint32_t count;
+    avr_cycle_count_t min;
+    avr_cycle_count_t max;
+    avr_cycle_count_t total;
+} bench_stat_t;
+
+/* Everything collected while running one script
+ */
+typedef struct bench_state {
+    avr_t *avr;
+    // Cycle each marked point was started on
+    avr_cycle_count_t mark_start[bench_id_COUNT];
+    // Nonzero when the point has been started and not finished
+    uint8_t mark_open[bench_id_COUNT];
+    bench_stat_t mark[bench_id_COUNT];
+    // Cycle each interrupt was raised and entered on
+    avr_cycle_count_t raised[BENCH_VECTORS];
+    avr_cycle_count_t entered[BENCH_VECTORS];
+    bench_stat_t latency[BENCH_VECTORS];
+    bench_stat_t isr[BENCH_VECTORS];
+    // Cycle interrupts were last disabled on
+    avr_cycle_count_t irqoff_start;
+    // Nonzero once main() has enabled interrupts
+    uint8_t irq_seen;
+    bench_stat_t irqoff;
+    // Cycle the firmware last sent a character on
+    avr_cycle_count_t last_output;
+    // The line being typed, and the next character to type
+    char line[BENCH_LINESIZE + 2];
+    uint8_t line_index;
+    avr_irq_t *uart_input;
+} bench_state_t;
+
+/* bench_stat_add( pointer to stat, cycles )
+ * Add one measurement.
+ */
+static void bench_stat_add(bench_stat_t *stat, avr_cycle_count_t cycles) {
+    if ((stat -> count == 0) || (cycles < stat -> min)) {
+        stat -> min = cycles;
+    }
+    if (cycles > stat -> max) {
+        stat -> max = cycles;
+    }
+    stat -> total += cycles;
+    stat -> count++;
+}
+
+/* bench_stat_print( script, point, pointer to stat )
+ * Print one report line.  Points that never ran are still listed, so
+ * reports from different builds line up.
+ */
+static void bench_stat_print(const char *script, const char *point,
+                             const bench_stat_t *stat) {
+    unsigned long long mean = 0;
+    if (stat -> count != 0) {
+        mean = stat -> total / stat -> count;
+    }
+    printf("%-24s %-20s %8lu %8llu %8llu %8llu %12llu\n", script, point,
+           (unsigned long)stat -> count,
+           (unsigned long long)stat -> min,
+           (unsigned long long)stat -> max, mean,
+           (unsigned long long)stat -> total);
+}
+
+/* bench_marker_write( avr, address, value, pointer to state )
+ * Called when the firmware writes GPIOR0 or GPIOR1.  The register still
+ * has to be written, since the watch replaces the write.
+ */
+static void bench_marker_write(avr_t *avr, avr_io_addr_t addr, uint8_t v,
+                               void *param) {
+    bench_state_t *state = param;
+    avr -> data[addr] = v;
+    if ((v == bench_id_NONE) || (v >= bench_id_COUNT)) {
+        return;
+    }
+    if (addr == BENCH_GPIOR0) {
+        state -> mark_start[v] = avr -> cycle;
+        state -> mark_open[v] = 1;
+    }
+    else if (state -> mark_open[v]) {
+        bench_stat_add(&state -> mark[v],
+                       avr -> cycle - state -> mark_start[v]);
+        state -> mark_open[v] = 0;
+    }
+}
+
+/* bench_vector_pending( irq, value, pointer to state )
+ * Called when an interrupt is raised or cleared.  The irq's own value is
+ * still the old one during the call.
+ */
+static void bench_vector_pending(avr_irq_t *irq, uint32_t value, void *param) {
+    bench_state_t *state = param;
+    uint8_t index;
+    for (index = 0; index < BENCH_VECTORS; index++) {
+        if (avr_get_interrupt_irq(state -> avr,
+                                  bench_vectors[index].vector) +
+            AVR_INT_IRQ_PENDING == irq) {
+            break;
+        }
+    }
+    if ((index < BENCH_VECTORS) && value && !(irq -> value)) {
+        state -> raised[index] = state -> avr -> cycle;
+    }
+}
+
+/* bench_vector_running( irq, value, pointer to state )
+ * Called when an interrupt handler is entered and when it returns.
+ */
+static void bench_vector_running(avr_irq_t *irq, uint32_t value, void *param) {
+    bench_state_t *state = param;
+    avr_cycle_count_t now = state -> avr -> cycle;
+    uint8_t index;
+    for (index = 0; index < BENCH_VECTORS; index++) {
+        if (avr_get_interrupt_irq(state -> avr,
+                                  bench_vectors[index].vector) +
+            AVR_INT_IRQ_RUNNING == irq) {
+            break;
+        }
+    }
+    if (index == BENCH_VECTORS) {
+        return;
+    }
+    if (value) {
+        state -> entered[index] = now;
+        bench_stat_add(&state -> latency[index], now - state -> raised[index]);
+    }
+    else {
+        bench_stat_add(&state -> isr[index], now - state -> entered[index]);
+    }
+}
+
+/* bench_uart_output( irq, value, pointer to state )
+ * Called for every character the firmware sends.
+ */
+static void bench_uart_output(avr_irq_t *irq, uint32_t value, void *param) {
+    bench_state_t *state = param;
+    state -> last_output = state -> avr -> cycle;
+    fputc((int)value, stderr);
+}
+
+/* bench_type( avr, when, pointer to state )
+ * Cycle timer callback that types the next character of the line.
+ * Returns the cycle to be called again on, or 0 at the end of the line.
+ */
+static avr_cycle_count_t bench_type(avr_t *avr, avr_cycle_count_t when,
+                                    void *param) {
+    bench_state_t *state = param;
+    char c = state -> line[state -> line_index];
+    if (c == '\0') {
+        return 0;
+    }
+    avr_raise_irq(state -> uart_input, (uint8_t)c);
+    state -> line_index++;
+    return when + BENCH_CHAR_CYCLES;
+}
+
+/* bench_step( pointer to state )
+ * Run one instruction and keep track of the interrupt enable.  Returns
+ * nonzero if the simulation has ended.
+ */
+static int bench_step(bench_state_t *state) {
+    avr_t *avr = state -> avr;
+    int cpu_state = avr_run(avr);
+    if (avr -> sreg[S_I]) {
+        if (state -> irq_seen && state -> irqoff_start) {
+            bench_stat_add(&state -> irqoff,
+                           avr -> cycle - state -> irqoff_start);
+        }
+        state -> irq_seen = 1;
+        state -> irqoff_start = 0;
+    }
+    else if (state -> irq_seen && !(state -> irqoff_start)) {
+        state -> irqoff_start = avr -> cycle;
+    }
+    return (cpu_state == cpu_Done) || (cpu_state == cpu_Crashed);
+}
+
+/* bench_run_until( pointer to state, cycle )
+ * Run until the given cycle.  Returns nonzero if the simulation ended.
+ */
+static int bench_run_until(bench_state_t *state, avr_cycle_count_t until) {
+    while (state -> avr -> cycle < until) {
+        if (bench_step(state)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* bench_send_line( pointer to state, line )
+ * Type the line with a carriage return, then run until the firmware has
+ * been quiet for a while.  Returns nonzero if the simulation ended.
+ */
+static int bench_send_line(bench_state_t *state, const char *line) {
+    avr_t *avr = state -> avr;
+    avr_cycle_count_t started = avr -> cycle;
+    snprintf(state -> line, sizeof(state -> line), "%s\r", line);
+    state -> line_index = 0;
+    state -> last_output = started;
+    avr_cycle_timer_register(avr, 1, bench_type, state);
+    for (;;) {
+        if (bench_step(state)) {
+            return 1;
+        }
+        if (state -> line[state -> line_index] != '\0') {
+            continue; // Still typing
+        }
+        if (avr -> cycle - state -> last_output > BENCH_QUIET_CYCLES) {
+            return 0;
+        }
+        if (avr -> cycle - started > BENCH_LINE_CYCLES) {
+            fprintf(stderr, "\n# line timed out: %s\n", line);
+            return 0;
+        }
+    }
+}
+
+/* bench_avr( pointer to firmware, pointer to state )
+ * Make a fresh simulated part with the firmware loaded and the watches
+ * in place.  Returns NULL if simavr doesn't know the part.
+ */
+static avr_t *bench_avr(elf_firmware_t *firmware, bench_state_t *state) {
+    avr_t *avr;
+    uint32_t flags = 0;
+    uint8_t index;
+    avr_irq_t *irq;
+
+    avr = avr_make_mcu_by_name(firmware -> mmcu);
+    if (avr == NULL) {
+        return NULL;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, firmware);
+    state -> avr = avr;
+
+    avr_register_io_write(avr, BENCH_GPIOR0, bench_marker_write, state);
+    avr_register_io_write(avr, BENCH_GPIOR1, bench_marker_write, state);
+
+    // Keep the USART off the simulator's own stdout
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+    state -> uart_input = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+                                        UART_IRQ_INPUT);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+                                          UART_IRQ_OUTPUT),
+                            bench_uart_output, state);
+
+    for (index = 0; index < BENCH_VECTORS; index++) {
+        irq = avr_get_interrupt_irq(avr, bench_vectors[index].vector);
+        if (irq == NULL) {
+            continue;
+        }
+        avr_irq_register_notify(irq + AVR_INT_IRQ_PENDING,
+                                bench_vector_pending, state);
+        avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING,
+                                bench_vector_running, state);
+    }
+    return avr;
+}
+
+/* bench_script( pointer to firmware, script file name )
+ * Run one script and print its report.  Returns nonzero on errors.
+ */
+static int bench_script(elf_firmware_t *firmware, const char *script) {
+    bench_state_t *state;
+    FILE *scriptfile;
+    char line[BENCH_LINESIZE + 2];
+    size_t length;
+    uint8_t index;
+    int ended = 0;
+
+    scriptfile = fopen(script, "r");
+    if (scriptfile == NULL) {
+        perror(script);
+        return 1;
+    }
+    state = calloc(1, sizeof(bench_state_t));
+    if ((state == NULL) || (bench_avr(firmware, state) == NULL)) {
+        fprintf(stderr, "# can't simulate %s\n", firmware -> mmcu);
+        fclose(scriptfile);
+        free(state);
+        return 1;
+    }
+
+    ended = bench_run_until(state, BENCH_BOOT_CYCLES);
+    while (!ended && (fgets(line, sizeof(line), scriptfile) != NULL)) {
+        length = strcspn(line, "\r\n");
+        line[length] = '\0';
+        if ((length == 0) || (line[0] == '#')) {
+            continue;
+        }
+        ended = bench_send_line(state, line);
+    }
+    fclose(scriptfile);
+    if (ended) {
+        fprintf(stderr, "# %s: the firmware stopped\n", script);
+    }
+
+    for (index = bench_id_NONE + 1; index < bench_id_COUNT; index++) {
+        bench_stat_print(script, bench_names[index], &state -> mark[index]);
+    }
+    for (index = 0; index < BENCH_VECTORS; index++) {
+        char point[32];
+        snprintf(point, sizeof(point), "isr_%s", bench_vectors[index].name);
+        bench_stat_print(script, point, &state -> isr[index]);
+        snprintf(point, sizeof(point), "latency_%s",
+                 bench_vectors[index].name);
+        bench_stat_print(script, point, &state -> latency[index]);
+    }
+    bench_stat_print(script, "irqoff", &state -> irqoff);
+
+    avr_terminate(state -> avr);
+    free(state);
+    return ended;
+}
+
+int main(int argc, char *argv[]) {
+    elf_firmware_t firmware;
+    int status = 0;
+    int arg;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s firmware.elf script.cmd...\n", argv[0]);
+        return 2;
+    }
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[1], &firmware) != 0) {
+        fprintf(stderr, "# can't read %s\n", argv[1]);
+        return 1;
+    }
+    if (firmware.mmcu[0] == '\0') {
+        strcpy(firmware.mmcu, BENCH_MCU);
+    }
+    if (firmware.frequency == 0) {
+        firmware.frequency = BENCH_FREQUENCY;
+    }
+
+    printf("# firmware %s on %s at %lu Hz, times in cycles\n", argv[1],
+           firmware.mmcu, (unsigned long)firmware.frequency);
+    printf("# %-22s %-20s %8s %8s %8s %8s %12s\n", "script", "point",
+           "count", "min", "max", "mean", "total");
+    for (arg = 2; arg < argc; arg++) {
+        status |= bench_script(&firmware, argv[arg]);
+    }
+    return status;
+}
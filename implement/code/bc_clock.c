@@ -1,6 +1,9 @@
 /* bc_clock.c
  * 
  * Functions for handling the system clock. 
+ *
+ * This is the AVR side of the timer part of the hardware abstraction
+ * layer.  bc_hal_linux.c provides these functions for the PC build.
  */
 
 
@@ -20,9 +23,243 @@
  */
 #include <avr/interrupt.h>
 
+/* util/atomic.h
+ * Provides ATOMIC_BLOCK() for reading 16-bit timer registers.
+ */
+#include <util/atomic.h>
+
+/* bc_hal.h
+ * Provides eeprom_read_block() and eeprom_update_block() for the OSCCAL
+ * cache, and hal_uart_tx_idle() for timing drift nudges.
+ */
+#include "bc_hal.h"
+
+#include "bc_clock.h"
+
+/* bc_config.h
+ * Provides CONFIG_EEPROM_END, where the OSCCAL cache starts.
+ */
+#include "bc_config.h"
+
+/* bc_stats.h
+ * Provides the markers that time the timer 2 overflow interrupt.
+ */
+#include "bc_stats.h"
+
+/* The system clock mode set by fosc_1mhz() or clock_set_mode()
+ */
+static clock_mode_t clock_mode_now = clock_mode_1MHZ;
+
+/* The OSCCAL value last used in each clock mode, put back by
+ * clock_set_mode()
+ */
+static uint8_t clock_osccal[clock_mode_COUNT];
+
+/* The range of timer 1 counts accepted by fosc_calibrate() for each
+ * clock mode.  200 crystal ticks are 6104 system clock cycles at 1MHz,
+ * and the window allows about 1% either way.  The 8MHz window is the
+ * same window scaled up.
+ */
+static const uint16_t clock_cal_window[clock_mode_COUNT][2] = {
+    {6040, 6170},
+    {48310, 49350}
+};
+
+/* The boot record filled in by fosc_1mhz() and clock_boot_ready()
+ */
+clock_boot_t clock_boot;
+clock_boot_t *clock_boot_ptr = &clock_boot;
+
+/* The drift tracking done by the timer 2 overflow interrupt
+ */
+volatile clock_drift_t clock_drift;
+
+/* Timer 2 overflows counted by its interrupt.  Timer 2 holds the low 8
+ * bits of clock_now().
+ */
+static volatile uint32_t clock_overflows = 0;
+
+/* fosc_measure(void)
+ * Return the number of timer 1 counts, system clock cycles, in 200
+ * ticks of the 32kHz crystal on timer 2.  Timer 2 has to be running from
+ * the crystal already.  Returns 0xffff if timer 1 overflows, which also
+ * ends the measurement if the crystal isn't ticking.
+ *
+ * Timer 2 used to be cleared at the start of each measurement, but
+ * writes to it only take effect a couple of crystal ticks later, which
+ * is where the old window's "mysterious" extra 80 cycles came from.
+ * Starting on a tick edge instead doesn't disturb the system tick and
+ * doesn't need the allowance.
+ */
+static uint16_t fosc_measure(void) {
+    uint16_t temp;
+    uint8_t tempL;
+    uint8_t start; // Timer 2 count at the start of the measurement
+
+    /* Interrupts are disabled so nothing lands between seeing a tick
+     * and starting or stopping timer 1.  An overflow of timer 2 in the
+     * meantime just leaves its flag set for the interrupt to count
+     * afterwards. */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        /* Clear the timer 1 overflow flag.  Strangely enough, bits in
+         * this register are cleared when logic ones are written to
+         * them. */
+        TIFR1 = (1<<TOV1);
+
+        /* Wait for timer 2 to tick so the count starts on an edge, then
+         * clear timer 1.  Timer 1 is 16-bit, and thus has two counting
+         * bytes. */
+        start = TCNT2;
+        while ((TCNT2 == start) && !(TIFR1 & (1<<TOV1)));
+        TCNT1H = 0;
+        TCNT1L = 0;
+        TIFR1 = (1<<TOV1);
+
+        /* Busy loop until timer 2 has counted 200 more ticks, about
+         * 6104us.  The 8-bit count wraps around the same way the sum
+         * does. */
+        start += 201;
+        while ((TCNT2 != start) && !(TIFR1 & (1<<TOV1)));
+
+        TCCR1B = 0; // Stop timer 1
+    }
+
+    /* If timer 1 overflowed, it's going way too fast. Set temp to the
+     * maximum value to avoid having to deal with it.  If it didn't
+     * overflow, read the value into temp. */
+    if ( (TIFR1 & (1<<TOV1)) ) {
+        temp = 0xFFFF;
+    }
+    else {
+        tempL = TCNT1L;
+        temp = TCNT1H;
+        temp = (temp << 8);
+        temp += tempL;
+    }
 
+    TCCR1B = (1<<CS10); // Restart timer 1
+    clock_drift_restart();
+    return temp;
+}
+
+/* fosc_calibrate( mode, pointer to measurement count )
+ * Nudge OSCCAL one step at a time until fosc_measure() lands in the
+ * mode's window, taking at most CLOCK_CAL_PASSES measurements.  Adds the
+ * measurements taken to the count.  Returns 1 if the window wasn't
+ * reached, 0 otherwise.
+ */
+static uint8_t fosc_calibrate( clock_mode_t mode, uint8_t *passes_ptr ) {
+    uint8_t calibrate = 0; // This is zero while calibrating.
+    uint8_t passes = 0;
+    uint16_t temp;
+
+#ifdef BENCH
+    // The simulator's clock is exact.  See fosc_1mhz().
+    return 0;
+#endif
+
+    while(!calibrate) {
+        if (passes == CLOCK_CAL_PASSES) {
+            return 1;
+        }
+        temp = fosc_measure();
+        passes++;
+        (*passes_ptr)++;
+
+        /* A 1MHz clock should give 6104 counts in temp for 200 ticks.
+         * See clock_cal_window. */
+        if (temp > clock_cal_window[mode][1]) {
+            OSCCAL--;   // The internRC oscillator runs to fast, decrease the OSCCAL
+        }
+        else if (temp < clock_cal_window[mode][0]) {
+            OSCCAL++;   // The internRC oscillator runs to slow, increase the OSCCAL
+        }
+        else
+            calibrate = 1;//TRUE;   // the interRC is correct
+    }
+    return 0;
+}
+
+/* fosc_step_to( OSCCAL value )
+ * Move OSCCAL to the value one step at a time.  The datasheet warns that
+ * the clock changing by more than 2% from one cycle to the next can
+ * upset the CPU, and one step is well under that.
+ */
+static void fosc_step_to( uint8_t target ) {
+    while (OSCCAL != target) {
+        if (OSCCAL < target) {
+            OSCCAL++;
+        }
+        else {
+            OSCCAL--;
+        }
+    }
+}
+
+/* fosc_search( mode )
+ * Binary search for the lowest OSCCAL that isn't too slow.  The
+ * atmega169p's OSCCAL has two overlapping ranges selected by bit 7, and
+ * only counts up monotonically within a range, so the search stays in
+ * the range OSCCAL is already in.  It also stays within
+ * CLOCK_SEARCH_SPAN of where it started, and steps to each guess.  This
+ * takes at most 7 measurements instead of one per step.  Returns the
+ * number of measurements taken.
+ */
+static uint8_t fosc_search( clock_mode_t mode ) {
+    uint8_t start = OSCCAL;
+    uint8_t low = start & 0x80;
+    uint8_t high = low | 0x7f;
+    uint8_t passes = 0;
+    uint16_t temp;
+    if ((start - low) > CLOCK_SEARCH_SPAN) {
+        low = start - CLOCK_SEARCH_SPAN;
+    }
+    if ((high - start) > CLOCK_SEARCH_SPAN) {
+        high = start + CLOCK_SEARCH_SPAN;
+    }
+    while (low < high) {
+        fosc_step_to(low + ((high - low) >> 1));
+        temp = fosc_measure();
+        passes++;
+        if (temp < clock_cal_window[mode][0]) {
+            low = OSCCAL + 1;
+        }
+        else if (temp > clock_cal_window[mode][1]) {
+            high = OSCCAL;
+        }
+        else {
+            return passes;
+        }
+    }
+    fosc_step_to(low);
+    return passes;
+}
 
+/* clock_cache_read(void)
+ * Load OSCCAL from the EEPROM cache.  Returns 1 if the cache is empty or
+ * damaged, leaving OSCCAL alone.
+ */
+static uint8_t clock_cache_read(void) {
+    clock_cache_t cache;
+    eeprom_read_block(&cache, CLOCK_CACHE_ADDRESS, sizeof(cache));
+    if ((uint8_t)~cache.osccal != cache.check) {
+        return 1;
+    }
+    fosc_step_to(cache.osccal);
+    return 0;
+}
 
+/* clock_cache_write(void)
+ * Save OSCCAL in the EEPROM cache.  eeprom_update_block() only writes
+ * the bytes that changed, so this costs nothing when the value is the
+ * same as last boot.
+ */
+static void clock_cache_write(void) {
+    clock_cache_t cache;
+    cache.osccal = OSCCAL;
+    cache.check = ~cache.osccal;
+    eeprom_update_block(&cache, CLOCK_CACHE_ADDRESS, sizeof(cache));
+}
 
 /* fosc_1mhz(void)
  * This sets the frequency of the system clock provided by the internal
@@ -32,9 +269,11 @@
  * end, we'll have a 1MHz system clock to within about 2% 
  */
 void fosc_1mhz(void) {
-    unsigned char calibrate = 0; // This is zero while calibrating.
-    int temp;
-    unsigned char tempL;
+    uint16_t temp; // The latest measurement
+    uint16_t last; // The measurement before it
+    uint8_t passes; // Measurements taken
+    uint8_t start; // OSCCAL before calibration
+    uint8_t failed = 0;
 
     /* The CLKPCE bit must be written to logic one to enable changing
      * the CLKPS bits.  This bit can only be written to one if the others
@@ -50,6 +289,15 @@ void fosc_1mhz(void) {
      * for the system clock, making it ~1MHz.  This next line just calls
      * attention to this without changing any defaults. */
     CLKPR = (1<<CLKPS1) | (1<<CLKPS0);
+    clock_osccal[clock_mode_1MHZ] = OSCCAL;
+    clock_osccal[clock_mode_8MHZ] = OSCCAL;
+
+#ifdef BENCH
+    /* The simulator's clock is exactly 1MHz and it doesn't model the
+     * 32kHz crystal, so just start timer 1 for clock_timestamp(). */
+    TCCR1B = (1<<CS10);
+    return;
+#endif
 
     /* Disable interrupts from timer 2 compare match and overflow */
     TIMSK2 = 0;
@@ -60,9 +308,6 @@ void fosc_1mhz(void) {
      * set by setting the AS2 bit in ASSR while clearing all others. */
     ASSR = (1<<AS2);
 
-    /* Set timer 2 compare value. */
-    OCR2A = 200;
-
     /* Disable interrupts from timer 1 compare match and overflow */
     TIMSK0 = 0;
 
@@ -78,67 +323,241 @@ void fosc_1mhz(void) {
      * configuration register is ready to take new values (TCR2UB = 0). */
     while((ASSR & 0x01) | (ASSR & 0x04));
 
-    // wait for external crystal to stabilise
+    /* Leave timer 2 running from the crystal as the system tick.  Its
+     * overflow interrupt counts the high bits of clock_now().  Starting
+     * it now lets the boot record time the calibration. */
+    TIFR2 = (1<<TOV2);
+    TIMSK2 = (1<<TOIE2);
+
+    clock_mode_now = clock_mode_1MHZ;
+    clock_cache_read();
+    start = OSCCAL;
+
     /* The board has just been turned on, so we need to wait for the
-     * crystal to stabilize.  The _delay_loop_2 function takes a 16-bit
-     * (the 2 is for two bytes) integer for a countdown timer.  The timer
-     * is decremented every 4 system clocks.  So a 1MHz clock would give
-     * a maximum delay of 65536 * 1us * 4 = 262ms */
-    for(int i = 0; i < 10; i++)
-            _delay_loop_2(30000); // About 100ms
+     * crystal to stabilize.  This used to be a fixed wait of about a
+     * second.  A crystal that's still starting up gives measurements
+     * that jump around, so measure until two in a row agree instead.
+     * The _delay_loop_2 function takes a 16-bit (the 2 is for two bytes)
+     * integer for a countdown timer.  The timer is decremented every 4
+     * system clocks. */
+    temp = fosc_measure();
+    passes = 1;
+    do {
+        last = temp;
+        _delay_loop_2(CLOCK_CRYSTAL_DELAY);
+        temp = fosc_measure();
+        passes++;
+    } while (((temp == 0xFFFF) ||
+              (((temp > last) ? (temp - last) : (last - temp)) >
+               CLOCK_CRYSTAL_STABLE)) &&
+             (passes < CLOCK_CRYSTAL_PASSES));
+    clock_boot_ptr -> crystal = clock_now();
 
-    while(!calibrate) {
-        /* Disable all interrupts by clearing the global interrupt mask.
-         * Look in avr/interrupt.h for a better description of cli() */
-        cli();
-
-        /* Clear timer 1 and timer 2 interrupt flag registers.  Strangely
-         * enough, bits in these registers are cleared when logic ones
-         * are written to them. */
-        TIFR1 = 0xFF;
-        TIFR2 = 0xFF;
-
-        /* Reset timers 1 and 2 by clearing their counting registers.
-         * Timer 1 is 16-bit, and thus has two counting bytes.  Timer 2
-         * is 8-bit. */
-        TCNT1H = 0;
-        TCNT1L = 0;
-        TCNT2 = 0;
+    /* With a good cached OSCCAL, the crystal settling is the whole
+     * calibration.  If the cached value is close, nudge it.  Otherwise,
+     * a binary search gets close much faster than nudging. */
+    if ((temp >= clock_cal_window[clock_mode_1MHZ][0]) &&
+        (temp <= clock_cal_window[clock_mode_1MHZ][1])) {
+        clock_boot_ptr -> source = clock_boot_VERIFIED;
+    }
+    else if ((temp >= clock_cal_window[clock_mode_1MHZ][0] - CLOCK_CAL_NUDGE) &&
+             (temp <= clock_cal_window[clock_mode_1MHZ][1] + CLOCK_CAL_NUDGE)) {
+        clock_boot_ptr -> source = clock_boot_NUDGED;
+        failed = fosc_calibrate(clock_mode_1MHZ, &passes);
+    }
+    else {
+        clock_boot_ptr -> source = clock_boot_SEARCHED;
+        passes += fosc_search(clock_mode_1MHZ);
+        failed = fosc_calibrate(clock_mode_1MHZ, &passes);
+    }
 
-        /* The OCF2A flag will be set when timer 2 reaches the OCR2A
-         * compare value. Busy loop until timer 2 reaches this value. An
-         * OCR2A value of 200 should cause a 6104us delay */
-        while ( !(TIFR2 && (1<<OCF2A)) );
+    /* A crystal that never started measures as far too fast, so a failed
+     * calibration may have walked OSCCAL a long way off.  Put back the
+     * cached or factory value, and don't cache the bad one.  Drift
+     * tracking carries on from there if the crystal does run. */
+    if (failed) {
+        clock_boot_ptr -> source = clock_boot_FAILED;
+        fosc_step_to(start);
+    }
+    else {
+        clock_cache_write();
+    }
+    clock_osccal[clock_mode_1MHZ] = OSCCAL;
+    clock_osccal[clock_mode_8MHZ] = OSCCAL;
+    clock_boot_ptr -> calibrated = clock_now();
+    clock_boot_ptr -> passes = passes;
+    clock_boot_ptr -> osccal = OSCCAL;
+    clock_drift.running = 1;
+}
 
-        TCCR1B = 0; // Stop timer 1
-        sei(); // Enable all interrupts again.
+/* clock_boot_ready(void)
+ * Called by main() just before the main loop.
+ */
+void clock_boot_ready(void) {
+    clock_boot_ptr -> ready = clock_now();
+}
+
+/* clock_drift_restart(void)
+ * The interrupt starts the next measurement from its next overflow.  A
+ * nudge decided from the old measurement is dropped too.
+ */
+void clock_drift_restart(void) {
+    clock_drift.step = 0;
+    clock_drift.restart = 1;
+}
 
-        /* If timer 1 overflowed, it's going way too fast. Set temp to
-         * the maximum value to avoid having to deal with it.  If it
-         * didn't overflow, read the value into temp. */
-        if ( (TIFR1 && (1<<TOV1)) ) {
-            temp = 0xFFFF;
+/* clock_set_mode( mode )
+ * The same oscillator runs both modes, so the OSCCAL value found for
+ * one is right for the other.  Running the calibration again would keep
+ * interrupts off for 6ms a measurement, so the mode's last OSCCAL value
+ * is put back instead, and drift tracking trims it from there a step at
+ * a time.  The CLKPR writes are timed, and the overflow interrupt
+ * changes OSCCAL too, so none of this can be interrupted.
+ */
+void clock_set_mode( clock_mode_t mode ) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        clock_osccal[clock_mode_now] = OSCCAL;
+        CLKPR = (1<<CLKPCE);
+        if (mode == clock_mode_8MHZ) {
+            CLKPR = 0; // Divide by 1
         }
         else {
-            tempL = TCNT1L;
-            temp = TCNT1H;
-            temp = (temp << 8);
-            temp += tempL;
+            CLKPR = (1<<CLKPS1) | (1<<CLKPS0); // Divide by 8
         }
+        clock_mode_now = mode;
+        fosc_step_to(clock_osccal[mode]);
+        clock_drift_restart();
+    }
+}
 
-        /* These timer boundaries are somewhat mysterious.  A 1MHz clock
-         * should give 6104 counts in temp for OCR2A=200.  But there's
-         * some extra cycles spent between when timer 2 overflows and
-         * when timer 1 can be stopped. */
-        if (temp > 6250) {
-            OSCCAL--;   // The internRC oscillator runs to fast, decrease the OSCCAL
-        }
-        else if (temp < 6120) {
-            OSCCAL++;   // The internRC oscillator runs to slow, increase the OSCCAL
+/* clock_get_mode(void)
+ * Return the system clock mode.
+ */
+clock_mode_t clock_get_mode(void) {
+    return clock_mode_now;
+}
+
+/* clock_fosc(void)
+ * Return the system clock frequency in Hz.
+ */
+uint32_t clock_fosc(void) {
+    if (clock_mode_now == clock_mode_8MHZ) {
+        return CLOCK_FOSC_8MHZ;
+    }
+    return CLOCK_FOSC_1MHZ;
+}
+
+/* clock_timestamp(void)
+ * Returns the count of timer 1.  Reading TCNT1L latches TCNT1H, so the
+ * two bytes must be read without an interrupt in between.
+ */
+uint16_t clock_timestamp(void) {
+    uint16_t timestamp;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        timestamp = TCNT1;
+    }
+    return timestamp;
+}
+
+/* clock_now(void)
+ * TCNT2 is read through a synchronizer in asynchronous mode, so it can
+ * roll over to 0 with its overflow flag set before the interrupt has
+ * run.  A low count with the flag set means the overflow hasn't been
+ * counted yet.
+ */
+uint32_t clock_now(void) {
+    uint32_t overflows;
+    uint8_t count;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        overflows = clock_overflows;
+        count = TCNT2;
+        if ((TIFR2 & (1<<TOV2)) && (count < 128)) {
+            overflows++;
         }
-        else
-            calibrate = 1;//TRUE;   // the interRC is correct
+    }
+    return (overflows << 8) | count;
+}
+
+/* clock_uptime(void)
+ * Timer 2 overflows 128 times a second.
+ */
+uint32_t clock_uptime(void) {
+    uint32_t overflows;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        overflows = clock_overflows;
+    }
+    return overflows >> 7;
+}
+
+
+/* clock_drift_update(void)
+ * Called by the timer 2 overflow interrupt.  Timer 1 is never stopped
+ * between overflows, so adding up the counts between them gives the
+ * system clock cycles in a second of crystal ticks.  Interrupt latency
+ * only moves the two ends of a measurement, so it hardly matters.  The
+ * counts between overflows are 62500 at 8MHz, so the 16-bit difference
+ * doesn't wrap.
+ *
+ * A nudge waits for both directions of the USART to be idle, so a
+ * character isn't sent or sampled at two speeds.  The transmitter can't
+ * start a byte while this interrupt runs.  The receiver counts as idle
+ * when no character has arrived since the last overflow and the RXD pin
+ * is high.  A byte that started since then and is on a 1 bit still gets
+ * past that, but a character time is shorter than an overflow at every
+ * rate "baud" allows, so a burst of characters keeps the nudge waiting.
+ * The nudge stays pending for as long as it takes.  Changing OSCCAL ends
+ * the measurement.
+ */
+static void clock_drift_update(void) {
+    uint16_t now = TCNT1;
+    int32_t limit;
+    if ((clock_drift.step != 0) && hal_uart_tx_idle() &&
+        !clock_drift.rx_seen && hal_uart_rx_idle()) {
+        OSCCAL += clock_drift.step;
+        clock_drift.step = 0;
+        clock_drift.adjustments++;
+        clock_drift.restart = 1;
+    }
+    clock_drift.rx_seen = 0;
+    if (clock_drift.restart) {
+        clock_drift.restart = 0;
+        clock_drift.overflows = 0;
+        clock_drift.cycles = 0;
+        clock_drift.last = now;
+        return;
+    }
+    clock_drift.cycles += (uint16_t)(now - clock_drift.last);
+    clock_drift.last = now;
+    clock_drift.overflows++;
+    if (clock_drift.overflows < CLOCK_DRIFT_OVERFLOWS) {
+        return;
+    }
+    limit = (int32_t)(clock_fosc() >> CLOCK_DRIFT_SHIFT);
+    clock_drift.error = (int32_t)(clock_drift.cycles - clock_fosc());
+    clock_drift.overflows = 0;
+    clock_drift.cycles = 0;
+    if (clock_drift.error > limit) {
+        clock_drift.step = -1; // Running fast
+    }
+    else if (clock_drift.error < -limit) {
+        clock_drift.step = 1; // Running slow
+    }
+    // Cycles per second are ppm at 1MHz
+    if (clock_mode_now == clock_mode_8MHZ) {
+        clock_drift.error /= 8;
+    }
+}
+
 
-        TCCR1B = (1<<CS10); // Restart timer 1
+/* -------------------------- Interrupts ------------------------------- */
+
+/* Interrupt on timer 2 overflow, every 256 crystal ticks.
+ */
+ISR(TIMER2_OVF_vect) {
+    STATS_ISR_ENTER();
+    clock_overflows++;
+    if (clock_drift.running) {
+        clock_drift_update();
     }
+    STATS_ISR_EXIT(stats_isr_TIMER2_OVF);
 }
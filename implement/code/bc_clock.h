@@ -2,13 +2,212 @@
  * 
  * Functions for handling the system clock. 
  */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint16_t
+ */
+#include <stdint.h>
+
+/* System clock frequencies for each clock mode.  Use clock_fosc()
+ * instead of F_CPU for timer and baud rate arithmetic -- the makefile's
+ * F_CPU is only used for delay loops.
+ */
+#define CLOCK_FOSC_1MHZ 1000000UL
+#define CLOCK_FOSC_8MHZ 8000000UL
+
+/* System clock modes.  Both run the RC oscillator at 8MHz calibrated
+ * against the 32kHz crystal.  1MHZ divides it by 8, which is how the
+ * part comes out of reset.  8MHZ runs it undivided, which needs at
+ * least 2.7V.
+ */
+typedef enum clock_mode {
+    clock_mode_1MHZ,
+    clock_mode_8MHZ,
+    clock_mode_COUNT // Number of modes.  Must be last.
+} clock_mode_t;
  
+/* The last good 1MHz OSCCAL value, kept in EEPROM at
+ * CONFIG_EEPROM_OSCCAL.  check is the complement of osccal, so erased
+ * EEPROM doesn't look like a value.
+ */
+typedef struct clock_cache_struct {
+    uint8_t osccal;
+    uint8_t check;
+} clock_cache_t;
+
+#define CLOCK_CACHE_ADDRESS ((clock_cache_t *)CONFIG_EEPROM_OSCCAL)
+
+/* Define the busy wait between measurements while the crystal starts,
+ * in units of 4 system clock cycles.  2500 is 10ms at 1MHz.
+ */
+#define CLOCK_CRYSTAL_DELAY 2500
+
+/* Define how close two measurements in a row have to be, in timer 1
+ * counts, for the crystal to count as running.
+ */
+#define CLOCK_CRYSTAL_STABLE 8
+
+/* Define the most measurements taken waiting for the crystal.  Each is
+ * about 16ms, so 75 is the 1.2s the startup wait used to take.
+ */
+#define CLOCK_CRYSTAL_PASSES 75
+
+/* Define how far outside the 1MHz window a measurement can be, in timer
+ * 1 counts, and still be fixed by nudging OSCCAL.  One OSCCAL step is
+ * roughly 40 counts.  Anything further off gets a binary search.
+ */
+#define CLOCK_CAL_NUDGE 250
+
+/* Define the furthest the binary search moves OSCCAL from where it
+ * started.  The datasheet asks for OSCCAL to change by no more than 0x20
+ * in each calibration.  Anything further is left to nudging.
+ */
+#define CLOCK_SEARCH_SPAN 0x20
+
+/* Define the most measurements taken nudging OSCCAL.  Each is about
+ * 6ms with interrupts off.  A good crystal and oscillator get there in
+ * a few, so 40 is only reached if something is broken.
+ */
+#define CLOCK_CAL_PASSES 40
+
+/* How the boot calibration found OSCCAL
+ */
+typedef enum clock_boot_source {
+    clock_boot_VERIFIED, // The cached or reset value was already good
+    clock_boot_NUDGED, // The value was close, and was nudged
+    clock_boot_SEARCHED, // The value was off, and was binary searched
+    clock_boot_FAILED // Nothing landed in the window, so nothing was cached
+} clock_boot_source_t;
+
+/* Boot record structure.  Times are clock_now() ticks since timer 2
+ * started.  They're kept whole, since 16 bits of ticks wrap in 2s.
+ */
+typedef struct clock_boot_struct {
+    uint8_t source; // How OSCCAL was found (clock_boot_source_t)
+    uint8_t osccal; // The OSCCAL value found
+    uint8_t passes; // Number of calibration measurements
+    uint32_t crystal; // When the crystal was running
+    uint32_t calibrated; // When calibration was finished
+    uint32_t ready; // When the main loop started
+} clock_boot_t;
+
+extern clock_boot_t *clock_boot_ptr;
+
+/* Define how many timer 2 overflows make up one drift measurement.
+ * 128 overflows are 32768 crystal ticks, exactly one second, so timer 1
+ * should count clock_fosc() cycles.
+ */
+#define CLOCK_DRIFT_OVERFLOWS 128
+
+/* Define how far off a drift measurement can be before OSCCAL is
+ * nudged, as a right shift of clock_fosc().  7 is about 0.8%, a little
+ * tighter than the boot calibration window and about one OSCCAL step.
+ */
+#define CLOCK_DRIFT_SHIFT 7
+
+/* Drift tracking state structure.  The timer 2 overflow interrupt owns
+ * everything but running.
+ */
+typedef struct clock_drift_struct {
+    uint8_t running; // Nonzero once the boot calibration is finished
+    uint8_t restart; // Nonzero to throw away the measurement so far
+    uint8_t overflows; // Timer 2 overflows in this measurement
+    uint16_t last; // Timer 1 count at the last overflow
+    uint32_t cycles; // System clock cycles in this measurement
+    int8_t step; // OSCCAL step waiting for the USART to go idle, or 0
+    uint8_t rx_seen; // Set by the receive interrupt, cleared at overflows
+    int32_t error; // Last measured clock error in ppm
+    uint16_t adjustments; // OSCCAL steps taken since boot
+} clock_drift_t;
+
+extern volatile clock_drift_t clock_drift;
+
+/* CLOCK_DRIFT_RX()
+ * Called by the receive interrupt for each character, so a nudge waits
+ * for a quiet receive line.  A plain store, to keep the interrupt short.
+ */
+#define CLOCK_DRIFT_RX() (clock_drift.rx_seen = 1)
+
 /* fosc_1mhz(void)
  * This sets the frequency of the system clock provided by the internal
  * RC oscillator.  Since this frequency depends on voltage, time, and
  * temperature, the actual frequency is calibrated by comparing the
  * resulting system clock with the 32kHz crystal clock source.   In the
  * end, we'll have a 1MHz system clock to within about 2% 
+ *
+ * The OSCCAL value found is cached in EEPROM, so the next boot only has
+ * to check it.  How long each step took is kept in clock_boot_ptr.  If
+ * calibration fails, the starting OSCCAL is put back, nothing is cached,
+ * and the boot record's source is clock_boot_FAILED.
  */
 void fosc_1mhz(void);
 
+/* clock_boot_ready(void)
+ * Record the time the main loop started in the boot record.
+ */
+void clock_boot_ready(void);
+
+/* clock_drift_restart(void)
+ * Throw away the drift measurement in progress.  Call this after
+ * anything that stops or clears timer 1, or changes OSCCAL.
+ */
+void clock_drift_restart(void);
+
+/* clock_set_mode( mode )
+ * Switch the system clock prescaler and put back the OSCCAL value last
+ * used in the new mode.  This doesn't block for a calibration.  Drift
+ * tracking keeps the oscillator trimmed afterwards.  fosc_1mhz() has to
+ * have run first.  Timer 1 counts at the new rate, so everything that
+ * counts system clock cycles has to be set up again.
+ */
+void clock_set_mode( clock_mode_t mode );
+
+/* clock_get_mode(void)
+ * Return the system clock mode.
+ */
+clock_mode_t clock_get_mode(void);
+
+/* clock_fosc(void)
+ * Return the system clock frequency in Hz.
+ */
+uint32_t clock_fosc(void);
+
+
+/* Define the rate of the tick counted by clock_now().  Timer 2 counts
+ * the 32kHz crystal with no prescaler.
+ */
+#define CLOCK_TICK_HZ 32768UL
+
+/* Convert milliseconds to clock_now() ticks
+ */
+#define CLOCK_MS_TICKS( ms ) ((uint32_t)(ms) * CLOCK_TICK_HZ / 1000)
+
+/* Convert clock_now() ticks to milliseconds
+ */
+#define CLOCK_TICKS_MS( ticks ) ((uint32_t)(ticks) * 1000 / CLOCK_TICK_HZ)
+
+/* clock_now(void)
+ * Returns the number of 32kHz crystal ticks since fosc_1mhz() started
+ * timer 2.  Timer 2 keeps counting when the system clock is changed or
+ * recalibrated, so this is the firmware's monotonic time.  It wraps
+ * every 36.4 hours, so subtract two readings to get a time difference.
+ */
+uint32_t clock_now(void);
+
+/* clock_uptime(void)
+ * Returns the number of seconds since fosc_1mhz() started timer 2.
+ * This doesn't wrap for 1000 years.
+ */
+uint32_t clock_uptime(void);
+
+/* clock_timestamp(void)
+ * Returns the count of timer 1, which is left running from the system
+ * clock by fosc_1mhz() and clock_set_mode().  This makes a cheap 16-bit
+ * timestamp in system clock cycles that wraps every 65536 cycles.
+ */
+uint16_t clock_timestamp(void);
+
+#endif // End the include guard
@@ -4,11 +4,16 @@
 #include <stdio.h>
 #include <string.h>
 
-/* pgmspace.h
- * Provides macros and functions for saving and reading data out of
- * flash.
+/* bc_hal.h
+ * Provides flash access, and ATOMIC_BLOCK() for reading counters shared
+ * with the received character ISR.
  */
-#include <avr/pgmspace.h>
+#include "bc_hal.h"
+
+/* bc_bench.h
+ * Provides the benchmark markers around command processing.
+ */
+#include "bc_bench.h"
 
 
 /* bc_command.h 
@@ -49,6 +54,31 @@
  */
 #include "bc_adc.h"
 
+/* bc_config.h
+ * Provides the commands for saving and restoring settings.
+ */
+#include "bc_config.h"
+
+/* bc_stats.h
+ * Provides the stack and interrupt statistics commands.
+ */
+#include "bc_stats.h"
+
+/* bc_clock.h
+ * Provides clock_now() for timing commands.
+ */
+#include "bc_clock.h"
+
+/* bc_sched.h
+ * Provides the scheduler statistics command.
+ */
+#include "bc_sched.h"
+
+/* bc_job.h
+ * Provides the job progress command.
+ */
+#include "bc_job.h"
+
 /* Initialize command help strings.
  * 
  * The help text for each command needs to be defined outside of the
@@ -64,6 +94,10 @@ const char helpstr_loglevel[] PROGMEM =
     "loglevel -- Set the logger severity level.\r\n"
     "    Argument: 0-3\r\n"
     "    Return: None\r\n";
+const char helpstr_logmode[] PROGMEM =
+    "logmode -- Set the log message format.\r\n"
+    "    Argument: 0 (text) or 1 (binary frames)\r\n"
+    "    Return: None\r\n";
 const char helpstr_logreg[] PROGMEM =
     "logreg -- Set the logger enable register.\r\n"
     "    Argument: 16-bit unsigned hex number\r\n"
@@ -78,81 +112,364 @@ const char helpstr_vslope[] PROGMEM =
     "    Return: None\r\n";
 const char helpstr_voffset[] PROGMEM =
     "voffset -- Set the voltage measurement offset calibration factor.\r\n"
-    "    Argument: 16-bit unsigned hex number\r\n"
+    "    Argument: Signed decimal mV\r\n"
+    "    Return: None\r\n";
+const char helpstr_vcal[] PROGMEM =
+    "vcal -- Set the voltage measurement slope and offset calibration factors.\r\n"
+    "    Arguments: Slope in hex and offset in signed decimal mV\r\n"
+    "    Return: None\r\n";
+const char helpstr_vcal_q[] PROGMEM =
+    "vcal? -- Query the voltage measurement calibration factors.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Slope in hex, offset in decimal mV, fraction bits in hex\r\n";
+const char helpstr_vcalpt[] PROGMEM =
+    "vcalpt -- Record a two-point calibration point.  Point 2 sets the calibration.\r\n"
+    "    Arguments: Point (1 or 2) in hex and the applied voltage in decimal mV\r\n"
+    "    Return: None\r\n";
+const char helpstr_vqbits[] PROGMEM =
+    "vqbits -- Set the number of fraction bits in the voltage slope.\r\n"
+    "    Argument: 0 to f\r\n"
     "    Return: None\r\n";
 const char helpstr_vcounts_q[] PROGMEM =
     "vcounts? -- Query the raw ADC counts from the voltage measurement.\r\n"
     "    Argument: None\r\n"
     "    Return: 16-bit unsigned hex number\r\n";
+const char helpstr_vavg[] PROGMEM =
+    "vavg -- Average many voltage measurements.  Runs as a job.\r\n"
+    "    Argument: Number of measurements in decimal\r\n"
+    "    Return: Job ID, then done with the ID and the average in mV\r\n";
+const char helpstr_job_q[] PROGMEM =
+    "job? -- Query a job's progress.\r\n"
+    "    Argument: Job ID in hex\r\n"
+    "    Return: Units done and total in hex, done, or unknown\r\n";
 const char helpstr_volt_q[] PROGMEM =
     "volt? -- Query the calibrated voltage measurement.\r\n"
     "    Argument: None\r\n"
     "    Return: Voltage in millivolts\r\n";
+const char helpstr_tasks_q[] PROGMEM =
+    "tasks? -- Query the scheduler statistics.\r\n"
+    "    Argument: None\r\n"
+    "    Return: A line per task: name, runs, and longest run and wait\r\n"
+    "            in hex 32kHz ticks, then the number of sleeps\r\n";
+const char helpstr_txpolicy[] PROGMEM =
+    "txpolicy -- Set the transmit queue overflow policy.\r\n"
+    "    Argument: 0 (block), 1 (drop newest), 2 (drop oldest)\r\n"
+    "    Return: None\r\n";
+const char helpstr_txstat_q[] PROGMEM =
+    "txstat? -- Query the transmit queue statistics.\r\n"
+    "    Argument: None\r\n"
+    "    Return: High water mark and dropped count in hex\r\n";
+const char helpstr_boot_q[] PROGMEM =
+    "boot? -- Query the startup times.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Calibration (0 verified, 1 nudged, 2 searched), OSCCAL,\r\n"
+    "            passes, then crystal, calibration and ready times in ms\r\n";
+const char helpstr_uptime_q[] PROGMEM =
+    "uptime? -- Query the time since reset.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Seconds, and the 32kHz tick count in hex\r\n";
+const char helpstr_drift_q[] PROGMEM =
+    "drift? -- Query the system clock drift tracking.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Clock error in ppm and OSCCAL steps taken\r\n";
+const char helpstr_factory[] PROGMEM =
+    "factory -- Restore the factory settings.  Use save to keep them.\r\n"
+    "    Argument: None\r\n"
+    "    Return: None\r\n";
+const char helpstr_load[] PROGMEM =
+    "load -- Restore the settings saved in EEPROM.\r\n"
+    "    Argument: None\r\n"
+    "    Return: None\r\n";
+const char helpstr_save[] PROGMEM =
+    "save -- Save the calibration, logger, filter, and scan settings.\r\n"
+    "    Argument: None\r\n"
+    "    Return: None\r\n";
+const char helpstr_filter[] PROGMEM =
+    "filter -- Set the measurement filter.\r\n"
+    "    Arguments: Mode 0 (none), 1 (boxcar), 2 (ema), 3 (median),\r\n"
+    "               extra bits (0-3), and ema weight shift (1-6) in hex\r\n"
+    "    Return: None\r\n";
+const char helpstr_filter_q[] PROGMEM =
+    "filter? -- Query the measurement filter.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Mode, extra bits, and ema weight shift in hex\r\n";
+const char helpstr_filtbench_q[] PROGMEM =
+    "filtbench? -- Time each measurement filter.\r\n"
+    "    Argument: None\r\n"
+    "    Return: A line per filter: name, cycles, and fastest rate (Hz)\r\n";
+const char helpstr_scan[] PROGMEM =
+    "scan -- Scan the first entries of the scan list.\r\n"
+    "    Argument: Number of entries in hex (0 stops)\r\n"
+    "    Return: None\r\n";
+const char helpstr_scan_q[] PROGMEM =
+    "scan? -- Query the scanned channels.\r\n"
+    "    Argument: None\r\n"
+    "    Return: A line per entry: channel, mV, counts, and 32kHz tick,\r\n"
+    "            then the number of sweeps\r\n";
+const char helpstr_scancal[] PROGMEM =
+    "scancal -- Set a scan list entry's calibration factors.\r\n"
+    "    Arguments: Entry and slope in hex, offset in signed decimal mV\r\n"
+    "    Return: None\r\n";
+const char helpstr_scanq[] PROGMEM =
+    "scanq -- Set the number of fraction bits in a scan list entry's slope.\r\n"
+    "    Arguments: Entry and fraction bits (0 to f) in hex\r\n"
+    "    Return: None\r\n";
+#ifdef STATS
+const char helpstr_stack_q[] PROGMEM =
+    "stack? -- Query the stack high water mark.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Most stack used and stack never used, in hex bytes\r\n";
+const char helpstr_stats_q[] PROGMEM =
+    "stats? -- Query the longest interrupt handler times.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Received character, transmit, ADC and tick times in hex\r\n"
+    "            cycles\r\n";
+#endif
+const char helpstr_scanch[] PROGMEM =
+    "scanch -- Set a scan list entry's channel and samples.\r\n"
+    "    Arguments: Entry, channel (0-7), and samples to average in hex\r\n"
+    "    Return: None\r\n";
+const char helpstr_stream[] PROGMEM =
+    "stream -- Stream voltage samples in blocks.\r\n"
+    "    Arguments: Rate in decimal Hz (0 stops), format 0 (hex) or 1 (binary)\r\n"
+    "    Return: Sample blocks until stopped\r\n";
+const char helpstr_streamstat_q[] PROGMEM =
+    "streamstat? -- Query the sample stream statistics.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Rate (Hz) in decimal, blocks sent and samples lost in hex\r\n";
+const char helpstr_rxstat_q[] PROGMEM =
+    "rxstat? -- Query the received command queue statistics.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Queued, dropped, and peak depth in hex\r\n";
 const char helpstr_help[] PROGMEM =
-    "help -- Print the command help.\r\n";
-const char nullstr[] PROGMEM = "";
+    "help -- Print the command help.  Runs as a job, and each line\r\n"
+    "        starts with the job ID.\r\n";
+const char helpstr_baud[] PROGMEM =
+    "baud -- Set the baud rate.  Send a command at the new rate within 2s\r\n"
+    "        or it goes back to the old one.\r\n"
+    "    Argument: 2400, 4800, 9600, 19200, 38400, 76800 or 250000\r\n"
+    "    Return: None\r\n";
+const char helpstr_baud_q[] PROGMEM =
+    "baud? -- Query the baud rate.\r\n"
+    "    Argument: None\r\n"
+    "    Return: Baud rate and clock (MHz) in decimal, and the rate's error\r\n"
+    "            in tenths of a percent\r\n";
 
 /* Define the remote commands recognized by the system.
+ *
+ * The whole table lives in flash.  command_find() does a binary search
+ * on it, so the entries MUST be sorted by name in strcmp() order.  Note
+ * that '?' sorts before the letters.  command_init() checks the order
+ * and logs an error if a new command was put in the wrong place.
 */
-command_t command_array[] ={
+const command_t command_array[] PROGMEM ={
+    // baud -- Set the baud rate
+    {"baud",
+     {arg_type_DEC32},
+     &cmd_baud,
+     helpstr_baud},
+    // baud? -- Query the baud rate
+    {"baud?",
+     {arg_type_NONE},
+     &cmd_baud_q,
+     helpstr_baud_q},
+    // boot? -- Query the startup times
+    {"boot?",
+     {arg_type_NONE},
+     &cmd_boot_q,
+     helpstr_boot_q},
+    // drift? -- Query the system clock drift tracking
+    {"drift?",
+     {arg_type_NONE},
+     &cmd_drift_q,
+     helpstr_drift_q},
+    // factory -- Restore the factory settings
+    {"factory",         // Name of the command
+     {arg_type_NONE},   // Argument types (arg_type_t)
+     &cmd_factory,      // Address of function to execute
+     helpstr_factory},  // The help text (defined above)
+    // filtbench? -- Time each measurement filter
+    {"filtbench?",
+     {arg_type_NONE},
+     &cmd_filtbench_q,
+     helpstr_filtbench_q},
+    // filter -- Set the measurement filter
+    {"filter",
+     {arg_type_HEX, arg_type_HEX, arg_type_HEX},
+     &cmd_filter,
+     helpstr_filter},
+    // filter? -- Query the measurement filter
+    {"filter?",
+     {arg_type_NONE},
+     &cmd_filter_q,
+     helpstr_filter_q},
     // hello -- Print a greeting.
-    {"hello",           // Name of the command
-     "none",            // Argument type (can be "none" or "hex" right now)
-     0,                 // Maximum number of characters in argument
-     &cmd_hello,        // Address of function to execute
-     helpstr_hello},    // The help text (defined above)
-    //loglevel -- Set the logger severity level.
+    {"hello",
+     {arg_type_NONE},
+     &cmd_hello,
+     helpstr_hello},
+    // help -- Print all the help strings
+    {"help",
+     {arg_type_NONE},
+     &cmd_help,
+     helpstr_help},
+    // job? -- Query a job's progress
+    {"job?",
+     {arg_type_HEX},
+     &cmd_job_q,
+     helpstr_job_q},
+    // load -- Restore the saved settings
+    {"load",
+     {arg_type_NONE},
+     &cmd_load,
+     helpstr_load},
+    // loglevel -- Set the logger severity level.
     {"loglevel",
-     "hex",
-     1,
+     {arg_type_HEX},
      &cmd_loglevel,
      helpstr_loglevel},
+    // logmode -- Set the log message format.
+    {"logmode",
+     {arg_type_HEX},
+     &cmd_logmode,
+     helpstr_logmode},
     // logreg -- Set the logger enable register.
     {"logreg",
-     "hex",
-     4,
+     {arg_type_HEX},
      &cmd_logreg,
      helpstr_logreg},
-     // logreg? -- Query the logger enable register.
+    // logreg? -- Query the logger enable register.
     {"logreg?",
-     "none",
-     0,
+     {arg_type_NONE},
      &cmd_logreg_q,
      helpstr_logreg_q},
-     // vslope -- Set the voltage measurement slope calibration factor
-     {"vslope",
-     "hex",
-     4,
-     &cmd_vslope,
-     helpstr_vslope},
-     // voffset -- Set the voltage measurement offset calibration factor
-     {"voffset",
-     "hex",
-     4,
-     &cmd_voffset,
-     helpstr_voffset},
-     // vcounts? -- Query the raw ADC counts from the voltage measurement
-     {"vcounts?",
-     "none",
-     0,
+    // rxstat? -- Query the received command queue statistics
+    {"rxstat?",
+     {arg_type_NONE},
+     &cmd_rxstat_q,
+     helpstr_rxstat_q},
+    // save -- Save the settings to EEPROM
+    {"save",
+     {arg_type_NONE},
+     &cmd_save,
+     helpstr_save},
+    // scan -- Start or stop the scan
+    {"scan",
+     {arg_type_HEX},
+     &cmd_scan,
+     helpstr_scan},
+    // scan? -- Query the scanned channels
+    {"scan?",
+     {arg_type_NONE},
+     &cmd_scan_q,
+     helpstr_scan_q},
+    // scancal -- Set a scan list entry's calibration factors
+    {"scancal",
+     {arg_type_HEX, arg_type_HEX, arg_type_SIGNED},
+     &cmd_scancal,
+     helpstr_scancal},
+    // scanch -- Set a scan list entry's channel and samples
+    {"scanch",
+     {arg_type_HEX, arg_type_HEX, arg_type_HEX},
+     &cmd_scanch,
+     helpstr_scanch},
+    // scanq -- Set a scan list entry's slope fraction bits
+    {"scanq",
+     {arg_type_HEX, arg_type_HEX},
+     &cmd_scanq,
+     helpstr_scanq},
+#ifdef STATS
+    // stack? -- Query the stack high water mark
+    {"stack?",
+     {arg_type_NONE},
+     &cmd_stack_q,
+     helpstr_stack_q},
+    // stats? -- Query the longest interrupt handler times
+    {"stats?",
+     {arg_type_NONE},
+     &cmd_stats_q,
+     helpstr_stats_q},
+#endif
+    // stream -- Stream voltage samples
+    {"stream",
+     {arg_type_DEC, arg_type_HEX},
+     &cmd_stream,
+     helpstr_stream},
+    // streamstat? -- Query the sample stream statistics
+    {"streamstat?",
+     {arg_type_NONE},
+     &cmd_streamstat_q,
+     helpstr_streamstat_q},
+    // tasks? -- Query the scheduler statistics
+    {"tasks?",
+     {arg_type_NONE},
+     &cmd_tasks_q,
+     helpstr_tasks_q},
+    // txpolicy -- Set the transmit queue overflow policy
+    {"txpolicy",
+     {arg_type_HEX},
+     &cmd_txpolicy,
+     helpstr_txpolicy},
+    // txstat? -- Query the transmit queue statistics
+    {"txstat?",
+     {arg_type_NONE},
+     &cmd_txstat_q,
+     helpstr_txstat_q},
+    // uptime? -- Query the time since reset
+    {"uptime?",
+     {arg_type_NONE},
+     &cmd_uptime_q,
+     helpstr_uptime_q},
+    // vavg -- Average many voltage measurements
+    {"vavg",
+     {arg_type_DEC},
+     &cmd_vavg,
+     helpstr_vavg},
+    // vcal -- Set the voltage measurement slope and offset calibration factors
+    {"vcal",
+     {arg_type_HEX, arg_type_SIGNED},
+     &cmd_vcal,
+     helpstr_vcal},
+    // vcal? -- Query the voltage measurement calibration factors
+    {"vcal?",
+     {arg_type_NONE},
+     &cmd_vcal_q,
+     helpstr_vcal_q},
+    // vcalpt -- Record a two-point calibration point
+    {"vcalpt",
+     {arg_type_HEX, arg_type_DEC},
+     &cmd_vcalpt,
+     helpstr_vcalpt},
+    // vcounts? -- Query the raw ADC counts from the voltage measurement
+    {"vcounts?",
+     {arg_type_NONE},
      &cmd_vcounts_q,
      helpstr_vcounts_q},
-     // volt? -- Query the calibrated voltage measurement
-     {"volt?",
-     "none",
-     0,
+    // voffset -- Set the voltage measurement offset calibration factor
+    {"voffset",
+     {arg_type_SIGNED},
+     &cmd_voffset,
+     helpstr_voffset},
+    // volt? -- Query the calibrated voltage measurement
+    {"volt?",
+     {arg_type_NONE},
      &cmd_volt_q,
      helpstr_volt_q},
-     // help -- Print all the help strings
-     {"help",
-     "none",
-     0,
-     &cmd_help,
-     helpstr_help},
-     // End of table indicator.  Must be last.
-    {"","",0,0,nullstr}
+    // vqbits -- Set the voltage measurement slope fraction bits
+    {"vqbits",
+     {arg_type_HEX},
+     &cmd_vqbits,
+     helpstr_vqbits},
+    // vslope -- Set the voltage measurement slope calibration factor
+    {"vslope",
+     {arg_type_HEX},
+     &cmd_vslope,
+     helpstr_vslope}
 };
 
+/* The number of commands in command_array */
+const uint8_t command_count = sizeof(command_array) / sizeof(command_t);
+
 /* Making this function explicitly take a pointer to the received command
  * state structure makes it clear that it modifies this structure.
  */
@@ -160,32 +477,78 @@ void command_init( recv_cmd_state_t *recv_cmd_state_ptr ) {
     memset((recv_cmd_state_ptr -> rbuffer),0,RECEIVE_BUFFER_SIZE);
     recv_cmd_state_ptr -> rbuffer_write_ptr =
         recv_cmd_state_ptr -> rbuffer; // Initialize write pointer
-    memset((recv_cmd_state_ptr -> pbuffer),0,RECEIVE_BUFFER_SIZE);
-    recv_cmd_state_ptr -> pbuffer_arg_ptr =
-        recv_cmd_state_ptr -> pbuffer; // Initialize argument pointer
+    memset((recv_cmd_state_ptr -> pbuffer),0,
+        RECEIVE_QUEUE_SLOTS * RECEIVE_BUFFER_SIZE);
     recv_cmd_state_ptr -> rbuffer_count = 0;
-    recv_cmd_state_ptr -> pbuffer_lock = 0; // Parse buffer unlocked
+    recv_cmd_state_ptr -> pbuffer_head = 0; // Parse queue empty
+    recv_cmd_state_ptr -> pbuffer_tail = 0;
+    recv_cmd_state_ptr -> pbuffer_queued = 0;
+    recv_cmd_state_ptr -> pbuffer_dropped = 0;
+    recv_cmd_state_ptr -> pbuffer_peak = 0;
+    command_check_table();
     return;
 }
 
+/* command_check_table()
+ * Make sure the names in command_array are in strcmp() order.  Binary
+ * searches of an unsorted table will miss commands, so complain loudly.
+ */
+void command_check_table( void ) {
+    command_t this_command;
+    command_t last_command;
+    uint8_t index;
+    memcpy_P(&last_command, &command_array[0], sizeof(command_t));
+    for (index = 1; index < command_count; index++) {
+        memcpy_P(&this_command, &command_array[index], sizeof(command_t));
+        if (strcmp( last_command.name, this_command.name ) >= 0) {
+            logger_msg_p(log_system_COMMAND,log_level_ERROR,
+                PSTR("Command '%s' is out of order.\r\n"),this_command.name);
+        }
+        last_command = this_command;
+    }
+    return;
+}
 
-/* check_argsize( pointer to received command state,
- *                pointer to list of commands )
- * Returns 0 if the argument size is less than or equal to the number
- * of characters specified in the command list.  Returns -1 otherwise. 
+/* command_search( command name, number of entries to search )
+ * strcmp() returns an int, and the difference between two characters
+ * doesn't always fit in an int8_t, so keep the whole thing.
  */
-uint8_t check_argsize(recv_cmd_state_t *recv_cmd_state_ptr ,
-                      struct command_struct *command_array) {
-    uint8_t isok = 0;
-    uint8_t argsize = strlen(recv_cmd_state_ptr -> pbuffer_arg_ptr);
-    logger_msg_p("command",log_level_INFO,
-        PSTR("Argument size is %d.\r\n"), argsize);
-    if (argsize > (command_array -> arg_max_chars)) {
-        isok = -1;
+uint8_t command_search( char *name, uint8_t count ) {
+    uint8_t low = 0;
+    uint8_t high = count; // One past the last candidate
+    uint8_t middle;
+    int order;
+    while (low < high) {
+        middle = (low + high) >> 1;
+        order = strcmp_P( name, command_array[middle].name );
+        if (order == 0) {
+            return middle;
+        }
+        else if (order < 0) {
+            high = middle;
+        }
+        else {
+            low = middle + 1;
+        }
+    }
+    return count;
+}
+
+/* command_find( command name, pointer to command structure )
+ * Binary search command_array for a command name.  If it's found, copy
+ * the command out of flash into the structure and return 0.  Return 1
+ * otherwise.
+ */
+uint8_t command_find( char *name, command_t *command ) {
+    uint8_t index = command_search( name, command_count );
+    if (index == command_count) {
+        return 1;
     }
-    return isok;
+    memcpy_P(command, &command_array[index], sizeof(command_t));
+    return 0;
 }
 
+
 void rbuffer_erase( recv_cmd_state_t *recv_cmd_state_ptr ) {
     memset((recv_cmd_state_ptr -> rbuffer),0,RECEIVE_BUFFER_SIZE);
     recv_cmd_state_ptr -> rbuffer_write_ptr =
@@ -194,102 +557,358 @@ void rbuffer_erase( recv_cmd_state_t *recv_cmd_state_ptr ) {
     return;
 }
 
-/* process_pbuffer( recv_cmd_state_t *recv_cmd_state_ptr,
- *                  command_struct *commands )
- * Process the command (if there is one) in the parse buffer. 
+/* rbuffer_terminate( pointer to received command state )
+ * Copy the terminated string in the received character buffer into the
+ * head of the parse queue.  Only the received character ISR calls this,
+ * so it's the only writer of pbuffer_head.
  */
-void process_pbuffer( recv_cmd_state_t *recv_cmd_state_ptr ,
-                    struct command_struct *command_array) {
-    if ((recv_cmd_state_ptr -> pbuffer_lock) == 1) {
-        // Parse buffer is locked -- there's a command to process
-        logger_msg_p("command",log_level_INFO,
-            PSTR("The parse buffer is locked.\r\n"));
-        recv_cmd_state_ptr -> pbuffer_arg_ptr = strchr(recv_cmd_state_ptr -> pbuffer,' ');
-        if (recv_cmd_state_ptr -> pbuffer_arg_ptr != NULL) {
-            // Parse buffer contains a space -- there's an argument
-            logger_msg_p("command",log_level_INFO,
-                PSTR("The command contains a space.\r\n"));
-            *(recv_cmd_state_ptr -> pbuffer_arg_ptr) = '\0'; // Terminate the command string
-            (recv_cmd_state_ptr -> pbuffer_arg_ptr)++;
-            while (*(recv_cmd_state_ptr -> pbuffer_arg_ptr) == ' ') {
-                (recv_cmd_state_ptr -> pbuffer_arg_ptr)++; // Move to first non-space character
-            }
-            // pbuffer_arg_ptr now points to the beginning of the argument
-            logger_msg_p("command",log_level_INFO,
-                PSTR("The command's argument is '%s'.\r\n"),
-                (recv_cmd_state_ptr -> pbuffer_arg_ptr));
+uint8_t rbuffer_terminate( recv_cmd_state_t *recv_cmd_state_ptr ) {
+    uint8_t depth = (recv_cmd_state_ptr -> pbuffer_head) -
+        (recv_cmd_state_ptr -> pbuffer_tail);
+    if (depth >= RECEIVE_QUEUE_SLOTS) {
+        // Every slot is waiting to be processed
+        (recv_cmd_state_ptr -> pbuffer_dropped)++;
+        return 1;
+    }
+    *(recv_cmd_state_ptr -> rbuffer_write_ptr) = '\0';
+    strcpy((recv_cmd_state_ptr -> pbuffer[(recv_cmd_state_ptr -> pbuffer_head) &
+            (RECEIVE_QUEUE_SLOTS - 1)]),
+        (recv_cmd_state_ptr -> rbuffer));
+    // Only publish the slot after the string is in place
+    (recv_cmd_state_ptr -> pbuffer_head)++;
+    (recv_cmd_state_ptr -> pbuffer_queued)++;
+    depth++;
+    if (depth > (recv_cmd_state_ptr -> pbuffer_peak)) {
+        recv_cmd_state_ptr -> pbuffer_peak = depth;
+    }
+    return 0;
+}
+
+/* cmd_rxstat_q()
+ * Called by the remote command "rxstat?"  Returns the number of
+ * commands queued, the number dropped, and the peak parse queue depth.
+ */
+command_status_t cmd_rxstat_q( command_arg_t *argv ) {
+    uint16_t queued;
+    uint16_t dropped;
+    uint8_t peak;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        queued = recv_cmd_state_ptr -> pbuffer_queued;
+        dropped = recv_cmd_state_ptr -> pbuffer_dropped;
+        peak = recv_cmd_state_ptr -> pbuffer_peak;
+    }
+    usart_puts_p(PSTR("0x"));
+    usart_put_hex16(queued);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(dropped);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(peak);
+    usart_put_crlf();
+    return command_status_OK;
+}
+
+/* command_run( command string )
+ * Split the name from the argument, look the name up, and execute it.
+ */
+command_status_t command_run( char *cmdstr ) {
+    char *arg_ptr; // Points to the beginning of the argument
+    command_t command; // RAM copy of the matching command
+    uint8_t found; // Zero if the name is in the command table
+    arg_ptr = strchr(cmdstr,' ');
+    if (arg_ptr != NULL) {
+        // Command string contains a space -- there's an argument
+        logger_msg_p(log_system_COMMAND,log_level_INFO,
+            PSTR("The command contains a space.\r\n"));
+        *arg_ptr = '\0'; // Terminate the command string
+        arg_ptr++;
+        while (*arg_ptr == ' ') {
+            arg_ptr++; // Move to first non-space character
+        }
+        // arg_ptr now points to the beginning of the argument
+        logger_msg_p(log_system_COMMAND,log_level_INFO,
+            PSTR("The command's argument is '%s'.\r\n"), arg_ptr);
+    }
+    lowstring(cmdstr); // Convert command to lower case
+    // Look through the command list for a match
+    BENCH_START(bench_id_COMMAND_FIND);
+    found = command_find( cmdstr, &command );
+    BENCH_END(bench_id_COMMAND_FIND);
+    if (found != 0) {
+        // We didn't find a match, so send an error message
+        logger_msg_p(log_system_COMMAND,log_level_ERROR,
+            PSTR("Unrecognized command: '%s'.\r\n"),cmdstr);
+        return command_status_UNKNOWN;
+    }
+    logger_msg_p(log_system_COMMAND,log_level_INFO,
+        PSTR("Command '%s' recognized.\r\n"),command.name);
+    // A command got through, so the host is keeping up with the baud rate
+    usart_baud_confirm();
+    return command_exec(&command,arg_ptr);
+}
+
+/* command_separator( line )
+ * Return a pointer to the first separator in a line that isn't inside
+ * quotes, or NULL if there isn't one.
+ */
+static char *command_separator( char *line ) {
+    uint8_t quoted = 0;
+    for (; *line != '\0'; line++) {
+        if (*line == COMMAND_QUOTE) {
+            quoted = !quoted;
+        }
+        else if ((*line == COMMAND_SEPARATOR) && (quoted == 0)) {
+            return line;
         }
-        lowstring(recv_cmd_state_ptr -> pbuffer); // Convert command to lower case
-        // Look through the command list for a match
-        uint8_t pbuffer_match = 0;
-        while ((command_array -> execute) != 0) {
-            if (strcmp( recv_cmd_state_ptr -> pbuffer,
-                command_array -> name ) == 0) {
-                // We've found a matching command
-                logger_msg_p("command",log_level_INFO,
-                    PSTR("Command '%s' recognized.\r\n"),command_array -> name);
-                pbuffer_match = 1;
-                if (strcmp( command_array -> arg_type, "none") != 0) {
-                    // The command is specified to have an argument
-                    uint8_t arg_ok = check_argsize(recv_cmd_state_ptr,command_array);
-                    if (arg_ok != 0) {
-                        logger_msg_p("command",log_level_ERROR,
-                            PSTR("Argument to '%s' is out of range.\r\n"),
-                            command_array -> name);
-                        }
-                    else {
-                        // The argument is the right size
-                        logger_msg_p("command",log_level_INFO,
-                            PSTR("Argument to '%s' is within limits.\r\n"),
-                            command_array -> name);
-                        command_exec(command_array,recv_cmd_state_ptr -> pbuffer_arg_ptr);
-                    }
-                }
-                else  {
-                    // There's no argument specified
-                    if (recv_cmd_state_ptr -> pbuffer_arg_ptr != NULL) {
-                        // There's an argument, but we didn't expect one
-                        logger_msg_p("command",log_level_WARNING,
-                            PSTR("Ignoring argument for command '%s'.\r\n"),
-                            command_array -> name);
-                    }
-                    command_exec(command_array,NULL);
-                }
-                recv_cmd_state_ptr -> pbuffer_lock = 0;
+    }
+    return NULL;
+}
+
+/* command_next( pointer to string pointer )
+ * Return the next non-empty command in a batched line, or NULL when
+ * there are no more.  The separator after the command is replaced with
+ * a terminator and the string pointer is moved past it.
+ */
+static char *command_next( char **line_ptr ) {
+    char *cmdstr;
+    char *end_ptr;
+    while (**line_ptr != '\0') {
+        cmdstr = *line_ptr;
+        end_ptr = command_separator(cmdstr);
+        if (end_ptr == NULL) {
+            *line_ptr = cmdstr + strlen(cmdstr);
+        }
+        else {
+            *end_ptr = '\0';
+            *line_ptr = end_ptr + 1;
+        }
+        while (*cmdstr == ' ') {
+            cmdstr++; // Skip spaces after the separator
+        }
+        if (*cmdstr != '\0') {
+            return cmdstr;
+        }
+    }
+    return NULL;
+}
+
+/* command_count_batch( line )
+ * Return the number of non-empty commands in a batched line.
+ */
+static uint8_t command_count_batch( char *line ) {
+    uint8_t count = 0;
+    char *end_ptr;
+    for (;;) {
+        end_ptr = command_separator(line);
+        while (*line == ' ') {
+            line++;
+        }
+        if ((*line != '\0') && (line != end_ptr)) {
+            count++;
+        }
+        if (end_ptr == NULL) {
+            return count;
+        }
+        line = end_ptr + 1;
+    }
+}
+
+/* process_batch( line )
+ * Run each command in a line of separated commands, framing their
+ * output and reporting the status of each one.  Every command is run
+ * even if an earlier one fails.
+ */
+static void process_batch( char *line ) {
+    char *line_ptr = line;
+    char *cmdstr;
+    uint8_t count;
+    uint8_t index = 0;
+    command_status_t status;
+    // Count the commands first so the frame can announce them
+    count = command_count_batch(line);
+    usart_puts_p(PSTR("batch "));
+    usart_put_u16(count);
+    usart_put_crlf();
+    while ((cmdstr = command_next(&line_ptr)) != NULL) {
+        index++;
+        status = command_run(cmdstr);
+        switch( status ) {
+            case command_status_OK:
+                usart_puts_p(PSTR("ok "));
+                usart_put_u16(index);
+                break;
+            case command_status_UNKNOWN:
+                usart_puts_p(PSTR("err "));
+                usart_put_u16(index);
+                usart_puts_p(PSTR(" unknown"));
+                break;
+            case command_status_FAILED:
+                usart_puts_p(PSTR("err "));
+                usart_put_u16(index);
+                usart_puts_p(PSTR(" failed"));
+                break;
+            default:
+                usart_puts_p(PSTR("err "));
+                usart_put_u16(index);
+                usart_puts_p(PSTR(" badarg"));
                 break;
-            }
-            command_array++;
         }
-        // If we didn't find a match, send an error message
-        if (pbuffer_match == 0) {
-            logger_msg_p("command",log_level_ERROR,
-                PSTR("Unrecognized command: '%s'.\r\n"),recv_cmd_state_ptr -> pbuffer);
-            recv_cmd_state_ptr -> pbuffer_lock = 0;
+        usart_put_crlf();
+    }
+    usart_puts_p(PSTR("end "));
+    usart_put_u16(count);
+    usart_put_crlf();
+    return;
+}
+
+/* process_pbuffer( recv_cmd_state_t *recv_cmd_state_ptr )
+ * Process the command (if there is one) at the tail of the parse queue. 
+ */
+void process_pbuffer( recv_cmd_state_t *recv_cmd_state_ptr ) {
+    char *pbuffer;
+    if ((recv_cmd_state_ptr -> pbuffer_head) !=
+        (recv_cmd_state_ptr -> pbuffer_tail)) {
+        // The parse queue isn't empty -- there's a command to process
+        BENCH_START(bench_id_PBUFFER);
+        pbuffer = recv_cmd_state_ptr -> pbuffer[(recv_cmd_state_ptr -> pbuffer_tail) &
+            (RECEIVE_QUEUE_SLOTS - 1)];
+        logger_msg_p(log_system_COMMAND,log_level_INFO,
+            PSTR("Processing '%s' from the parse queue.\r\n"), pbuffer);
+        if (command_separator(pbuffer) != NULL) {
+            process_batch(pbuffer);
         }
+        else {
+            command_run(pbuffer);
+        }
+        /* Give the slot back to the received character ISR.  Only
+         * process_pbuffer() writes pbuffer_tail. */
+        (recv_cmd_state_ptr -> pbuffer_tail)++;
+        BENCH_END(bench_id_PBUFFER);
     }
     return;
 }
 
 
-/* Execute a valid command received over the remote interface.
+/* command_parse_args( pointer to command, argument string,
+ *                     array of parsed arguments )
+ * Walk the argument string once, terminating each word where it sits in
+ * the parse queue and converting it to the type the command expects.
+ * A quoted word ends at its closing quote, which is overwritten with
+ * the terminator, so the word is used where it sits too.
  */
-void command_exec( command_t *command, char *argument ) {
-    // uint16_t argval = 0; // Decimal value of the argument
-    if (strcmp( command -> arg_type,"none" ) == 0) {
-        // There's no argument
-        logger_msg_p("command",log_level_INFO,
-            PSTR("Executing command with no argument.\r\n"));
-        command -> execute(0);
+uint8_t command_parse_args( command_t *command, char *argument,
+                            command_arg_t *argv ) {
+    uint8_t argnum;
+    char *word;
+    uint32_t value;
+    number_status_t status = number_status_OK;
+    
+    for (argnum = 0; argnum < COMMAND_MAX_ARGS; argnum++) {
+        if (command -> arg_type[argnum] == arg_type_NONE) {
+            break;
+        }
+        if ((argument == NULL) || (*argument == '\0')) {
+            logger_msg_p(log_system_COMMAND,log_level_ERROR,
+                PSTR("'%s' is missing argument %d.\r\n"),
+                command -> name, argnum + 1);
+            return 1;
+        }
+        // Terminate this word and move argument to the start of the next
+        word = argument;
+        if (*word == COMMAND_QUOTE) {
+            // The word is everything up to the closing quote
+            word++;
+            argument = strchr(word,COMMAND_QUOTE);
+            if ((argument == NULL) ||
+                ((argument[1] != ' ') && (argument[1] != '\0'))) {
+                logger_msg_p(log_system_COMMAND,log_level_ERROR,
+                    PSTR("Argument %d to '%s' has a bad quote.\r\n"),
+                    argnum + 1, command -> name);
+                return 1;
+            }
+            *argument++ = '\0';
+        }
+        else {
+            while ((*argument != ' ') && (*argument != '\0')) {
+                argument++;
+            }
+        }
+        while (*argument == ' ') {
+            *argument++ = '\0';
+        }
+        switch( command -> arg_type[argnum] ) {
+            case arg_type_HEX:
+                status = parse_hex( word, &value, 0xffff );
+                argv[argnum].u16 = (uint16_t)value;
+                break;
+            case arg_type_DEC:
+                status = parse_dec( word, &value, 0xffff );
+                argv[argnum].u16 = (uint16_t)value;
+                break;
+            case arg_type_SIGNED:
+                status = parse_signed( word, &argv[argnum].s16 );
+                break;
+            case arg_type_HEX32:
+                status = parse_hex( word, &argv[argnum].u32, 0xffffffffUL );
+                break;
+            case arg_type_DEC32:
+                status = parse_dec( word, &argv[argnum].u32, 0xffffffffUL );
+                break;
+            case arg_type_STRING:
+                argv[argnum].str = word;
+                break;
+            default:
+                break;
+        }
+        switch( status ) {
+            case number_status_EMPTY:
+                // Only a quoted word can be empty
+                logger_msg_p(log_system_COMMAND,log_level_ERROR,
+                    PSTR("Argument %d to '%s' is empty.\r\n"),
+                    argnum + 1, command -> name);
+                return 1;
+            case number_status_INVALID:
+                logger_msg_p(log_system_COMMAND,log_level_ERROR,
+                    PSTR("Argument %d to '%s' has a bad digit: '%s'.\r\n"),
+                    argnum + 1, command -> name, word);
+                return 1;
+            case number_status_OVERFLOW:
+                logger_msg_p(log_system_COMMAND,log_level_ERROR,
+                    PSTR("Argument %d to '%s' is out of range: '%s'.\r\n"),
+                    argnum + 1, command -> name, word);
+                return 1;
+            default:
+                break;
+        }
+        logger_msg_p(log_system_COMMAND,log_level_INFO,
+            PSTR("Argument %d is '%s'.\r\n"), argnum + 1, word);
     }
-    else if (strcmp( command -> arg_type,"hex" ) == 0) {
-        // There's a hex argument
-        logger_msg_p("command",log_level_INFO,
-            PSTR("Executing command with hex argument.\r\n"));
-        
-        uint16_t argval = hex2num(argument);
-        logger_msg_p("command",log_level_INFO,
-            PSTR("The argument value is %u.\r\n"),argval);
-        command -> execute(argval);
+    if ((argument != NULL) && (*argument != '\0')) {
+        logger_msg_p(log_system_COMMAND,log_level_ERROR,
+            PSTR("Too many arguments to '%s': '%s'.\r\n"),
+            command -> name, argument);
+        return 1;
     }
+    return 0;
 }
 
+/* Execute a valid command received over the remote interface.
+ */
+command_status_t command_exec( command_t *command, char *argument ) {
+    command_arg_t argv[COMMAND_MAX_ARGS];
+    uint32_t start; // clock_now() when the command started
+    command_status_t status;
+    if (command_parse_args( command, argument, argv ) != 0) {
+        // The error has already been logged
+        return command_status_BADARG;
+    }
+    logger_msg_p(log_system_COMMAND,log_level_INFO,
+        PSTR("Executing '%s'.\r\n"), command -> name);
+    start = clock_now();
+    status = command -> execute(argv);
+    /* This comes after every command, so it has its own system, which
+     * main() leaves off. */
+    logger_msg_p(log_system_TIMING,log_level_INFO,
+        PSTR("'%s' took %lu ticks.\r\n"), command -> name,
+        (unsigned long)(clock_now() - start));
+    return status;
+}
@@ -5,15 +5,56 @@
 #ifndef COMMAND_H
 #define COMMAND_H
 
+/* stdint.h
+ * Defines fixed-width integer types like uint8_t
+ */
+#include <stdint.h>
+
 /* Define the size of the received character buffer.  This buffer must 
  * be big enough to hold the biggest remote command along with its 
- * biggest argument and a space between the two.
+ * biggest argument and a space between the two.  Batched lines (see
+ * COMMAND_SEPARATOR) have to fit all of their commands.
  * 
- * The parse buffer will also be made this size, since I don't allow
- * received commands to pile up -- they have to be processed one at a
- * time.
+ * Each slot in the parse queue will also be made this size, so every
+ * byte added here costs RECEIVE_QUEUE_SLOTS + 1 bytes of RAM.  32 bytes
+ * costs 160 bytes in all, 60 more than the old 20 byte buffer.  It holds
+ * the longest command with real arguments, like "scancal 7 ffff -32768",
+ * and short batches like "vcalpt 1 3300;vcalpt 2 1000".  Set it from
+ * the makefile with something like -DRECEIVE_BUFFER_SIZE=64 for longer
+ * batches.
+ */
+#ifndef RECEIVE_BUFFER_SIZE
+#define RECEIVE_BUFFER_SIZE 32
+#endif
+
+/* Commands on one line separated by this character are run in order as
+ * a batch, with a single framed response:
+ *
+ * batch <number of commands>
+ * <output of the first command>
+ * ok 1
+ * <output of the second command>
+ * err 2 <unknown, badarg or failed>
+ * ...
+ * end <number of commands>
+ *
+ * Lines without a separator are run as a single command and answered
+ * without the frame.
+ */
+#define COMMAND_SEPARATOR ';'
+
+/* An argument starting with this character runs to the next one, so it
+ * can hold spaces and separators.  The quotes aren't part of the
+ * argument.  There's no way to put a quote inside a quoted argument.
+ */
+#define COMMAND_QUOTE '"'
+
+/* Define the number of slots in the parse queue.  Each slot holds one
+ * terminated command waiting to be processed, so this many commands
+ * can arrive back-to-back before process_pbuffer() has to catch up.
+ * This must be a power of 2.
  */
-#define RECEIVE_BUFFER_SIZE 20
+#define RECEIVE_QUEUE_SLOTS 4
 
 
 /* Define the received command state structure.
@@ -26,76 +67,180 @@ typedef struct recv_cmd_struct {
     /* rbuffer_write_ptr will always point to the next write location
      * in the received character buffer. */
     char *rbuffer_write_ptr;
-    /* Properly terminated strings will wait in the parse buffer to be
+    /* Properly terminated strings will wait in the parse queue to be
      * processed.  These strings may or may not have one argument, separated
      * from the command by 1 or a few spaces (the entire string isn't
-     * allowed to exceed the buffer size).  Since I don't queue up commands,
-     * this buffer can be the same size as the received character buffer. */
-    char pbuffer[RECEIVE_BUFFER_SIZE];
-    char *pbuffer_arg_ptr; // Points to the beginning of the argument
+     * allowed to exceed the buffer size).  The received character ISR
+     * copies strings in at the head, and process_pbuffer() takes them out
+     * at the tail. */
+    char pbuffer[RECEIVE_QUEUE_SLOTS][RECEIVE_BUFFER_SIZE];
+    volatile uint8_t pbuffer_head; // Counts strings put into the parse queue
+    volatile uint8_t pbuffer_tail; // Counts strings taken out of the parse queue
     uint8_t rbuffer_count; // Counts up as characters go into receive buffer.
-    uint8_t pbuffer_lock; // Parse buffer lock.  1 = locked
+    uint16_t pbuffer_queued; // Number of strings ever put in the parse queue
+    uint16_t pbuffer_dropped; // Number of strings lost to a full parse queue
+    uint8_t pbuffer_peak; // The most strings ever waiting in the parse queue
 } recv_cmd_state_t;
 
+/* The received command state is instantiated in bc_main.c */
+extern recv_cmd_state_t *recv_cmd_state_ptr;
+
 
 
  
+/* Results of running a command
+ */
+typedef enum command_status {
+    command_status_OK, // The command was executed
+    command_status_UNKNOWN, // No command has that name
+    command_status_BADARG, // The arguments didn't match the command
+    command_status_FAILED // The command refused a value or couldn't run
+} command_status_t;
+
+/* Define the maximum number of arguments a command can take.
+ */
+#define COMMAND_MAX_ARGS 3
+
+/* Argument types understood by command_exec()
+ */
+typedef enum arg_type {
+    arg_type_NONE, // No argument.  Ends a command's argument list.
+    arg_type_HEX, // 16-bit unsigned hex number
+    arg_type_DEC, // 16-bit unsigned decimal number
+    arg_type_SIGNED, // 16-bit signed decimal number
+    arg_type_HEX32, // 32-bit unsigned hex number
+    arg_type_DEC32, // 32-bit unsigned decimal number
+    arg_type_STRING // A word of text, pointing into the parse queue
+} arg_type_t;
+
+/* A parsed argument.  The member to use depends on the argument type:
+ * u16 for HEX and DEC, s16 for SIGNED, u32 for HEX32 and DEC32, and str
+ * for STRING.
+ */
+typedef union command_arg {
+    uint16_t u16;
+    int16_t s16;
+    uint32_t u32;
+    char *str;
+} command_arg_t;
+
 /* Define fpointer_t to be a pointer to a function called by a remote
  * command.
  * 
  * In order to make all functions called by remote commands take the same
- * arguments, we settle on them all taking a 16-bit argument.  Functions
- * called by remote commands should be prefixed by 'cmd_' to make the
- * reason for their argument type clear.
+ * arguments, we settle on them all taking an array of parsed arguments.
+ * The arguments have already been checked against the command's
+ * argument list, so argv[n] holds the type the command asked for.
+ * Functions called by remote commands should be prefixed by 'cmd_' to
+ * make the reason for their argument type clear.
+ *
+ * They return command_status_OK, or command_status_FAILED if they
+ * refused a value or couldn't do the job.  They log the reason
+ * themselves.
  */
-typedef void (*fpointer_t)(uint16_t argval);
+typedef command_status_t (*fpointer_t)(command_arg_t *argv);
 
-/* Each command_struct will describe one command */
+/* Define the size of the name field in each command structure.  This
+ * must hold the longest command name and its terminator.
+ */
+#define COMMAND_NAME_SIZE 12
+
+/* Each command_struct will describe one command.  The name is stored in
+ * the structure itself so the whole command table can live in flash.
+ */
 typedef struct command_struct {
-    char *name; // The name of the command
-    char *arg_type; // A string representing the type of argument expected
-    uint8_t arg_max_chars; // The maximum number of characters in the argument
+    char name[COMMAND_NAME_SIZE]; // The name of the command
+    /* The type of each argument, in order.  Unused entries are
+     * arg_type_NONE.  Every listed argument is required. */
+    arg_type_t arg_type[COMMAND_MAX_ARGS];
     fpointer_t execute; // The function to execute
     const char *help;
 } command_t;
 
 /* The array of command structures will have global scope.  The variable
- * command_array should be initialized in bc_command.c 
+ * command_array should be initialized in bc_command.c.  It's located in
+ * flash, so read entries with memcpy_P() or use command_find().
  */
-extern command_t command_array[];
+extern const command_t command_array[];
+
+/* The number of commands in command_array */
+extern const uint8_t command_count;
 
 
 /* command_init()
  * Initialize the received command state: Erase the buffers, reset
- * the write and argument pointers, zero the received character
- * counter, and unlock the parse buffer. 
+ * the write pointer, zero the received character
+ * counter, and empty the parse queue. 
  */
 void command_init( recv_cmd_state_t *recv_cmd_state_ptr );
 
-/* Execute a valid command received over the remote interface.
+/* command_check_table()
+ * Log an error for each command in command_array that's out of
+ * strcmp() order.  command_find() depends on the table being sorted.
  */
-void command_exec( command_t *command, char *argument );
-
-
+void command_check_table( void );
 
+/* command_search( command name, number of entries to search )
+ * Binary search the first count entries of command_array for a command
+ * name.  Returns the entry's index, or count if it isn't there.  The
+ * lookup benchmark uses the count to time smaller tables.
+ */
+uint8_t command_search( char *name, uint8_t count );
 
+/* command_find( command name, pointer to command structure )
+ * Binary search command_array for a command name.  If it's found, copy
+ * the command out of flash into the structure and return 0.  Return 1
+ * otherwise.
+ */
+uint8_t command_find( char *name, command_t *command );
+
+/* command_parse_args( pointer to command, argument string,
+ *                     array of parsed arguments )
+ * Split the argument string into words in place and convert each one to
+ * the type in the command's argument list.  Words are separated by
+ * spaces, or quoted with COMMAND_QUOTE.  Logs an error and returns 1 if
+ * there are too few or too many words, if a quote isn't closed, or if a
+ * word isn't a valid value of its type.  Returns 0 otherwise.
+ */
+uint8_t command_parse_args( command_t *command, char *argument,
+                            command_arg_t *argv );
+
+/* Execute a valid command received over the remote interface.  The
+ * argument is the rest of the received string after the command name,
+ * or NULL if there isn't one.  Returns command_status_BADARG without
+ * executing anything if the argument doesn't parse.  Otherwise returns
+ * the command's own status.
+ */
+command_status_t command_exec( command_t *command, char *argument );
 
-/* check_argsize( pointer to received command state,
- *                pointer to list of commands )
- * Returns 0 if the argument size is less than or equal to the number
- * of characters specified in the command list.  Returns -1 otherwise. */
-uint8_t check_argsize(recv_cmd_state_t *recv_cmd_state_ptr ,
-                  struct command_struct *command_array);
+/* command_run( command string )
+ * Split a single command string into its name and argument, look the
+ * name up, and execute it.  The string is modified in place.
+ */
+command_status_t command_run( char *cmdstr );
 
 
-/* process_pbuffer( recv_cmd_state_t *recv_cmd_state_ptr,
- *                  command_struct *commands )
- * Process the command (if there is one) in the parse buffer. */
-void process_pbuffer( recv_cmd_state_t *recv_cmd_state_ptr ,
-                    struct command_struct *command_array);
+/* process_pbuffer( recv_cmd_state_t *recv_cmd_state_ptr )
+ * Process the line (if there is one) at the tail of the parse queue.
+ * Lines containing COMMAND_SEPARATOR are run as a batch. */
+void process_pbuffer( recv_cmd_state_t *recv_cmd_state_ptr );
                     
 /* Erases the received character buffer, resets the received character
  * number, and resets the write pointer. */
 void rbuffer_erase( recv_cmd_state_t *recv_cmd_state_ptr );
 
+/* rbuffer_terminate( pointer to received command state )
+ * Called by the received character ISR when a command terminator
+ * arrives.  Copies the received string into the head of the parse
+ * queue, or counts it as dropped if the queue is full.  Returns 0 if the
+ * string was queued.
+ */
+uint8_t rbuffer_terminate( recv_cmd_state_t *recv_cmd_state_ptr );
+
+/* cmd_rxstat_q()
+ * Called by the remote command "rxstat?"  Returns the number of
+ * commands queued, the number dropped, and the peak parse queue depth.
+ */
+command_status_t cmd_rxstat_q( command_arg_t *argv );
+
 #endif // End the include guard
@@ -0,0 +1,299 @@
+/* bc_config.c
+ *
+ * Saves and restores the system configuration in EEPROM.
+ */
+
+/* string.h
+ * Provides memcmp() for verifying saved slots
+ */
+#include <string.h>
+
+/* stddef.h
+ * Provides offsetof()
+ */
+#include <stddef.h>
+
+/* bc_hal.h
+ * Provides eeprom_read_block() and eeprom_update_block().  The update
+ * functions skip bytes that already hold the right value, which saves
+ * both time and wear.  Also provides flash access, _crc_ccitt_update()
+ * for checking slots, and ATOMIC_BLOCK() for changing the scan list
+ * while the scan interrupt may be using it.
+ */
+#include "bc_hal.h"
+
+/* bc_logger.h
+ * Provides logger_msg_p, and logger_config for saving and restoring.
+ */
+#include "bc_logger.h"
+
+#include "bc_config.h"
+
+/* The settings the firmware was built with.  These match the defaults
+ * set up by the other modules' initializers and main().
+ */
+const config_t config_factory_settings PROGMEM = {
+    {1, 0, ADC_CAL_QBITS}, // Voltage slope, offset, and fraction bits
+    (1 << log_system_LOGGER) | (1 << log_system_RXCHAR) |
+    (1 << log_system_COMMAND) | (1 << log_system_ADC) |
+    (1 << log_system_CONFIG), // Logger enable
+    log_level_INFO, // Logger level
+    log_format_TEXT, // Logger format
+    adc_filter_NONE, // Filter mode
+    0, // Filter extra bits
+    2, // Exponential filter weight shift
+    { // Scan list entry n starts out on channel n
+        {0, 1, {1, 0, ADC_CAL_QBITS}},
+        {1, 1, {1, 0, ADC_CAL_QBITS}},
+        {2, 1, {1, 0, ADC_CAL_QBITS}},
+        {3, 1, {1, 0, ADC_CAL_QBITS}}
+    }
+};
+
+// Define a pointer to the configuration store state
+config_state_t config_state = {CONFIG_SLOTS, 0};
+config_state_t *config_state_ptr = &config_state;
+
+/* config_crc( pointer to slot )
+ * Returns the CRC of everything in the slot before the crc field.
+ */
+static uint16_t config_crc( config_slot_t *slot_ptr ) {
+    uint16_t crc = 0xffff;
+    uint8_t *byte_ptr = (uint8_t *)slot_ptr;
+    uint8_t count;
+    for (count = 0; count < offsetof(config_slot_t, crc); count++) {
+        crc = _crc_ccitt_update(crc, byte_ptr[count]);
+    }
+    return crc;
+}
+
+/* config_read( slot number, pointer to slot )
+ * Read a slot out of EEPROM.  Returns 0 if it holds a valid
+ * configuration of this version.
+ */
+static uint8_t config_read( uint8_t slot, config_slot_t *slot_ptr ) {
+    eeprom_read_block(slot_ptr, CONFIG_SLOT_ADDRESS(slot),
+                      sizeof(config_slot_t));
+    if ((slot_ptr -> version) != CONFIG_VERSION) {
+        return 1;
+    }
+    if (config_crc(slot_ptr) != (slot_ptr -> crc)) {
+        return 1;
+    }
+    return 0;
+}
+
+/* config_newer( sequence a, sequence b )
+ * True if a was saved after b.  Sequence numbers wrap, so compare the
+ * difference instead of the numbers.
+ */
+static uint8_t config_newer( uint16_t a, uint16_t b ) {
+    return (int16_t)(a - b) > 0;
+}
+
+/* config_find( pointer to slot )
+ * Read just the sequence numbers, then check slots newest first until
+ * one is valid.  At boot this is usually a single slot read.  Fills in
+ * the slot and the store state and returns 0 if a valid slot was found.
+ */
+static uint8_t config_find( config_slot_t *slot_ptr ) {
+    uint16_t sequence[CONFIG_SLOTS];
+    uint8_t tried = 0; // Bitfield of slots already checked
+    uint8_t newest;
+    uint8_t slot;
+    uint8_t count;
+    for (slot = 0; slot < CONFIG_SLOTS; slot++) {
+        sequence[slot] = eeprom_read_word(&(CONFIG_SLOT_ADDRESS(slot) -> sequence));
+    }
+    for (count = 0; count < CONFIG_SLOTS; count++) {
+        newest = CONFIG_SLOTS;
+        for (slot = 0; slot < CONFIG_SLOTS; slot++) {
+            if (tried & (1 << slot)) {
+                continue;
+            }
+            if ((newest == CONFIG_SLOTS) ||
+                config_newer(sequence[slot],sequence[newest])) {
+                newest = slot;
+            }
+        }
+        tried |= (1 << newest);
+        if (config_read(newest,slot_ptr) == 0) {
+            config_state_ptr -> slot = newest;
+            config_state_ptr -> sequence = sequence[newest];
+            return 0;
+        }
+    }
+    config_state_ptr -> slot = CONFIG_SLOTS;
+    return 1;
+}
+
+/* config_gather( pointer to configuration )
+ * Copy the current settings out of the other modules.
+ */
+static void config_gather( config_t *config_ptr ) {
+    uint8_t entry;
+    config_ptr -> volt_cal = volt_calfactor;
+    config_ptr -> log_enable = logger_config.enable;
+    config_ptr -> loglevel = logger_config.loglevel;
+    config_ptr -> logformat = logger_config.format;
+    config_ptr -> filter_mode = adc_filter.mode;
+    config_ptr -> filter_bits = adc_filter.bits;
+    config_ptr -> filter_shift = adc_filter.ema_shift;
+    for (entry = 0; entry < ADC_SCAN_SLOTS; entry++) {
+        config_ptr -> scan[entry].channel = adc_scan.entry[entry].channel;
+        config_ptr -> scan[entry].samples = adc_scan.entry[entry].samples;
+        config_ptr -> scan[entry].cal = adc_scan.entry[entry].cal;
+    }
+}
+
+/* config_apply( pointer to configuration )
+ * Copy settings into the other modules.  Settings that are out of
+ * range leave the module's setting alone, in case EEPROM holds
+ * something this firmware doesn't understand.
+ */
+static void config_apply( config_t *config_ptr ) {
+    uint8_t entry;
+    if ((config_ptr -> volt_cal.cal_qbits) <= ADC_CAL_MAXQBITS) {
+        volt_calfactor = config_ptr -> volt_cal;
+    }
+    logger_config.enable = config_ptr -> log_enable;
+    if ((config_ptr -> loglevel) <= log_level_ERROR) {
+        logger_config.loglevel = (logger_level_t)(config_ptr -> loglevel);
+    }
+    if ((config_ptr -> logformat) <= log_format_BINARY) {
+        logger_config.format = (logger_format_t)(config_ptr -> logformat);
+    }
+    if (((config_ptr -> filter_mode) < adc_filter_COUNT) &&
+        ((config_ptr -> filter_bits) <= ADC_FILTER_MAXBITS) &&
+        ((config_ptr -> filter_shift) > 0) &&
+        ((config_ptr -> filter_shift) <= ADC_EMA_FRACTION)) {
+        adc_filter.mode = (adc_filter_mode_t)(config_ptr -> filter_mode);
+        adc_filter.bits = config_ptr -> filter_bits;
+        adc_filter.ema_shift = config_ptr -> filter_shift;
+        adc_filter.ema_valid = 0;
+    }
+    for (entry = 0; entry < ADC_SCAN_SLOTS; entry++) {
+        if (((config_ptr -> scan[entry].channel) > 7) ||
+            ((config_ptr -> scan[entry].samples) == 0) ||
+            ((config_ptr -> scan[entry].samples) > ADC_SCAN_MAXSAMPLES) ||
+            ((config_ptr -> scan[entry].cal.cal_qbits) > ADC_CAL_MAXQBITS)) {
+            continue;
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            adc_scan.entry[entry].channel = config_ptr -> scan[entry].channel;
+            adc_scan.entry[entry].samples = config_ptr -> scan[entry].samples;
+            adc_scan.entry[entry].cal = config_ptr -> scan[entry].cal;
+        }
+    }
+}
+
+/* config_init()
+ * Restore the saved settings at boot.
+ */
+void config_init(void) {
+    if (config_load() == 0) {
+        logger_msg_p(log_system_CONFIG,log_level_INFO,
+            PSTR("Loaded configuration %u from slot %u.\r\n"),
+            config_state_ptr -> sequence, config_state_ptr -> slot);
+    }
+    else {
+        logger_msg_p(log_system_CONFIG,log_level_INFO,
+            PSTR("No saved configuration.  Using defaults.\r\n"));
+    }
+}
+
+/* config_load()
+ * Apply the newest valid slot.
+ */
+uint8_t config_load(void) {
+    config_slot_t slot;
+    if (config_find(&slot) != 0) {
+        return 1;
+    }
+    config_apply(&(slot.config));
+    return 0;
+}
+
+/* config_save()
+ * Write the settings to the slot after the newest valid one.  The
+ * newest slot isn't touched, so if the power goes out partway through,
+ * it's still there to be loaded at the next boot.
+ */
+uint8_t config_save(void) {
+    config_slot_t slot;
+    config_slot_t check;
+    uint8_t next;
+    if ((config_state_ptr -> slot) >= CONFIG_SLOTS) {
+        // Nothing valid saved yet.  Look again in case that's changed.
+        config_find(&slot);
+    }
+    if ((config_state_ptr -> slot) >= CONFIG_SLOTS) {
+        next = 0;
+        slot.sequence = 0;
+    }
+    else {
+        next = ((config_state_ptr -> slot) + 1) % CONFIG_SLOTS;
+        slot.sequence = (config_state_ptr -> sequence) + 1;
+    }
+    slot.version = CONFIG_VERSION;
+    config_gather(&(slot.config));
+    slot.crc = config_crc(&slot);
+    eeprom_update_block(&slot, CONFIG_SLOT_ADDRESS(next), sizeof(config_slot_t));
+    if ((config_read(next,&check) != 0) ||
+        (memcmp(&slot,&check,sizeof(config_slot_t)) != 0)) {
+        return 1;
+    }
+    config_state_ptr -> slot = next;
+    config_state_ptr -> sequence = slot.sequence;
+    return 0;
+}
+
+/* config_factory()
+ * Apply the settings stored in flash.
+ */
+void config_factory(void) {
+    config_t config;
+    memcpy_P(&config, &config_factory_settings, sizeof(config_t));
+    config_apply(&config);
+}
+
+/* cmd_save()
+ * Save the current settings.
+ */
+command_status_t cmd_save(command_arg_t *argv) {
+    if (config_save() != 0) {
+        logger_msg_p(log_system_CONFIG,log_level_ERROR,
+            PSTR("Configuration slot %u failed to verify.\r\n"),
+            ((config_state_ptr -> slot) + 1) % CONFIG_SLOTS);
+        return command_status_FAILED;
+    }
+    logger_msg_p(log_system_CONFIG,log_level_INFO,
+        PSTR("Saved configuration %u to slot %u.\r\n"),
+        config_state_ptr -> sequence, config_state_ptr -> slot);
+    return command_status_OK;
+}
+
+/* cmd_load()
+ * Restore the saved settings.
+ */
+command_status_t cmd_load(command_arg_t *argv) {
+    if (config_load() != 0) {
+        logger_msg_p(log_system_CONFIG,log_level_ERROR,
+            PSTR("No saved configuration.\r\n"));
+        return command_status_FAILED;
+    }
+    logger_msg_p(log_system_CONFIG,log_level_INFO,
+        PSTR("Loaded configuration %u from slot %u.\r\n"),
+        config_state_ptr -> sequence, config_state_ptr -> slot);
+    return command_status_OK;
+}
+
+/* cmd_factory()
+ * Restore the settings the firmware was built with.
+ */
+command_status_t cmd_factory(command_arg_t *argv) {
+    config_factory();
+    logger_msg_p(log_system_CONFIG,log_level_INFO,
+        PSTR("Restored factory settings.  Use save to keep them.\r\n"));
+    return command_status_OK;
+}
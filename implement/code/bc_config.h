@@ -0,0 +1,134 @@
+/* bc_config.h
+ *
+ * Saves and restores the system configuration in EEPROM.
+ *
+ * The EEPROM holds CONFIG_SLOTS copies of the configuration.  Each save
+ * goes in the slot after the newest one, so the writes are spread over
+ * all the slots instead of wearing out one.  Every slot carries a
+ * sequence number and a CRC.  A slot that was half written when the
+ * power went out fails its CRC, and the newest slot that passes is
+ * used instead.
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint8_t
+ */
+#include <stdint.h>
+
+/* bc_command.h
+ * Defines command_arg_t, the argument passed to remote command functions.
+ */
+#include "bc_command.h"
+
+/* bc_adc.h
+ * Defines adc_cal_t and ADC_SCAN_SLOTS.
+ */
+#include "bc_adc.h"
+
+/* Change this whenever config_t changes.  Slots saved with a different
+ * version are ignored.
+ */
+#define CONFIG_VERSION 2
+
+/* Define where the configuration slots start in EEPROM and how many
+ * there are.  The atmega169p has 512 bytes of EEPROM.
+ */
+#define CONFIG_EEPROM_START 0x000
+#define CONFIG_SLOTS 8
+
+/* Saved settings for one scan list entry */
+typedef struct config_scan_struct {
+    uint8_t channel; // ADC mux channel
+    uint8_t samples; // Number of samples averaged
+    adc_cal_t cal; // Slope and offset
+} config_scan_t;
+
+/* The settings kept in EEPROM.
+ */
+typedef struct config_struct {
+    adc_cal_t volt_cal; // Voltage measurement calibration
+    uint16_t log_enable; // Logger enable register
+    uint8_t loglevel; // Logger level threshold (logger_level_t)
+    uint8_t logformat; // Log message format (logger_format_t)
+    uint8_t filter_mode; // Measurement filter (adc_filter_mode_t)
+    uint8_t filter_bits; // Measurement filter extra bits
+    uint8_t filter_shift; // Exponential filter weight shift
+    config_scan_t scan[ADC_SCAN_SLOTS]; // The scan list
+} config_t;
+
+/* One configuration slot in EEPROM.  The CRC covers everything before
+ * it.
+ */
+typedef struct config_slot_struct {
+    uint16_t sequence; // Counts saves.  The newest slot has the highest.
+    uint8_t version; // CONFIG_VERSION when the slot was saved
+    config_t config;
+    uint16_t crc; // CRC-CCITT of the bytes above
+} config_slot_t;
+
+/* Address of a configuration slot in EEPROM */
+#define CONFIG_SLOT_ADDRESS( slot ) \
+    ((config_slot_t *)(CONFIG_EEPROM_START + (slot) * sizeof(config_slot_t)))
+
+/* The first EEPROM address after the configuration slots */
+#define CONFIG_EEPROM_END \
+    (CONFIG_EEPROM_START + CONFIG_SLOTS * sizeof(config_slot_t))
+
+/* The OSCCAL cache kept by bc_clock.c goes right after the slots
+ */
+#define CONFIG_EEPROM_OSCCAL CONFIG_EEPROM_END
+
+/* Configuration store state structure.
+ */
+typedef struct config_state_struct {
+    uint8_t slot; // The newest valid slot, or CONFIG_SLOTS if there isn't one
+    uint16_t sequence; // The newest valid slot's sequence number
+} config_state_t;
+
+
+/* config_init(void)
+ * Find the newest valid slot and apply its settings.  Call this once
+ * the other modules are initialized and before the main loop.  The
+ * settings made by the other modules' init functions are left alone if
+ * nothing valid is saved.
+ */
+void config_init(void);
+
+/* config_save(void)
+ * Save the current settings in the next slot.  Returns 0 if the slot
+ * reads back correctly.  This takes a few milliseconds per changed
+ * byte.
+ */
+uint8_t config_save(void);
+
+/* config_load(void)
+ * Apply the settings from the newest valid slot.  Returns 1 if there
+ * isn't one.
+ */
+uint8_t config_load(void);
+
+/* config_factory(void)
+ * Apply the settings the firmware was built with.  Nothing in EEPROM
+ * changes until the next save.
+ */
+void config_factory(void);
+
+/* cmd_save
+ * Called by the remote command "save."  Saves the current settings.
+ */
+command_status_t cmd_save(command_arg_t *argv);
+
+/* cmd_load
+ * Called by the remote command "load."  Restores the saved settings.
+ */
+command_status_t cmd_load(command_arg_t *argv);
+
+/* cmd_factory
+ * Called by the remote command "factory."  Restores the settings the
+ * firmware was built with.
+ */
+command_status_t cmd_factory(command_arg_t *argv);
+
+#endif // End the include guard
@@ -6,40 +6,124 @@
 #include <stdio.h>
 #include <string.h>
 
-/* pgmspace.h
- * Contains macros and functions for saving and reading data out of
- * flash.
+/* bc_hal.h
+ * Provides flash access, and ATOMIC_BLOCK() for reading the drift
+ * tracking results.
  */
-#include <avr/pgmspace.h>
+#include "bc_hal.h"
 #include "bc_usart.h"
 
 
 #include "bc_functions.h"
 
-/* pgmspace.h
- * Contains macros and functions for saving and reading data out of
- * flash.
- */
-#include <avr/pgmspace.h>
 
 /* bc_logger.h sets up logging */
 #include "bc_logger.h"
 
+/* bc_clock.h
+ * Provides the system tick and uptime.
+ */
+#include "bc_clock.h"
+
+/* bc_job.h
+ * Provides job_start() for sending the help in the background.
+ */
+#include "bc_job.h"
+
+
+command_status_t cmd_hello( command_arg_t *argv ) {
+    usart_puts_p(PSTR("Hello yourself!\r\n"));
+    return command_status_OK;
+}
+
+/* cmd_uptime_q()
+ * The seconds don't wrap, but the tick count does after 36.4 hours.
+ */
+command_status_t cmd_uptime_q( command_arg_t *argv ) {
+    uint32_t ticks = clock_now();
+    usart_put_u32(clock_uptime());
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex32(ticks);
+    usart_put_crlf();
+    return command_status_OK;
+}
+
+/* cmd_boot_q()
+ * The times are kept in ticks to save RAM, and converted here.
+ */
+command_status_t cmd_boot_q( command_arg_t *argv ) {
+    usart_put_u16(clock_boot_ptr -> source);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(clock_boot_ptr -> osccal);
+    usart_putc(' ');
+    usart_put_u16(clock_boot_ptr -> passes);
+    usart_putc(' ');
+    usart_put_u32(CLOCK_TICKS_MS(clock_boot_ptr -> crystal));
+    usart_putc(' ');
+    usart_put_u32(CLOCK_TICKS_MS(clock_boot_ptr -> calibrated));
+    usart_putc(' ');
+    usart_put_u32(CLOCK_TICKS_MS(clock_boot_ptr -> ready));
+    usart_put_crlf();
+    return command_status_OK;
+}
 
-void cmd_hello( uint16_t nonval ) {
-    usart_printf_p(PSTR("Hello yourself!\r\n"));
-    return;
+/* cmd_drift_q()
+ * Copy the results out with interrupts off, so they're from the same
+ * measurement.
+ */
+command_status_t cmd_drift_q( command_arg_t *argv ) {
+    int32_t error;
+    uint16_t adjustments;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        error = clock_drift.error;
+        adjustments = clock_drift.adjustments;
+    }
+    usart_put_s32(error);
+    usart_putc(' ');
+    usart_put_u16(adjustments);
+    usart_put_crlf();
+    return command_status_OK;
 }
 
-void cmd_help( uint16_t nonval ) {
-    print_help( command_array );
-    return;
+/* help_step( pointer to job )
+ * Send one command's whole help string each step, and only once the
+ * transmit queue is empty, so replies to other commands land between
+ * entries.  Each line starts with the job's ID.  done counts the
+ * commands whose help has been sent.  Help strings are never empty and
+ * end with a line ending.
+ */
+static job_status_t help_step( job_t *job_ptr ) {
+    const char *text_ptr;
+    char data;
+    if (usart_tx_pending() != 0) {
+        return job_status_RUNNING;
+    }
+    // The help pointer is in the command table in flash
+    memcpy_P(&text_ptr, &command_array[job_ptr -> done].help,
+             sizeof(text_ptr));
+    job_reply_tag(job_ptr);
+    while ((data = pgm_read_byte(text_ptr++)) != '\0') {
+        usart_putc(data);
+        if ((data == '\n') && (pgm_read_byte(text_ptr) != '\0')) {
+            job_reply_tag(job_ptr);
+        }
+    }
+    (job_ptr -> done)++;
+    if ((job_ptr -> done) < (job_ptr -> total)) {
+        return job_status_RUNNING;
+    }
+    job_reply_done(job_ptr);
+    usart_put_crlf();
+    return job_status_DONE;
 }
 
-void print_help( command_t *command_array ) {
-    while ((command_array -> execute) != 0) {
-        usart_printf_p(command_array -> help);
-        command_array++;
+/* cmd_help()
+ * The help is several kilobytes, which takes seconds to send at 9600
+ * baud, so it's sent by a job.
+ */
+command_status_t cmd_help( command_arg_t *argv ) {
+    if (job_start(&help_step, command_count, 0) == 0) {
+        return command_status_FAILED;
     }
-    return;
+    return command_status_OK;
 }
@@ -17,16 +17,31 @@ struct cal_struct {
 /* cmd_hello()
  * Print a greeting.
  */
-void cmd_hello( uint16_t nonval );
+command_status_t cmd_hello( command_arg_t *argv );
 
-/* cmd_help()
- * Call print_help() to print the help strings for all recognized
- * commands.
+/* cmd_uptime_q()
+ * Called by the remote command "uptime?"  Returns the seconds since
+ * reset and the 32kHz tick count from clock_now().
+ */
+command_status_t cmd_uptime_q( command_arg_t *argv );
+
+/* cmd_boot_q()
+ * Called by the remote command "boot?"  Returns how the oscillator
+ * calibration found OSCCAL (clock_boot_source_t), the OSCCAL value, the
+ * number of calibration measurements, and the milliseconds from timer 2
+ * starting until the crystal was running, until calibration finished,
+ * and until the main loop started.
  */
-void cmd_help( uint16_t nonval );
+command_status_t cmd_boot_q( command_arg_t *argv );
 
-/* print_help()
- * Called by cmd_help().  Prints the help strings for all recognized
- * commands.
+/* cmd_drift_q()
+ * Called by the remote command "drift?"  Returns the system clock error
+ * from the last second of drift tracking in ppm, and the number of
+ * OSCCAL steps taken since boot.
+ */
+command_status_t cmd_drift_q( command_arg_t *argv );
+
+/* cmd_help()
+ * Start a job that prints the help strings for all recognized commands.
  */
-void print_help(command_t *command_array);
+command_status_t cmd_help( command_arg_t *argv );
@@ -0,0 +1,90 @@
+/* bc_hal.h
+ *
+ * Hardware abstraction layer.  Modules include this instead of the
+ * avr-libc headers, and reach the USART and ADC through the hal_
+ * functions below instead of writing registers, so the command stack
+ * can also be built as a native program.
+ *
+ * bc_hal_avr.h implements the layer for the Butterfly.  Its functions
+ * are static inline register accesses, so the AVR build costs the same
+ * as writing the registers directly.  bc_hal_linux.h and bc_hal_linux.c
+ * implement it on a PC.  See "make host" in the makefile.
+ *
+ * Both implementations provide:
+ *
+ * PROGMEM, PSTR(), PGM_P, pgm_read_byte(), pgm_read_word(),
+ *     pgm_read_dword(), memcpy_P(), strcmp_P(), strncpy_P(),
+ *     vsnprintf_P() -- flash access
+ * ISR(), sei(), cli() -- interrupts
+ * ATOMIC_BLOCK(ATOMIC_RESTORESTATE) -- sections interrupts can't enter
+ * eeprom_read_block(), eeprom_read_word(), eeprom_update_block() -- the
+ *     EEPROM
+ * _crc_ccitt_update() -- the CRC used by the EEPROM configuration store
+ *
+ * hal_poll() -- Called once per pass of the main loop.  Does nothing on
+ *     the AVR.  On a PC it runs the modeled peripherals and their
+ *     interrupts.
+ * hal_wait() -- Called from loops waiting on an interrupt.  Does nothing
+ *     on the AVR.  On a PC it runs the modeled interrupts.
+ * hal_irq_enabled() -- Nonzero if interrupts are enabled.
+ * hal_sleep() -- Called with interrupts disabled when there's nothing
+ *     to do.  Enables interrupts and sleeps until the next one.  On a PC
+ *     it enables interrupts and lets hal_poll() wait.
+ *
+ * hal_uart_init() -- 9600 baud, 8 data bits, 1 stop bit, no parity,
+ *     with receive complete interrupts.
+ * hal_uart_baud( setting ) -- Set UBRR0 to the low 12 bits of the
+ *     setting, with double speed mode if HAL_UART_U2X is set.
+ * hal_uart_tx_start() -- Enable the data register empty interrupt.
+ * hal_uart_tx_stop() -- Disable the data register empty interrupt.
+ * hal_uart_tx_ready() -- Nonzero if the data register can take a byte.
+ * hal_uart_put( byte ) -- Write the data register.
+ * hal_uart_tx_idle() -- Nonzero if the last byte written has been
+ *     completely shifted out.
+ * hal_uart_rx_ready() -- Nonzero if a received byte is waiting.
+ * hal_uart_rx_idle() -- Nonzero if the RXD pin is at its idle level.  It
+ *     also reads high during the 1 bits of a byte being received.
+ * hal_uart_get() -- Read the data register.
+ *
+ * hal_adc_init() -- Enable the ADC on AVcc with the voltage reader
+ *     selected, and run the first (longer) conversion.
+ * hal_adc_prescaler( prescaler bits ) -- Set the ADPS bits that divide
+ *     the system clock down to the ADC clock.
+ * hal_adc_mux( channel ) -- Select the input channel.
+ * hal_adc_convert() -- Run one conversion and return the result.
+ * hal_adc_result() -- Return the last result.  Used by the interrupt.
+ * hal_adc_start() -- Start a conversion without waiting for it.
+ * hal_adc_irq_start() -- Enable the conversion complete interrupt and
+ *     start a conversion.
+ * hal_adc_irq_stop() -- Disable the interrupt and wait for any
+ *     conversion in progress.
+ * hal_adc_timer_start( clock select, top ) -- Run timer 0 in CTC mode
+ *     with the given clock select bits and top count, triggering a
+ *     conversion and its interrupt on every compare match.
+ * hal_adc_timer_ack() -- Re-arm the compare match trigger.  Call this
+ *     from the interrupt.
+ * hal_adc_timer_stop() -- Stop timer 0 and the triggered conversions.
+ *
+ * Timer 1, the system clock and its calibration are in bc_clock.h.
+ * bc_clock.c implements them for the AVR, and bc_hal_linux.c for a PC.
+ */
+#ifndef HAL_H
+#define HAL_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint8_t
+ */
+#include <stdint.h>
+
+/* Define the flag in a hal_uart_baud() setting that selects double
+ * speed mode.
+ */
+#define HAL_UART_U2X 0x8000
+
+#ifdef __AVR__
+#include "bc_hal_avr.h"
+#else
+#include "bc_hal_linux.h"
+#endif
+
+#endif // End the include guard
@@ -0,0 +1,328 @@
+/* bc_hal_avr.h
+ *
+ * The hardware abstraction layer for the Butterfly's ATmega169P.  These
+ * are static inline so each one compiles down to its register accesses.
+ * Include bc_hal.h instead of this file.
+ */
+#ifndef HAL_AVR_H
+#define HAL_AVR_H
+
+/* avr/io.h
+ * Device-specific port definitions
+ */
+#include <avr/io.h>
+
+/* pgmspace.h
+ * Contains macros and functions for saving and reading data out of
+ * flash.
+ */
+#include <avr/pgmspace.h>
+
+/* avr/interrupt.h
+ * Provides the ISR() macro and sei() / cli().
+ */
+#include <avr/interrupt.h>
+
+/* avr/eeprom.h
+ * Provides eeprom_read_block() and eeprom_update_block().
+ */
+#include <avr/eeprom.h>
+
+/* util/atomic.h
+ * Provides ATOMIC_BLOCK() for touching data shared with interrupts.
+ */
+#include <util/atomic.h>
+
+/* util/crc16.h
+ * Provides _crc_ccitt_update().
+ */
+#include <util/crc16.h>
+
+/* avr/sleep.h
+ * Provides the sleep_ macros for hal_sleep().
+ */
+#include <avr/sleep.h>
+
+/* hal_poll()
+ * The peripherals run by themselves on the AVR.
+ */
+static inline void hal_poll(void) {
+}
+
+/* hal_wait()
+ * Interrupts make progress by themselves on the AVR.
+ */
+static inline void hal_wait(void) {
+}
+
+/* hal_irq_enabled()
+ * Return nonzero if the global interrupt enable bit is set.
+ */
+static inline uint8_t hal_irq_enabled(void) {
+    return SREG & (1<<SREG_I);
+}
+
+/* hal_sleep()
+ * sei() only takes effect after the instruction that follows it, so an
+ * interrupt can't slip in between enabling interrupts and sleeping and
+ * leave the CPU asleep with work to do.  Idle mode keeps the timers, the
+ * USART and the ADC running, and any of their interrupts wakes it.
+ */
+static inline void hal_sleep(void) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+}
+
+/* ------------------------------ USART ------------------------------- */
+
+/* hal_uart_init()
+ * The butterfly only has one USART, so all the n values for
+ * configuration registers are 0.
+ */
+static inline void hal_uart_init(void) {
+    /* Set the USART baudrate registers for 9600.  With a fosc of 1MHz,
+     * and double speed operation enabled, this means UBRR0 = 12.  UBRR
+     * is a 12-bit register, so it has a high and a low byte. */
+    UBRR0H = 0;
+    UBRR0L = 12;
+
+    /* Set double speed mode. */
+    UCSR0A = (1<<U2X0);
+
+    /* Configure USART control register B */
+    UCSR0B = (1<<RXEN0)|(1<<TXEN0); // Enable receiver and transmitter.
+    UCSR0B |= (1<<RXCIE0); // Enable receive complete interrupts.
+    UCSR0B |= (0<<TXCIE0); // Enable transmit complete interrupts (not right now).
+    UCSR0B |= (0<<UDRIE0); // Data register empty interrupts are enabled by usart_putc().
+
+    /* Set the USART to asynchronous at 8 bits no parity and 1 stop bit */
+    UCSR0C = (0<<UMSEL0)|(0<<UPM00)|(0<<USBS0)|(3<<UCSZ00)|(0<<UCPOL0);
+}
+
+/* hal_uart_baud( setting )
+ * Only change the baud rate when the transmitter is idle.  Writing
+ * UBRR0L updates the baud rate prescaler straight away.
+ */
+static inline void hal_uart_baud(uint16_t setting) {
+    if (setting & HAL_UART_U2X) {
+        UCSR0A |= (1<<U2X0);
+    }
+    else {
+        UCSR0A &= ~(1<<U2X0);
+    }
+    UBRR0H = (uint8_t)((setting >> 8) & 0x0f);
+    UBRR0L = (uint8_t)setting;
+}
+
+/* hal_uart_tx_start()
+ * Enable data register empty interrupts.
+ */
+static inline void hal_uart_tx_start(void) {
+    UCSR0B |= (1<<UDRIE0);
+}
+
+/* hal_uart_tx_stop()
+ * Disable data register empty interrupts.
+ */
+static inline void hal_uart_tx_stop(void) {
+    UCSR0B &= ~(1<<UDRIE0);
+}
+
+/* hal_uart_tx_ready()
+ * The UDRE0 flag is set when the data register can take a byte.
+ */
+static inline uint8_t hal_uart_tx_ready(void) {
+    return UCSR0A & (1<<UDRE0);
+}
+
+/* hal_uart_put( byte )
+ * Clear the transmit complete flag for hal_uart_tx_idle(), then write
+ * the data register.  The flag is cleared by writing a one to it.  The
+ * error flags have to be written as zeros, so only U2X0 is kept.
+ */
+static inline void hal_uart_put(uint8_t data) {
+    UCSR0A = (UCSR0A & (1<<U2X0)) | (1<<TXC0);
+    UDR0 = data;
+}
+
+/* hal_uart_tx_idle()
+ * The TXC0 flag is set when the shift register empties with nothing
+ * waiting in the data register.  It's only cleared by hal_uart_put(),
+ * since the transmit complete interrupt isn't used.
+ */
+static inline uint8_t hal_uart_tx_idle(void) {
+    return UCSR0A & (1<<TXC0);
+}
+
+/* hal_uart_rx_ready()
+ * The RXC0 flag is set when there's data in the receive buffer.
+ */
+static inline uint8_t hal_uart_rx_ready(void) {
+    return UCSR0A & (1<<RXC0);
+}
+
+/* hal_uart_rx_idle()
+ * RXD is PE0, which idles high.  The receiver takes over the pin, but
+ * PINE still reads it.
+ */
+static inline uint8_t hal_uart_rx_idle(void) {
+    return PINE & (1<<PINE0);
+}
+
+/* hal_uart_get()
+ * Read the data register.
+ */
+static inline uint8_t hal_uart_get(void) {
+    return UDR0;
+}
+
+/* ------------------------------- ADC -------------------------------- */
+
+/* hal_adc_init()
+ * Set up the 10-bit SAR ADC on the voltage reader.
+ */
+static inline void hal_adc_init(void) {
+    /* The butterfly has Vcc connected to AVcc via a low-pass filter.
+     * It also has a shunt capacitor at the Aref pin.  So I can use the
+     * voltage at AVcc as the reference. */
+    ADMUX = (0<<REFS1) | (1<<REFS0);
+
+    /* Right-justify the data in the high and low registers by clearing
+     * ADLAR.  This is a 10-bit ADC. */
+    ADMUX &= ~(_BV(ADLAR));
+
+    /* The butterfly's voltage reader is connected to ADC1 on pin 60.
+     * This makes a nice initialization value. */
+    ADMUX |= 1;
+
+    /* Enable the ADC and set the fosc --> fsar prescaler.
+     * The SAR conversion requires between 50 and 200kHz for 10-bit
+     * resolution, but can be set as high as fosc/2 for lower resolution.
+     * Set the prescaler to 8 to get fsar = 125kHz.
+     * Normal conversions take 13 cycles, or 13*8us = 104us for
+     * fsar = 125kHz.  The maximum conversion rate is thus fsar / 13
+     * or 9.6kHz for fsar = 125kHz.
+     *
+     * ADCSRA = (1<<ADEN) | (1<<ADPS1) | (1<<ADPS0); fsar = 125kHz
+     */
+    ADCSRA = (1<<ADEN) | (1<<ADPS1) | (1<<ADPS0);
+
+    /* Disable auto-triggering.  We'll trigger the ADC manually. */
+    ADCSRA &= ~(_BV(ADATE));
+
+    /* The first ADC conversion will take 25 ADC clock cycles instead of
+     * the normal 13.  The first one initializes the ADC. Take a single
+     * conversion for this initialization step. */
+    ADCSRA |= (1<<ADSC);
+
+    /* The ADIF bit in the ADCSRA register will be set when the conversion
+     * is finished. Wait for conversion to finish. */
+    while(!(ADCSRA & (1<<ADIF)));
+    ADCSRA |= (1<<ADIF); // Clear the flag by writing a one to it
+}
+
+/* hal_adc_prescaler( prescaler bits )
+ * Replace the ADPS bits, leaving the rest of ADCSRA alone.  ADIF is
+ * cleared by writing a one, so don't write it back.
+ */
+static inline void hal_adc_prescaler(uint8_t prescaler) {
+    ADCSRA = (ADCSRA & ~(_BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0))) |
+        (prescaler & (_BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0)));
+}
+
+/* hal_adc_mux( channel )
+ * The mux selection overrides any data direction selection made with
+ * DDRF.  See section 13.3 of the datasheet.
+ */
+static inline void hal_adc_mux(uint8_t channel) {
+    ADMUX &= (1<<REFS1) | (1<<REFS0) | (1<<ADLAR);
+    ADMUX |= channel;
+}
+
+/* hal_adc_result()
+ * Reading ADCL locks the result registers until ADCH is read.
+ */
+static inline uint16_t hal_adc_result(void) {
+    uint16_t result;
+    result = ADCL;            // Read the lower 8 bits first
+    result += (ADCH << 8);    // Add the upper 2 bits
+    return result;
+}
+
+/* hal_adc_convert()
+ * ADIF is only cleared by writing a one to it, so clear the flag left
+ * by the last conversion before starting this one.  Otherwise the wait
+ * below falls straight through and returns stale data.  The ADC stays
+ * enabled from hal_adc_init().
+ */
+static inline uint16_t hal_adc_convert(void) {
+    ADCSRA |= (1<<ADIF);
+    ADCSRA |= (1<<ADSC);  // Do a single conversion
+    while(!(ADCSRA & (1<<ADIF)));  // Wait for the conversion to finish
+    return hal_adc_result();
+}
+
+/* hal_adc_start()
+ * Start a conversion.
+ */
+static inline void hal_adc_start(void) {
+    ADCSRA |= _BV(ADSC);
+}
+
+/* hal_adc_irq_start()
+ * Clear any old conversion flag, then start a conversion with its
+ * interrupt enabled.
+ */
+static inline void hal_adc_irq_start(void) {
+    ADCSRA |= _BV(ADIF);
+    ADCSRA |= _BV(ADIE) | _BV(ADSC);
+}
+
+/* hal_adc_irq_stop()
+ * Let a conversion that's already started finish, so it can't be
+ * mistaken for the next single conversion.
+ */
+static inline void hal_adc_irq_stop(void) {
+    ADCSRA &= ~(_BV(ADIE));
+    while (ADCSRA & _BV(ADSC));
+}
+
+/* hal_adc_timer_start( clock select, top )
+ * The ADC starts a conversion on the rising edge of the trigger flag.
+ * Nothing else clears OCF0A, so it has to start out clear and the ADC
+ * interrupt has to clear it after every conversion with
+ * hal_adc_timer_ack().
+ */
+static inline void hal_adc_timer_start(uint8_t clock_select, uint16_t top) {
+    OCR0A = (uint8_t)(top - 1);
+    TCNT0 = 0;
+    TIFR0 = _BV(OCF0A);
+    // Select timer 0 compare match A as the auto trigger source
+    ADCSRB = (ADCSRB & ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0))) |
+        _BV(ADTS1) | _BV(ADTS0);
+    // Clear any old conversion flag, then enable triggering and interrupts
+    ADCSRA |= _BV(ADIF);
+    ADCSRA |= _BV(ADATE) | _BV(ADIE);
+    // Start timer 0 in CTC mode with the chosen prescaler
+    TCCR0A = _BV(WGM01) | clock_select;
+}
+
+/* hal_adc_timer_ack()
+ * Clear the trigger flag so the next compare match starts a conversion.
+ */
+static inline void hal_adc_timer_ack(void) {
+    TIFR0 = _BV(OCF0A);
+}
+
+/* hal_adc_timer_stop()
+ * Writing ADCSRA back also clears ADIF if a conversion just finished.
+ */
+static inline void hal_adc_timer_stop(void) {
+    TCCR0A = 0;
+    ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+}
+
+#endif // End the include guard
@@ -0,0 +1,591 @@
+/* bc_hal_linux.c
+ *
+ * The hardware abstraction layer for building the command stack as a
+ * native program on a PC.  See bc_hal_linux.h.
+ */
+#include <stdio.h>
+#include <stdlib.h> // Provides exit()
+
+/* unistd.h and poll.h
+ * Provide read() and poll() for taking characters from stdin without
+ * blocking the main loop.
+ */
+#include <unistd.h>
+#include <poll.h>
+
+/* time.h
+ * Provides clock_gettime() for timer 1 and the sample trigger.
+ */
+#include <time.h>
+
+#include "bc_hal.h"
+
+/* bc_clock.h
+ * Provides clock_fosc() and the clock functions implemented here for the
+ * PC.
+ */
+#include "bc_clock.h"
+
+/* bc_bench.h
+ * Declares the marker timing functions kept here when built with
+ * -DBENCH.
+ */
+#include "bc_bench.h"
+
+/* Define the longest time in ms that hal_poll() waits for input when
+ * there's nothing else to do.  This keeps the main loop from spinning.
+ */
+#define HAL_LINUX_IDLE_MS 10
+
+/* Define the most triggered conversions run by one hal_poll() when the
+ * main loop falls behind.  Any more are skipped, like a real overrun.
+ */
+#define HAL_LINUX_MAX_CATCHUP 16
+
+volatile uint8_t hal_linux_irq = 0;
+
+/* The modeled USART
+ */
+typedef struct hal_linux_uart_struct {
+    uint8_t rx_irq; // Receive complete interrupt enabled
+    uint8_t tx_irq; // Data register empty interrupt enabled
+    int16_t rx_data; // The received character, or -1 for none
+    uint8_t rx_eof; // stdin has been closed
+    uint8_t eof_polls; // Calls to hal_poll() since stdin was closed
+} hal_linux_uart_t;
+
+hal_linux_uart_t hal_linux_uart = {0, 0, -1, 0, 0};
+
+/* Where the modeled USART sends characters, or NULL for stdout.  The
+ * tests point this at a memory stream to check replies.
+ */
+FILE *hal_linux_tx_file = NULL;
+
+/* Nonzero when the main loop called hal_sleep() on its last pass, so
+ * it has nothing to do until the next interrupt
+ */
+uint8_t hal_linux_idle = 0;
+
+/* The modeled ADC and timer 0
+ */
+typedef struct hal_linux_adc_struct {
+    uint8_t channel; // Selected mux channel
+    uint8_t irq; // Conversion complete interrupt enabled
+    uint8_t busy; // A conversion has been started
+    uint16_t result; // The last conversion
+    uint16_t count; // Conversions so far, used to make the ramp
+    uint8_t timer_running; // Timer 0 is triggering conversions
+    uint64_t timer_period; // Microseconds between triggers
+    uint64_t timer_next; // Time of the next trigger in microseconds
+} hal_linux_adc_t;
+
+hal_linux_adc_t hal_linux_adc = {1, 0, 0, 0, 0, 0, 0, 0};
+
+/* Makes up conversions in place of the ramp when it isn't NULL
+ */
+uint16_t (*hal_linux_adc_source)(uint8_t channel) = NULL;
+
+/* Timer 0 prescaler for each clock select setting
+ */
+const uint16_t hal_linux_prescaler[] = {0, 1, 8, 64, 256, 1024};
+
+/* The EEPROM contents, loaded from HAL_LINUX_EEPROM_FILE on first use.
+ * Erased EEPROM reads as 0xff.
+ */
+uint8_t hal_linux_eeprom[HAL_LINUX_EEPROM_SIZE];
+uint8_t hal_linux_eeprom_loaded = 0;
+
+/* Bytes left before a modeled power failure, or -1 for no limit
+ */
+int16_t hal_linux_eeprom_budget = -1;
+
+#ifdef BENCH
+bench_host_stat_t bench_host_stats[bench_id_COUNT];
+
+/* When each marked point was started in nanoseconds, or 0 if it isn't
+ * running
+ */
+static uint64_t bench_host_started[bench_id_COUNT];
+
+/* bench_host_nanos()
+ * Return the time in nanoseconds from the PC's monotonic clock.  Never
+ * returns 0, which marks a point that isn't running.
+ */
+static uint64_t bench_host_nanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec + 1;
+}
+
+/* bench_host_start( point )
+ * See bc_bench.h.
+ */
+void bench_host_start( bench_id_t id ) {
+    bench_host_started[id] = bench_host_nanos();
+}
+
+/* bench_host_end( point )
+ * See bc_bench.h.
+ */
+void bench_host_end( bench_id_t id ) {
+    bench_host_stat_t *stat_ptr = &bench_host_stats[id];
+    uint64_t elapsed;
+    if (bench_host_started[id] == 0) {
+        return;
+    }
+    elapsed = bench_host_nanos() - bench_host_started[id];
+    bench_host_started[id] = 0;
+    if (((stat_ptr -> count) == 0) || (elapsed < (stat_ptr -> min))) {
+        stat_ptr -> min = elapsed;
+    }
+    if (elapsed > (stat_ptr -> max)) {
+        stat_ptr -> max = elapsed;
+    }
+    stat_ptr -> total += elapsed;
+    (stat_ptr -> count)++;
+}
+#endif
+
+/* hal_linux_micros()
+ * Return the time in microseconds from the PC's monotonic clock.
+ */
+static uint64_t hal_linux_micros(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/* hal_linux_isr( interrupt function )
+ * Run an interrupt with further interrupts disabled, like the AVR does.
+ */
+static void hal_linux_isr(void (*vector)(void)) {
+    hal_linux_irq = 0;
+    vector();
+    hal_linux_irq = 1;
+}
+
+/* hal_linux_rx_fill( timeout in ms )
+ * Read a character from stdin into the receive register if it's empty
+ * and a character arrives within the timeout.  Terminals end lines with
+ * a line feed, but the command interface wants a carriage return.
+ */
+static void hal_linux_rx_fill(int timeout) {
+    struct pollfd input = {0, POLLIN, 0};
+    char data;
+    if ((hal_linux_uart.rx_data >= 0) || hal_linux_uart.rx_eof) {
+        return;
+    }
+    if (poll(&input, 1, timeout) <= 0) {
+        return;
+    }
+    if (read(0, &data, 1) != 1) {
+        hal_linux_uart.rx_eof = 1;
+        return;
+    }
+    hal_linux_uart.rx_data = (uint8_t)((data == '\n') ? '\r' : data);
+}
+
+/* hal_linux_convert()
+ * Finish a conversion.  Unless hal_linux_adc_source says otherwise, the
+ * input is a ramp offset by the channel number, so filters, scans and
+ * streams have something to show.
+ */
+static void hal_linux_convert(void) {
+    if (hal_linux_adc_source != NULL) {
+        hal_linux_adc.result = hal_linux_adc_source(hal_linux_adc.channel) &
+                               0x3ff;
+    }
+    else {
+        hal_linux_adc.result = ((hal_linux_adc.channel << 7) +
+                                (hal_linux_adc.count & 0x7f)) & 0x3ff;
+    }
+    (hal_linux_adc.count)++;
+    hal_linux_adc.busy = 0;
+}
+
+/* hal_linux_run_interrupts()
+ * Call the interrupt for each peripheral with something to do.
+ */
+static void hal_linux_run_interrupts(void) {
+    uint64_t now;
+    uint8_t catchup = 0;
+    if (hal_linux_irq == 0) {
+        return;
+    }
+    while (hal_linux_uart.tx_irq) {
+        hal_linux_isr(&USART0_UDRE_vect);
+    }
+    if (hal_linux_adc.timer_running) {
+        now = hal_linux_micros();
+        while (now >= hal_linux_adc.timer_next) {
+            hal_linux_adc.timer_next += hal_linux_adc.timer_period;
+            if (++catchup > HAL_LINUX_MAX_CATCHUP) {
+                continue;
+            }
+            hal_linux_convert();
+            if (hal_linux_adc.irq) {
+                hal_linux_isr(&ADC_vect);
+            }
+        }
+    }
+    else if (hal_linux_adc.busy && hal_linux_adc.irq) {
+        hal_linux_convert();
+        hal_linux_isr(&ADC_vect);
+    }
+}
+
+/* hal_wait()
+ * Let the interrupts make progress while something waits on them.
+ */
+void hal_wait(void) {
+    hal_linux_run_interrupts();
+}
+
+/* hal_poll()
+ * Run the interrupts, flush what they sent, then deliver at most one
+ * received character so each command is handled before the next one
+ * arrives.  Only wait for input if the main loop is idle.  Exit once
+ * stdin is closed, everything has been sent and the main loop has
+ * nothing left to do.
+ */
+void hal_poll(void) {
+    int timeout = HAL_LINUX_IDLE_MS;
+    uint8_t idle = hal_linux_idle;
+    hal_linux_idle = 0;
+    hal_linux_run_interrupts();
+    fflush(stdout);
+    if (hal_linux_uart.rx_eof) {
+        if (idle && (hal_linux_uart.tx_irq == 0) &&
+            (++hal_linux_uart.eof_polls > 2)) {
+            exit(0);
+        }
+        return;
+    }
+    if (!idle || hal_linux_adc.busy || hal_linux_uart.tx_irq) {
+        timeout = 0;
+    }
+    else if (hal_linux_adc.timer_running) {
+        timeout = 1;
+    }
+    hal_linux_rx_fill(timeout);
+    if ((hal_linux_uart.rx_data >= 0) && hal_linux_uart.rx_irq &&
+        hal_linux_irq) {
+        hal_linux_isr(&USART0_RX_vect);
+    }
+}
+
+/* hal_irq_enabled()
+ * Return nonzero if interrupts are enabled.
+ */
+uint8_t hal_irq_enabled(void) {
+    return hal_linux_irq;
+}
+
+/* hal_sleep()
+ * Let hal_poll() wait for input, since nothing else is happening.
+ */
+void hal_sleep(void) {
+    hal_linux_idle = 1;
+    sei();
+}
+
+/* ------------------------------ USART ------------------------------- */
+
+void hal_uart_init(void) {
+    hal_linux_uart.rx_irq = 1;
+    hal_linux_uart.tx_irq = 0;
+}
+
+/* The last hal_uart_baud() setting
+ */
+uint16_t hal_linux_uart_setting = 0;
+
+/* hal_uart_baud( setting )
+ * stdin and stdout don't have a baud rate, so just keep the setting.
+ */
+void hal_uart_baud(uint16_t setting) {
+    hal_linux_uart_setting = setting;
+}
+
+void hal_uart_tx_start(void) {
+    hal_linux_uart.tx_irq = 1;
+}
+
+void hal_uart_tx_stop(void) {
+    hal_linux_uart.tx_irq = 0;
+}
+
+/* hal_uart_tx_ready()
+ * stdout takes characters as fast as they come.
+ */
+uint8_t hal_uart_tx_ready(void) {
+    return 1;
+}
+
+void hal_uart_put(uint8_t data) {
+    putc(data, (hal_linux_tx_file == NULL) ? stdout : hal_linux_tx_file);
+}
+
+uint8_t hal_uart_tx_idle(void) {
+    return 1;
+}
+
+uint8_t hal_uart_rx_idle(void) {
+    return 1;
+}
+
+uint8_t hal_uart_rx_ready(void) {
+    hal_linux_rx_fill(0);
+    return hal_linux_uart.rx_data >= 0;
+}
+
+/* hal_uart_get()
+ * Reading the data register empties it.
+ */
+uint8_t hal_uart_get(void) {
+    uint8_t data = (uint8_t)hal_linux_uart.rx_data;
+    hal_linux_uart.rx_data = -1;
+    return data;
+}
+
+/* ------------------------------- ADC -------------------------------- */
+
+void hal_adc_init(void) {
+    hal_linux_adc.channel = 1;
+    hal_linux_convert();
+}
+
+/* hal_adc_prescaler( prescaler bits )
+ * The made-up conversions don't take any time.
+ */
+void hal_adc_prescaler(uint8_t prescaler) {
+}
+
+void hal_adc_mux(uint8_t channel) {
+    hal_linux_adc.channel = channel;
+}
+
+uint16_t hal_adc_convert(void) {
+    hal_linux_convert();
+    return hal_linux_adc.result;
+}
+
+uint16_t hal_adc_result(void) {
+    return hal_linux_adc.result;
+}
+
+void hal_adc_start(void) {
+    hal_linux_adc.busy = 1;
+}
+
+void hal_adc_irq_start(void) {
+    hal_linux_adc.irq = 1;
+    hal_linux_adc.busy = 1;
+}
+
+void hal_adc_irq_stop(void) {
+    hal_linux_adc.irq = 0;
+    hal_linux_adc.busy = 0;
+}
+
+/* hal_adc_timer_start( clock select, top )
+ * Work out the trigger period from the prescaler and top count, at the
+ * system clock rate.
+ */
+void hal_adc_timer_start(uint8_t clock_select, uint16_t top) {
+    hal_linux_adc.timer_period = ((uint64_t)hal_linux_prescaler[clock_select] *
+                                  top * 1000000) / clock_fosc();
+    if (hal_linux_adc.timer_period == 0) {
+        hal_linux_adc.timer_period = 1;
+    }
+    hal_linux_adc.timer_next = hal_linux_micros() + hal_linux_adc.timer_period;
+    hal_linux_adc.irq = 1;
+    hal_linux_adc.timer_running = 1;
+}
+
+/* hal_linux_adc_trigger( number of triggers )
+ * Each trigger runs the interrupt the way a compare match does, with
+ * interrupts disabled for the duration.
+ */
+void hal_linux_adc_trigger(uint16_t count) {
+    if (hal_linux_adc.timer_running == 0) {
+        return;
+    }
+    hal_linux_adc.timer_next = hal_linux_micros() + hal_linux_adc.timer_period;
+    while (count-- != 0) {
+        hal_linux_convert();
+        if (hal_linux_adc.irq) {
+            hal_linux_isr(&ADC_vect);
+        }
+    }
+}
+
+void hal_adc_timer_ack(void) {
+}
+
+void hal_adc_timer_stop(void) {
+    hal_linux_adc.timer_running = 0;
+    hal_linux_adc.irq = 0;
+}
+
+/* ------------------------------ Clock ------------------------------- */
+
+/* The clock mode, which only changes how fast timer 1 counts
+ */
+clock_mode_t hal_linux_clock_mode = clock_mode_1MHZ;
+
+/* The time fosc_1mhz() was called, which starts the system tick
+ */
+uint64_t hal_linux_clock_start = 0;
+
+/* The boot record.  There's no calibration, so only the ready time is
+ * filled in.
+ */
+clock_boot_t clock_boot;
+clock_boot_t *clock_boot_ptr = &clock_boot;
+
+/* fosc_1mhz(void)
+ * There's no oscillator to calibrate on a PC.
+ */
+void fosc_1mhz(void) {
+    hal_linux_clock_mode = clock_mode_1MHZ;
+    hal_linux_clock_start = hal_linux_micros();
+}
+
+/* The drift tracking state.  The PC's clock doesn't drift, so it stays
+ * zero.
+ */
+volatile clock_drift_t clock_drift;
+
+void clock_drift_restart(void) {
+}
+
+void clock_boot_ready(void) {
+    clock_boot_ptr -> ready = clock_now();
+}
+
+void clock_set_mode( clock_mode_t mode ) {
+    hal_linux_clock_mode = mode;
+}
+
+clock_mode_t clock_get_mode(void) {
+    return hal_linux_clock_mode;
+}
+
+uint32_t clock_fosc(void) {
+    if (hal_linux_clock_mode == clock_mode_8MHZ) {
+        return CLOCK_FOSC_8MHZ;
+    }
+    return CLOCK_FOSC_1MHZ;
+}
+
+/* clock_timestamp(void)
+ * Timer 1 counts system clock cycles, so count microseconds times the
+ * clock in MHz.
+ */
+uint16_t clock_timestamp(void) {
+    return (uint16_t)(hal_linux_micros() * (clock_fosc() / 1000000));
+}
+
+/* clock_now(void)
+ * Scale the time since fosc_1mhz() to crystal ticks.
+ */
+uint32_t clock_now(void) {
+    uint64_t elapsed = hal_linux_micros() - hal_linux_clock_start;
+    return (uint32_t)((elapsed * CLOCK_TICK_HZ) / 1000000);
+}
+
+uint32_t clock_uptime(void) {
+    return (uint32_t)((hal_linux_micros() - hal_linux_clock_start) / 1000000);
+}
+
+/* ------------------------------ EEPROM ------------------------------ */
+
+/* hal_linux_eeprom_load()
+ * Read the EEPROM file the first time the EEPROM is used.  A missing or
+ * short file leaves the rest erased.
+ */
+static void hal_linux_eeprom_load(void) {
+    FILE *file;
+    if (hal_linux_eeprom_loaded) {
+        return;
+    }
+    memset(hal_linux_eeprom, 0xff, HAL_LINUX_EEPROM_SIZE);
+    file = fopen(HAL_LINUX_EEPROM_FILE, "rb");
+    if (file != NULL) {
+        if (fread(hal_linux_eeprom, 1, HAL_LINUX_EEPROM_SIZE, file) == 0) {
+            memset(hal_linux_eeprom, 0xff, HAL_LINUX_EEPROM_SIZE);
+        }
+        fclose(file);
+    }
+    hal_linux_eeprom_loaded = 1;
+}
+
+/* hal_linux_eeprom_range( address, length )
+ * Return nonzero if the range is inside the EEPROM.
+ */
+static uint8_t hal_linux_eeprom_range(const void *address, size_t length) {
+    return ((size_t)address + length) <= HAL_LINUX_EEPROM_SIZE;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t length) {
+    hal_linux_eeprom_load();
+    if (hal_linux_eeprom_range(src, length)) {
+        memcpy(dst, &hal_linux_eeprom[(size_t)src], length);
+    }
+}
+
+uint16_t eeprom_read_word(const uint16_t *address) {
+    uint16_t word = 0xffff;
+    eeprom_read_block(&word, address, sizeof(word));
+    return word;
+}
+
+/* hal_linux_eeprom_store()
+ * Write the whole image back to the file.
+ */
+static void hal_linux_eeprom_store(void) {
+    FILE *file;
+    file = fopen(HAL_LINUX_EEPROM_FILE, "wb");
+    if (file != NULL) {
+        fwrite(hal_linux_eeprom, 1, HAL_LINUX_EEPROM_SIZE, file);
+        fclose(file);
+    }
+}
+
+/* eeprom_update_block( source, destination, length )
+ * Like avr-libc's, only bytes that differ are written, so only they
+ * count against hal_linux_eeprom_budget.  Write the whole image back to
+ * the file after each update.
+ */
+void eeprom_update_block(const void *src, void *dst, size_t length) {
+    const uint8_t *byte_ptr = (const uint8_t *)src;
+    size_t address = (size_t)dst;
+    size_t count;
+    hal_linux_eeprom_load();
+    if (hal_linux_eeprom_range(dst, length) == 0) {
+        return;
+    }
+    for (count = 0; count < length; count++) {
+        if (hal_linux_eeprom[address + count] == byte_ptr[count]) {
+            continue;
+        }
+        if (hal_linux_eeprom_budget == 0) {
+            break;
+        }
+        if (hal_linux_eeprom_budget > 0) {
+            hal_linux_eeprom_budget--;
+        }
+        hal_linux_eeprom[address + count] = byte_ptr[count];
+    }
+    hal_linux_eeprom_store();
+}
+
+/* hal_linux_eeprom_erase()
+ * Erased EEPROM reads as 0xff.
+ */
+void hal_linux_eeprom_erase(void) {
+    memset(hal_linux_eeprom, 0xff, HAL_LINUX_EEPROM_SIZE);
+    hal_linux_eeprom_loaded = 1;
+    hal_linux_eeprom_store();
+}
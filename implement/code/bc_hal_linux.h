@@ -0,0 +1,186 @@
+/* bc_hal_linux.h
+ *
+ * The hardware abstraction layer for building the command stack as a
+ * native program on a PC.  The USART is stdin and stdout, the ADC
+ * returns a made-up ramp, timer 1 follows the PC's clock and the EEPROM
+ * is kept in a file.  Interrupts don't preempt anything: hal_poll()
+ * calls the interrupt functions from the main loop when their
+ * peripherals have something to do and interrupts are enabled.
+ * Include bc_hal.h instead of this file.
+ */
+#ifndef HAL_LINUX_H
+#define HAL_LINUX_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint8_t
+ */
+#include <stdint.h>
+
+/* stddef.h
+ * Defines size_t for the EEPROM functions.
+ */
+#include <stddef.h>
+
+/* string.h and stdio.h
+ * The flash access functions are the RAM ones on a PC.
+ */
+#include <string.h>
+#include <stdio.h>
+
+/* Define the name of the file holding the EEPROM contents
+ */
+#define HAL_LINUX_EEPROM_FILE "bc_host_eeprom.bin"
+
+/* Define the size of the EEPROM, the same as the ATmega169P's
+ */
+#define HAL_LINUX_EEPROM_SIZE 512
+
+/* --------------------------- Flash access --------------------------- */
+
+/* Everything is in RAM on a PC.
+ */
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char *
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strncpy_P strncpy
+#define vsnprintf_P vsnprintf
+
+/* ---------------------------- Interrupts ---------------------------- */
+
+/* Nonzero when interrupts are enabled, like the I bit in SREG
+ */
+extern volatile uint8_t hal_linux_irq;
+
+/* Interrupt functions are ordinary functions named after their vectors.
+ */
+#define ISR(vector) void vector(void)
+#define sei() (hal_linux_irq = 1)
+#define cli() (hal_linux_irq = 0)
+
+/* The interrupts hal_poll() knows how to call
+ */
+void USART0_RX_vect(void);
+void USART0_UDRE_vect(void);
+void ADC_vect(void);
+
+/* hal_linux_atomic_restore( pointer to saved state )
+ * Put the interrupt enable back the way ATOMIC_BLOCK found it.
+ */
+static inline void hal_linux_atomic_restore(const uint8_t *saved) {
+    hal_linux_irq = *saved;
+}
+
+/* hal_linux_atomic_enter()
+ * Disable interrupts and return whether they were enabled.
+ */
+static inline uint8_t hal_linux_atomic_enter(void) {
+    uint8_t saved = hal_linux_irq;
+    hal_linux_irq = 0;
+    return saved;
+}
+
+/* Works like avr-libc's: the cleanup attribute restores the interrupt
+ * enable however the block is left, including by return.
+ */
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) \
+    for (uint8_t hal_atomic_saved \
+             __attribute__((cleanup(hal_linux_atomic_restore))) = \
+             hal_linux_atomic_enter(), hal_atomic_once = 1; \
+         hal_atomic_once; hal_atomic_once = 0)
+
+/* ------------------------------ USART ------------------------------- */
+
+/* Where the modeled USART sends characters, or NULL for stdout
+ */
+extern FILE *hal_linux_tx_file;
+
+/* The last hal_uart_baud() setting, or 0 if it hasn't been called.
+ * stdout has no baud rate, so the tests look here for the switch.
+ */
+extern uint16_t hal_linux_uart_setting;
+
+/* ------------------------------- ADC -------------------------------- */
+
+/* Makes up each conversion from the selected mux channel, or NULL for
+ * the built-in ramp.  The tests point this at a known signal.
+ */
+extern uint16_t (*hal_linux_adc_source)(uint8_t channel);
+
+/* hal_linux_adc_trigger( number of triggers )
+ * Fire timer 0's compare match now, as if that many trigger periods had
+ * gone by, and start the next period from now.  Does nothing unless a
+ * stream is triggering conversions.  Lets the tests feed a slow stream
+ * without waiting on the PC's clock.
+ */
+void hal_linux_adc_trigger(uint16_t count);
+
+/* ------------------------------ EEPROM ------------------------------ */
+
+/* Addresses are EEPROM byte addresses cast to pointers, the same as on
+ * the AVR.  Updates are written through to HAL_LINUX_EEPROM_FILE.
+ */
+void eeprom_read_block(void *dst, const void *src, size_t length);
+uint16_t eeprom_read_word(const uint16_t *address);
+void eeprom_update_block(const void *src, void *dst, size_t length);
+
+/* The number of bytes eeprom_update_block() may still change before the
+ * power "goes out", or -1 for no limit.  Bytes are written in address
+ * order, and the ones after the budget runs out keep their old values.
+ * The tests use this to tear a write partway through.
+ */
+extern int16_t hal_linux_eeprom_budget;
+
+/* hal_linux_eeprom_erase(void)
+ * Erase the whole EEPROM to 0xff, in memory and in the file.
+ */
+void hal_linux_eeprom_erase(void);
+
+/* _crc_ccitt_update( crc, data )
+ * The C version of avr-libc's assembly CRC-CCITT update.
+ */
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data) {
+    data ^= (uint8_t)crc;
+    data ^= data << 4;
+    return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^
+            ((uint16_t)data << 3));
+}
+
+/* ----------------------------- Functions ---------------------------- */
+
+/* See bc_hal.h for what these do.
+ */
+void hal_poll(void);
+void hal_wait(void);
+uint8_t hal_irq_enabled(void);
+void hal_sleep(void);
+
+void hal_uart_init(void);
+void hal_uart_baud(uint16_t setting);
+void hal_uart_tx_start(void);
+void hal_uart_tx_stop(void);
+uint8_t hal_uart_tx_ready(void);
+void hal_uart_put(uint8_t data);
+uint8_t hal_uart_tx_idle(void);
+uint8_t hal_uart_rx_ready(void);
+uint8_t hal_uart_rx_idle(void);
+uint8_t hal_uart_get(void);
+
+void hal_adc_init(void);
+void hal_adc_prescaler(uint8_t prescaler);
+void hal_adc_mux(uint8_t channel);
+uint16_t hal_adc_convert(void);
+uint16_t hal_adc_result(void);
+void hal_adc_start(void);
+void hal_adc_irq_start(void);
+void hal_adc_irq_stop(void);
+void hal_adc_timer_start(uint8_t clock_select, uint16_t top);
+void hal_adc_timer_ack(void);
+void hal_adc_timer_stop(void);
+
+#endif // End the include guard
@@ -0,0 +1,134 @@
+/* bc_job.c
+ *
+ * Jobs for commands that take too long to finish in one go.  See
+ * bc_job.h.
+ */
+
+// ----------------------- Include files ------------------------------
+/* bc_hal.h
+ * Provides flash access.
+ */
+#include "bc_hal.h"
+
+#include "bc_job.h"
+
+/* bc_usart.h
+ * Provides the functions for sending replies.
+ */
+#include "bc_usart.h"
+
+/* bc_logger.h sets up logging */
+#include "bc_logger.h"
+
+/* bc_sched.h
+ * Provides sched_ready() for keeping the job task running.
+ */
+#include "bc_sched.h"
+
+job_state_t job_state;
+job_state_t *job_state_ptr = &job_state;
+
+/* job_start( step function, total units, starting position )
+ * IDs count up from 1 and skip 0, which marks a free slot.
+ */
+uint8_t job_start( job_step_t step, uint16_t total, uint16_t pos ) {
+    job_t *job_ptr;
+    uint8_t slot;
+    for (slot = 0; slot < JOB_SLOTS; slot++) {
+        job_ptr = &(job_state_ptr -> slot[slot]);
+        if (job_ptr -> id == 0) {
+            break;
+        }
+    }
+    if (slot == JOB_SLOTS) {
+        logger_msg_p(log_system_COMMAND,log_level_ERROR,
+            PSTR("No free job slots.  Wait for a job to finish.\r\n"));
+        return 0;
+    }
+    (job_state_ptr -> last_id)++;
+    if (job_state_ptr -> last_id == 0) {
+        job_state_ptr -> last_id = 1;
+        job_state_ptr -> wrapped = 1;
+    }
+    job_ptr -> id = job_state_ptr -> last_id;
+    job_ptr -> step = step;
+    job_ptr -> done = 0;
+    job_ptr -> total = total;
+    job_ptr -> pos = pos;
+    job_ptr -> acc = 0;
+    usart_puts_p(PSTR("job 0x"));
+    usart_put_hex16(job_ptr -> id);
+    usart_put_crlf();
+    sched_ready(sched_id_JOB);
+    return job_ptr -> id;
+}
+
+/* job_run(void)
+ * The task makes itself ready again while any job is left, so the jobs
+ * get a step on every pass of the scheduler.
+ */
+void job_run(void) {
+    job_t *job_ptr;
+    uint8_t slot;
+    uint8_t running = 0;
+    for (slot = 0; slot < JOB_SLOTS; slot++) {
+        job_ptr = &(job_state_ptr -> slot[slot]);
+        if (job_ptr -> id == 0) {
+            continue;
+        }
+        if ((job_ptr -> step)(job_ptr) == job_status_DONE) {
+            job_ptr -> id = 0;
+        }
+        else {
+            running = 1;
+        }
+    }
+    if (running) {
+        sched_ready(sched_id_JOB);
+    }
+}
+
+/* job_reply_tag( pointer to job )
+ * Tags stay short so they cost little on every line of the help.
+ */
+void job_reply_tag( job_t *job_ptr ) {
+    usart_puts_p(PSTR("0x"));
+    usart_put_hex16(job_ptr -> id);
+    usart_putc(' ');
+}
+
+/* job_reply_done( pointer to job )
+ * The ID goes first, so the host can match the result to the job.
+ */
+void job_reply_done( job_t *job_ptr ) {
+    usart_puts_p(PSTR("done 0x"));
+    usart_put_hex16(job_ptr -> id);
+}
+
+/* cmd_job_q()
+ * Called by the remote command "job?"  IDs from 1 up to the last one
+ * given out have been used, and every ID has once they wrap.
+ */
+command_status_t cmd_job_q( command_arg_t *argv ) {
+    uint16_t id = argv[0].u16;
+    job_t *job_ptr;
+    uint8_t slot;
+    for (slot = 0; slot < JOB_SLOTS; slot++) {
+        job_ptr = &(job_state_ptr -> slot[slot]);
+        if ((job_ptr -> id != 0) && (job_ptr -> id == id)) {
+            usart_puts_p(PSTR("0x"));
+            usart_put_hex16(job_ptr -> done);
+            usart_puts_p(PSTR(" 0x"));
+            usart_put_hex16(job_ptr -> total);
+            usart_put_crlf();
+            return command_status_OK;
+        }
+    }
+    if ((id == 0) || (id > 0xff) ||
+        ((job_state_ptr -> wrapped == 0) && (id > job_state_ptr -> last_id))) {
+        usart_puts_p(PSTR("unknown\r\n"));
+        return command_status_OK;
+    }
+    usart_puts_p(PSTR("done\r\n"));
+    return command_status_OK;
+}
@@ -0,0 +1,102 @@
+/* bc_job.h
+ *
+ * Jobs for commands that take too long to finish in one go.
+ *
+ * A command starts a job with job_start() instead of doing the work
+ * itself.  The job gets an ID, which is sent straight back as
+ * "job 0x<id>", and the command returns so the next one can be
+ * processed.  The scheduler's job task then calls the job's step
+ * function once per pass until it returns job_status_DONE.  Commands
+ * get their turn between steps, so a quick query is never stuck behind
+ * a long job.
+ *
+ * Step functions can't keep anything on the stack between calls.  They
+ * keep their place in the job structure instead, like a protothread,
+ * and have to return after a short piece of work.
+ *
+ * Replies to other commands can land between steps, so every line a job
+ * sends starts with its ID.  Lines sent while the job runs start with
+ * "0x<id> ".  The last line is always the completion message
+ * "done 0x<id>", followed on the same line by any short result.  The
+ * host can also ask "job? <id>" for a job's progress.
+ */
+#ifndef JOB_H
+#define JOB_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint16_t
+ */
+#include <stdint.h>
+
+/* bc_command.h
+ * Defines command_arg_t, the argument passed to remote command functions.
+ */
+#include "bc_command.h"
+
+/* Define the number of jobs that can run at once
+ */
+#define JOB_SLOTS 2
+
+/* Values returned by step functions */
+typedef enum job_status {
+    job_status_RUNNING, // Call the step function again
+    job_status_DONE // The job is finished and its slot can be reused
+} job_status_t;
+
+typedef struct job_struct job_t;
+
+/* Step function type.  Each call does a little more of the job.
+ */
+typedef job_status_t (*job_step_t)( job_t *job_ptr );
+
+/* Job structure.  Everything after id belongs to the step function.
+ * job_start() sets done to 0, and "job?" reports done and total.
+ */
+struct job_struct {
+    uint8_t id; // The job's ID, or 0 while the slot is free
+    job_step_t step; // Called by the job task until it returns DONE
+    uint16_t done; // Units of work finished
+    uint16_t total; // Units of work in the whole job
+    uint16_t pos; // Where the step function picks up within a unit
+    uint32_t acc; // Accumulator for the step function
+};
+
+/* Job slots and the ID given to the last job started
+ */
+typedef struct job_state_struct {
+    job_t slot[JOB_SLOTS];
+    uint8_t last_id;
+    uint8_t wrapped; // Nonzero once every ID has been given out
+} job_state_t;
+
+/* job_start( step function, total units, starting position )
+ * Start a job in a free slot and send its ID.  Returns the ID, or 0 if
+ * every slot is busy.  The error has already been logged in that case.
+ */
+uint8_t job_start( job_step_t step, uint16_t total, uint16_t pos );
+
+/* job_run(void)
+ * The scheduler's job task.  Runs one step of each job.
+ */
+void job_run(void);
+
+/* job_reply_tag( pointer to job )
+ * Send the start of a line of output, "0x<id> ".  The step function
+ * adds the rest of the line.
+ */
+void job_reply_tag( job_t *job_ptr );
+
+/* job_reply_done( pointer to job )
+ * Send the start of the completion message, "done 0x<id>".  The step
+ * function adds any result and ends the line.
+ */
+void job_reply_done( job_t *job_ptr );
+
+/* cmd_job_q()
+ * Called by the remote command "job?"  Returns the units of work done
+ * and the total for a running job, "done" for a job that has finished,
+ * or "unknown" for an ID that hasn't been given out.
+ */
+command_status_t cmd_job_q( command_arg_t *argv );
+
+#endif // End the include guard
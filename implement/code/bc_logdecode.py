@@ -0,0 +1,283 @@
+""" bc_logdecode.py
+    Turn binary log frames from the Butterfly back into text.
+
+    Binary log frames (see bc_logger.h) carry the flash address of the
+    log message's format string instead of the formatted message.  This
+    looks the format strings and system names up in the firmware's ELF
+    file and prints each message the way the text logger would:
+
+        [I] (command) Command 'hello' recognized.
+
+    Binary sample blocks from the stream command (see bc_adc.h) are
+    printed the same way the hex stream format prints them:
+
+        s 1c 1ff 200 1fe 1ff 1ff 200 201 1ff
+
+    Anything on the link that isn't a frame (command replies, for
+    example) is passed through unchanged.
+
+    Usage:
+        python3 bc_logdecode.py bc_main.elf [input] [--baud 9600] [-t]
+
+    input can be a file of captured bytes or a serial port like
+    /dev/ttyUSB0 (which needs pyserial).  Standard input is read if it's
+    left out.  -t prefixes each message with its timestamp, in seconds
+    since reset.
+"""
+import struct
+import sys
+
+# These must match bc_logger.h
+FRAME_SYNC = 0xa5
+FRAME_HEADER = 10
+FRAME_TEXT = 0xffff
+LEVEL_TAGS = ['[R]', '[I]', '[W]', '[E]']
+
+# This must match CLOCK_TICK_HZ in bc_clock.h
+TICK_HZ = 32768.0
+
+# These must match bc_adc.h
+STREAM_SYNC = 0xa6
+STREAM_HEADER = 4
+
+# Flash addresses in the ELF file are below this.  RAM is mapped above.
+FLASH_LIMIT = 0x800000
+
+
+class Firmware:
+    """ Flash contents and symbols read from an AVR ELF file """
+
+    def __init__(self, filename):
+        with open(filename, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF':
+            raise ValueError('%s is not an ELF file' % filename)
+        (shoff,) = struct.unpack_from('<I', self.data, 0x20)
+        (shentsize, shnum) = struct.unpack_from('<HH', self.data, 0x2e)
+        self.sections = []
+        for n in range(shnum):
+            fields = struct.unpack_from('<IIIIIIIIII', self.data,
+                                        shoff + n * shentsize)
+            self.sections.append({'type': fields[1], 'addr': fields[3],
+                                  'offset': fields[4], 'size': fields[5],
+                                  'link': fields[6]})
+        self.symbols = self._read_symbols()
+        self.systems = self._read_systems()
+
+    def _read_symbols(self):
+        symbols = {}
+        for section in self.sections:
+            if section['type'] != 2:  # SHT_SYMTAB
+                continue
+            strtab = self.sections[section['link']]
+            for n in range(section['size'] // 16):
+                (name, value, size) = struct.unpack_from(
+                    '<III', self.data, section['offset'] + n * 16)
+                start = strtab['offset'] + name
+                end = self.data.index(b'\0', start)
+                symbols[self.data[start:end].decode()] = (value, size)
+        return symbols
+
+    def _read_systems(self):
+        """ Read the system names through the pointers in system_array """
+        if 'system_array' not in self.symbols:
+            return []
+        (address, size) = self.symbols['system_array']
+        systems = []
+        for n in range(size // 2):
+            (pointer,) = struct.unpack('<H', self.flash(address + 2 * n, 2))
+            systems.append(self.string(pointer))
+        return systems
+
+    def flash(self, address, length):
+        """ Return length bytes of flash starting at address """
+        for section in self.sections:
+            if section['type'] != 1:  # SHT_PROGBITS
+                continue
+            if section['addr'] >= FLASH_LIMIT:
+                continue
+            if section['addr'] <= address < section['addr'] + section['size']:
+                start = section['offset'] + address - section['addr']
+                return self.data[start:start + length]
+        raise KeyError('No flash at 0x%x' % address)
+
+    def string(self, address):
+        """ Return the terminated string in flash at address """
+        chars = bytearray()
+        while True:
+            char = self.flash(address, 1)[0]
+            if char == 0:
+                return chars.decode('ascii', 'replace')
+            chars.append(char)
+            address += 1
+
+
+def format_message(fmt, args):
+    """ Walk the format string the same way logger_frame_args_p() does,
+        pulling each argument out of args and formatting it with Python's
+        % operator. """
+    out = []
+    index = 0
+    n = 0
+    while n < len(fmt):
+        if fmt[n] != '%':
+            out.append(fmt[n])
+            n += 1
+            continue
+        spec = '%'
+        longarg = False
+        n += 1
+        while n < len(fmt) and (fmt[n] in '0123456789-+ #.hl'):
+            if fmt[n] == 'l':
+                longarg = True
+            elif fmt[n] != 'h':
+                spec += fmt[n]
+            n += 1
+        if n >= len(fmt):
+            break
+        conv = fmt[n]
+        n += 1
+        if conv == '%':
+            out.append('%')
+            continue
+        if conv in 'sS':
+            end = args.find(b'\0', index)
+            if end < 0:
+                end = len(args)
+            out.append((spec + 's') % args[index:end].decode('ascii', 'replace'))
+            index = end + 1
+            continue
+        width = 4 if longarg else 2
+        if index + width > len(args):
+            out.append('<?>')
+            continue
+        raw = args[index:index + width]
+        index += width
+        if conv in 'di':
+            (value,) = struct.unpack('<i' if longarg else '<h', raw)
+            out.append((spec + 'd') % value)
+        elif conv == 'c':
+            out.append((spec + 'c') % raw[0])
+        elif conv == 'p':
+            (value,) = struct.unpack('<H', raw[:2])
+            out.append('0x%x' % value)
+        else:
+            (value,) = struct.unpack('<I' if longarg else '<H', raw)
+            if conv == 'u':
+                conv = 'd'
+            out.append((spec + conv) % value)
+    return ''.join(out)
+
+
+def decode_frame(firmware, frame, timestamps):
+    """ Return the text for one frame, not including the sync and length
+        bytes or the checksum. """
+    (msgid, system, level, stamp) = struct.unpack_from('<HBBI', frame, 0)
+    args = frame[FRAME_HEADER - 2:]
+    if msgid == FRAME_TEXT:
+        message = args.split(b'\0')[0].decode('ascii', 'replace')
+    else:
+        try:
+            message = format_message(firmware.string(msgid), args)
+        except KeyError:
+            message = '<unknown message 0x%04x>\r\n' % msgid
+    if system < len(firmware.systems):
+        sysname = firmware.systems[system]
+    else:
+        sysname = 'system %d' % system
+    if level < len(LEVEL_TAGS):
+        tag = LEVEL_TAGS[level]
+    else:
+        tag = '[?]'
+    prefix = '%10.4f ' % (stamp / TICK_HZ) if timestamps else ''
+    return '%s%s(%s) %s' % (prefix, tag, sysname, message)
+
+
+def decode_block(block):
+    """ Return the text for one stream block, not including the sync byte
+        or the checksum. """
+    (sequence, count) = struct.unpack_from('<HB', block, 0)
+    samples = struct.unpack_from('<%dH' % count, block, STREAM_HEADER - 1)
+    return 's %x %s\r\n' % (sequence, ' '.join('%x' % s for s in samples))
+
+
+def decode(firmware, read, write, timestamps=False):
+    """ Read bytes with read() until it returns nothing, writing text
+        and decoded frames with write(). """
+    pending = bytearray()
+    while True:
+        chunk = read()
+        if not chunk:
+            break
+        pending.extend(chunk)
+        while pending:
+            syncs = [n for n in (pending.find(bytes([FRAME_SYNC])),
+                                 pending.find(bytes([STREAM_SYNC])))
+                     if n >= 0]
+            sync = min(syncs) if syncs else -1
+            if sync != 0:
+                # Pass everything up to the next frame through as text
+                text = pending if sync < 0 else pending[:sync]
+                write(text.decode('ascii', 'replace'))
+                del pending[:len(text)]
+                continue
+            if pending[0] == STREAM_SYNC:
+                if len(pending) < STREAM_HEADER:
+                    break  # Wait for the rest of the header
+                length = STREAM_HEADER + 2 * pending[3] + 1
+                if len(pending) < length:
+                    break  # Wait for the rest of the block
+                block = bytes(pending[1:length - 1])
+                if (sum(block) & 0xff) != pending[length - 1]:
+                    del pending[:1]
+                    continue
+                write(decode_block(block))
+                del pending[:length]
+                continue
+            if len(pending) < 2 or len(pending) < pending[1] + 2:
+                break  # Wait for the rest of the frame
+            length = pending[1]
+            body = bytes(pending[2:length + 1])
+            checksum = pending[length + 1]
+            if length < FRAME_HEADER - 1 or (sum(body) & 0xff) != checksum:
+                # Not really a frame.  Skip the sync byte and resynchronize.
+                del pending[:1]
+                continue
+            write(decode_frame(firmware, body, timestamps))
+            del pending[:length + 2]
+
+
+def main():
+    args = [a for a in sys.argv[1:] if not a.startswith('-')]
+    timestamps = '-t' in sys.argv
+    baud = 9600
+    if '--baud' in sys.argv:
+        baud = int(sys.argv[sys.argv.index('--baud') + 1])
+        args.remove(str(baud))
+    if not args:
+        print(__doc__)
+        sys.exit(1)
+    firmware = Firmware(args[0])
+    if len(args) < 2:
+        source = sys.stdin.buffer
+        read = lambda: source.read1(256)
+    elif args[1].startswith('/dev/'):
+        import serial
+        source = serial.Serial(args[1], baud, timeout=None)
+        read = lambda: source.read(max(1, source.in_waiting))
+    else:
+        source = open(args[1], 'rb')
+        read = lambda: source.read(256)
+
+    def write(text):
+        sys.stdout.write(text)
+        sys.stdout.flush()
+
+    try:
+        decode(firmware, read, write, timestamps)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
@@ -9,49 +9,71 @@
 #include "bc_logger.h"
 #include "bc_usart.h"
 
-/* pgmspace.h
- * Contains macros and functions for saving and reading data out of
- * flash.
+/* bc_clock.h
+ * Provides clock_now() for stamping binary log frames.
  */
-#include <avr/pgmspace.h>
+#include "bc_clock.h"
+
+/* bc_sched.h
+ * Provides sched_ready() for waking logger_drain().
+ */
+#include "bc_sched.h"
+
+/* bc_hal.h
+ * Provides flash access, and ATOMIC_BLOCK() for reading counters shared
+ * with interrupts.
+ */
+#include "bc_hal.h"
+
+/* bc_bench.h
+ * Provides the benchmark markers around logger_write_p().
+ */
+#include "bc_bench.h"
 
 // Define a pointer to the logging configuration
 log_config_t logger_config;
 log_config_t *logger_config_ptr = &logger_config;
 
-/* Define the recognized systems.  The freeform system name will need
- * to match calls to logger_msg() and logger_msg_p().  Group systems to
- * have shared bitshifts if you run out of space. 
- */
-logger_system_t system_array[] ={
-    // The logger system
-    {"logger", // Name
-    0 // Bitshift -- bit location in logging configuration bitfields
-    },
-    // The command system
-    {"command",
-    1
-    },
-    // The received character interrupt
-    {"rxchar",
-    2
-    },
-    // The ADC module
-    {"adc",
-    3
-    },
-    // The voltage measurement
-    {"vmeasure",
-    4
-    },
-    // Miscellaneous system functions
-    {"functions",
-    5
-    },
-    // End of table indicator.  Must be last.
-    {"",0}
+// Define a pointer to the deferred log queue
+logger_queue_t logger_queue;
+logger_queue_t *logger_queue_ptr = &logger_queue;
+
+/* Define the names of the recognized systems.  These are printed with
+ * each log message.  They must be in the same order as logger_system_t
+ * in bc_logger.h.
+ */
+const char sysname_logger[] PROGMEM = "logger";
+const char sysname_command[] PROGMEM = "command";
+const char sysname_rxchar[] PROGMEM = "rxchar";
+const char sysname_adc[] PROGMEM = "adc";
+const char sysname_vmeasure[] PROGMEM = "vmeasure";
+const char sysname_functions[] PROGMEM = "functions";
+const char sysname_config[] PROGMEM = "config";
+const char sysname_timing[] PROGMEM = "timing";
+
+PGM_P const system_array[log_system_COUNT] PROGMEM ={
+    sysname_logger,
+    sysname_command,
+    sysname_rxchar,
+    sysname_adc,
+    sysname_vmeasure,
+    sysname_functions,
+    sysname_config,
+    sysname_timing
 };
 
+/* Copy a system's name out of flash into sysname, which must hold
+ * LOGGER_SYSNAME_SIZE characters.
+ */
+void logger_sysname( logger_system_t logsys, char *sysname ) {
+    PGM_P sysname_ptr;
+    // The table of name pointers is in flash too
+    memcpy_P(&sysname_ptr, &system_array[logsys], sizeof(PGM_P));
+    strncpy_P(sysname, sysname_ptr, LOGGER_SYSNAME_SIZE - 1);
+    sysname[LOGGER_SYSNAME_SIZE - 1] = '\0';
+    return;
+}
+
 /* Initialize the logger system:
  * Log messages above the "informational" level
  * All systems enabled for logging.
@@ -60,13 +82,18 @@ void logger_init() {
     logger_config_ptr -> enable = 0xffff;  /* Logs from all systems enabled
                                             * by default. */
     logger_config_ptr -> loglevel = log_level_INFO;
+    logger_config_ptr -> format = log_format_TEXT;
+    logger_queue_ptr -> head = 0;
+    logger_queue_ptr -> tail = 0;
+    logger_queue_ptr -> dropped = 0;
+    logger_queue_ptr -> dropped_reported = 0;
 }
 
 /* Set the logging threshold level.
  */
 void logger_setlevel( logger_level_t loglevel ) {
     logger_config_ptr -> loglevel = loglevel;
-    logger_msg_p( "logger", log_level_INFO,
+    logger_msg_p( log_system_LOGGER, log_level_INFO,
                  PSTR("Logging set to level %i\r\n"),loglevel);
 }
 
@@ -75,7 +102,8 @@ void logger_setlevel( logger_level_t loglevel ) {
  * member.  If no level matches the user's parameter, issue an error
  * and leave the level as it was.
  */
-void cmd_loglevel( uint16_t setval ) {
+command_status_t cmd_loglevel( command_arg_t *argv ) {
+    uint16_t setval = argv[0].u16;
     switch(setval) {
         case 0: logger_setlevel(log_level_ISR);
                 break;
@@ -85,47 +113,65 @@ void cmd_loglevel( uint16_t setval ) {
                 break;
         case 3: logger_setlevel(log_level_ERROR);
                 break;
-        default: logger_msg_p( "logger", log_level_ERROR,
+        default: logger_msg_p( log_system_LOGGER, log_level_ERROR,
                               PSTR("Log level %u is not recognized.\r\n"),setval);
+                 return command_status_FAILED;
         }
+    return command_status_OK;
 }
 
 
 
+/* cmd_logmode()
+ * Called by the remote command "logmode."  Sets the log message format.
+ */
+command_status_t cmd_logmode( command_arg_t *argv ) {
+    uint16_t setval = argv[0].u16;
+    switch(setval) {
+        case 0: logger_config_ptr -> format = log_format_TEXT;
+                break;
+        case 1: logger_config_ptr -> format = log_format_BINARY;
+                break;
+        default: logger_msg_p( log_system_LOGGER, log_level_ERROR,
+                              PSTR("Log mode %u is not recognized.\r\n"),setval);
+                 return command_status_FAILED;
+        }
+    logger_msg_p( log_system_LOGGER, log_level_INFO,
+                  PSTR("Log mode set to %u.\r\n"),setval );
+    return command_status_OK;
+}
+
 /* Called by the remote command "logreg." Sets the logger configuration 
  * enable byte directly.  You have to know which systems correspond to 
  * which bitshifts to make use of this.
  */
-void cmd_logreg( uint16_t setval ) {
-    logger_msg_p( "logger", log_level_INFO,
+command_status_t cmd_logreg( command_arg_t *argv ) {
+    uint16_t setval = argv[0].u16;
+    logger_msg_p( log_system_LOGGER, log_level_INFO,
                   PSTR("Logger enable register set to 0x%x.\r\n"),setval );
     (logger_config_ptr -> enable) = setval;
+    return command_status_OK;
 }
 
 /* Called by the remote command "logreg?" Returns the logger configuration
  * register value in hex.
  */
-void cmd_logreg_q( uint16_t nonval ) {
-    usart_printf_p(PSTR("0x%x\r\n"),logger_config_ptr -> enable);
+command_status_t cmd_logreg_q( command_arg_t *argv ) {
+    usart_puts_p(PSTR("0x"));
+    usart_put_hex16( logger_config_ptr -> enable );
+    usart_put_crlf();
+    return command_status_OK;
 }
 
 /* Set a bit in the logger configuration enable bitfield.  The system 
- * whose bitshift corresponds to that bit will then be enabled for
- * logging.
- */
-void logger_setsystem( char *logsys ) {
-    struct system_struct *system_array_ptr = system_array;
-    // Go through all systems looking for a match to the system name
-    while (strcmp( system_array_ptr -> name, "" ) != 0) {
-        if (strcmp( logsys, system_array_ptr -> name ) == 0) {
-            // We've found a matching system
-            (logger_config_ptr -> enable) |= (1<< (system_array_ptr -> bitshift));
-            logger_msg_p("logger", log_level_INFO, 
-                PSTR("Now logging system %s\r\n"), system_array_ptr -> name);
-            break;
-        }
-        system_array_ptr++;
-    }
+ * with that bit location will then be enabled for logging.
+ */
+void logger_setsystem( logger_system_t logsys ) {
+    char sysname[LOGGER_SYSNAME_SIZE];
+    (logger_config_ptr -> enable) |= ((uint16_t)1 << logsys);
+    logger_sysname( logsys, sysname );
+    logger_msg_p(log_system_LOGGER, log_level_INFO,
+        PSTR("Now logging system %s\r\n"), sysname);
     return;
 }
 
@@ -135,53 +181,263 @@ void logger_disable() {
     return;
 }
 
-/* Send a log message */
-void logger_msg( char *logsys, logger_level_t loglevel,char *logmsg, ... ) {
+/* Fill in the header of a binary log frame, stamped with a clock_now()
+ * time.  Returns the index of the first argument byte.
+ */
+static uint8_t logger_frame_header( uint8_t *frame, uint16_t msgid,
+                                    logger_system_t logsys,
+                                    logger_level_t loglevel,
+                                    uint32_t timestamp ) {
+    frame[0] = LOGGER_FRAME_SYNC;
+    frame[2] = (uint8_t)msgid;
+    frame[3] = (uint8_t)(msgid >> 8);
+    frame[4] = logsys;
+    frame[5] = loglevel;
+    frame[6] = (uint8_t)timestamp;
+    frame[7] = (uint8_t)(timestamp >> 8);
+    frame[8] = (uint8_t)(timestamp >> 16);
+    frame[9] = (uint8_t)(timestamp >> 24);
+    return LOGGER_FRAME_HEADER;
+}
+
+/* Fill in the length and checksum of a binary log frame whose
+ * arguments end just before index.  Returns the length of the whole
+ * frame.
+ */
+static uint8_t logger_frame_finish( uint8_t *frame, uint8_t index ) {
+    uint8_t checksum = 0;
+    uint8_t count;
+    for (count = 2; count < index; count++) {
+        checksum += frame[count];
+    }
+    frame[index++] = checksum;
+    frame[1] = index - 2;
+    return index;
+}
+
+/* Walk a format string located in flash memory and copy the argument
+ * for each conversion into the frame, starting at index.  Once the frame
+ * is full, a string is cut off without its terminator and the rest of
+ * the arguments are left off.  Returns the index just past the last
+ * argument byte.
+ */
+static uint8_t logger_frame_args_p( uint8_t *frame, uint8_t index,
+                                    const char *logmsg, va_list args ) {
+    /* Leave room for a 4-byte argument and the checksum */
+    const uint8_t last = LOGGER_BUFFERSIZE - 5;
+    char fmtchar;
+    uint8_t longarg;
+    uint32_t argval;
+    const char *strptr;
+    
+    while ((fmtchar = pgm_read_byte(logmsg++)) != '\0') {
+        if (fmtchar != '%') {
+            continue;
+        }
+        // Skip flags, width, and precision
+        longarg = 0;
+        for (;;) {
+            fmtchar = pgm_read_byte(logmsg++);
+            if (fmtchar == 'l') {
+                longarg = 1;
+            }
+            else if (!(((fmtchar >= '0') && (fmtchar <= '9')) ||
+                (fmtchar == '-') || (fmtchar == '+') || (fmtchar == ' ') ||
+                (fmtchar == '#') || (fmtchar == '.') || (fmtchar == 'h'))) {
+                break;
+            }
+        }
+        switch( fmtchar ) {
+            case '\0':
+                // The format string ended in the middle of a conversion
+                return index;
+            case '%':
+                break;
+            case 's':
+                // String in RAM
+                strptr = va_arg(args, char *);
+                while ((index < last) && (*strptr != '\0')) {
+                    frame[index++] = *strptr++;
+                }
+                if (index >= last) {
+                    return index;
+                }
+                frame[index++] = '\0';
+                break;
+            case 'S':
+                // String in flash
+                strptr = va_arg(args, const char *);
+                while ((index < last) && (pgm_read_byte(strptr) != '\0')) {
+                    frame[index++] = pgm_read_byte(strptr++);
+                }
+                if (index >= last) {
+                    return index;
+                }
+                frame[index++] = '\0';
+                break;
+            default:
+                // Everything else is an integer
+                if (longarg) {
+                    argval = va_arg(args, uint32_t);
+                }
+                else {
+                    argval = (uint16_t)va_arg(args, unsigned int);
+                }
+                if (index >= last) {
+                    return index;
+                }
+                frame[index++] = (uint8_t)argval;
+                frame[index++] = (uint8_t)(argval >> 8);
+                if (longarg) {
+                    frame[index++] = (uint8_t)(argval >> 16);
+                    frame[index++] = (uint8_t)(argval >> 24);
+                }
+        }
+    }
+    return index;
+}
+
+/* Format a log message and send it on to be tagged */
+void logger_write( logger_system_t logsys, logger_level_t loglevel,
+                   char *logmsg, ... ) {
     va_list args; 
     char printbuffer[LOGGER_BUFFERSIZE]; 
+    uint8_t index;
     
-    if (logger_config_ptr -> enable == 0) {
-        // Logging has been disabled.  Nothing to do.
+    if (logger_config_ptr -> format == log_format_BINARY) {
+        /* The decoder can't find format strings in RAM, so send the
+         * formatted text in a frame of its own. */
+        index = logger_frame_header( (uint8_t *)printbuffer,
+                                     LOGGER_FRAME_TEXT, logsys, loglevel,
+                                     clock_now() );
+        va_start (args, logmsg);
+            vsnprintf (&printbuffer[index], LOGGER_BUFFERSIZE - index - 1,
+                       logmsg, args);
+        va_end (args);
+        index += strlen(&printbuffer[index]) + 1;
+        index = logger_frame_finish( (uint8_t *)printbuffer, index );
+        logger_output_binary( (uint8_t *)printbuffer, index );
         return;
-    }     
-    
+    }
     va_start (args, logmsg); 
-    /* Make sure messages are never longer than printbuffer */
+        /* Make sure messages are never longer than printbuffer */
         vsnprintf (printbuffer, LOGGER_BUFFERSIZE, logmsg, args); 
     va_end (args); 
+    logger_system_filter( logsys, loglevel, printbuffer );
+    return;
+}
+
+/* Format a log message with a string located in flash memory and send
+ * it on to be tagged.  Binary frames are stamped with timestamp, which
+ * is when the message was made. */
+static void logger_vwrite_p( logger_system_t logsys, logger_level_t loglevel,
+                             uint32_t timestamp, const char *logmsg,
+                             va_list args ) {
+    char printbuffer[LOGGER_BUFFERSIZE]; 
+    uint8_t index;
     
-    if (loglevel >= (logger_config_ptr -> loglevel)) {
-        /* If this message's level is high enough to be logged, we send
-         * it on to be filtered by system. */
-        logger_system_filter( logsys, loglevel, printbuffer );
+    BENCH_START(bench_id_LOGGER_WRITE);
+    if (logger_config_ptr -> format == log_format_BINARY) {
+        /* Send the format string's address and the raw arguments instead
+         * of formatting anything. */
+        index = logger_frame_header( (uint8_t *)printbuffer,
+                                     (uint16_t)(uintptr_t)logmsg,
+                                     logsys, loglevel, timestamp );
+        index = logger_frame_args_p( (uint8_t *)printbuffer, index,
+                                     logmsg, args );
+        index = logger_frame_finish( (uint8_t *)printbuffer, index );
+        logger_output_binary( (uint8_t *)printbuffer, index );
+        BENCH_END(bench_id_LOGGER_WRITE);
+        return;
     }
+    /* Make sure messages are never longer than printbuffer */
+    vsnprintf_P (printbuffer, LOGGER_BUFFERSIZE, logmsg, args); 
+    logger_system_filter( logsys, loglevel, printbuffer );
+    BENCH_END(bench_id_LOGGER_WRITE);
     return;
 }
 
-/* Send a log message with a string located in flash memory */
-void logger_msg_p( char *logsys, logger_level_t loglevel,const char *logmsg, ... ) {
+/* Format a log message with a string located in flash memory and send
+ * it on to be tagged */
+void logger_write_p( logger_system_t logsys, logger_level_t loglevel,
+                     const char *logmsg, ... ) {
     va_list args; 
-    char printbuffer[LOGGER_BUFFERSIZE]; 
+    va_start (args, logmsg);
+        logger_vwrite_p( logsys, loglevel, clock_now(), logmsg, args );
+    va_end (args);
+    return;
+}
+
+/* Send a deferred log message, stamped with the time it was stored
+ * instead of the time it's sent */
+static void logger_write_record_p( logger_record_t *record_ptr, ... ) {
+    va_list args; 
+    va_start (args, record_ptr);
+        logger_vwrite_p( record_ptr -> logsys, record_ptr -> loglevel,
+                         record_ptr -> stamp, record_ptr -> logmsg, args );
+    va_end (args);
+    return;
+}
+
+/* Store a log message from an interrupt in the deferred log queue.
+ * logger_isr_p() has already checked that it will be logged. */
+void logger_defer_p( logger_system_t logsys, logger_level_t loglevel,
+                     const char *logmsg, uint16_t arg0, uint16_t arg1 ) {
+    logger_record_t *record_ptr;
     
-    if (logger_config_ptr -> enable == 0) {
-        // Logging has been disabled.  Nothing to do.
+    // Either way, logger_drain() has something to send
+    sched_ready(sched_id_LOGGER);
+    if ((uint8_t)((logger_queue_ptr -> head) - (logger_queue_ptr -> tail)) >=
+        LOGGER_QUEUE_SIZE) {
+        // The queue is full
+        (logger_queue_ptr -> dropped)++;
         return;
     }
+    record_ptr = &(logger_queue_ptr -> record[(logger_queue_ptr -> head) &
+                   (LOGGER_QUEUE_SIZE - 1)]);
+    record_ptr -> logsys = logsys;
+    record_ptr -> loglevel = loglevel;
+    record_ptr -> logmsg = logmsg;
+    record_ptr -> arg[0] = arg0;
+    record_ptr -> arg[1] = arg1;
+    record_ptr -> stamp = clock_now();
+    // Only publish the record after it's filled in
+    (logger_queue_ptr -> head)++;
+    return;
+}
+
+/* Format and send the messages waiting in the deferred log queue */
+void logger_drain( void ) {
+    logger_record_t *record_ptr;
+    uint16_t dropped;
     
-    if (loglevel >= (logger_config_ptr -> loglevel)) {
-        /* If this message's level is high enough to be logged, we send
-         * it on to be filtered by system name. */
-        va_start (args, logmsg); 
-            /* Make sure messages are never longer than printbuffer */
-            vsnprintf_P (printbuffer, LOGGER_BUFFERSIZE, logmsg, args); 
-        va_end (args);
-        logger_system_filter( logsys, loglevel, printbuffer );
+    while ((logger_queue_ptr -> head) != (logger_queue_ptr -> tail)) {
+        record_ptr = &(logger_queue_ptr -> record[(logger_queue_ptr -> tail) &
+                       (LOGGER_QUEUE_SIZE - 1)]);
+        /* Extra arguments are ignored by the format string, so always
+         * pass all of them.  The logger may have been set up differently
+         * since the record was stored, so check again. */
+        if (logger_enabled( record_ptr -> logsys, record_ptr -> loglevel )) {
+            logger_write_record_p( record_ptr,
+                                   record_ptr -> arg[0], record_ptr -> arg[1] );
+        }
+        // Give the record back to the interrupts
+        (logger_queue_ptr -> tail)++;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        dropped = logger_queue_ptr -> dropped;
+    }
+    if (dropped != (logger_queue_ptr -> dropped_reported)) {
+        logger_msg_p( log_system_LOGGER, log_level_WARNING,
+                      PSTR("Dropped %u deferred log messages.\r\n"),
+                      dropped - (logger_queue_ptr -> dropped_reported) );
+        logger_queue_ptr -> dropped_reported = dropped;
     }
     return;
 }
 
-/* Decide if a message should be logged based on the logger configuration
- * and the message tag.  If it's enabled for logging, print: 
+/* Tag a log message with its severity and origin system and send it to
+ * the output device:
  * [The message severity] (The origin system) The message
  * 
  * Message severity tags:
@@ -190,43 +446,32 @@ void logger_msg_p( char *logsys, logger_level_t loglevel,const char *logmsg, ...
  * [W] Warning
  * [E] Error
  */
-void logger_system_filter( char *logsys, logger_level_t loglevel, char *logmsg ) {
-    char sysname[LOGGER_BUFFERSIZE];
-    struct system_struct *system_array_ptr = system_array;
-    // Go through all systems looking for a match to the system name
-    while (strcmp( system_array_ptr -> name, "" ) != 0) {
-        if (strcmp( logsys, system_array_ptr -> name ) == 0) {
-            // We've found a matching system
-            if ((logger_config_ptr -> enable) & 
-                (1<< (system_array_ptr -> bitshift))) {
-                /* The system is enabled for logging.  Send three strings
-                 * to the logging device:
-                 * 1. [Severity] 
-                 * 1. (System name)
-                 * 2. Log message */
-                switch( loglevel ) {
-                    case log_level_ISR:
-                        logger_output("[R]");
-                        break;
-                    case log_level_INFO:
-                        logger_output("[I]");
-                        break;
-                    case log_level_WARNING:
-                        logger_output("[W]");
-                        break;
-                    case log_level_ERROR:
-                        logger_output("[E]");
-                        break;    
-                }
-                snprintf(sysname,LOGGER_BUFFERSIZE,"(%s) ",
-                    system_array_ptr -> name);
-                logger_output(sysname);
-                logger_output(logmsg);
+void logger_system_filter( logger_system_t logsys, logger_level_t loglevel,
+                           char *logmsg ) {
+    char sysname[LOGGER_SYSNAME_SIZE];
+    /* Send three strings to the logging device:
+     * 1. [Severity] 
+     * 2. (System name)
+     * 3. Log message */
+    switch( loglevel ) {
+        case log_level_ISR:
+            logger_output("[R]");
             break;
-            }
-        }
-        system_array_ptr++;
+        case log_level_INFO:
+            logger_output("[I]");
+            break;
+        case log_level_WARNING:
+            logger_output("[W]");
+            break;
+        case log_level_ERROR:
+            logger_output("[E]");
+            break;    
     }
+    logger_sysname( logsys, sysname );
+    logger_output("(");
+    logger_output(sysname);
+    logger_output(") ");
+    logger_output(logmsg);
     return;
 }
 
@@ -234,5 +479,15 @@ void logger_system_filter( char *logsys, logger_level_t loglevel, char *logmsg )
  * suit whatever output device you'd like to use.
  */
 void logger_output( char *logmsg ) {
-    usart_printf("%s",logmsg);
+    usart_puts(logmsg);
+}
+
+/* Send a binary log frame to the output device.  This needs to be
+ * changed along with logger_output().
+ */
+void logger_output_binary( uint8_t *frame, uint8_t length ) {
+    while (length != 0) {
+        usart_putc(*frame++);
+        length--;
+    }
 }
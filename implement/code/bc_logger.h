@@ -1,27 +1,60 @@
 /* bc_logger.h
- * 
- * Functions for handling log messages. 
+ *
+ * Functions for handling log messages.
  */
+#ifndef LOGGER_H
+#define LOGGER_H
+
 #include <stdint.h> // Defines uint8_t
 
+/* bc_command.h
+ * Defines command_arg_t, the argument passed to remote command functions.
+ */
+#include "bc_command.h"
+
 /* Define the maximum log message size */
 #define LOGGER_BUFFERSIZE 80
- 
-/* Each system_struct will describe one system.  Create an array of these
- * to define all systems recognized by the machine.  Each system can have
- * a unique bit in the logger configuration bitfield.  This bit controls
- * whether or not messages from that system will be printed. 
- */
-typedef struct system_struct {
-    char *name; // The name of the system
-    uint8_t bitshift; // The system's location in the enable register
+
+/* Define the size of the buffer holding a system name, including the
+ * terminator */
+#define LOGGER_SYSNAME_SIZE 12
+
+/* Define the number of records in the deferred log queue.  This must
+ * be a power of 2.
+ */
+#define LOGGER_QUEUE_SIZE 8
+
+/* Define the number of 16-bit arguments carried by a deferred log
+ * record.
+ */
+#define LOGGER_RECORD_ARGS 2
+
+/* Systems recognized by the logger.  Log messages must be tagged with
+ * one of these.  Each system's value is its bit location in the logger
+ * configuration enable bitfield, so there can be at most 16 of them.
+ * That bit controls whether or not messages from the system will be
+ * printed.  Group systems to share a value if you run out of space.
+ *
+ * The names printed with each message are in system_array in
+ * bc_logger.c, which must be kept in the same order.
+ */
+typedef enum log_system {
+    log_system_LOGGER, // The logger system
+    log_system_COMMAND, // The command system
+    log_system_RXCHAR, // The received character interrupt
+    log_system_ADC, // The ADC module
+    log_system_VMEASURE, // The voltage measurement
+    log_system_FUNCTIONS, // Miscellaneous system functions
+    log_system_CONFIG, // The EEPROM configuration store
+    log_system_TIMING, // How long each command took.  Off unless asked for.
+    log_system_COUNT // Number of systems.  Must be last.
 } logger_system_t;
 
 /* Log levels recognized by the logger.  Log messages must be tagged with
  * one of these levels.  The messages will be sent to the output device
- * if their level is at or above the logger's threshold. 
- * 
- * Use logger_setlevel() to set the level threshold. 
+ * if their level is at or above the logger's threshold.
+ *
+ * Use logger_setlevel() to set the level threshold.
  */
 typedef enum log_level {
     log_level_ISR,
@@ -30,21 +63,112 @@ typedef enum log_level {
     log_level_ERROR
 } logger_level_t;
 
-/* Logging configuration structure. 
+/* Formats for log messages sent to the output device.
+ *
+ * TEXT -- Messages are formatted on the AVR and sent as text.
+ * BINARY -- Messages are sent as binary frames holding the format
+ *           string's flash address and the raw arguments.  Use
+ *           bc_logdecode.py with the firmware's ELF file to turn them
+ *           back into text on the PC.
  */
-typedef struct logger_config_struct { 
+typedef enum log_format {
+    log_format_TEXT,
+    log_format_BINARY
+} logger_format_t;
+
+/* Binary log frame layout.  Multi-byte values are little-endian.
+ *
+ * 0  LOGGER_FRAME_SYNC
+ * 1  Number of bytes following this one, including the checksum
+ * 2  Message ID low byte -- the flash address of the format string
+ * 3  Message ID high byte
+ * 4  System (logger_system_t)
+ * 5  Level (logger_level_t)
+ * 6  Timestamp, 4 bytes -- 32kHz ticks from clock_now() when the
+ *    message was made.  Messages from interrupts are stamped when the
+ *    interrupt stored them, not when logger_drain() sent them.
+ * 10 Arguments, in the order the format string uses them.  Integers are
+ *    2 bytes, or 4 with the l modifier.  Strings are sent with their
+ *    terminator.
+ * n  Checksum -- 8-bit sum of bytes 2 through n-1
+ *
+ * Messages formatted from strings in RAM have the message ID
+ * LOGGER_FRAME_TEXT and carry the formatted text as a single string.
+ */
+#define LOGGER_FRAME_SYNC 0xa5
+#define LOGGER_FRAME_HEADER 10
+#define LOGGER_FRAME_TEXT 0xffff
+
+/* Messages with levels below LOG_COMPILE_LEVEL are removed by the
+ * compiler, along with their format strings and argument evaluation.
+ * Release builds can set this from the makefile with something like
+ * -DLOG_COMPILE_LEVEL=log_level_WARNING to save flash and cycles.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL log_level_ISR
+#endif
+
+/* Logging configuration structure.
+ */
+typedef struct logger_config_struct {
     uint16_t enable; /* Bitfield in which each bit enables or disables
-                      * log messages from the system defined by an array
-                      * of system_struct */
+                      * log messages from the system with that
+                      * logger_system_t value */
     logger_level_t loglevel; // Only display messages at or above this level
+    logger_format_t format; // Send messages as text or binary frames
 } log_config_t;
 
+/* The logging configuration is defined in bc_logger.c.  The logging
+ * macros below read it directly.
+ */
+extern log_config_t logger_config;
+
+
+/* Deferred log record structure.
+ *
+ * Interrupts can't afford to format and send log messages, so they
+ * store the pieces of the message in one of these instead.  The main
+ * loop formats and sends it later with logger_drain().
+ */
+typedef struct logger_record_struct {
+    logger_system_t logsys; // The originating system
+    logger_level_t loglevel; // The message severity
+    const char *logmsg; // Format string located in flash memory
+    uint16_t arg[LOGGER_RECORD_ARGS]; // Arguments for the format string
+    uint32_t stamp; // clock_now() when the record was stored
+} logger_record_t;
+
+/* Deferred log queue structure.
+ *
+ * A single-producer, single-consumer ring of log records.  Interrupts
+ * (which can't interrupt each other) are the producer and only write
+ * the head.  logger_drain() is the consumer and only writes the tail.
+ */
+typedef struct logger_queue_struct {
+    logger_record_t record[LOGGER_QUEUE_SIZE];
+    volatile uint8_t head; // Counts records put into the queue
+    volatile uint8_t tail; // Counts records taken out of the queue
+    volatile uint16_t dropped; // Records lost to a full queue
+    uint16_t dropped_reported; // Dropped records already reported
+} logger_queue_t;
+
+
+/* logger_enabled( system, level )
+ * True if a message from this system at this level would be logged
+ * with the current configuration.  This is a couple of loads and a
+ * compare, so it's cheap enough to check before doing anything else.
+ */
+#define logger_enabled( sys, level ) \
+    (((level) >= LOG_COMPILE_LEVEL) && \
+     ((level) >= logger_config.loglevel) && \
+     (logger_config.enable & ((uint16_t)1 << (sys))))
+
 
-/* Initialize the logging system to a set of defaults. 
- */  
+/* Initialize the logging system to a set of defaults.
+ */
 void logger_init( void );
 
-/* Set the log level 
+/* Set the log level
  * Messages with loglevels at or above this setting will be sent to the
  *     output device.
  */
@@ -55,65 +179,136 @@ void logger_setlevel( logger_level_t loglevel );
  * member.  If no level matches the user's parameter, issue an error
  * and leave the level as it was.
  */
-void cmd_loglevel( uint16_t setval );
+command_status_t cmd_loglevel( command_arg_t *argv );
 
 
 /* Enable a system for logging.  This sets a bit in the logging configuration
- * structure's enable bitfield.  
- * 
- * To log multiple systems, call logger_disable(), then call this function 
- * for each system you'd like to log. 
+ * structure's enable bitfield.
+ *
+ * To log multiple systems, call logger_disable(), then call this function
+ * for each system you'd like to log.
  */
-void logger_setsystem( char *logsys );
+void logger_setsystem( logger_system_t logsys );
 
-/* Called by the remote command "logreg." Sets the logger configuration 
- * enable byte directly.  You have to know which systems correspond to 
- * which bitshifts to make use of this.
+/* cmd_logmode()
+ * Called by the remote command "logmode."  Sets the format of log
+ * messages: 0 for text, 1 for binary frames.  Unknown modes are
+ * reported as errors and leave the format as it was.
  */
-void cmd_logreg( uint16_t setval );
+command_status_t cmd_logmode( command_arg_t *argv );
+
+/* Called by the remote command "logreg." Sets the logger configuration
+ * enable byte directly.  Each bit corresponds to a logger_system_t value.
+ */
+command_status_t cmd_logreg( command_arg_t *argv );
 
 /* Called by the remote command "logreg?" Returns the logger configuration
  * register value in hex.
  */
-void cmd_logreg_q( uint16_t nonval );
+command_status_t cmd_logreg_q( command_arg_t *argv );
 
-/* Turn off all logging. 
+/* Turn off all logging.
  */
 void logger_disable( void );
 
-/* The interface to the logging system.  Use this function to send log
- * messages.  
- * 
- * logsys is a freeform string that must match one of the system name
- *     strings defined in an array of system structures.
- * 
- * loglevel is an enum defined above. 
- * 
- * logmsg is a format string -- the log message payload.
+/* The interface to the logging system.  Use these macros to send log
+ * messages.  They check the logger configuration before evaluating
+ * the format arguments, so filtered messages cost almost nothing.
+ *
+ * logsys is one of the logger_system_t values defined above.
+ *
+ * loglevel is a logger_level_t value defined above.
+ *
+ * The remaining arguments are a format string -- the log message
+ *     payload -- and its parameters.
  */
-void logger_msg( char *logsys, logger_level_t loglevel, char *logmsg, ... );
+#define logger_msg( logsys, loglevel, ... ) \
+    do { \
+        if (logger_enabled( logsys, loglevel )) { \
+            logger_write( logsys, loglevel, __VA_ARGS__ ); \
+        } \
+    } while (0)
 
 /* The same as logger_msg, but called with a string located in flash
  * memory.
  */
-void logger_msg_p( char *logsys, logger_level_t loglevel,const char *logmsg, ... );
+#define logger_msg_p( logsys, loglevel, ... ) \
+    do { \
+        if (logger_enabled( logsys, loglevel )) { \
+            logger_write_p( logsys, loglevel, __VA_ARGS__ ); \
+        } \
+    } while (0)
 
+/* The interface to the logging system for interrupt service routines.
+ * The message is checked against the logger configuration and then
+ * stored in the deferred log queue without being formatted.  If the
+ * queue is full, the message is counted as dropped.
+ *
+ * logmsg is a format string located in flash memory.  It can use up to
+ *     LOGGER_RECORD_ARGS conversions, each taking a 16-bit argument.
+ *     Pass 0 for unused arguments.
+ *
+ * Only call this with interrupts disabled.
+ */
+#define logger_isr_p( logsys, loglevel, logmsg, arg0, arg1 ) \
+    do { \
+        if (logger_enabled( logsys, loglevel )) { \
+            logger_defer_p( logsys, loglevel, logmsg, arg0, arg1 ); \
+        } \
+    } while (0)
 
+/* Format a log message and send it on to the output device.  This
+ * doesn't check the logger configuration -- call it through
+ * logger_msg() instead.
+ */
+void logger_write( logger_system_t logsys, logger_level_t loglevel,
+                   char *logmsg, ... );
 
-/* Decide if a message should be logged based on the logger configuration
- * and the message tag.  If it's enabled for logging, print: 
+/* The same as logger_write, but called with a string located in flash
+ * memory.  Call it through logger_msg_p().
+ */
+void logger_write_p( logger_system_t logsys, logger_level_t loglevel,
+                     const char *logmsg, ... );
+
+/* Store a log message in the deferred log queue.  Call it through
+ * logger_isr_p().
+ */
+void logger_defer_p( logger_system_t logsys, logger_level_t loglevel,
+                     const char *logmsg, uint16_t arg0, uint16_t arg1 );
+
+/* Copy a system's name out of flash into sysname, which must hold
+ * LOGGER_SYSNAME_SIZE characters.
+ */
+void logger_sysname( logger_system_t logsys, char *sysname );
+
+/* Format and send all the messages waiting in the deferred log queue.
+ * Call this from the main loop.  Reports how many messages were dropped
+ * since the last call.
+ */
+void logger_drain( void );
+
+/* Send a formatted log message to the output device, tagged with its
+ * severity and origin system:
  * [The message severity] (The origin system) The message
- * 
+ *
  * Message severity tags:
  * [R] Interrupt service routine (ISR)
  * [I] Informational
  * [W] Warning
  * [E] Error
  */
-void logger_system_filter( char *logsys, logger_level_t loglevel, char *logmsg );
+void logger_system_filter( logger_system_t logsys, logger_level_t loglevel,
+                           char *logmsg );
 
 /* Sends the final log message to the output device.  This function makes
  * the output device more modular.  The output chosen in the implementation
  * can be simply printf() for prototyping on a PC.
  */
 void logger_output( char *logmsg );
+
+/* Sends a binary log frame to the output device.  This is the binary
+ * mode counterpart of logger_output().
+ */
+void logger_output_binary( uint8_t *frame, uint8_t length );
+
+#endif // End the include guard
@@ -6,13 +6,19 @@
 // ----------------------- Include files ------------------------------
 #include <stdio.h>
 #include <string.h>
-#include <avr/interrupt.h>
+
+/* bc_hal.h
+ * Provides sei(), the ISR() macro and the hal_uart functions for the
+ * received character interrupt, and flash access.
+ */
+#include "bc_hal.h"
 
 #include "bc_functions.h"
 #include "bc_main.h"
 
 /* bc_clock.h
- * Provides fosc_cal() to set up a calibrated 1MHz system clock.
+ * Provides fosc_cal() to set up a calibrated 1MHz system clock, and
+ * CLOCK_DRIFT_RX() for holding off OSCCAL nudges while receiving.
  */
 #include "bc_clock.h"
 
@@ -26,12 +32,6 @@
 #include "bc_command.h"
 #include "bc_usart.h"
 
-/* pgmspace.h
- * Contains macros and functions for saving and reading data out of
- * flash.
- */
-#include <avr/pgmspace.h>
-
 /* bc_logger.h sets up logging 
  */
 #include "bc_logger.h"
@@ -42,6 +42,22 @@
  */
 #include "bc_adc.h"
 
+/* bc_config.h
+ * Provides config_init() for restoring the settings saved in EEPROM.
+ */
+#include "bc_config.h"
+
+/* bc_stats.h
+ * Provides the markers that time the received character interrupt.
+ */
+#include "bc_stats.h"
+
+/* bc_sched.h
+ * Provides the scheduler that runs the main loop, and sched_ready() for
+ * handing finished command lines to it.
+ */
+#include "bc_sched.h"
+
 
 // Define a pointer to the received command state
 recv_cmd_state_t  recv_cmd_state;
@@ -63,17 +79,20 @@ int main() {
      * with logger_setsystem().
      */
     logger_disable(); // Disable logging from all systems
-    logger_setsystem( "logger" ); // Enable logger system logging
-    logger_setsystem( "rxchar" ); // Enable received character logging
-    logger_setsystem( "command" ); // Enable command system logging
-    logger_setsystem( "adc" ); // Enable adc module logging
+    logger_setsystem( log_system_LOGGER ); // Enable logger system logging
+    logger_setsystem( log_system_RXCHAR ); // Enable received character logging
+    logger_setsystem( log_system_COMMAND ); // Enable command system logging
+    logger_setsystem( log_system_ADC ); // Enable adc module logging
+    logger_setsystem( log_system_CONFIG ); // Enable configuration store logging
     adc_init(); // Set the ADCs reference and SAR prescaler
     command_init( recv_cmd_state_ptr );
-    for(;;) {
-        /* Process the parse buffer to look for commands loaded with the
-         * received character ISR. */
-        process_pbuffer( recv_cmd_state_ptr, command_array );
-    }// end main for loop
+    /* Restore the saved settings last, so they replace the defaults set
+     * up above. */
+    config_init();
+    clock_boot_ready(); // Record how long all that took for "boot?"
+    /* The scheduler runs the command processor, the log and stream
+     * drains, and the baud rate fallback from here on. */
+    sched_run();
     return retval;
 } // end main
 
@@ -93,13 +112,16 @@ int main() {
  */
  
 
-/* Interrupt on character received via the USART */
-ISR(USART0_RX_vect) {
+/* receive_char()
+ * Handle a character received via the USART.  Log messages from here go
+ * through logger_isr_p() so they're formatted and sent by the main loop
+ * instead of inside the interrupt. */
+static void receive_char(void) {
     // Write the received character to the buffer
-    *(recv_cmd_state_ptr -> rbuffer_write_ptr) = UDR0;
+    *(recv_cmd_state_ptr -> rbuffer_write_ptr) = hal_uart_get();
     if (*(recv_cmd_state_ptr -> rbuffer_write_ptr) == '\r') {
-        logger_msg_p("rxchar",log_level_ISR,
-            PSTR("Received a command terminator.\r\n"));
+        logger_isr_p(log_system_RXCHAR,log_level_ISR,
+            PSTR("Received a command terminator.\r\n"),0,0);
         if ((recv_cmd_state_ptr -> rbuffer_count) == 0) {
             /* We got a terminator, but the received character buffer is
              * empty.  The user is trying to clear the transmit and
@@ -107,28 +129,25 @@ ISR(USART0_RX_vect) {
             return;
         }
         else {
-            if ((recv_cmd_state_ptr -> pbuffer_lock) == 1) {
+            if (rbuffer_terminate(recv_cmd_state_ptr) != 0) {
                 /* We got a terminator, and there are characters in the received
-                 * character buffer, but the parse buffer is locked.  This is
-                 * bad -- we're receiving commands faster than we can process
-                 * them. */
-                logger_msg_p("rxchar",log_level_ERROR,
-                    PSTR("Command process speed error!\r\n"));
+                 * character buffer, but every slot in the parse queue is full.
+                 * This is bad -- we're receiving commands faster than we can
+                 * process them. */
+                logger_isr_p(log_system_RXCHAR,log_level_ERROR,
+                    PSTR("Command process speed error!\r\n"),0,0);
                 rbuffer_erase(recv_cmd_state_ptr);
                 return;
             }
             else {
-                /* We got a terminator, and there are characters in the received
-                 * character buffer.  The parse buffer is unlocked so terminate
-                 * the received string and copy it to the parse buffer. */
-                *(recv_cmd_state_ptr -> rbuffer_write_ptr) = '\0';
-                strcpy((recv_cmd_state_ptr -> pbuffer),
-                    (recv_cmd_state_ptr -> rbuffer));
-                recv_cmd_state_ptr -> pbuffer_lock = 1;
-                logger_msg_p("rxchar",log_level_ISR,
-                    PSTR("Parse buffer contains '%s'.\r\n"),
-                    (recv_cmd_state_ptr -> pbuffer));
+                /* We got a terminator, and the received string has been
+                 * copied to the head of the parse queue. */
+                logger_isr_p(log_system_RXCHAR,log_level_ISR,
+                    PSTR("Parse queue depth is %d.\r\n"),
+                    (uint8_t)((recv_cmd_state_ptr -> pbuffer_head) -
+                    (recv_cmd_state_ptr -> pbuffer_tail)),0);
                 rbuffer_erase(recv_cmd_state_ptr);
+                sched_ready(sched_id_COMMAND);
                 return;
             }
         }
@@ -136,13 +155,13 @@ ISR(USART0_RX_vect) {
     else {
         // The character is not a command terminator.
         (recv_cmd_state_ptr -> rbuffer_count)++;
-        logger_msg_p("rxchar",log_level_ISR,
+        logger_isr_p(log_system_RXCHAR,log_level_ISR,
             PSTR("%c  <-- copied to receive buffer.  Received count is %d.\r\n"),
             *(recv_cmd_state_ptr -> rbuffer_write_ptr),
             recv_cmd_state_ptr -> rbuffer_count);
         if ((recv_cmd_state_ptr -> rbuffer_count) >= (RECEIVE_BUFFER_SIZE-1)) {
-            logger_msg_p("rxchar",log_level_ERROR,
-                PSTR("Received character number above limit.\r\n"));
+            logger_isr_p(log_system_RXCHAR,log_level_ERROR,
+                PSTR("Received character number above limit.\r\n"),0,0);
             rbuffer_erase(recv_cmd_state_ptr);
             return;
         }
@@ -153,3 +172,11 @@ ISR(USART0_RX_vect) {
     }
     return;
 }
+
+/* Interrupt on character received via the USART. */
+ISR(USART0_RX_vect) {
+    STATS_ISR_ENTER();
+    CLOCK_DRIFT_RX();
+    receive_char();
+    STATS_ISR_EXIT(stats_isr_USART0_RX);
+}
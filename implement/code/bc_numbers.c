@@ -2,45 +2,126 @@
 #include <string.h>
 #include "bc_numbers.h"
 #include "bc_usart.h" // For debugging
-#include <avr/pgmspace.h> // For strings in flash
+#include "bc_hal.h" // For tables in flash
+#include "bc_bench.h" // For the benchmark markers around the parsers
 
+/* Marks characters in number_digit_table that aren't digits in any
+ * radix we parse.
+ */
+#define NUMBER_NOT_DIGIT 0xff
 
-/* asc2num() -- Converts an ascii character representing a hexadecimal
- *              number into its integer equivalent.  Accepts both upper
- *              and lower case characters.  Returns 0 for non-numeric
- *              arguments.
+/* Digit values for the characters '0' through 'f', indexed by the
+ * character minus '0'.  Upper and lower case hex digits have the same
+ * value.  The parsers look up each character once, then reject it if
+ * the value isn't below the radix.
  */
-uint8_t asc2num(char n_asc) {
-    uint8_t n_int = 0;
-    n_int = n_asc - 0x30; // Subtract off non-numeric beginning of table
-    if ( n_int > 0x09 ) {
-        // Input number is 0xa or larger.  Need to subtract off the 
-        // non-numeric interval between 9 and A in the table.
-        n_int -= 0x07;
-    }
-    if ( n_int > 0x0f ) {
-        // Input number is lower case.  Need to subtract off the difference
-        // between lower and upper cases.
-        n_int -= 0x20;
+const uint8_t number_digit_table[] PROGMEM = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, // '0' to '9'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // ':' to '<'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // '=' to '?'
+    NUMBER_NOT_DIGIT, // '@'
+    0xa, 0xb, 0xc, 0xd, 0xe, 0xf, // 'A' to 'F'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // 'G' to 'I'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // 'J' to 'L'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // 'M' to 'O'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // 'P' to 'R'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // 'S' to 'U'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // 'V' to 'X'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // 'Y' to '['
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // '\' to '^'
+    NUMBER_NOT_DIGIT, NUMBER_NOT_DIGIT, // '_' and '`'
+    0xa, 0xb, 0xc, 0xd, 0xe, 0xf // 'a' to 'f'
+};
+
+/* Characters used to write hexadecimal digits
+ */
+const char number_hex_chars[] PROGMEM = "0123456789abcdef";
+
+/* Powers of ten used to write decimal digits by repeated subtraction,
+ * which is much cheaper than division on the AVR.
+ */
+const uint16_t number_powers_of_ten[NUMBER_POWERS] PROGMEM = {
+    10000, 1000, 100, 10
+};
+
+/* parse_number( string, pointer to result, largest allowed value, radix )
+ * Converts a string of digits in the given radix into an unsigned number
+ * in a single pass.  The limit check compares against maxval / radix,
+ * worked out once, so there's no division inside the loop.
+ */
+static number_status_t parse_number( char *numstr, uint32_t *value,
+                                     uint32_t maxval, uint8_t radix ) {
+    uint32_t totval = 0;
+    uint32_t limit = maxval / radix; // Largest total that can take a digit
+    uint8_t lastdigit = maxval % radix; // Largest digit to shift into limit
+    uint8_t index;
+    uint8_t digit;
+    if (*numstr == '\0') {
+        return number_status_EMPTY;
     }
-    if ( n_int > 0xf ) {
-        // If the integer is still too big, this is an invalid entry.
-        n_int = 0x00;
+    while (*numstr != '\0') {
+        index = (uint8_t)(*numstr - '0');
+        if (index >= sizeof(number_digit_table)) {
+            return number_status_INVALID;
+        }
+        digit = pgm_read_byte(&number_digit_table[index]);
+        if (digit >= radix) {
+            return number_status_INVALID;
+        }
+        if ((totval > limit) || ((totval == limit) && (digit > lastdigit))) {
+            // Another digit would go past the limit
+            return number_status_OVERFLOW;
+        }
+        totval = (totval * radix) + digit;
+        numstr++;
     }
-    return n_int;
+    *value = totval;
+    return number_status_OK;
 }
 
-/* hex2num() -- Converts a string of ascii characters into a decimal
- *              by repeatedly calling asc2num().
- */
-uint16_t hex2num(char *hexstr) {
-    uint8_t digits = 0; // Number of digits in the string
-    uint16_t totval = 0; // Returned value of the string
-    digits = strlen(hexstr);
-    while (digits != 0) {
-        totval += asc2num(hexstr[0]) << (4 * (digits - 1));
-        hexstr++;
-        digits--;
+/* parse_hex( string, pointer to result, largest allowed value )
+ * Converts a string of hexadecimal digits into an unsigned number,
+ * checking every digit and the running total.
+ */
+number_status_t parse_hex( char *hexstr, uint32_t *value, uint32_t maxval ) {
+    number_status_t status;
+    BENCH_START(bench_id_PARSE_HEX);
+    status = parse_number( hexstr, value, maxval, 16 );
+    BENCH_END(bench_id_PARSE_HEX);
+    return status;
+}
+
+/* parse_dec( string, pointer to result, largest allowed value )
+ * Converts a string of decimal digits into an unsigned number, checking
+ * every digit and the running total.
+ */
+number_status_t parse_dec( char *decstr, uint32_t *value, uint32_t maxval ) {
+    number_status_t status;
+    BENCH_START(bench_id_PARSE_DEC);
+    status = parse_number( decstr, value, maxval, 10 );
+    BENCH_END(bench_id_PARSE_DEC);
+    return status;
+}
+
+/* parse_signed( string, pointer to result )
+ * Converts a string of decimal digits with an optional leading sign into
+ * a signed 16-bit number.
+ */
+number_status_t parse_signed( char *decstr, int16_t *value ) {
+    uint32_t magnitude;
+    number_status_t status;
+    uint8_t negative = 0;
+    if (*decstr == '-') {
+        negative = 1;
+        decstr++;
+    }
+    else if (*decstr == '+') {
+        decstr++;
+    }
+    // The negative range is one bigger than the positive range
+    status = parse_dec( decstr, &magnitude, negative ? 32768UL : 32767UL );
+    if (status == number_status_OK) {
+        *value = negative ? (int16_t)(0 - magnitude) : (int16_t)magnitude;
     }
-    return totval;
+    return status;
 }
@@ -2,16 +2,57 @@
  * 
  * Functions for handling numbers. 
  */
+#ifndef NUMBERS_H
+#define NUMBERS_H
+
 #include <stdio.h>
- 
-/* asc2num() -- Converts an ascii character representing a hexadecimal
- *              number into its integer equivalent.  Accepts both upper
- *              and lower case characters.  Returns 0 for non-numeric
- *              arguments.
- */
-uint8_t asc2num(char n_asc);
-    
-/* hex2num() -- Converts a string of ascii characters into a decimal
- *              by repeatedly calling asc2num().
- */
-uint16_t hex2num(char *hexstr);
+
+/* stdint.h
+ * Defines fixed-width integer types like uint32_t
+ */
+#include <stdint.h>
+
+/* Values returned by the checked number parsers
+ */
+typedef enum number_status {
+    number_status_OK, // The whole string was a valid number
+    number_status_EMPTY, // There were no digits
+    number_status_INVALID, // A character wasn't a digit
+    number_status_OVERFLOW // The number was bigger than the limit
+} number_status_t;
+
+/* parse_hex( string, pointer to result, largest allowed value )
+ * Converts a string of hexadecimal digits (either case) into an
+ * unsigned number.  The whole string must be digits, and the number
+ * can't be larger than maxval.
+ */
+number_status_t parse_hex( char *hexstr, uint32_t *value, uint32_t maxval );
+
+/* parse_dec( string, pointer to result, largest allowed value )
+ * Converts a string of decimal digits into an unsigned number.  The
+ * whole string must be digits, and the number can't be larger than
+ * maxval.
+ */
+number_status_t parse_dec( char *decstr, uint32_t *value, uint32_t maxval );
+
+/* parse_signed( string, pointer to result )
+ * Converts a string of decimal digits with an optional leading sign into
+ * a signed 16-bit number.
+ */
+number_status_t parse_signed( char *decstr, int16_t *value );
+
+/* Characters used to write hexadecimal digits, located in flash
+ */
+extern const char number_hex_chars[];
+
+/* Define the number of entries in number_powers_of_ten
+ */
+#define NUMBER_POWERS 4
+
+/* Powers of ten used to write 16-bit decimal numbers by repeated
+ * subtraction, largest first and located in flash.  The ones digit is
+ * whatever is left over.
+ */
+extern const uint16_t number_powers_of_ten[];
+
+#endif // End the include guard
@@ -0,0 +1,193 @@
+/* bc_sched.c
+ *
+ * Cooperative scheduler for the main loop.  See bc_sched.h.
+ */
+
+// ----------------------- Include files ------------------------------
+/* bc_hal.h
+ * Provides ATOMIC_BLOCK() for the ready mask, cli() and hal_sleep() for
+ * going idle, hal_poll() for the PC build, and flash access for the task
+ * table.
+ */
+#include "bc_hal.h"
+
+#include "bc_sched.h"
+
+/* bc_clock.h
+ * Provides clock_now() for deadlines and task times.
+ */
+#include "bc_clock.h"
+
+/* bc_usart.h
+ * Provides the functions for sending replies, and usart_baud_poll().
+ */
+#include "bc_usart.h"
+
+/* bc_logger.h
+ * Provides logger_drain().
+ */
+#include "bc_logger.h"
+
+/* bc_adc.h
+ * Provides adc_stream_drain().
+ */
+#include "bc_adc.h"
+
+/* bc_job.h
+ * Provides job_run().
+ */
+#include "bc_job.h"
+
+sched_state_t sched_state;
+sched_state_t *sched_state_ptr = &sched_state;
+
+/* sched_command(void)
+ * process_pbuffer() only handles one line at a time, so the logger and
+ * the stream get a turn in between.  Come back for the rest.
+ */
+static void sched_command(void) {
+    process_pbuffer(recv_cmd_state_ptr);
+    if ((recv_cmd_state_ptr -> pbuffer_head) !=
+        (recv_cmd_state_ptr -> pbuffer_tail)) {
+        sched_ready(sched_id_COMMAND);
+    }
+}
+
+/* The task table.  Must be in the same order as sched_id_t.
+ */
+const sched_task_t sched_task_array[sched_id_COUNT] PROGMEM = {
+    {"command", &sched_command, 0},
+    {"job", &job_run, 0},
+    {"logger", &logger_drain, 0},
+    {"stream", &adc_stream_drain, 0},
+    {"baud", &usart_baud_poll, CLOCK_MS_TICKS(100)}
+};
+
+/* sched_ticks( start )
+ * Return the ticks since start, stopping at 0xffff.
+ */
+static uint16_t sched_ticks( uint32_t start ) {
+    uint32_t elapsed = clock_now() - start;
+    if (elapsed > 0xffff) {
+        return 0xffff;
+    }
+    return (uint16_t)elapsed;
+}
+
+/* sched_ready( task )
+ * Only the first call after the task runs is stamped, so the wait is
+ * measured from the oldest work.
+ */
+void sched_ready( sched_id_t task ) {
+    uint8_t bit = (1<<task);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (((sched_state_ptr -> ready) & bit) == 0) {
+            sched_state_ptr -> readied[task] = clock_now();
+            sched_state_ptr -> ready |= bit;
+        }
+    }
+}
+
+/* sched_deadlines(void)
+ * Make the periodic tasks whose deadlines have passed ready.  The next
+ * deadline is counted from now, so a late task isn't run several times
+ * to catch up.
+ */
+static void sched_deadlines(void) {
+    uint32_t now = clock_now();
+    uint16_t period;
+    uint8_t task;
+    for (task = 0; task < sched_id_COUNT; task++) {
+        period = pgm_read_word(&sched_task_array[task].period);
+        if ((period != 0) &&
+            ((int32_t)(now - (sched_state_ptr -> due[task])) >= 0)) {
+            sched_state_ptr -> due[task] = now + period;
+            sched_ready(task);
+        }
+    }
+}
+
+/* sched_exec( task )
+ * Clear the task's ready bit and run it, keeping its statistics.  The
+ * bit is cleared first, so an interrupt during the run makes it ready
+ * again.
+ */
+static void sched_exec( uint8_t task ) {
+    uint8_t bit = (1<<task);
+    uint32_t readied;
+    uint32_t start;
+    uint16_t elapsed;
+    void (*run)(void);
+    sched_stats_t *stats_ptr = &(sched_state_ptr -> stats[task]);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sched_state_ptr -> ready &= ~bit;
+        readied = sched_state_ptr -> readied[task];
+    }
+    elapsed = sched_ticks(readied);
+    start = clock_now();
+    if (elapsed > (stats_ptr -> wait_max)) {
+        stats_ptr -> wait_max = elapsed;
+    }
+    memcpy_P(&run, &sched_task_array[task].run, sizeof(run));
+    run();
+    elapsed = sched_ticks(start);
+    if (elapsed > (stats_ptr -> run_max)) {
+        stats_ptr -> run_max = elapsed;
+    }
+    (stats_ptr -> runs)++;
+}
+
+/* sched_run(void)
+ * Each pass runs every task that's ready, in table order.  The ready
+ * mask is checked again with interrupts off before sleeping, so work
+ * left by an interrupt during the pass isn't slept through.
+ */
+void sched_run(void) {
+    uint32_t now = clock_now();
+    uint8_t task;
+    for (task = 0; task < sched_id_COUNT; task++) {
+        sched_state_ptr -> due[task] = now +
+            pgm_read_word(&sched_task_array[task].period);
+    }
+    for(;;) {
+        sched_deadlines();
+        for (task = 0; task < sched_id_COUNT; task++) {
+            if ((sched_state_ptr -> ready) & (1<<task)) {
+                sched_exec(task);
+            }
+        }
+        cli();
+        if ((sched_state_ptr -> ready) == 0) {
+            (sched_state_ptr -> sleeps)++;
+            hal_sleep();
+        }
+        else {
+            sei();
+        }
+        /* Run the modeled peripherals when built for a PC. */
+        hal_poll();
+    }
+}
+
+/* cmd_tasks_q()
+ * Called by the remote command "tasks?"
+ */
+command_status_t cmd_tasks_q( command_arg_t *argv ) {
+    sched_stats_t *stats_ptr;
+    uint8_t task;
+    for (task = 0; task < sched_id_COUNT; task++) {
+        stats_ptr = &(sched_state_ptr -> stats[task]);
+        usart_puts_p(sched_task_array[task].name);
+        usart_puts_p(PSTR(" 0x"));
+        usart_put_hex16(stats_ptr -> runs);
+        usart_puts_p(PSTR(" 0x"));
+        usart_put_hex16(stats_ptr -> run_max);
+        usart_puts_p(PSTR(" 0x"));
+        usart_put_hex16(stats_ptr -> wait_max);
+        usart_put_crlf();
+    }
+    usart_puts_p(PSTR("sleeps 0x"));
+    usart_put_hex16(sched_state_ptr -> sleeps);
+    usart_put_crlf();
+    return command_status_OK;
+}
@@ -0,0 +1,93 @@
+/* bc_sched.h
+ *
+ * Cooperative scheduler for the main loop.
+ *
+ * Each piece of main loop work is a task in the fixed sched_task_array.
+ * A task runs when its bit in the ready mask is set.  Interrupts set
+ * bits with sched_ready() when they leave work for the main loop, and
+ * tasks with a period are made ready when their deadline passes.  Tasks
+ * run to completion, in table order, so a task that wants the CPU again
+ * soon has to make itself ready again.  When nothing is ready, the CPU
+ * sleeps until the next interrupt.  The timer 2 tick wakes it at least
+ * every 7.8ms, which bounds how late a deadline can be noticed.
+ *
+ * The scheduler keeps the number of runs, the longest run and the
+ * longest wait from ready to running for each task.  "tasks?" reports
+ * them.
+ */
+#ifndef SCHED_H
+#define SCHED_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint16_t
+ */
+#include <stdint.h>
+
+/* bc_command.h
+ * Defines command_arg_t, the argument passed to remote command functions.
+ */
+#include "bc_command.h"
+
+/* Tasks, in the order they're run.  Must match sched_task_array.
+ */
+typedef enum sched_id {
+    sched_id_COMMAND, // Process a line from the parse queue
+    sched_id_JOB, // Run a step of each long command
+    sched_id_LOGGER, // Send log messages queued by interrupts
+    sched_id_STREAM, // Send finished blocks of streamed samples
+    sched_id_BAUD, // Fall back if the host didn't follow a baud change
+    sched_id_COUNT // Number of tasks.  Must be last.
+} sched_id_t;
+
+/* Define the length of a task name, including the terminator
+ */
+#define SCHED_NAME_SIZE 8
+
+/* Task table entry structure.  The table is in flash.
+ */
+typedef struct sched_task_struct {
+    char name[SCHED_NAME_SIZE]; // Name reported by "tasks?"
+    void (*run)(void); // Function that does the work
+    uint16_t period; // clock_now() ticks between runs, or 0 if none
+} sched_task_t;
+
+/* Task statistics structure.  Times are clock_now() ticks, and stop at
+ * 0xffff.
+ */
+typedef struct sched_stats_struct {
+    uint16_t runs; // Number of times the task has run
+    uint16_t run_max; // Longest run
+    uint16_t wait_max; // Longest time from ready to running
+} sched_stats_t;
+
+/* Scheduler state structure.
+ */
+typedef struct sched_state_struct {
+    volatile uint8_t ready; // Bit n is set when task n is ready
+    volatile uint32_t readied[sched_id_COUNT]; // When each bit was set
+    /* Next deadline of periodic tasks.  These are whole clock_now()
+     * values, so a pass that runs long can't make an overdue task look
+     * like it isn't due yet. */
+    uint32_t due[sched_id_COUNT];
+    uint16_t sleeps; // Number of times the CPU went to sleep
+    sched_stats_t stats[sched_id_COUNT];
+} sched_state_t;
+
+/* sched_ready( task )
+ * Mark a task ready to run.  Safe to call from interrupts.
+ */
+void sched_ready( sched_id_t task );
+
+/* sched_run(void)
+ * Run the tasks forever.  This is the main loop.
+ */
+void sched_run(void);
+
+/* cmd_tasks_q()
+ * Called by the remote command "tasks?"  Returns a line for each task
+ * with its name, the number of runs, and the longest run and wait in
+ * 32kHz ticks, followed by the number of sleeps.
+ */
+command_status_t cmd_tasks_q( command_arg_t *argv );
+
+#endif // End the include guard
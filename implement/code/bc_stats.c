@@ -0,0 +1,124 @@
+/* bc_stats.c
+ *
+ * Stack and interrupt statistics.  See bc_stats.h.
+ */
+
+// ----------------------- Include files ------------------------------
+/* bc_hal.h
+ * Provides ATOMIC_BLOCK() for reading the times kept by the interrupts,
+ * and flash access.
+ */
+#include "bc_hal.h"
+
+#include "bc_stats.h"
+
+/* bc_usart.h
+ * Provides the functions for sending replies.
+ */
+#include "bc_usart.h"
+
+#ifdef STATS
+
+volatile uint16_t stats_isr_max[stats_isr_COUNT];
+
+#ifdef __AVR__
+
+/* The linker's symbols for the end of the variables in RAM and the top
+ * of the stack.  Nothing uses malloc(), so everything in between belongs
+ * to the stack.
+ */
+extern uint8_t _end;
+extern uint8_t __stack;
+
+/* stats_paint_stack()
+ * Fill the RAM between the variables and the top of the stack with
+ * STATS_CANARY.  This is put in .init1, so it runs straight after reset
+ * before the C runtime has set up r1 or the variables.  That's why it's
+ * naked assembly instead of C, and it falls through to .init2 instead of
+ * returning.
+ */
+void stats_paint_stack(void) __attribute__((naked, used, section(".init1")));
+void stats_paint_stack(void) {
+    __asm__ volatile (
+        "    ldi r30, lo8(_end)\n"
+        "    ldi r31, hi8(_end)\n"
+        "    ldi r24, %0\n"
+        "    ldi r25, hi8(__stack)\n"
+        "    rjmp 2f\n"
+        "1:  st Z+, r24\n"
+        "2:  cpi r30, lo8(__stack)\n"
+        "    cpc r31, r25\n"
+        "    brlo 1b\n"
+        "    breq 1b\n"
+        :: "M" (STATS_CANARY));
+}
+
+/* stats_stack_size()
+ * Return the number of bytes painted at reset.
+ */
+static uint16_t stats_stack_size(void) {
+    return (uint16_t)(&__stack - &_end) + 1;
+}
+
+/* stats_stack_unused()
+ * The stack grows down from __stack, so count the paint that's left
+ * from the bottom up.
+ */
+static uint16_t stats_stack_unused(void) {
+    const uint8_t *paint_ptr = &_end;
+    while ((paint_ptr <= &__stack) && (*paint_ptr == STATS_CANARY)) {
+        paint_ptr++;
+    }
+    return (uint16_t)(paint_ptr - &_end);
+}
+
+#else
+
+/* The PC's stack can't be painted, so there's nothing to report.
+ */
+static uint16_t stats_stack_size(void) {
+    return 0;
+}
+
+static uint16_t stats_stack_unused(void) {
+    return 0;
+}
+
+#endif // __AVR__
+
+/* cmd_stack_q()
+ * Called by the remote command "stack?"
+ */
+command_status_t cmd_stack_q( command_arg_t *argv ) {
+    uint16_t unused = stats_stack_unused();
+    usart_puts_p(PSTR("0x"));
+    usart_put_hex16(stats_stack_size() - unused);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(unused);
+    usart_put_crlf();
+    return command_status_OK;
+}
+
+/* cmd_stats_q()
+ * Called by the remote command "stats?"
+ */
+command_status_t cmd_stats_q( command_arg_t *argv ) {
+    uint16_t isr_max[stats_isr_COUNT];
+    uint8_t isr;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (isr = 0; isr < stats_isr_COUNT; isr++) {
+            isr_max[isr] = stats_isr_max[isr];
+        }
+    }
+    for (isr = 0; isr < stats_isr_COUNT; isr++) {
+        if (isr != 0) {
+            usart_putc(' ');
+        }
+        usart_puts_p(PSTR("0x"));
+        usart_put_hex16(isr_max[isr]);
+    }
+    usart_put_crlf();
+    return command_status_OK;
+}
+
+#endif // STATS
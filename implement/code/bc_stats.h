@@ -0,0 +1,92 @@
+/* bc_stats.h
+ *
+ * Stack and interrupt statistics for finding out how close the firmware
+ * comes to running out of its 1k of SRAM, and how long interrupts can be
+ * kept waiting.
+ *
+ * The stack is painted with STATS_CANARY before main() runs.  "stack?"
+ * counts how much of the paint is still there.  Each interrupt handler
+ * is bracketed by STATS_ISR_ENTER() and STATS_ISR_EXIT(), which keep
+ * the longest time spent in it, and "stats?" reports those times.
+ * Handlers don't nest, so the longest handler is also the longest any
+ * other interrupt can be kept waiting by handlers.
+ *
+ * Everything here is compiled out unless STATS is defined.  See CDEFS
+ * in the makefile.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint16_t
+ */
+#include <stdint.h>
+
+/* bc_clock.h
+ * Provides clock_timestamp() for timing interrupt handlers.
+ */
+#include "bc_clock.h"
+
+/* bc_command.h
+ * Defines command_arg_t, the argument passed to remote command functions.
+ */
+#include "bc_command.h"
+
+/* Define the value painted over the unused stack.  Anything that isn't
+ * likely to be pushed a lot, so not 0x00 or 0xff.
+ */
+#define STATS_CANARY 0xc5
+
+/* Interrupt handlers that are timed
+ */
+typedef enum stats_isr {
+    stats_isr_USART0_RX,
+    stats_isr_USART0_UDRE,
+    stats_isr_ADC,
+    stats_isr_TIMER2_OVF,
+    stats_isr_COUNT // Number of handlers.  Must be last.
+} stats_isr_t;
+
+#ifdef STATS
+
+/* The longest time spent in each handler, in system clock cycles
+ */
+extern volatile uint16_t stats_isr_max[stats_isr_COUNT];
+
+/* stats_isr_exit( handler, timestamp at entry )
+ * Keep the handler's time if it's the longest yet.  Timer 1 wraps every
+ * 65536 cycles, so longer times are lost.  The registers pushed and
+ * popped around the handler aren't counted.
+ */
+static inline void stats_isr_exit(stats_isr_t isr, uint16_t start) {
+    uint16_t elapsed = clock_timestamp() - start;
+    if (elapsed > stats_isr_max[isr]) {
+        stats_isr_max[isr] = elapsed;
+    }
+}
+
+#define STATS_ISR_ENTER() uint16_t stats_isr_start = clock_timestamp()
+#define STATS_ISR_EXIT( isr ) stats_isr_exit( (isr), stats_isr_start )
+
+/* cmd_stack_q()
+ * Called by the remote command "stack?"  Returns the most stack ever
+ * used and the stack that has never been touched, in bytes.  Both are
+ * zero in the PC build.
+ */
+command_status_t cmd_stack_q( command_arg_t *argv );
+
+/* cmd_stats_q()
+ * Called by the remote command "stats?"  Returns the longest time spent
+ * in the received character, data register empty, ADC and timer 2
+ * overflow interrupts, in system clock cycles.
+ */
+command_status_t cmd_stats_q( command_arg_t *argv );
+
+#else
+
+#define STATS_ISR_ENTER() do {} while (0)
+#define STATS_ISR_EXIT( isr ) do {} while (0)
+
+#endif // STATS
+
+#endif // End the include guard
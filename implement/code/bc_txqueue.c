@@ -0,0 +1,71 @@
+/* bc_txqueue.c
+ *
+ * A ring buffer for characters waiting to be transmitted.
+ */
+#include "bc_txqueue.h"
+
+/* txqueue_init( pointer to queue, overflow policy )
+ * Empty the queue, clear the counters, and set the overflow policy.
+ */
+void txqueue_init( txqueue_t *txqueue_ptr, txqueue_policy_t policy ) {
+    txqueue_ptr -> head = 0;
+    txqueue_ptr -> tail = 0;
+    txqueue_ptr -> policy = policy;
+    txqueue_ptr -> highwater = 0;
+    txqueue_ptr -> dropped = 0;
+    return;
+}
+
+/* txqueue_count( pointer to queue )
+ * Returns the number of characters waiting in the queue.
+ */
+uint8_t txqueue_count( txqueue_t *txqueue_ptr ) {
+    return (uint8_t)((txqueue_ptr -> head) - (txqueue_ptr -> tail));
+}
+
+/* txqueue_put( pointer to queue, character )
+ * Put a character at the head of the queue, applying the overflow
+ * policy if there's no room.
+ */
+txqueue_status_t txqueue_put( txqueue_t *txqueue_ptr, uint8_t data ) {
+    txqueue_status_t status = txqueue_status_QUEUED;
+    uint8_t count = txqueue_count(txqueue_ptr);
+    if (count >= TXQUEUE_SIZE) {
+        // The queue is full
+        switch( txqueue_ptr -> policy ) {
+            case txqueue_policy_DROP_NEWEST:
+                (txqueue_ptr -> dropped)++;
+                return txqueue_status_DROPPED;
+            case txqueue_policy_DROP_OLDEST:
+                (txqueue_ptr -> tail)++;
+                (txqueue_ptr -> dropped)++;
+                count--;
+                status = txqueue_status_DROPPED;
+                break;
+            default:
+                return txqueue_status_FULL;
+        }
+    }
+    txqueue_ptr -> buffer[(txqueue_ptr -> head) & (TXQUEUE_SIZE - 1)] = data;
+    /* Only move the head after the character is in place.  The consumer
+     * may be looking at it from an interrupt. */
+    (txqueue_ptr -> head)++;
+    count++;
+    if (count > (txqueue_ptr -> highwater)) {
+        txqueue_ptr -> highwater = count;
+    }
+    return status;
+}
+
+/* txqueue_get( pointer to queue, pointer to character )
+ * Take the character at the tail of the queue.  Returns 0 if a
+ * character was written to data_ptr, 1 if the queue was empty.
+ */
+uint8_t txqueue_get( txqueue_t *txqueue_ptr, uint8_t *data_ptr ) {
+    if (txqueue_count(txqueue_ptr) == 0) {
+        return 1;
+    }
+    *data_ptr = txqueue_ptr -> buffer[(txqueue_ptr -> tail) & (TXQUEUE_SIZE - 1)];
+    (txqueue_ptr -> tail)++;
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* bc_txqueue.h
+ *
+ * A ring buffer for characters waiting to be transmitted.  The USART
+ * module puts characters in with txqueue_put() and the data register
+ * empty interrupt takes them out with txqueue_get().
+ *
+ * Nothing in here touches the hardware, so the queue can be compiled
+ * with the native gcc and exercised on a PC.
+ */
+#ifndef TXQUEUE_H
+#define TXQUEUE_H
+
+/* stdint.h
+ * Defines fixed-width integer types like uint8_t
+ */
+#include <stdint.h>
+
+/* Define the size of the transmit queue.  The head and tail indexes
+ * are free-running 8-bit counters, so this must be a power of 2 no
+ * larger than 128. */
+#ifndef TXQUEUE_SIZE
+#define TXQUEUE_SIZE 64
+#endif
+
+/* What to do with a new character when the queue is full.
+ *
+ * BLOCK -- Refuse the character.  The caller waits for room.
+ * DROP_NEWEST -- Throw away the new character.
+ * DROP_OLDEST -- Throw away the character at the tail of the queue to
+ *                make room for the new one.
+ */
+typedef enum txqueue_policy {
+    txqueue_policy_BLOCK,
+    txqueue_policy_DROP_NEWEST,
+    txqueue_policy_DROP_OLDEST
+} txqueue_policy_t;
+
+/* Values returned by txqueue_put() */
+typedef enum txqueue_status {
+    txqueue_status_QUEUED, // The character is in the queue
+    txqueue_status_DROPPED, // A character was thrown away to make room
+    txqueue_status_FULL // Nothing was done.  Try again later.
+} txqueue_status_t;
+
+/* Transmit queue structure.
+ *
+ * The head is only written by the producer and the tail is only written
+ * by the consumer, except under the drop-oldest policy.  The number of
+ * characters waiting is always (head - tail) in 8-bit arithmetic.
+ */
+typedef struct txqueue_struct {
+    uint8_t buffer[TXQUEUE_SIZE];
+    volatile uint8_t head; // Counts characters put into the queue
+    volatile uint8_t tail; // Counts characters taken out of the queue
+    txqueue_policy_t policy; // What to do when the queue is full
+    uint8_t highwater; // The most characters ever waiting in the queue
+    uint16_t dropped; // Characters thrown away by the overflow policy
+} txqueue_t;
+
+/* txqueue_init( pointer to queue, overflow policy )
+ * Empty the queue, clear the counters, and set the overflow policy.
+ */
+void txqueue_init( txqueue_t *txqueue_ptr, txqueue_policy_t policy );
+
+/* txqueue_count( pointer to queue )
+ * Returns the number of characters waiting in the queue.
+ */
+uint8_t txqueue_count( txqueue_t *txqueue_ptr );
+
+/* txqueue_put( pointer to queue, character )
+ * Put a character at the head of the queue, applying the overflow
+ * policy if there's no room.  The drop-oldest policy moves the tail, so
+ * the consumer must not be able to run while this is called.
+ */
+txqueue_status_t txqueue_put( txqueue_t *txqueue_ptr, uint8_t data );
+
+/* txqueue_get( pointer to queue, pointer to character )
+ * Take the character at the tail of the queue.  Returns 0 if a
+ * character was written to data_ptr, 1 if the queue was empty.
+ */
+uint8_t txqueue_get( txqueue_t *txqueue_ptr, uint8_t *data_ptr );
+
+#endif // End the include guard
@@ -4,63 +4,136 @@
  */
 #include <stdio.h>
 
-/* stdarg.h
- * Allows functions to accept an indefinite number of arguments.
+/* bc_hal.h
+ * Provides the USART registers through the hal_uart functions, flash
+ * access, the ISR() macro for the data register empty interrupt, and
+ * ATOMIC_BLOCK() for touching the transmit queue with that interrupt
+ * masked.
  */
-#include <stdarg.h>
+#include "bc_hal.h"
 
-/* avr/io.h
- * Device-specific port definitions
+#include "bc_usart.h"
+
+/* bc_txqueue.h
+ * Provides the transmit ring buffer emptied by the data register empty
+ * interrupt.
  */
-#include <avr/io.h>
+#include "bc_txqueue.h"
 
-/* pgmspace.h
- * Contains macros and functions for saving and reading data out of
- * flash.
+/* bc_numbers.h
+ * Provides the flash tables of hex characters and powers of ten used to
+ * send numbers.
  */
-#include <avr/pgmspace.h>
-#include "bc_usart.h"
+#include "bc_numbers.h"
+
+/* bc_stats.h
+ * Provides the markers that time the data register empty interrupt.
+ */
+#include "bc_stats.h"
 
-/* Send a format string and parameter to the USART. 
+/* bc_clock.h
+ * Provides the clock modes, and timer 1 for timing baud rate changes.
  */
-uint8_t usart_printf (const char *fmt, ...) { 
-    va_list args; 
-    uint8_t i; 
-    char printbuffer[USART_TXBUFFERSIZE]; 
+#include "bc_clock.h"
 
-    va_start (args, fmt); 
+/* bc_adc.h
+ * Provides adc_clock_update() for when a baud rate changes the clock.
+ */
+#include "bc_adc.h"
 
-    /* For this to work, printbuffer must be larger than 
-    * anything we ever want to print. 
-    */ 
-    i = vsprintf (printbuffer, fmt, args); 
-    va_end (args); 
+/* bc_logger.h
+ * Provides logger_msg_p() for reporting baud rate changes and bad
+ * settings.
+ */
+#include "bc_logger.h"
 
-    /* Print the string */ 
-    usart_puts(printbuffer); 
-    return 0; 
-}
+/* bc_sched.h
+ * Provides sched_ready() for switching the baud rate once the reply is
+ * queued.
+ */
+#include "bc_sched.h"
+
+/* The queue of characters waiting to be sent by the USART
+ */
+txqueue_t usart_txqueue;
+txqueue_t *usart_txqueue_ptr = &usart_txqueue;
+
+/* Baud rate settings are worked out here by the compiler.  The USART
+ * divides the system clock by 16 (or 8 in double speed mode) times
+ * (UBRR + 1), so each rate gets the UBRR closest to that, and double
+ * speed mode is only used when it gets closer -- normal mode samples
+ * each bit more times.
+ */
+#define USART_BAUD_DIVISOR( fosc, rate, div ) \
+    (((fosc) + ((div) * (rate)) / 2) / ((div) * (rate)))
+#define USART_BAUD_UBRR( fosc, rate, div ) \
+    ((USART_BAUD_DIVISOR(fosc, rate, div) < 1) ? 0 : \
+     (USART_BAUD_DIVISOR(fosc, rate, div) - 1))
+// The actual rate's error in tenths of a percent
+#define USART_BAUD_ERROR( fosc, rate, div ) \
+    ((int16_t)((((fosc) * 1000ULL / \
+                 ((div) * (USART_BAUD_UBRR(fosc, rate, div) + 1))) + \
+                ((rate) / 2)) / (rate)) - 1000)
+#define USART_BAUD_ABS( error ) (((error) < 0) ? -(error) : (error))
+#define USART_BAUD_U2X( fosc, rate ) \
+    (USART_BAUD_ABS(USART_BAUD_ERROR(fosc, rate, 8)) < \
+     USART_BAUD_ABS(USART_BAUD_ERROR(fosc, rate, 16)))
+#define USART_BAUD_SETTING( fosc, rate ) \
+    (USART_BAUD_U2X(fosc, rate) ? \
+     (USART_BAUD_UBRR(fosc, rate, 8) | HAL_UART_U2X) : \
+     USART_BAUD_UBRR(fosc, rate, 16))
+#define USART_BAUD_BEST_ERROR( fosc, rate ) \
+    (USART_BAUD_U2X(fosc, rate) ? USART_BAUD_ERROR(fosc, rate, 8) : \
+     USART_BAUD_ERROR(fosc, rate, 16))
+#define USART_BAUD_ENTRY( rate ) \
+    {(rate), \
+     {USART_BAUD_SETTING(CLOCK_FOSC_1MHZ, rate), \
+      USART_BAUD_SETTING(CLOCK_FOSC_8MHZ, rate)}, \
+     {USART_BAUD_BEST_ERROR(CLOCK_FOSC_1MHZ, rate), \
+      USART_BAUD_BEST_ERROR(CLOCK_FOSC_8MHZ, rate)}}
+
+/* A baud rate and its settings in each clock mode
+ */
+typedef struct usart_baud {
+    uint32_t rate;
+    // hal_uart_baud() settings
+    uint16_t setting[clock_mode_COUNT];
+    // Errors in tenths of a percent
+    int16_t error[clock_mode_COUNT];
+} usart_baud_t;
 
-/* Send a format string stored in flash memory to the USART.
+/* The baud rates "baud" looks for.  57600 and 115200 are more than
+ * USART_BAUD_MAX_ERROR off at both clocks, so they're turned down.
+ * Faster rates than 250k would leave the received character interrupt
+ * 160 cycles or less per character, even at 8MHz.
  */
-uint8_t usart_printf_p(const char *fmt, ...) {
-    va_list args; 
-    uint8_t i; 
-    char printbuffer[USART_TXBUFFERSIZE]; 
+const usart_baud_t usart_baud_table[] PROGMEM = {
+    USART_BAUD_ENTRY(2400),
+    USART_BAUD_ENTRY(4800),
+    USART_BAUD_ENTRY(9600),
+    USART_BAUD_ENTRY(19200),
+    USART_BAUD_ENTRY(38400),
+    USART_BAUD_ENTRY(57600),
+    USART_BAUD_ENTRY(76800),
+    USART_BAUD_ENTRY(115200),
+    USART_BAUD_ENTRY(250000)
+};
 
-    va_start (args, fmt); 
-        /* For this to work, printbuffer must be larger than 
-        * anything we ever want to print. 
-        */ 
-        i = vsnprintf_P (printbuffer, USART_TXBUFFERSIZE, fmt, args); 
-    va_end (args); 
+#define USART_BAUD_RATES (sizeof(usart_baud_table) / sizeof(usart_baud_t))
 
-    /* Print the string */ 
-    usart_puts(printbuffer); 
-    return 0; 
-}    
+/* The baud rate in use, the one "baud" asked for, and the one to go
+ * back to if the host doesn't follow a change
+ */
+typedef struct usart_baud_state {
+    uint8_t index; // Entry in usart_baud_table in use
+    uint8_t next; // Entry to switch to, or USART_BAUD_RATES for none
+    uint8_t fallback; // Entry to go back to
+    uint8_t pending; // Nonzero while waiting for the host
+    uint32_t start; // clock_now() when the rate was changed
+} usart_baud_state_t;
 
- 
+usart_baud_state_t usart_baud_state;
+usart_baud_state_t *usart_baud_state_ptr = &usart_baud_state;
 
 /* usart_receive
  * Simple USART receive function based on polling of the receive
@@ -71,18 +144,118 @@ uint8_t usart_printf_p(const char *fmt, ...) {
  * by checking the RXCn flag.  This flag is set when data is present. 
  */
 unsigned char usart_receive(void) {
-    while( !(UCSR0A & (1<<RXC0)));
-    return UDR0;
+    while( !hal_uart_rx_ready() );
+    return hal_uart_get();
+}
+
+/* usart_tx_poll()
+ * Wait for the data register to empty, then move one character from
+ * the transmit queue into it.  This is how the queue gets drained when
+ * interrupts are disabled and the data register empty interrupt can't
+ * run.
+ */
+static void usart_tx_poll(void) {
+    uint8_t txdata;
+    while( !hal_uart_tx_ready() );
+    if (txqueue_get(usart_txqueue_ptr, &txdata) == 0) {
+        hal_uart_put(txdata);
+    }
 }
 
 /* usart_putc(char data)
- * Sends a character to the USART 
+ * Puts a character in the transmit queue and makes sure the data
+ * register empty interrupt is enabled to send it.  What happens when
+ * the queue is full depends on the queue's overflow policy.
  */
 void usart_putc(char data) {
-    /* Wait for empty transmit buffer */
-    while( !( UCSR0A & (1<<UDRE0)) );
-    /* Put data into buffer -- sends the data */
-    UDR0 = data;
+    txqueue_status_t status;
+    for(;;) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            status = txqueue_put(usart_txqueue_ptr, data);
+            // Enable data register empty interrupts to start sending
+            hal_uart_tx_start();
+        }
+        if (status != txqueue_status_FULL) {
+            break;
+        }
+        /* The queue is full and we're supposed to wait for room.  If
+         * interrupts are disabled (we were called from an ISR) the queue
+         * will never drain by itself, so push a character out by hand. */
+        if ( !hal_irq_enabled() ) {
+            usart_tx_poll();
+        }
+        else {
+            hal_wait();
+        }
+    }
+}
+
+/* usart_flush()
+ * Wait until everything in the transmit queue has been sent.
+ */
+void usart_flush(void) {
+    while (txqueue_count(usart_txqueue_ptr) != 0) {
+        if ( !hal_irq_enabled() ) {
+            usart_tx_poll();
+        }
+        else {
+            hal_wait();
+        }
+    }
+    // Wait for the last character to leave the data register
+    while( !hal_uart_tx_ready() );
+}
+
+uint8_t usart_tx_pending(void) {
+    return txqueue_count(usart_txqueue_ptr);
+}
+
+/* usart_txpolicy( overflow policy )
+ * Set what happens to characters sent when the transmit queue is full.
+ */
+void usart_txpolicy( txqueue_policy_t policy ) {
+    usart_txqueue_ptr -> policy = policy;
+}
+
+/* cmd_txpolicy()
+ * Called by the remote command "txpolicy."  Sets the transmit queue's
+ * overflow policy.  If no policy matches the user's parameter, issue an
+ * error and leave the policy as it was.
+ */
+command_status_t cmd_txpolicy( command_arg_t *argv ) {
+    uint16_t setval = argv[0].u16;
+    switch(setval) {
+        case 0: usart_txpolicy(txqueue_policy_BLOCK);
+                break;
+        case 1: usart_txpolicy(txqueue_policy_DROP_NEWEST);
+                break;
+        case 2: usart_txpolicy(txqueue_policy_DROP_OLDEST);
+                break;
+        default: logger_msg_p( log_system_COMMAND, log_level_ERROR,
+                              PSTR("Transmit policy %u is not recognized.\r\n"),
+                              setval);
+                 return command_status_FAILED;
+    }
+    return command_status_OK;
+}
+
+/* cmd_txstat_q()
+ * Called by the remote command "txstat?"  Returns the transmit queue's
+ * high water mark and the number of characters it has dropped.
+ */
+command_status_t cmd_txstat_q( command_arg_t *argv ) {
+    uint8_t highwater;
+    uint16_t dropped;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        highwater = usart_txqueue_ptr -> highwater;
+        dropped = usart_txqueue_ptr -> dropped;
+    }
+    usart_puts_p(PSTR("0x"));
+    usart_put_hex16(highwater);
+    usart_puts_p(PSTR(" 0x"));
+    usart_put_hex16(dropped);
+    usart_put_crlf();
+    return command_status_OK;
 }
 
 /* usart_puts(char s[])
@@ -101,34 +274,319 @@ void usart_puts(const char s[]) {
  * Sends strings stored in flash memory to the usart.
  */
 void usart_puts_p(const char *data_ptr) {
-    uint8_t txdata = 1; // Dummy initialization value
+    uint8_t txdata = pgm_read_byte(data_ptr);
     while ( txdata != 0x00 ) {
-        txdata = pgm_read_byte(data_ptr);
         usart_putc(txdata);
         data_ptr++;
+        txdata = pgm_read_byte(data_ptr);
+    }
+}
+
+/* usart_put_nibbles( value, started )
+ * Send each nibble from the most significant down, skipping leading
+ * zeros until started is set.  The last nibble is always sent, so zero
+ * is sent as a single 0.
+ */
+static void usart_put_nibbles(uint16_t value, uint8_t started) {
+    uint8_t shift = 12;
+    uint8_t nibble;
+    while (shift != 0) {
+        nibble = (value >> shift) & 0xf;
+        if ((nibble != 0) || started) {
+            usart_putc(pgm_read_byte(&number_hex_chars[nibble]));
+            started = 1;
+        }
+        shift -= 4;
+    }
+    usart_putc(pgm_read_byte(&number_hex_chars[value & 0xf]));
+}
+
+/* usart_put_hex16( value )
+ * Skip the leading zeros.
+ */
+void usart_put_hex16(uint16_t value) {
+    usart_put_nibbles(value, 0);
+}
+
+/* usart_put_hex32( value )
+ * Send the high word without leading zeros, then the low word with
+ * them.
+ */
+void usart_put_hex32(uint32_t value) {
+    if (value > 0xffff) {
+        usart_put_nibbles((uint16_t)(value >> 16), 0);
+        usart_put_nibbles((uint16_t)value, 1);
+    }
+    else {
+        usart_put_nibbles((uint16_t)value, 0);
+    }
+}
+
+/* usart_put_digits( value, first power, started )
+ * Count how many times each power of ten can be subtracted to get each
+ * digit, most significant first, so digits can be sent as soon as
+ * they're known.  Leading zeros are skipped until started is set.
+ */
+static void usart_put_digits(uint16_t value, uint8_t power, uint8_t started) {
+    uint16_t tens;
+    char digit;
+    for (; power < NUMBER_POWERS; power++) {
+        tens = pgm_read_word(&number_powers_of_ten[power]);
+        digit = '0';
+        while (value >= tens) {
+            value -= tens;
+            digit++;
+        }
+        if ((digit != '0') || started) {
+            usart_putc(digit);
+            started = 1;
+        }
+    }
+    usart_putc('0' + (uint8_t)value);
+}
+
+/* usart_put_u16( value )
+ * Start with the largest power of ten and skip leading zeros.
+ */
+void usart_put_u16(uint16_t value) {
+    usart_put_digits(value, 0, 0);
+}
+
+/* usart_put_u32( value )
+ * Send everything above the last four digits first, then the last four
+ * with their leading zeros.  This recurses at most twice.
+ */
+void usart_put_u32(uint32_t value) {
+    if (value > 0xffff) {
+        usart_put_u32(value / 10000);
+        usart_put_digits((uint16_t)(value % 10000), 1, 1);
+    }
+    else {
+        usart_put_u16((uint16_t)value);
+    }
+}
+
+/* usart_put_s16( value )
+ * The magnitude of -32768 still fits in a uint16_t.
+ */
+void usart_put_s16(int16_t value) {
+    if (value < 0) {
+        usart_putc('-');
+        usart_put_u16((uint16_t)0 - (uint16_t)value);
+    }
+    else {
+        usart_put_u16((uint16_t)value);
     }
 }
 
+/* usart_put_s32( value )
+ * The magnitude of the most negative value still fits in a uint32_t.
+ */
+void usart_put_s32(int32_t value) {
+    if (value < 0) {
+        usart_putc('-');
+        usart_put_u32((uint32_t)0 - (uint32_t)value);
+    }
+    else {
+        usart_put_u32((uint32_t)value);
+    }
+}
+
+/* usart_put_crlf()
+ * Send the end of a reply.
+ */
+void usart_put_crlf(void) {
+    usart_putc('\r');
+    usart_putc('\n');
+}
+
+/* usart_baud_find( rate )
+ * Return the usart_baud_table entry for the rate, or USART_BAUD_RATES if
+ * it isn't there.
+ */
+static uint8_t usart_baud_find( uint32_t rate ) {
+    uint8_t index;
+    for (index = 0; index < USART_BAUD_RATES; index++) {
+        if (pgm_read_dword(&usart_baud_table[index].rate) == rate) {
+            break;
+        }
+    }
+    return index;
+}
+
+/* usart_baud_mode( index )
+ * Return the slowest clock mode that gets close enough to the rate, or
+ * clock_mode_COUNT if neither does.
+ */
+static clock_mode_t usart_baud_mode( uint8_t index ) {
+    uint8_t mode;
+    int16_t error;
+    for (mode = 0; mode < clock_mode_COUNT; mode++) {
+        error = (int16_t)pgm_read_word(&usart_baud_table[index].error[mode]);
+        if (USART_BAUD_ABS(error) <= USART_BAUD_MAX_ERROR) {
+            break;
+        }
+    }
+    return (clock_mode_t)mode;
+}
+
+/* usart_baud_wait()
+ * usart_flush() returns when the last character has left the data
+ * register, but it's still being shifted out.  Wait two character times
+ * at the current rate for it to finish.  One character is 10 bits, and
+ * at most 33334 cycles.
+ */
+static void usart_baud_wait(void) {
+    uint32_t rate = pgm_read_dword(
+        &usart_baud_table[usart_baud_state_ptr -> index].rate);
+    uint16_t cycles = (uint16_t)((clock_fosc() * 10) / rate) + 1;
+    uint16_t start;
+    uint8_t chars;
+    for (chars = 0; chars < 2; chars++) {
+        start = clock_timestamp();
+        while ((uint16_t)(clock_timestamp() - start) < cycles);
+    }
+}
+
+/* usart_baud_set( index )
+ * Change the clock mode first if the new rate needs it, since the USART
+ * setting depends on it.  The transmitter has to be idle.
+ */
+static void usart_baud_set( uint8_t index ) {
+    clock_mode_t mode = usart_baud_mode(index);
+    if (mode != clock_get_mode()) {
+        clock_set_mode(mode);
+        adc_clock_update();
+    }
+    hal_uart_baud(pgm_read_word(&usart_baud_table[index].setting[mode]));
+    usart_baud_state_ptr -> index = index;
+}
+
+/* usart_baud_confirm()
+ * Nothing to do unless a change is waiting for the host.
+ */
+void usart_baud_confirm(void) {
+    usart_baud_state_ptr -> pending = 0;
+}
+
+/* usart_baud_switch()
+ * Make the change asked for by cmd_baud().  The command task runs
+ * before this one, so the replies to the line with "baud" in it are
+ * already queued, and they go out at the old rate before the switch.
+ */
+static void usart_baud_switch(void) {
+    uint8_t index = usart_baud_state_ptr -> next;
+    usart_baud_state_ptr -> next = USART_BAUD_RATES;
+    if (index == usart_baud_state_ptr -> index) {
+        return;
+    }
+    usart_flush();
+    usart_baud_wait();
+    usart_baud_state_ptr -> fallback = usart_baud_state_ptr -> index;
+    usart_baud_set(index);
+    usart_baud_state_ptr -> start = clock_now();
+    usart_baud_state_ptr -> pending = 1;
+}
+
+/* usart_baud_poll()
+ * The system tick keeps counting through the clock change, so the time
+ * since the change is just the difference of two clock_now() readings.
+ */
+void usart_baud_poll(void) {
+    if (usart_baud_state_ptr -> next != USART_BAUD_RATES) {
+        usart_baud_switch();
+        return;
+    }
+    if (usart_baud_state_ptr -> pending == 0) {
+        return;
+    }
+    if ((clock_now() - (usart_baud_state_ptr -> start)) <
+        CLOCK_MS_TICKS(USART_BAUD_CONFIRM_MS)) {
+        return;
+    }
+    usart_baud_state_ptr -> pending = 0;
+    usart_flush();
+    usart_baud_wait();
+    usart_baud_set(usart_baud_state_ptr -> fallback);
+    logger_msg_p(log_system_COMMAND,log_level_WARNING,
+        PSTR("No commands at the new baud rate.  Back to %lu baud.\r\n"),
+        (unsigned long)pgm_read_dword(
+            &usart_baud_table[usart_baud_state_ptr -> index].rate));
+}
+
+/* cmd_baud()
+ * This only asks usart_baud_poll() for the change, so the reply goes out
+ * at the old rate.  After that, the host has USART_BAUD_CONFIRM_MS to
+ * switch and send a command at the new rate.  Send a carriage return
+ * first to throw away anything garbled while switching.
+ */
+command_status_t cmd_baud( command_arg_t *argv ) {
+    uint32_t rate = argv[0].u32;
+    uint8_t index = usart_baud_find(rate);
+    if ((index == USART_BAUD_RATES) ||
+        (usart_baud_mode(index) == clock_mode_COUNT)) {
+        logger_msg_p(log_system_COMMAND,log_level_ERROR,
+            PSTR("Can't run at %lu baud.\r\n"),(unsigned long)rate);
+        return command_status_FAILED;
+    }
+    // A later "baud" in the same line replaces an earlier one
+    usart_baud_state_ptr -> next = index;
+    if (index == usart_baud_state_ptr -> index) {
+        return command_status_OK;
+    }
+    logger_msg_p(log_system_COMMAND,log_level_INFO,
+        PSTR("Switching to %lu baud.\r\n"),(unsigned long)rate);
+    sched_ready(sched_id_BAUD);
+    return command_status_OK;
+}
+
+/* cmd_baud_q()
+ * Called by the remote command "baud?"
+ */
+command_status_t cmd_baud_q( command_arg_t *argv ) {
+    uint8_t index = usart_baud_state_ptr -> index;
+    clock_mode_t mode = clock_get_mode();
+    usart_put_u32(pgm_read_dword(&usart_baud_table[index].rate));
+    usart_putc(' ');
+    usart_put_u16((uint16_t)(clock_fosc() / 1000000));
+    usart_putc(' ');
+    usart_put_s16((int16_t)pgm_read_word(&usart_baud_table[index].error[mode]));
+    usart_put_crlf();
+    return command_status_OK;
+}
+
 /* usart_init()
- * Initialize the USART.  The butterfly only has one USART, so all the
- * n values for configuration registers are 0. 
+ * Initialize the USART and its transmit queue.
  */
 void usart_init(void) {
-    /* Set the USART baudrate registers for 9600.  With a fosc of 1MHz,
-     * and double speed operation enabled, this means UBRR0 = 12.  UBRR
-     * is a 12-bit register, so it has a high and a low byte. */
-    UBRR0H = 0;
-    UBRR0L = 12;
-
-    /* Set double speed mode. */
-    UCSR0A = (1<<U2X0);
-
-    /* Configure USART control register B */
-    UCSR0B = (1<<RXEN0)|(1<<TXEN0); // Enable receiver and transmitter.
-    UCSR0B |= (1<<RXCIE0); // Enable receive complete interrupts.
-    UCSR0B |= (0<<TXCIE0); // Enable transmit complete interrupts (not right now).
-    UCSR0B |= (0<<UDRIE0); // Enable data registter empty interrupts (not right now).
-
-    /* Set the USART to asynchronous at 8 bits no parity and 1 stop bit */
-    UCSR0C = (0<<UMSEL0)|(0<<UPM00)|(0<<USBS0)|(3<<UCSZ00)|(0<<UCPOL0);
+    /* Start with an empty transmit queue.  Callers wait for room when
+     * it fills up. */
+    txqueue_init(usart_txqueue_ptr, txqueue_policy_BLOCK);
+
+    /* 9600 baud, 8 data bits, no parity and 1 stop bit, with receive
+     * complete interrupts.  Data register empty interrupts are enabled
+     * by usart_putc(). */
+    hal_uart_init();
+    usart_baud_state_ptr -> index = usart_baud_find(USART_BAUD_DEFAULT);
+    usart_baud_state_ptr -> next = USART_BAUD_RATES;
+    usart_baud_state_ptr -> pending = 0;
+}
+
+
+/* -------------------------- Interrupts ------------------------------- */
+
+/* Interrupt on the USART data register becoming empty.  Send the next
+ * character in the transmit queue, or turn this interrupt off if there
+ * isn't one.
+ */
+ISR(USART0_UDRE_vect) {
+    uint8_t txdata;
+    STATS_ISR_ENTER();
+    if (txqueue_get(usart_txqueue_ptr, &txdata) == 0) {
+        hal_uart_put(txdata);
+    }
+    else {
+        hal_uart_tx_stop();
+    }
+    STATS_ISR_EXIT(stats_isr_USART0_UDRE);
 }
@@ -8,17 +8,19 @@
  */
 #include <stdint.h>
 
-/* Define the maximum string length that will be sent to the USART.
+/* bc_txqueue.h
+ * Defines txqueue_policy_t, the transmit queue overflow policies.
  */
-#define USART_TXBUFFERSIZE 150
+#include "bc_txqueue.h"
 
-/* Send a format string to the USART interface 
+/* bc_command.h
+ * Defines command_arg_t, the argument passed to remote command functions.
  */
-uint8_t usart_printf (const char *fmt, ...);
+#include "bc_command.h"
 
-/* Send a format string stored in flash memory to the USART interface.
+/* Define the maximum string length that will be sent to the USART.
  */
-uint8_t usart_printf_p(const char *fmt, ...);
+#define USART_TXBUFFERSIZE 150
 
 /* usart_receive
  * Simple USART receive function based on polling of the receive
@@ -31,10 +33,40 @@ uint8_t usart_printf_p(const char *fmt, ...);
 unsigned char usart_receive(void);
 
 /* usart_putc(char data)
- * Sends a character to the USART 
+ * Puts a character in the transmit queue.  The data register empty
+ * interrupt sends it.  If the queue is full, the character is handled
+ * according to the overflow policy set with usart_txpolicy().
  */
 void usart_putc(char data);
 
+/* usart_flush()
+ * Wait until everything in the transmit queue has been sent.
+ */
+void usart_flush(void);
+
+/* usart_tx_pending()
+ * Returns the number of characters waiting in the transmit queue.
+ */
+uint8_t usart_tx_pending(void);
+
+/* usart_txpolicy( overflow policy )
+ * Set what happens to characters sent when the transmit queue is full.
+ * The default is txqueue_policy_BLOCK.
+ */
+void usart_txpolicy( txqueue_policy_t policy );
+
+/* cmd_txpolicy()
+ * Called by the remote command "txpolicy."  Sets the transmit queue's
+ * overflow policy: 0 = block, 1 = drop newest, 2 = drop oldest.
+ */
+command_status_t cmd_txpolicy( command_arg_t *argv );
+
+/* cmd_txstat_q()
+ * Called by the remote command "txstat?"  Returns the transmit queue's
+ * high water mark and the number of characters it has dropped.
+ */
+command_status_t cmd_txstat_q( command_arg_t *argv );
+
 /* usart_puts(char s[])
  * Sends a string over the USART by repeatedly calling usart_putc() 
  */
@@ -45,8 +77,91 @@ void usart_puts(const char s[]);
  */
 void usart_puts_p(const char *data);
 
+/* usart_put_hex16( value )
+ * Sends a number as lower case hex digits without leading zeros or a
+ * prefix, the same as printf's %x.  Each digit goes straight into the
+ * transmit queue, so no string buffer is needed.
+ */
+void usart_put_hex16(uint16_t value);
+
+/* usart_put_hex32( value )
+ * Sends a 32-bit number as lower case hex digits without leading zeros
+ * or a prefix, the same as printf's %lx.
+ */
+void usart_put_hex32(uint32_t value);
+
+/* usart_put_u16( value )
+ * Sends a number as decimal digits, the same as printf's %u.
+ */
+void usart_put_u16(uint16_t value);
+
+/* usart_put_u32( value )
+ * Sends a 32-bit number as decimal digits, the same as printf's %lu.
+ */
+void usart_put_u32(uint32_t value);
+
+/* usart_put_s16( value )
+ * Sends a number as decimal digits with a leading minus sign for
+ * negative numbers, the same as printf's %d.
+ */
+void usart_put_s16(int16_t value);
+
+/* usart_put_s32( value )
+ * Sends a 32-bit number as decimal digits with a leading minus sign for
+ * negative numbers, the same as printf's %ld.
+ */
+void usart_put_s32(int32_t value);
+
+/* usart_put_crlf()
+ * Sends the carriage return and line feed that end each reply.
+ */
+void usart_put_crlf(void);
+
 /* usart_init()
  * Initialize the USART for 9600 baud, 8 data bits, 1 stop bit, no parity
  * checking. 
  */
 void usart_init(void);
+
+/* Define the default baud rate, set up by usart_init()
+ */
+#define USART_BAUD_DEFAULT 9600
+
+/* Define the largest baud rate error allowed, in tenths of a percent.
+ * The errors at both ends add up, and 8N1 frames start failing at about
+ * 4%.
+ */
+#define USART_BAUD_MAX_ERROR 20
+
+/* Define how long the host has to send a command at a new baud rate
+ * before going back to the old one, in ms.
+ */
+#define USART_BAUD_CONFIRM_MS 2000
+
+/* usart_baud_confirm()
+ * Called for every command recognized.  Getting one means the host is
+ * talking at the new baud rate, so there's no need to go back.
+ */
+void usart_baud_confirm(void);
+
+/* usart_baud_poll()
+ * Called from the main loop.  Makes the change asked for by "baud" once
+ * the replies before it have been sent.  Goes back to the old baud rate
+ * and clock if the host hasn't sent a command in USART_BAUD_CONFIRM_MS
+ * since the baud rate was changed.
+ */
+void usart_baud_poll(void);
+
+/* cmd_baud()
+ * Called by the remote command "baud."  Switches to a new baud rate,
+ * running the system clock at 8MHz if 1MHz can't make the rate.  The
+ * switch is made by usart_baud_poll() after the line's replies are
+ * sent at the old rate.
+ */
+command_status_t cmd_baud( command_arg_t *argv );
+
+/* cmd_baud_q()
+ * Called by the remote command "baud?"  Returns the baud rate, the
+ * system clock in MHz and the baud rate error in tenths of a percent.
+ */
+command_status_t cmd_baud_q( command_arg_t *argv );
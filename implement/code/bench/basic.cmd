@@ -0,0 +1,17 @@
+# Commands that exercise the parser, the command table and the number
+# formatters.  Run by "make bench" -- see bc_bench_sim.c.
+hello
+volt?
+vcounts?
+logreg ffff
+loglevel 3
+logreg?
+filter 2 2 3
+filter?
+vcalpt 1 3300
+vcal?
+txstat?
+rxstat?
+nosuchcommand
+loglevel 0
+help
@@ -0,0 +1,103 @@
+/* host_lookup.c
+ *
+ * Times command lookups against the size of the command table, on the
+ * PC.  Built and run by "make bench-host", which saves the report in
+ * host_lookup.txt.
+ *
+ * Each size searches the first n entries of command_array with
+ * command_search(), looking up every name in them and as many names
+ * that aren't there.  The linear column times the strcmp() loop that
+ * command_find() used before the table was sorted, over the same names.
+ * The report has whitespace-separated columns and # comment lines:
+ *
+ *     entries  probes  binary_ns  linear_ns
+ *
+ * probes is the most strcmp_P() calls a binary search of that many
+ * entries can make.  Times are the mean per lookup.  They're PC times,
+ * only good for comparing sizes and builds on the same PC.  AVR cycles
+ * for the whole table come from the command_find point in "make bench".
+ */
+
+// ----------------------- Include files ------------------------------
+/* time.h
+ * Provides clock_gettime() for timing the lookups.
+ */
+#include <time.h>
+
+#include "bc_test.h"
+
+/* Define the number of times each set of names is looked up
+ */
+#define LOOKUP_PASSES 20000
+
+/* Table sizes to time, ending with 0 for the whole table
+ */
+const uint8_t lookup_sizes[] = {2, 4, 8, 16, 32, 0};
+
+/* lookup_nanos(void)
+ * Return the PC's monotonic clock in nanoseconds.
+ */
+static double lookup_nanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1e9) + now.tv_nsec;
+}
+
+/* lookup_linear( command name, number of entries to search )
+ * The search command_find() did before the table was sorted.
+ */
+static uint8_t lookup_linear( char *name, uint8_t count ) {
+    uint8_t index;
+    for (index = 0; index < count; index++) {
+        if (strcmp_P( name, command_array[index].name ) == 0) {
+            break;
+        }
+    }
+    return index;
+}
+
+int main(void) {
+    char names[2 * 256][COMMAND_NAME_SIZE + 1];
+    volatile uint8_t found = 0;
+    uint8_t size;
+    uint8_t probes;
+    uint16_t count;
+    uint16_t index;
+    uint32_t pass;
+    double start;
+    double binary_ns;
+    double linear_ns;
+    test_init();
+    printf("# Command lookup time against table size, on the PC\n");
+    printf("# entries  probes  binary_ns  linear_ns\n");
+    for (index = 0; index < sizeof(lookup_sizes); index++) {
+        size = lookup_sizes[index] ? lookup_sizes[index] : command_count;
+        if (size > command_count) {
+            continue;
+        }
+        /* Every name in the table, then each name with a character
+         * added, which sorts just after it and isn't there. */
+        for (count = 0; count < size; count++) {
+            strcpy(names[count], command_array[count].name);
+            strcpy(names[size + count], command_array[count].name);
+            strcat(names[size + count], "x");
+        }
+        for (probes = 0; (size >> probes) != 0; probes++);
+        start = lookup_nanos();
+        for (pass = 0; pass < LOOKUP_PASSES; pass++) {
+            for (count = 0; count < (2 * size); count++) {
+                found += command_search(names[count], size);
+            }
+        }
+        binary_ns = (lookup_nanos() - start) / (LOOKUP_PASSES * 2.0 * size);
+        start = lookup_nanos();
+        for (pass = 0; pass < LOOKUP_PASSES; pass++) {
+            for (count = 0; count < (2 * size); count++) {
+                found += lookup_linear(names[count], size);
+            }
+        }
+        linear_ns = (lookup_nanos() - start) / (LOOKUP_PASSES * 2.0 * size);
+        printf("%u %u %.1f %.1f\n", size, probes, binary_ns, linear_ns);
+    }
+    return 0;
+}
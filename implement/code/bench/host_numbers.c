@@ -0,0 +1,198 @@
+/* host_numbers.c
+ *
+ * Times the number formatters and parsers against the C library, on
+ * the PC.  Built and run by "make bench-host", which saves the report in
+ * host_numbers.txt.
+ *
+ * Each formatter sends every 16-bit value, or a spread of 32-bit
+ * values, through the transmit queue to /dev/null.  The printf column
+ * sends the same text by formatting it with snprintf() first, the way
+ * the replies were sent before.  Each parser reads every 16-bit value
+ * back, and the library column does the same with strtoul() or strtol().
+ * The report has whitespace-separated columns and # comment lines:
+ *
+ *     function  calls  ns_per_call  library_ns_per_call
+ *
+ * They're PC times, only good for comparing builds on the same PC.  The
+ * AVR has no divide instruction, which the formatters avoid and
+ * snprintf() doesn't, so the gap there is wider than this shows.  AVR
+ * cycles for the parsers come from the parse_hex and parse_dec points
+ * in "make bench".
+ */
+
+// ----------------------- Include files ------------------------------
+/* time.h
+ * Provides clock_gettime() for timing.
+ */
+#include <time.h>
+
+#include "bc_test.h"
+
+/* bc_numbers.h
+ * The parsers being timed.
+ */
+#include "bc_numbers.h"
+
+/* Define the number of 32-bit values sent by the 32-bit formatters
+ */
+#define NUMBERS_LONGS 65536UL
+
+/* Kinds of number being formatted or parsed
+ */
+typedef enum numbers_kind {
+    numbers_kind_HEX16,
+    numbers_kind_U16,
+    numbers_kind_S16,
+    numbers_kind_HEX32,
+    numbers_kind_U32
+} numbers_kind_t;
+
+/* numbers_nanos(void)
+ * Return the PC's monotonic clock in nanoseconds.
+ */
+static double numbers_nanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1e9) + now.tv_nsec;
+}
+
+/* numbers_value( index )
+ * The 32-bit values are spread over the whole range.
+ */
+static uint32_t numbers_value( uint32_t index ) {
+    return index * 65537UL;
+}
+
+/* numbers_send( kind, value )
+ * Send a number with the formatter for its kind.
+ */
+static void numbers_send( numbers_kind_t kind, uint32_t value ) {
+    switch (kind) {
+        case numbers_kind_HEX16: usart_put_hex16((uint16_t)value);
+            break;
+        case numbers_kind_U16: usart_put_u16((uint16_t)value);
+            break;
+        case numbers_kind_S16: usart_put_s16((int16_t)value);
+            break;
+        case numbers_kind_HEX32: usart_put_hex32(value);
+            break;
+        default: usart_put_u32(value);
+            break;
+    }
+}
+
+/* numbers_printf( kind, value )
+ * Send the same text through snprintf() and usart_puts().
+ */
+static void numbers_printf( numbers_kind_t kind, uint32_t value ) {
+    char text[12];
+    switch (kind) {
+        case numbers_kind_HEX16: snprintf(text, sizeof(text), "%x",
+                                          (uint16_t)value);
+            break;
+        case numbers_kind_U16: snprintf(text, sizeof(text), "%u",
+                                        (uint16_t)value);
+            break;
+        case numbers_kind_S16: snprintf(text, sizeof(text), "%d",
+                                        (int16_t)value);
+            break;
+        case numbers_kind_HEX32: snprintf(text, sizeof(text), "%lx",
+                                          (unsigned long)value);
+            break;
+        default: snprintf(text, sizeof(text), "%lu", (unsigned long)value);
+            break;
+    }
+    usart_puts(text);
+}
+
+/* numbers_time_format( name, kind, number of values )
+ * Print one report line for a formatter.
+ */
+static void numbers_time_format( const char *name, numbers_kind_t kind,
+                                 uint32_t count ) {
+    uint32_t index;
+    double start;
+    double ours_ns;
+    double library_ns;
+    start = numbers_nanos();
+    for (index = 0; index < count; index++) {
+        numbers_send(kind, (kind >= numbers_kind_HEX32) ?
+                     numbers_value(index) : index);
+    }
+    hal_wait();
+    ours_ns = (numbers_nanos() - start) / count;
+    start = numbers_nanos();
+    for (index = 0; index < count; index++) {
+        numbers_printf(kind, (kind >= numbers_kind_HEX32) ?
+                       numbers_value(index) : index);
+    }
+    hal_wait();
+    library_ns = (numbers_nanos() - start) / count;
+    printf("%s %lu %.1f %.1f\n", name, (unsigned long)count, ours_ns,
+           library_ns);
+}
+
+/* numbers_time_parse( name, kind )
+ * Print one report line for a parser, reading back every 16-bit value.
+ */
+static void numbers_time_parse( const char *name, numbers_kind_t kind ) {
+    static char text[0x10000][8];
+    volatile uint32_t total = 0;
+    uint32_t parsed = 0;
+    int16_t signed_value = 0;
+    uint32_t index;
+    double start;
+    double ours_ns;
+    double library_ns;
+    for (index = 0; index <= 0xffff; index++) {
+        sprintf(text[index], (kind == numbers_kind_HEX16) ? "%x" :
+                (kind == numbers_kind_U16) ? "%u" : "%d",
+                (kind == numbers_kind_S16) ? (int)(int16_t)index :
+                                             (int)index);
+    }
+    start = numbers_nanos();
+    for (index = 0; index <= 0xffff; index++) {
+        if (kind == numbers_kind_HEX16) {
+            parse_hex(text[index], &parsed, 0xffff);
+        }
+        else if (kind == numbers_kind_U16) {
+            parse_dec(text[index], &parsed, 0xffff);
+        }
+        else {
+            parse_signed(text[index], &signed_value);
+            parsed = (uint16_t)signed_value;
+        }
+        total += parsed;
+    }
+    ours_ns = (numbers_nanos() - start) / 0x10000;
+    start = numbers_nanos();
+    for (index = 0; index <= 0xffff; index++) {
+        if (kind == numbers_kind_S16) {
+            total += (uint16_t)strtol(text[index], NULL, 10);
+        }
+        else {
+            total += strtoul(text[index], NULL,
+                             (kind == numbers_kind_HEX16) ? 16 : 10);
+        }
+    }
+    library_ns = (numbers_nanos() - start) / 0x10000;
+    printf("%s %lu %.1f %.1f\n", name, 0x10000UL, ours_ns, library_ns);
+}
+
+int main(void) {
+    test_init();
+    hal_linux_tx_file = fopen("/dev/null", "w");
+    printf("# Number formatting and parsing time, on the PC\n");
+    printf("# function  calls  ns_per_call  library_ns_per_call\n");
+    numbers_time_format("usart_put_hex16", numbers_kind_HEX16, 0x10000);
+    numbers_time_format("usart_put_u16", numbers_kind_U16, 0x10000);
+    numbers_time_format("usart_put_s16", numbers_kind_S16, 0x10000);
+    numbers_time_format("usart_put_hex32", numbers_kind_HEX32, NUMBERS_LONGS);
+    numbers_time_format("usart_put_u32", numbers_kind_U32, NUMBERS_LONGS);
+    numbers_time_parse("parse_hex", numbers_kind_HEX16);
+    numbers_time_parse("parse_dec", numbers_kind_U16);
+    numbers_time_parse("parse_signed", numbers_kind_S16);
+    fclose(hal_linux_tx_file);
+    hal_linux_tx_file = NULL;
+    return 0;
+}
@@ -0,0 +1,196 @@
+/* host_scripts.c
+ *
+ * Runs the "make bench" scripts through the PC build and reports the
+ * time spent between the markers in bc_bench.h.  Built with -DBENCH and
+ * run by "make bench-host", which saves the report in host_scripts.txt.
+ *
+ * Each $(BENCH_DIR)/*.cmd script is run the way bc_bench_sim.c runs it:
+ * each line goes into the parse queue, then the main loop's tasks run
+ * until the firmware has been quiet for HOST_QUIET_NS, or for at most
+ * HOST_LINE_NS.  Lines starting with # are comments.  The firmware's
+ * replies go to host_replies.log so they can be checked by eye.  The
+ * scripts share one command stack, so each starts where the last one
+ * left off, but the times are reset for each.
+ *
+ * The report has the same columns as bc_bench_sim.c's:
+ *
+ *     script  point  count  min  max  mean  total
+ *
+ * Times are PC nanoseconds instead of AVR cycles, only good for
+ * comparing builds on the same PC.  Interrupt times, latencies and the
+ * longest stretch with interrupts off need the simulator, so they
+ * aren't reported here.
+ */
+
+// ----------------------- Include files ------------------------------
+/* time.h
+ * Provides clock_gettime() for deciding when a line is finished.
+ */
+#include <time.h>
+
+/* glob.h
+ * Provides glob() for finding the scripts.
+ */
+#include <glob.h>
+
+#include "bc_test.h"
+
+/* bc_bench.h
+ * Provides the marker IDs and bench_host_stats.
+ */
+#include "bc_bench.h"
+
+/* bc_job.h
+ * Provides job_run() for the long commands.
+ */
+#include "bc_job.h"
+
+/* Define the scripts to run, relative to where "make bench-host" runs
+ */
+#define HOST_SCRIPTS "bench/*.cmd"
+
+/* Define where the firmware's replies go
+ */
+#define HOST_REPLIES "bench/host_replies.log"
+
+/* Define how long the firmware has to be quiet before the next line,
+ * and the longest a line may run, in nanoseconds.  About 20 character
+ * times at 9600 baud and one second, like bc_bench_sim.c.
+ */
+#define HOST_QUIET_NS 20000000ULL
+#define HOST_LINE_NS 1000000000ULL
+
+/* Define the longest script line
+ */
+#define HOST_LINESIZE 80
+
+/* Names for the points in bc_bench.h, in the same order as bench_id_t.
+ */
+static const char *host_names[bench_id_COUNT] = {
+    "none",
+    "pbuffer",
+    "command_find",
+    "parse_hex",
+    "parse_dec",
+    "logger_write"
+};
+
+/* host_nanos(void)
+ * Return the PC's monotonic clock in nanoseconds.
+ */
+static uint64_t host_nanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+/* host_send_line( line )
+ * Queue the line the way the receive interrupt does, then run the main
+ * loop's tasks until the firmware has been quiet for a while.
+ */
+static void host_send_line( const char *line ) {
+    char *slot_ptr = recv_cmd_state_ptr -> pbuffer[
+        (recv_cmd_state_ptr -> pbuffer_head) & (RECEIVE_QUEUE_SLOTS - 1)];
+    uint64_t started = host_nanos();
+    uint64_t last_output = started;
+    long sent = ftell(hal_linux_tx_file);
+    strncpy(slot_ptr, line, RECEIVE_BUFFER_SIZE - 1);
+    slot_ptr[RECEIVE_BUFFER_SIZE - 1] = '\0';
+    (recv_cmd_state_ptr -> pbuffer_head)++;
+    for (;;) {
+        if ((recv_cmd_state_ptr -> pbuffer_head) !=
+            (recv_cmd_state_ptr -> pbuffer_tail)) {
+            process_pbuffer(recv_cmd_state_ptr);
+        }
+        job_run();
+        logger_drain();
+        adc_stream_drain();
+        hal_wait();
+        if (ftell(hal_linux_tx_file) != sent) {
+            sent = ftell(hal_linux_tx_file);
+            last_output = host_nanos();
+        }
+        if ((host_nanos() - last_output) > HOST_QUIET_NS) {
+            return;
+        }
+        if ((host_nanos() - started) > HOST_LINE_NS) {
+            fprintf(hal_linux_tx_file, "\n# line timed out: %s\n", line);
+            return;
+        }
+    }
+}
+
+/* host_stat_print( script, point, pointer to stat )
+ * Print one report line.  Points that never ran are still listed, so
+ * reports from different builds line up.
+ */
+static void host_stat_print( const char *script, const char *point,
+                             const bench_host_stat_t *stat_ptr ) {
+    unsigned long long mean = 0;
+    if ((stat_ptr -> count) != 0) {
+        mean = (stat_ptr -> total) / (stat_ptr -> count);
+    }
+    printf("%-24s %-20s %8lu %8llu %8llu %8llu %12llu\n", script, point,
+           (unsigned long)(stat_ptr -> count),
+           (unsigned long long)(stat_ptr -> min),
+           (unsigned long long)(stat_ptr -> max), mean,
+           (unsigned long long)(stat_ptr -> total));
+}
+
+/* host_script( script file name )
+ * Run one script and print its report.  Returns nonzero on errors.
+ */
+static int host_script( const char *script ) {
+    FILE *scriptfile;
+    char line[HOST_LINESIZE + 2];
+    size_t length;
+    uint8_t index;
+    scriptfile = fopen(script, "r");
+    if (scriptfile == NULL) {
+        perror(script);
+        return 1;
+    }
+    memset(bench_host_stats, 0, sizeof(bench_host_stats));
+    fprintf(hal_linux_tx_file, "# %s\n", script);
+    while (fgets(line, sizeof(line), scriptfile) != NULL) {
+        length = strcspn(line, "\r\n");
+        line[length] = '\0';
+        if ((length == 0) || (line[0] == '#')) {
+            continue;
+        }
+        host_send_line(line);
+    }
+    fclose(scriptfile);
+    for (index = bench_id_NONE + 1; index < bench_id_COUNT; index++) {
+        host_stat_print(script, host_names[index], &bench_host_stats[index]);
+    }
+    return 0;
+}
+
+int main(void) {
+    glob_t scripts;
+    size_t index;
+    int status = 0;
+    test_init();
+    // Log the way the firmware does, so logger_write is measured
+    logger_setlevel( log_level_INFO );
+    hal_linux_tx_file = fopen(HOST_REPLIES, "w");
+    if (hal_linux_tx_file == NULL) {
+        perror(HOST_REPLIES);
+        return 1;
+    }
+    if (glob(HOST_SCRIPTS, 0, NULL, &scripts) != 0) {
+        fprintf(stderr, "# no scripts match %s\n", HOST_SCRIPTS);
+        return 1;
+    }
+    printf("# scripts run on the PC build, times in nanoseconds\n");
+    printf("# %-22s %-20s %8s %8s %8s %8s %12s\n", "script", "point",
+           "count", "min", "max", "mean", "total");
+    for (index = 0; index < scripts.gl_pathc; index++) {
+        status |= host_script(scripts.gl_pathv[index]);
+    }
+    globfree(&scripts);
+    fclose(hal_linux_tx_file);
+    hal_linux_tx_file = NULL;
+    return status;
+}
@@ -0,0 +1,13 @@
+# Streaming and scanning, for the ADC and transmit interrupts.  The
+# firmware never goes quiet while it streams, so each "stream" line
+# runs for the one second limit before the next line stops it.
+scanch 0 1 4
+scan 1
+scan?
+scan 0
+stream 200 0
+streamstat?
+stream 0 0
+stream 500 1
+stream 0 0
+streamstat?
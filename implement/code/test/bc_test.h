@@ -0,0 +1,149 @@
+/* bc_test.h
+ *
+ * Helpers shared by the tests run by "make test".
+ *
+ * Each test is a PC program linked against the host build, with the
+ * firmware's main() renamed out of the way.  test_init() sets things up
+ * the way main() does, test_command() runs a command line and returns
+ * everything the USART sent, and TEST_CHECK() counts failures.
+ * test_done() prints the totals and returns the exit status.
+ */
+#ifndef TEST_H
+#define TEST_H
+
+// ----------------------- Include files ------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* bc_hal.h
+ * Provides sei(), hal_wait() and hal_linux_tx_file for catching
+ * replies.
+ */
+#include "bc_hal.h"
+
+/* bc_command.h
+ * Provides command_run() and the received command state.
+ */
+#include "bc_command.h"
+
+#include "bc_usart.h"
+
+/* bc_logger.h
+ * Provides logger_init() and logger_drain() for log messages sent from
+ * interrupts.
+ */
+#include "bc_logger.h"
+
+#include "bc_adc.h"
+
+/* bc_clock.h
+ * Provides fosc_1mhz() to start the system tick.
+ */
+#include "bc_clock.h"
+
+/* Define the size of the buffer holding one command's replies
+ */
+#define TEST_REPLY_SIZE 4096
+
+/* Checks made and checks failed so far
+ */
+static unsigned long test_checks = 0;
+static unsigned long test_failures = 0;
+
+/* The replies caught by test_command(), and their length for replies
+ * that aren't text
+ */
+static char test_reply[TEST_REPLY_SIZE];
+static long test_reply_length = 0;
+
+/* TEST_CHECK( condition )
+ * Count a failure and print where it happened if the condition is
+ * false.  Evaluates to the condition.
+ */
+#define TEST_CHECK( cond ) test_check((cond), #cond, __FILE__, __LINE__)
+
+static inline int test_check( int ok, const char *text, const char *file,
+                              int line ) {
+    test_checks++;
+    if (!ok) {
+        test_failures++;
+        printf("FAIL %s:%d: %s\n", file, line, text);
+    }
+    return ok;
+}
+
+/* test_init(void)
+ * Set up the command stack the same way main() does, without restoring
+ * the saved settings.  Only warnings and errors are logged, so replies
+ * can be compared as they are.
+ */
+static inline void test_init(void) {
+    sei();
+    fosc_1mhz();
+    usart_init();
+    logger_init();
+    logger_setlevel( log_level_WARNING );
+    logger_disable();
+    logger_setsystem( log_system_LOGGER );
+    logger_setsystem( log_system_RXCHAR );
+    logger_setsystem( log_system_COMMAND );
+    logger_setsystem( log_system_ADC );
+    logger_setsystem( log_system_CONFIG );
+    adc_init();
+    command_init( recv_cmd_state_ptr );
+}
+
+/* test_flush(void)
+ * Send everything waiting in the log and transmit queues.
+ */
+static inline void test_flush(void) {
+    sei();
+    logger_drain();
+    hal_wait();
+}
+
+/* test_capture_start(void)
+ * Send the USART's output to test_reply until test_capture_end().
+ */
+static inline void test_capture_start(void) {
+    test_flush();
+    memset(test_reply, 0, sizeof(test_reply));
+    hal_linux_tx_file = fmemopen(test_reply, sizeof(test_reply) - 1, "w");
+    setvbuf(hal_linux_tx_file, NULL, _IONBF, 0);
+}
+
+/* test_capture_end(void)
+ * Send the USART's output to stdout again and return what was caught.
+ */
+static inline char *test_capture_end(void) {
+    test_flush();
+    test_reply_length = ftell(hal_linux_tx_file);
+    fclose(hal_linux_tx_file);
+    hal_linux_tx_file = NULL;
+    return test_reply;
+}
+
+/* test_command( command line )
+ * Run one command line, the way process_pbuffer() would, and return its
+ * replies and log messages.
+ */
+static inline char *test_command( const char *line ) {
+    char cmdstr[RECEIVE_BUFFER_SIZE];
+    strncpy(cmdstr, line, sizeof(cmdstr) - 1);
+    cmdstr[sizeof(cmdstr) - 1] = '\0';
+    test_capture_start();
+    command_run(cmdstr);
+    return test_capture_end();
+}
+
+/* test_done( test name )
+ * Print the totals and return the exit status for main().
+ */
+static inline int test_done( const char *name ) {
+    printf("%s: %lu checks, %lu failed\n", name, test_checks,
+           test_failures);
+    return (test_failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // End the include guard
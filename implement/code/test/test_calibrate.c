@@ -0,0 +1,187 @@
+/* test_calibrate.c
+ *
+ * Sweeps every count through adc_calibrate() and adc_autocal() and
+ * checks them against a double-precision model of the same lines.  Also
+ * runs the vcalpt command against a made-up ADC input.
+ */
+
+// ----------------------- Include files ------------------------------
+/* math.h
+ * Provides floor() and fabs() for the model.
+ */
+#include <math.h>
+
+#include "bc_test.h"
+
+/* test_model( pointer to calibration, counts, extra bits )
+ * What adc_calibrate() should return, worked out in floating point:
+ * the exact product rounded half up, plus the offset, limited to the
+ * int16_t range.
+ */
+static int16_t test_model( adc_cal_t *cal_ptr, uint16_t counts,
+                           uint8_t bits ) {
+    double mv = floor(((double)counts * cal_ptr -> cal_slope /
+                       ldexp(1.0, (cal_ptr -> cal_qbits) + bits)) + 0.5) +
+                cal_ptr -> cal_offset;
+    if (mv > INT16_MAX) {
+        return INT16_MAX;
+    }
+    if (mv < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t)mv;
+}
+
+/* test_calibrate_sweep(void)
+ * Every count at every filter resolution matches the model exactly,
+ * for slopes, offsets and fraction bits from one end of their ranges
+ * to the other, including ones that run past the int16_t limits.
+ */
+static void test_calibrate_sweep(void) {
+    const uint16_t slopes[] = {0, 1, 2, 3, 79, 1000, 0x7fff, 0x8000, 0xffff};
+    const int16_t offsets[] = {INT16_MIN, -1000, -1, 0, 1, 1000, INT16_MAX};
+    adc_cal_t cal;
+    uint32_t counts;
+    uint32_t mismatches = 0;
+    uint8_t slope;
+    uint8_t offset;
+    uint8_t qbits;
+    uint8_t bits;
+    for (slope = 0; slope < (sizeof(slopes) / sizeof(slopes[0])); slope++) {
+        for (offset = 0; offset < (sizeof(offsets) / sizeof(offsets[0]));
+             offset++) {
+            for (qbits = 0; qbits <= ADC_CAL_MAXQBITS; qbits++) {
+                cal.cal_slope = slopes[slope];
+                cal.cal_offset = offsets[offset];
+                cal.cal_qbits = qbits;
+                for (bits = 0; bits <= ADC_FILTER_MAXBITS; bits++) {
+                    for (counts = 0; counts < (1024UL << bits); counts++) {
+                        if (adc_calibrate(&cal, counts, bits) !=
+                            test_model(&cal, counts, bits)) {
+                            mismatches++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    TEST_CHECK(mismatches == 0);
+}
+
+/* test_autocal_line( counts 1, mV 1, counts 2, mV 2, extra bits,
+ *                    pointer to worst error )
+ * Calibrate from two points, then check every count against the exact
+ * line through them.  Rounding the product and the offset costs up to
+ * 1 mV, and the slope's last fraction bit costs up to half a bit per
+ * count away from point 1.  Keeps the worst error seen.
+ */
+static void test_autocal_line( uint16_t counts1, uint16_t mv1,
+                               uint16_t counts2, uint16_t mv2, uint8_t bits,
+                               double *worst_ptr ) {
+    adc_cal_t cal = {1, 0, ADC_CAL_QBITS};
+    double exact;
+    double error;
+    double allowed;
+    uint32_t counts;
+    uint32_t outside = 0;
+    if (!TEST_CHECK(adc_autocal(&cal, counts1, mv1, counts2, mv2, bits) ==
+                    0)) {
+        return;
+    }
+    TEST_CHECK(adc_calibrate(&cal, counts1, bits) == mv1);
+    for (counts = 0; counts < (1024UL << bits); counts++) {
+        exact = mv1 + (((double)counts - counts1) * ((double)mv2 - mv1) /
+                       ((double)counts2 - counts1));
+        if ((exact > INT16_MAX) || (exact < INT16_MIN)) {
+            continue;
+        }
+        error = fabs(adc_calibrate(&cal, counts, bits) - exact);
+        allowed = 1.0 + (fabs((double)counts - counts1) * 0.5 /
+                         ldexp(1.0, cal.cal_qbits + bits));
+        if (error > (allowed + 1e-9)) {
+            outside++;
+        }
+        if (error > *worst_ptr) {
+            *worst_ptr = error;
+        }
+    }
+    TEST_CHECK(outside == 0);
+}
+
+/* test_autocal_sweep(void)
+ * Lines from the Butterfly's voltage reader, steep and shallow lines,
+ * and lines with big offsets, at every filter resolution.
+ */
+static void test_autocal_sweep(void) {
+    double worst = 0;
+    uint8_t bits;
+    for (bits = 0; bits <= ADC_FILTER_MAXBITS; bits++) {
+        // Roughly the voltage reader's divider
+        test_autocal_line(100 << bits, 300, 900 << bits, 2700, bits, &worst);
+        test_autocal_line(900 << bits, 2700, 100 << bits, 300, bits, &worst);
+        // Less than a mV per count
+        test_autocal_line(0, 0, 1023 << bits, 500, bits, &worst);
+        // Many mV per count, up to the top of the range
+        test_autocal_line(10 << bits, 1000, 20 << bits, INT16_MAX, bits,
+                          &worst);
+        // A big offset, with the line crossing zero
+        test_autocal_line(600 << bits, 10, 700 << bits, 3000, bits, &worst);
+        // Points one count apart
+        test_autocal_line(511 << bits, 1234, (511 << bits) + 1, 1240, bits,
+                          &worst);
+    }
+    TEST_CHECK(adc_autocal(&(adc_cal_t){1, 0, 4}, 5, 100, 5, 200, 0) == 1);
+    TEST_CHECK(adc_autocal(&(adc_cal_t){1, 0, 4}, 5, 200, 9, 100, 0) == 1);
+    // Point 1 scales to 119939 mV, so the offset can't fit in 16 bits
+    TEST_CHECK(adc_autocal(&(adc_cal_t){1, 0, 4}, 600, 10, 700, 20000, 0) ==
+               1);
+    printf("calibrate: worst autocal error %.3f mV\n", worst);
+}
+
+/* The counts returned by test_source()
+ */
+static uint16_t test_counts = 0;
+
+/* test_source( mux channel )
+ * The voltage reader reads test_counts.
+ */
+static uint16_t test_source( uint8_t channel ) {
+    return test_counts;
+}
+
+/* test_vcalpt(void)
+ * Two points set the calibration used by volt?.  Voltages adc_calibrate()
+ * can't return are refused, and don't spoil a point already recorded.
+ */
+static void test_vcalpt(void) {
+    adc_cal_t saved = volt_calfactor;
+    hal_linux_adc_source = &test_source;
+    test_counts = 200;
+    TEST_CHECK(strcmp(test_command("vcalpt 1 1000"), "") == 0);
+    TEST_CHECK(strstr(test_command("vcalpt 2 32768"), "more than 32767") !=
+               NULL);
+    TEST_CHECK(strstr(test_command("vcalpt 1 65535"), "more than 32767") !=
+               NULL);
+    test_counts = 600;
+    TEST_CHECK(strcmp(test_command("vcalpt 2 3000"), "") == 0);
+    test_counts = 400;
+    TEST_CHECK(strcmp(test_command("volt?"), "2000\r\n") == 0);
+    test_counts = 0;
+    TEST_CHECK(strcmp(test_command("volt?"), "0\r\n") == 0);
+
+    test_counts = 1;
+    TEST_CHECK(strcmp(test_command("vcalpt 1 0"), "") == 0);
+    test_counts = 2;
+    TEST_CHECK(strcmp(test_command("vcalpt 2 32767"), "") == 0);
+    TEST_CHECK(strcmp(test_command("volt?"), "32767\r\n") == 0);
+    hal_linux_adc_source = NULL;
+    volt_calfactor = saved;
+}
+
+int main(void) {
+    test_init();
+    test_calibrate_sweep();
+    test_autocal_sweep();
+    test_vcalpt();
+    return test_done("calibrate");
+}
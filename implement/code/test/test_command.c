@@ -0,0 +1,221 @@
+/* test_command.c
+ *
+ * Tests the command table lookup, the argument parser, and batches and
+ * the status of each command in them.
+ */
+
+// ----------------------- Include files ------------------------------
+#include "bc_test.h"
+
+/* test_table_order(void)
+ * The binary search depends on the table being in strcmp() order.
+ */
+static void test_table_order(void) {
+    uint8_t index;
+    for (index = 1; index < command_count; index++) {
+        TEST_CHECK(strcmp(command_array[index - 1].name,
+                          command_array[index].name) < 0);
+    }
+}
+
+/* test_find_all(void)
+ * Every command is found in the whole table, and in every smaller table
+ * that holds it.
+ */
+static void test_find_all(void) {
+    command_t command;
+    char name[COMMAND_NAME_SIZE];
+    uint8_t index;
+    uint8_t count;
+    for (index = 0; index < command_count; index++) {
+        strcpy(name, command_array[index].name);
+        TEST_CHECK(command_find(name, &command) == 0);
+        TEST_CHECK(strcmp(command.name, name) == 0);
+        for (count = 0; count <= command_count; count++) {
+            TEST_CHECK(command_search(name, count) ==
+                       ((index < count) ? index : count));
+        }
+    }
+}
+
+/* test_find_missing(void)
+ * Names next to each command, and names with characters far from any
+ * in the table, aren't found unless they're another command.  The
+ * characters from 0x80 up differ from the letters by more than an
+ * int8_t holds.
+ */
+static void test_find_missing(void) {
+    command_t command;
+    char name[COMMAND_NAME_SIZE + 1];
+    size_t length;
+    uint8_t index;
+    uint16_t high;
+    for (index = 0; index < command_count; index++) {
+        strcpy(name, command_array[index].name);
+        strcat(name, "x");
+        TEST_CHECK(command_find(name, &command) == 1);
+        length = strlen(command_array[index].name);
+        name[length - 1] = '\0';
+        if (command_find(name, &command) == 0) {
+            // Some commands are the start of others, like scan and scan?
+            TEST_CHECK(strcmp(command.name, name) == 0);
+        }
+    }
+    TEST_CHECK(command_find("", &command) == 1);
+    for (high = 0x80; high <= 0xff; high++) {
+        name[0] = (char)high;
+        strcpy(&name[1], "elp");
+        TEST_CHECK(command_find(name, &command) == 1);
+        strcpy(name, "help");
+        name[3] = (char)high;
+        TEST_CHECK(command_find(name, &command) == 1);
+    }
+}
+
+/* test_parse( argument types, argument string, pointer to parsed
+ *             arguments )
+ * Parse a copy of the argument string against a made-up command.  The
+ * copy stays put, so string arguments can be checked afterwards.
+ */
+static uint8_t test_parse( const arg_type_t *types, const char *argument,
+                           command_arg_t *argv ) {
+    static char argstr[RECEIVE_BUFFER_SIZE];
+    command_t command;
+    strcpy(command.name, "test");
+    memcpy(command.arg_type, types, sizeof(command.arg_type));
+    strcpy(argstr, argument);
+    return command_parse_args(&command, argstr, argv);
+}
+
+/* test_parse_args(void)
+ * Each type parses, quoted words can hold spaces and separators, and bad
+ * words, bad quotes and the wrong number of words are refused.
+ */
+static void test_parse_args(void) {
+    const arg_type_t numbers[COMMAND_MAX_ARGS] =
+        {arg_type_HEX, arg_type_DEC, arg_type_SIGNED};
+    const arg_type_t longs[COMMAND_MAX_ARGS] =
+        {arg_type_HEX32, arg_type_DEC32, arg_type_NONE};
+    const arg_type_t strings[COMMAND_MAX_ARGS] =
+        {arg_type_STRING, arg_type_STRING, arg_type_HEX};
+    command_arg_t argv[COMMAND_MAX_ARGS];
+    test_capture_start();
+    TEST_CHECK(test_parse(numbers, "7e 65535 -32768", argv) == 0);
+    TEST_CHECK((argv[0].u16 == 0x7e) && (argv[1].u16 == 65535) &&
+               (argv[2].s16 == -32768));
+    TEST_CHECK(test_parse(numbers, "\"7e\"   1 \"-2\"", argv) == 0);
+    TEST_CHECK((argv[0].u16 == 0x7e) && (argv[1].u16 == 1) &&
+               (argv[2].s16 == -2));
+    TEST_CHECK(test_parse(longs, "ffffffff 4294967295", argv) == 0);
+    TEST_CHECK((argv[0].u32 == 0xffffffffUL) &&
+               (argv[1].u32 == 4294967295UL));
+    TEST_CHECK(test_parse(strings, "one \"two; three\" 3", argv) == 0);
+    TEST_CHECK(strcmp(argv[0].str, "one") == 0);
+    TEST_CHECK(strcmp(argv[1].str, "two; three") == 0);
+    TEST_CHECK(argv[2].u16 == 3);
+    TEST_CHECK(test_parse(strings, "\"\" \" \" 0", argv) == 0);
+    TEST_CHECK((argv[0].str[0] == '\0') && (strcmp(argv[1].str, " ") == 0));
+    test_capture_end();
+    TEST_CHECK(test_reply[0] == '\0');
+
+    test_capture_start();
+    TEST_CHECK(test_parse(numbers, "7g 1 1", argv) == 1);
+    TEST_CHECK(test_parse(numbers, "1 65536 1", argv) == 1);
+    TEST_CHECK(test_parse(numbers, "1 1 32768", argv) == 1);
+    TEST_CHECK(test_parse(numbers, "1 1", argv) == 1);
+    TEST_CHECK(test_parse(numbers, "1 1 1 1", argv) == 1);
+    TEST_CHECK(test_parse(numbers, "\"\" 1 1", argv) == 1);
+    TEST_CHECK(test_parse(strings, "\"one two", argv) == 1);
+    TEST_CHECK(test_parse(strings, "\"one\"two x 1", argv) == 1);
+    test_capture_end();
+    TEST_CHECK(strstr(test_reply, "bad digit") != NULL);
+    TEST_CHECK(strstr(test_reply, "out of range") != NULL);
+    TEST_CHECK(strstr(test_reply, "missing argument 3") != NULL);
+    TEST_CHECK(strstr(test_reply, "Too many arguments") != NULL);
+    TEST_CHECK(strstr(test_reply, "is empty") != NULL);
+    TEST_CHECK(strstr(test_reply, "bad quote") != NULL);
+}
+
+/* test_batch( line )
+ * Run a line through the parse queue and return the replies.
+ */
+static char *test_batch( const char *line ) {
+    strcpy(recv_cmd_state_ptr -> pbuffer[(recv_cmd_state_ptr -> pbuffer_head) &
+           (RECEIVE_QUEUE_SLOTS - 1)], line);
+    (recv_cmd_state_ptr -> pbuffer_head)++;
+    test_capture_start();
+    process_pbuffer(recv_cmd_state_ptr);
+    return test_capture_end();
+}
+
+/* test_batches(void)
+ * Separators split a line into a batch, except inside quotes.
+ */
+static void test_batches(void) {
+    char *reply;
+    reply = test_batch(" logreg? ; ;logreg?;");
+    TEST_CHECK(strncmp(reply, "batch 2\r\n", 9) == 0);
+    TEST_CHECK(strstr(reply, "ok 2\r\nend 2\r\n") != NULL);
+    reply = test_batch("logreg? \"a;b\"");
+    TEST_CHECK(strstr(reply, "batch") == NULL);
+    TEST_CHECK(strstr(reply, "Too many arguments") != NULL);
+    reply = test_batch("logreg?;logreg \"ff;\";logreg?");
+    TEST_CHECK(strncmp(reply, "batch 3\r\n", 9) == 0);
+    TEST_CHECK(strstr(reply, "err 2 badarg") != NULL);
+    TEST_CHECK(strstr(reply, "end 3\r\n") != NULL);
+}
+
+/* test_batch_status(void)
+ * Commands that refuse their values are reported as failed, and the
+ * rest of the batch still runs.
+ */
+static void test_batch_status(void) {
+    char *reply;
+    reply = test_batch("txpolicy 9;txpolicy 0");
+    TEST_CHECK(strstr(reply, "err 1 failed\r\n") != NULL);
+    TEST_CHECK(strstr(reply, "ok 2\r\n") != NULL);
+    reply = test_batch("vcalpt 3 1;baud 1234;loglevel 9");
+    TEST_CHECK(strstr(reply, "err 1 failed\r\n") != NULL);
+    TEST_CHECK(strstr(reply, "err 2 failed\r\n") != NULL);
+    TEST_CHECK(strstr(reply, "err 3 failed\r\n") != NULL);
+    reply = test_batch("txpolicy 0;stream 0 0;scan 0");
+    TEST_CHECK(strstr(reply, "ok 1\r\nok 2\r\n") != NULL);
+    TEST_CHECK(strstr(reply, "ok 3\r\nend 3\r\n") != NULL);
+}
+
+/* test_baud(void)
+ * The replies to a line with "baud" in it go out at the old rate, and
+ * the switch is made by usart_baud_poll() afterwards.  A command at the
+ * new rate keeps it.
+ */
+static void test_baud(void) {
+    uint16_t setting = hal_linux_uart_setting;
+    char *reply;
+    reply = test_batch("baud 19200;txpolicy 0");
+    TEST_CHECK(strcmp(reply, "batch 2\r\nok 1\r\nok 2\r\nend 2\r\n") == 0);
+    TEST_CHECK(hal_linux_uart_setting == setting);
+    TEST_CHECK(strncmp(test_command("baud?"), "9600 ", 5) == 0);
+    test_capture_start();
+    usart_baud_poll();
+    test_capture_end();
+    TEST_CHECK(test_reply_length == 0);
+    TEST_CHECK(hal_linux_uart_setting != setting);
+    TEST_CHECK(strncmp(test_command("baud?"), "19200 ", 6) == 0);
+    reply = test_batch("baud 9600;baud 9600");
+    TEST_CHECK(strstr(reply, "end 2\r\n") != NULL);
+    TEST_CHECK(strncmp(test_command("baud?"), "19200 ", 6) == 0);
+    usart_baud_poll();
+    TEST_CHECK(strncmp(test_command("baud?"), "9600 ", 5) == 0);
+}
+
+int main(void) {
+    test_init();
+    test_table_order();
+    test_find_all();
+    test_find_missing();
+    test_parse_args();
+    test_batches();
+    test_batch_status();
+    test_baud();
+    return test_done("command");
+}
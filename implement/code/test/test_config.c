@@ -0,0 +1,147 @@
+/* test_config.c
+ *
+ * Tests the configuration store: saves that lose power partway through,
+ * falling back to the slot before, and sequence numbers that wrap.
+ */
+
+// ----------------------- Include files ------------------------------
+#include "bc_test.h"
+
+/* bc_config.h
+ * The store under test.
+ */
+#include "bc_config.h"
+
+/* The store's state inside bc_config.c
+ */
+extern config_state_t *config_state_ptr;
+
+/* test_save( voltage slope )
+ * Save the settings with a slope that marks which save this was.
+ * Returns what config_save() returned.
+ */
+static uint8_t test_save( uint16_t slope ) {
+    volt_calfactor.cal_slope = slope;
+    return config_save();
+}
+
+/* test_boot(void)
+ * Forget the settings and the store state, the way a reset does, then
+ * load the newest valid slot.  Returns the slope it held, or 0 if
+ * nothing valid was found.
+ */
+static uint16_t test_boot(void) {
+    volt_calfactor.cal_slope = 0;
+    config_state_ptr -> slot = CONFIG_SLOTS;
+    config_state_ptr -> sequence = 0;
+    if (config_load() != 0) {
+        return 0;
+    }
+    return volt_calfactor.cal_slope;
+}
+
+/* test_torn_save(void)
+ * Cut the power after every possible number of bytes of the third
+ * save.  Booting then finds either the whole third save or the second
+ * one, never a mix and never nothing.  A save that loses power reports
+ * that it failed.
+ */
+static void test_torn_save(void) {
+    int16_t budget;
+    uint8_t torn = 0;
+    for (budget = 0; budget <= (int16_t)sizeof(config_slot_t); budget++) {
+        hal_linux_eeprom_erase();
+        config_state_ptr -> slot = CONFIG_SLOTS;
+        TEST_CHECK(test_save(10) == 0);
+        TEST_CHECK(test_save(20) == 0);
+        hal_linux_eeprom_budget = budget;
+        if (test_save(30) != 0) {
+            hal_linux_eeprom_budget = -1;
+            torn++;
+            TEST_CHECK(test_boot() == 20);
+            TEST_CHECK(config_state_ptr -> slot == 1);
+            TEST_CHECK(config_state_ptr -> sequence == 1);
+            // The next save goes back over the torn slot
+            TEST_CHECK(test_save(40) == 0);
+            TEST_CHECK(config_state_ptr -> slot == 2);
+            TEST_CHECK(test_boot() == 40);
+        }
+        else {
+            hal_linux_eeprom_budget = -1;
+            TEST_CHECK(test_boot() == 30);
+            TEST_CHECK(config_state_ptr -> slot == 2);
+        }
+    }
+    // Small budgets tear the save, and big enough ones finish it
+    TEST_CHECK(torn > 0);
+    TEST_CHECK(torn < (sizeof(config_slot_t) + 1));
+}
+
+/* test_torn_fallback(void)
+ * A torn slot that is newest by sequence number is skipped, and so is
+ * every other bad slot, until one passes its CRC.  The save command
+ * then carries on from the slot that was loaded.
+ */
+static void test_torn_fallback(void) {
+    const uint8_t garbage = 0x5a;
+    uint8_t save;
+    hal_linux_eeprom_erase();
+    config_state_ptr -> slot = CONFIG_SLOTS;
+    for (save = 1; save <= 4; save++) {
+        TEST_CHECK(test_save(save * 100) == 0);
+    }
+    // Tear the fifth save right after its sequence number
+    hal_linux_eeprom_budget = sizeof(uint16_t);
+    TEST_CHECK(test_save(500) != 0);
+    hal_linux_eeprom_budget = -1;
+    TEST_CHECK(test_boot() == 400);
+    TEST_CHECK(config_state_ptr -> slot == 3);
+
+    // Spoil the fourth save too
+    eeprom_update_block(&garbage, &(CONFIG_SLOT_ADDRESS(3) -> config), 1);
+    TEST_CHECK(test_boot() == 300);
+    TEST_CHECK(config_state_ptr -> slot == 2);
+    TEST_CHECK(strcmp(test_command("save"), "") == 0);
+    TEST_CHECK(config_state_ptr -> slot == 3);
+    TEST_CHECK(test_boot() == 300);
+    TEST_CHECK(config_state_ptr -> sequence == 3);
+
+    hal_linux_eeprom_erase();
+    TEST_CHECK(test_boot() == 0);
+    TEST_CHECK(strstr(test_command("load"), "No saved") != NULL);
+}
+
+/* test_wrap(void)
+ * Saves on either side of the sequence number wrapping are still loaded
+ * newest first, across more saves than there are slots.
+ */
+static void test_wrap(void) {
+    uint16_t save;
+    uint16_t last = CONFIG_SLOTS + 3;
+    hal_linux_eeprom_erase();
+    // Carry on as if slot 0 held save number 0xfffa
+    config_state_ptr -> slot = 0;
+    config_state_ptr -> sequence = 0xfffa;
+    for (save = 1; save <= last; save++) {
+        TEST_CHECK(test_save(save) == 0);
+        TEST_CHECK(test_boot() == save);
+        TEST_CHECK(config_state_ptr -> sequence == (uint16_t)(0xfffa + save));
+    }
+    TEST_CHECK(config_state_ptr -> sequence == (uint16_t)(0xfffa + last));
+
+    // A torn save just past the wrap falls back to the slot before
+    hal_linux_eeprom_budget = 4;
+    TEST_CHECK(test_save(99) != 0);
+    hal_linux_eeprom_budget = -1;
+    TEST_CHECK(test_boot() == last);
+    TEST_CHECK(config_state_ptr -> sequence == (uint16_t)(0xfffa + last));
+}
+
+int main(void) {
+    test_init();
+    test_torn_save();
+    test_torn_fallback();
+    test_wrap();
+    hal_linux_eeprom_erase();
+    return test_done("config");
+}
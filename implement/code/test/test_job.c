@@ -0,0 +1,147 @@
+/* test_job.c
+ *
+ * Tests jobs through vavg and help: every line a job sends carries its
+ * ID, the completion message comes last, and job? tells running,
+ * finished and never issued IDs apart.
+ */
+
+// ----------------------- Include files ------------------------------
+#include "bc_test.h"
+
+/* bc_job.h
+ * Provides job_run() for stepping the jobs.
+ */
+#include "bc_job.h"
+
+/* Define the most job task passes a test waits for its jobs
+ */
+#define TEST_JOB_PASSES 10000
+
+/* The job state inside bc_job.c
+ */
+extern job_state_t *job_state_ptr;
+
+/* The text sent while test_stream_start() is in effect
+ */
+static char *test_stream = NULL;
+static size_t test_stream_size = 0;
+
+/* test_stream_start(void)
+ * Catch everything the USART sends, however long, until
+ * test_stream_end().  The help is longer than test_reply.
+ */
+static void test_stream_start(void) {
+    test_flush();
+    hal_linux_tx_file = open_memstream(&test_stream, &test_stream_size);
+}
+
+/* test_stream_end(void)
+ * Stop catching and return what was sent.  Free it when done.
+ */
+static char *test_stream_end(void) {
+    test_flush();
+    fclose(hal_linux_tx_file);
+    hal_linux_tx_file = NULL;
+    return test_stream;
+}
+
+/* test_finish(void)
+ * Run the job task until every slot is free, and return everything the
+ * jobs sent.  Free it when done.
+ */
+static char *test_finish(void) {
+    uint16_t pass;
+    uint8_t slot;
+    uint8_t busy = 1;
+    test_stream_start();
+    for (pass = 0; busy && (pass < TEST_JOB_PASSES); pass++) {
+        job_run();
+        hal_wait();
+        busy = 0;
+        for (slot = 0; slot < JOB_SLOTS; slot++) {
+            busy |= (job_state_ptr -> slot[slot].id != 0);
+        }
+    }
+    TEST_CHECK(!busy);
+    return test_stream_end();
+}
+
+/* test_vavg(void)
+ * vavg sends its ID, job? reports progress until it finishes, and the
+ * result comes on the completion line.
+ */
+static void test_vavg(void) {
+    char *sent;
+    TEST_CHECK(strcmp(test_command("job? 1"), "unknown\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("vavg 4"), "job 0x1\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("job? 1"), "0x0 0x4\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("job? 2"), "unknown\r\n") == 0);
+    sent = test_finish();
+    TEST_CHECK(strncmp(sent, "done 0x1 ", 9) == 0);
+    TEST_CHECK(strchr(sent, '\n') == (sent + strlen(sent) - 1));
+    free(sent);
+    TEST_CHECK(strcmp(test_command("job? 1"), "done\r\n") == 0);
+}
+
+/* test_help(void)
+ * Every help line starts with the job's ID, each command's entry is
+ * there in table order, and "done 0x<id>" is the last line.
+ */
+static void test_help(void) {
+    const char *tag = "0x2 ";
+    char entry[32];
+    char *sent;
+    char *line;
+    char *end;
+    uint8_t index = 0;
+    uint8_t lines = 0;
+    TEST_CHECK(strcmp(test_command("help"), "job 0x2\r\n") == 0);
+    sent = test_finish();
+    line = sent;
+    while ((end = strstr(line, "\r\n")) != NULL) {
+        if (strncmp(line, "done 0x2\r\n", 10) == 0) {
+            break;
+        }
+        TEST_CHECK(strncmp(line, tag, strlen(tag)) == 0);
+        if (index < command_count) {
+            snprintf(entry, sizeof(entry), "%s%s -- ", tag,
+                     command_array[index].name);
+            if (strncmp(line, entry, strlen(entry)) == 0) {
+                index++;
+            }
+        }
+        lines++;
+        line = end + 2;
+    }
+    TEST_CHECK(index == command_count);
+    TEST_CHECK(lines > command_count);
+    TEST_CHECK(strcmp(line, "done 0x2\r\n") == 0);
+    free(sent);
+}
+
+/* test_wrap(void)
+ * IDs skip 0 when they wrap, and once they have, every ID has been
+ * given out.
+ */
+static void test_wrap(void) {
+    char *sent;
+    job_state_ptr -> last_id = 0xfe;
+    TEST_CHECK(strcmp(test_command("job? ff"), "unknown\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("job? 100"), "unknown\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("vavg 1"), "job 0xff\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("vavg 1"), "job 0x1\r\n") == 0);
+    sent = test_finish();
+    TEST_CHECK(strstr(sent, "done 0xff ") != NULL);
+    TEST_CHECK(strstr(sent, "done 0x1 ") != NULL);
+    free(sent);
+    TEST_CHECK(strcmp(test_command("job? 80"), "done\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("job? 0"), "unknown\r\n") == 0);
+}
+
+int main(void) {
+    test_init();
+    test_vavg();
+    test_help();
+    test_wrap();
+    return test_done("job");
+}
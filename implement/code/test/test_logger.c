@@ -0,0 +1,127 @@
+/* test_logger.c
+ *
+ * Tests the binary log frames, including messages whose arguments
+ * don't fit in one frame.
+ */
+
+// ----------------------- Include files ------------------------------
+/* unistd.h
+ * Provides usleep() for letting the clock run.
+ */
+#include <unistd.h>
+
+#include "bc_test.h"
+
+/* Define a string long enough to fill a frame by itself
+ */
+#define TEST_LONG_STRING \
+    "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef" \
+    "0123456789abcdef"
+
+/* test_frame_check(void)
+ * Check that the caught output is one well-formed frame no longer than
+ * the logger's buffer.  Returns the number of argument bytes.
+ */
+static int test_frame_check(void) {
+    uint8_t *frame = (uint8_t *)test_reply;
+    uint8_t checksum = 0;
+    long count;
+    if (!TEST_CHECK(test_reply_length >= (LOGGER_FRAME_HEADER + 1))) {
+        return 0;
+    }
+    TEST_CHECK(frame[0] == LOGGER_FRAME_SYNC);
+    TEST_CHECK(frame[1] == (test_reply_length - 2));
+    TEST_CHECK(test_reply_length <= LOGGER_BUFFERSIZE);
+    for (count = 2; count < (test_reply_length - 1); count++) {
+        checksum += frame[count];
+    }
+    TEST_CHECK(checksum == frame[test_reply_length - 1]);
+    return test_reply_length - LOGGER_FRAME_HEADER - 1;
+}
+
+/* test_frame_args(void)
+ * Integers go in low byte first and strings with their terminators.
+ */
+static void test_frame_args(void) {
+    const uint8_t expected[] = {0x34, 0x12, 'a', 'b', '\0',
+                                0x78, 0x56, 0x34, 0x12};
+    test_capture_start();
+    logger_msg_p(log_system_LOGGER,log_level_ERROR,PSTR("%x %s %lx"),
+                 0x1234,"ab",0x12345678UL);
+    test_capture_end();
+    TEST_CHECK(test_frame_check() == sizeof(expected));
+    TEST_CHECK(memcmp(&test_reply[LOGGER_FRAME_HEADER], expected,
+                      sizeof(expected)) == 0);
+}
+
+/* test_frame_full(void)
+ * Strings and integers after the frame fills up are left off, and the
+ * checksum still lands inside the buffer.
+ */
+static void test_frame_full(void) {
+    int length;
+    test_capture_start();
+    logger_msg_p(log_system_LOGGER,log_level_ERROR,
+                 PSTR("%s %s %s %S %s %S %lu %u %s"),
+                 TEST_LONG_STRING,"a","b",PSTR("c"),"d",PSTR("e"),
+                 1UL,2,"f");
+    test_capture_end();
+    length = test_frame_check();
+    TEST_CHECK(length == (LOGGER_BUFFERSIZE - 5 - LOGGER_FRAME_HEADER));
+    TEST_CHECK(memchr(&test_reply[LOGGER_FRAME_HEADER], '\0', length) ==
+               NULL);
+
+    test_capture_start();
+    logger_msg_p(log_system_LOGGER,log_level_ERROR,
+                 PSTR("%s %lu %lu %lu %lu"),
+                 &TEST_LONG_STRING[20],1UL,2UL,3UL,4UL);
+    test_capture_end();
+    length = test_frame_check();
+    TEST_CHECK(length <= (LOGGER_BUFFERSIZE - 2 - LOGGER_FRAME_HEADER));
+}
+
+/* test_frame_deferred(void)
+ * A message stored by an interrupt is stamped with the time it was
+ * stored, not the time logger_drain() sends it.
+ */
+static void test_frame_deferred(void) {
+    uint8_t *frame = (uint8_t *)test_reply;
+    uint32_t stored;
+    uint32_t stamp;
+    test_capture_start();
+    cli();
+    stored = clock_now();
+    logger_isr_p(log_system_LOGGER,log_level_ERROR,PSTR("%x"),0x1234,0);
+    sei();
+    usleep(100000);
+    test_capture_end();
+    TEST_CHECK(test_frame_check() == 2);
+    stamp = frame[6] | ((uint32_t)frame[7] << 8) |
+            ((uint32_t)frame[8] << 16) | ((uint32_t)frame[9] << 24);
+    TEST_CHECK((stamp - stored) < CLOCK_MS_TICKS(10));
+    TEST_CHECK((clock_now() - stamp) >= CLOCK_MS_TICKS(100));
+}
+
+/* test_timing(void)
+ * Command times are only logged once their system is turned on.
+ */
+static void test_timing(void) {
+    log_config_t saved = logger_config;
+    logger_config.loglevel = log_level_INFO;
+    TEST_CHECK(strstr(test_command("hello"), "took") == NULL);
+    logger_config.enable |= (1 << log_system_TIMING);
+    TEST_CHECK(strstr(test_command("hello"), "(timing) 'hello' took") !=
+               NULL);
+    logger_config = saved;
+}
+
+int main(void) {
+    test_init();
+    test_timing();
+    test_command("logmode 1");
+    test_frame_args();
+    test_frame_full();
+    test_frame_deferred();
+    test_command("logmode 0");
+    return test_done("logger");
+}
@@ -0,0 +1,294 @@
+/* test_numbers.c
+ *
+ * Tests the number parsers and the USART number formatters against the
+ * C library.  Every 16-bit value goes through each of them, and a
+ * spread of 32-bit values goes through the 32-bit ones.
+ */
+
+// ----------------------- Include files ------------------------------
+#include "bc_test.h"
+
+/* bc_numbers.h
+ * The parsers under test.
+ */
+#include "bc_numbers.h"
+
+/* Define the number of made-up 32-bit values formatted, on top of the
+ * powers of two and ten
+ */
+#define TEST_RANDOM_LONGS 100000UL
+
+/* The text sent while test_stream_start() is in effect
+ */
+static char *test_stream = NULL;
+static size_t test_stream_size = 0;
+
+/* test_stream_start(void)
+ * Catch everything the USART sends, however long, until
+ * test_stream_end().
+ */
+static void test_stream_start(void) {
+    test_flush();
+    hal_linux_tx_file = open_memstream(&test_stream, &test_stream_size);
+}
+
+/* test_stream_end(void)
+ * Stop catching and return what was sent.  Free it when done.
+ */
+static char *test_stream_end(void) {
+    test_flush();
+    fclose(hal_linux_tx_file);
+    hal_linux_tx_file = NULL;
+    return test_stream;
+}
+
+/* test_next_long( pointer to state )
+ * A linear congruential generator, so the made-up values are the same
+ * on every run.
+ */
+static uint32_t test_next_long( uint32_t *state_ptr ) {
+    *state_ptr = (*state_ptr * 1664525UL) + 1013904223UL;
+    return *state_ptr;
+}
+
+/* test_format_16(void)
+ * Every 16-bit value comes out the same as %x, %u and %d.
+ */
+static void test_format_16(void) {
+    char expected[32];
+    char *sent;
+    char *line;
+    uint32_t value;
+    uint32_t wrong = 0;
+    test_stream_start();
+    for (value = 0; value <= 0xffff; value++) {
+        usart_put_hex16((uint16_t)value);
+        usart_putc(' ');
+        usart_put_u16((uint16_t)value);
+        usart_putc(' ');
+        usart_put_s16((int16_t)value);
+        usart_putc('\n');
+    }
+    sent = test_stream_end();
+    line = sent;
+    for (value = 0; value <= 0xffff; value++) {
+        sprintf(expected, "%x %u %d\n", (unsigned)value, (unsigned)value,
+                (int)(int16_t)value);
+        if (strncmp(line, expected, strlen(expected)) != 0) {
+            wrong++;
+        }
+        line = strchr(line, '\n') + 1;
+    }
+    TEST_CHECK(wrong == 0);
+    TEST_CHECK(*line == '\0');
+    free(sent);
+}
+
+/* test_format_32(void)
+ * 32-bit values around every power of two and ten, and a spread of
+ * made-up ones, come out the same as %lx, %lu and %ld.
+ */
+static void test_format_32(void) {
+    static uint32_t values[3 * (32 + 10) + TEST_RANDOM_LONGS];
+    char expected[48];
+    char *sent;
+    char *line;
+    uint32_t count = 0;
+    uint32_t power = 1;
+    uint32_t state = 1;
+    uint32_t index;
+    uint32_t wrong = 0;
+    uint8_t shift;
+    for (shift = 0; shift < 32; shift++) {
+        values[count++] = ((uint32_t)1 << shift) - 1;
+        values[count++] = (uint32_t)1 << shift;
+        values[count++] = ((uint32_t)1 << shift) + 1;
+    }
+    for (shift = 0; shift < 10; shift++) {
+        values[count++] = power - 1;
+        values[count++] = power;
+        values[count++] = power + 1;
+        power *= 10;
+    }
+    while (count < (sizeof(values) / sizeof(values[0]))) {
+        values[count++] = test_next_long(&state);
+    }
+    test_stream_start();
+    for (index = 0; index < count; index++) {
+        usart_put_hex32(values[index]);
+        usart_putc(' ');
+        usart_put_u32(values[index]);
+        usart_putc(' ');
+        usart_put_s32((int32_t)values[index]);
+        usart_putc('\n');
+    }
+    sent = test_stream_end();
+    line = sent;
+    for (index = 0; index < count; index++) {
+        sprintf(expected, "%lx %lu %ld\n", (unsigned long)values[index],
+                (unsigned long)values[index], (long)(int32_t)values[index]);
+        if (strncmp(line, expected, strlen(expected)) != 0) {
+            wrong++;
+        }
+        line = strchr(line, '\n') + 1;
+    }
+    TEST_CHECK(wrong == 0);
+    TEST_CHECK(*line == '\0');
+    free(sent);
+}
+
+/* test_parse_16(void)
+ * Every 16-bit value parses back from %x, %X, %04x and %u, and the
+ * signed parser takes every int16_t value from %d and with a plus sign.
+ */
+static void test_parse_16(void) {
+    char text[16];
+    uint32_t value;
+    uint32_t parsed;
+    int16_t signed_value;
+    uint32_t wrong = 0;
+    for (value = 0; value <= 0xffff; value++) {
+        sprintf(text, "%x", (unsigned)value);
+        wrong += (parse_hex(text, &parsed, 0xffff) != number_status_OK) ||
+                 (parsed != value);
+        sprintf(text, "%X", (unsigned)value);
+        wrong += (parse_hex(text, &parsed, 0xffff) != number_status_OK) ||
+                 (parsed != value);
+        sprintf(text, "%04x", (unsigned)value);
+        wrong += (parse_hex(text, &parsed, 0xffff) != number_status_OK) ||
+                 (parsed != value);
+        sprintf(text, "%u", (unsigned)value);
+        wrong += (parse_dec(text, &parsed, 0xffff) != number_status_OK) ||
+                 (parsed != value);
+        sprintf(text, "%d", (int)(int16_t)value);
+        wrong += (parse_signed(text, &signed_value) != number_status_OK) ||
+                 (signed_value != (int16_t)value);
+        if ((int16_t)value >= 0) {
+            sprintf(text, "+%d", (int)(int16_t)value);
+            wrong += (parse_signed(text, &signed_value) != number_status_OK) ||
+                     (signed_value != (int16_t)value);
+        }
+    }
+    TEST_CHECK(wrong == 0);
+}
+
+/* test_parse_limit( largest allowed value )
+ * Each value up to 16 times the limit is refused exactly when it's over
+ * the limit.  Returns the number of wrong answers.
+ */
+static uint32_t test_parse_limit( uint32_t maxval ) {
+    char text[16];
+    uint32_t value;
+    uint32_t parsed;
+    uint32_t wrong = 0;
+    for (value = 0; value <= ((maxval * 16) + 16); value++) {
+        sprintf(text, "%lx", (unsigned long)value);
+        wrong += parse_hex(text, &parsed, maxval) !=
+                 ((value <= maxval) ? number_status_OK :
+                                      number_status_OVERFLOW);
+        sprintf(text, "%lu", (unsigned long)value);
+        wrong += parse_dec(text, &parsed, maxval) !=
+                 ((value <= maxval) ? number_status_OK :
+                                      number_status_OVERFLOW);
+    }
+    return wrong;
+}
+
+/* test_parse_limits(void)
+ * Every limit up to 300, and the limits on either side of the powers of
+ * ten and sixteen and the top of 16 bits.  Then the 32-bit and signed
+ * edges.
+ */
+static void test_parse_limits(void) {
+    const uint32_t limits[] = {999, 1000, 1001, 4095, 4096, 4097, 9999,
+                               10000, 10001, 65534, 65535};
+    uint32_t maxval;
+    uint32_t parsed;
+    int16_t signed_value;
+    uint32_t wrong = 0;
+    uint8_t index;
+    for (maxval = 0; maxval <= 300; maxval++) {
+        wrong += test_parse_limit(maxval);
+    }
+    for (index = 0; index < (sizeof(limits) / sizeof(limits[0])); index++) {
+        wrong += test_parse_limit(limits[index]);
+    }
+    TEST_CHECK(wrong == 0);
+
+    TEST_CHECK((parse_hex("ffffffff", &parsed, 0xffffffffUL) ==
+                number_status_OK) && (parsed == 0xffffffffUL));
+    TEST_CHECK(parse_hex("100000000", &parsed, 0xffffffffUL) ==
+               number_status_OVERFLOW);
+    TEST_CHECK((parse_dec("4294967295", &parsed, 0xffffffffUL) ==
+                number_status_OK) && (parsed == 0xffffffffUL));
+    TEST_CHECK(parse_dec("4294967296", &parsed, 0xffffffffUL) ==
+               number_status_OVERFLOW);
+    TEST_CHECK(parse_dec("99999999999", &parsed, 0xffffffffUL) ==
+               number_status_OVERFLOW);
+    TEST_CHECK((parse_dec("0000000000004294967295", &parsed, 0xffffffffUL) ==
+                number_status_OK) && (parsed == 0xffffffffUL));
+    TEST_CHECK(parse_signed("32768", &signed_value) ==
+               number_status_OVERFLOW);
+    TEST_CHECK(parse_signed("-32769", &signed_value) ==
+               number_status_OVERFLOW);
+    TEST_CHECK(parse_signed("+32768", &signed_value) ==
+               number_status_OVERFLOW);
+}
+
+/* test_parse_bad(void)
+ * Empty strings, and every character that isn't a digit in the radix,
+ * alone, first or last, are refused without touching the result.
+ */
+static void test_parse_bad(void) {
+    char text[4];
+    uint32_t parsed = 12345;
+    int16_t signed_value = 123;
+    uint16_t character;
+    uint8_t hex;
+    uint8_t dec;
+    uint32_t wrong = 0;
+    TEST_CHECK(parse_hex("", &parsed, 0xffff) == number_status_EMPTY);
+    TEST_CHECK(parse_dec("", &parsed, 0xffff) == number_status_EMPTY);
+    TEST_CHECK(parse_signed("", &signed_value) == number_status_EMPTY);
+    TEST_CHECK(parse_signed("-", &signed_value) == number_status_EMPTY);
+    TEST_CHECK(parse_signed("+", &signed_value) == number_status_EMPTY);
+    TEST_CHECK(parse_signed("--1", &signed_value) == number_status_INVALID);
+    TEST_CHECK(parse_signed("+-1", &signed_value) == number_status_INVALID);
+    for (character = 1; character <= 0xff; character++) {
+        dec = (character >= '0') && (character <= '9');
+        hex = dec || ((character >= 'a') && (character <= 'f')) ||
+              ((character >= 'A') && (character <= 'F'));
+        text[0] = (char)character;
+        text[1] = '\0';
+        wrong += (parse_hex(text, &parsed, 0xffff) == number_status_OK) != hex;
+        wrong += (parse_dec(text, &parsed, 0xffff) == number_status_OK) != dec;
+        if (hex) {
+            continue;
+        }
+        text[0] = '1';
+        text[1] = (char)character;
+        text[2] = '\0';
+        wrong += parse_hex(text, &parsed, 0xffff) != number_status_INVALID;
+        wrong += parse_dec(text, &parsed, 0xffff) != number_status_INVALID;
+        wrong += parse_signed(text, &signed_value) != number_status_INVALID;
+        text[0] = (char)character;
+        text[1] = '1';
+        wrong += parse_hex(text, &parsed, 0xffff) != number_status_INVALID;
+        if ((character != '-') && (character != '+')) {
+            wrong += parse_signed(text, &signed_value) !=
+                     number_status_INVALID;
+        }
+    }
+    TEST_CHECK(wrong == 0);
+    TEST_CHECK(signed_value == 123);
+}
+
+int main(void) {
+    test_init();
+    test_format_16();
+    test_format_32();
+    test_parse_16();
+    test_parse_limits();
+    test_parse_bad();
+    return test_done("numbers");
+}
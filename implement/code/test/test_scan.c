@@ -0,0 +1,89 @@
+/* test_scan.c
+ *
+ * Tests the ADC scan against a made-up input on each channel: the
+ * averages it reports, and that its entries can't change under it.
+ */
+
+// ----------------------- Include files ------------------------------
+#include "bc_test.h"
+
+/* test_source( mux channel )
+ * Each channel reads 100 counts per channel number, plus one.
+ */
+static uint16_t test_source( uint8_t channel ) {
+    return (channel * 100) + 1;
+}
+
+/* test_scan_entry( reply line, channel, counts, nonzero stamp )
+ * Check one line of scan? against the channel, averaged counts and
+ * whether the entry has been finished.  Returns the next line.
+ */
+static char *test_scan_entry( char *line, unsigned channel, unsigned counts,
+                              int stamped ) {
+    unsigned found_channel = 0;
+    int mv = 0;
+    unsigned found_counts = 0;
+    unsigned long stamp = 0;
+    TEST_CHECK(sscanf(line, "%u %d 0x%x 0x%lx", &found_channel, &mv,
+                      &found_counts, &stamp) == 4);
+    TEST_CHECK(found_channel == channel);
+    TEST_CHECK(found_counts == counts);
+    TEST_CHECK((stamp != 0) == stamped);
+    line = strstr(line, "\r\n");
+    return (line != NULL) ? (line + 2) : "";
+}
+
+/* test_scan_average(void)
+ * Each entry reports its own channel's average.
+ */
+static void test_scan_average(void) {
+    char *line;
+    uint8_t pass;
+    TEST_CHECK(strcmp(test_command("scanch 0 2 4"), "") == 0);
+    TEST_CHECK(strcmp(test_command("scanch 1 3 1"), "") == 0);
+    TEST_CHECK(strcmp(test_command("scan 2"), "") == 0);
+    for (pass = 0; pass < 50; pass++) {
+        hal_wait();
+    }
+    line = test_command("scan?");
+    line = test_scan_entry(line, 2, 201, 1);
+    line = test_scan_entry(line, 3, 301, 1);
+    TEST_CHECK(strncmp(line, "sweeps 0x", 9) == 0);
+}
+
+/* test_scan_locked(void)
+ * scanch is refused while the scan runs and leaves the entry alone.
+ * Once the scan is stopped the entry changes, and the next scan starts
+ * without the totals from the last one.
+ */
+static void test_scan_locked(void) {
+    char *line;
+    uint8_t pass;
+    TEST_CHECK(strstr(test_command("scanch 0 4 2"), "is scanning") != NULL);
+    TEST_CHECK(strstr(test_command("scanch 9 4 2"), "not between") != NULL);
+    line = test_command("scan?");
+    test_scan_entry(line, 2, 201, 1);
+
+    TEST_CHECK(strcmp(test_command("scan 0"), "") == 0);
+    TEST_CHECK(strcmp(test_command("scanch 0 4 2"), "") == 0);
+    TEST_CHECK(strcmp(test_command("scan 2"), "") == 0);
+    line = test_command("scan?");
+    line = test_scan_entry(line, 4, 0, 0);
+    line = test_scan_entry(line, 3, 0, 0);
+    for (pass = 0; pass < 50; pass++) {
+        hal_wait();
+    }
+    line = test_command("scan?");
+    line = test_scan_entry(line, 4, 401, 1);
+    line = test_scan_entry(line, 3, 301, 1);
+    TEST_CHECK(strcmp(test_command("scan 0"), "") == 0);
+}
+
+int main(void) {
+    test_init();
+    hal_linux_adc_source = &test_source;
+    test_scan_average();
+    test_scan_locked();
+    hal_linux_adc_source = NULL;
+    return test_done("scan");
+}
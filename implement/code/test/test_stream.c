@@ -0,0 +1,173 @@
+/* test_stream.c
+ *
+ * Tests the sample stream against a made-up ADC input: the blocks sent
+ * in both formats, the samples lost to overruns, and streamstat?
+ * before and after the stream stops.  Filtered measurements are
+ * refused while the stream runs.
+ */
+
+// ----------------------- Include files ------------------------------
+#include "bc_test.h"
+
+/* bc_adcblock.h
+ * Provides ADCBLOCK_SIZE and ADCBLOCK_COUNT.
+ */
+#include "bc_adcblock.h"
+
+/* Define the stream rate used by the tests.  It's slow enough that the
+ * PC's clock never triggers a conversion during a test, so every
+ * sample comes from hal_linux_adc_trigger().
+ */
+#define TEST_STREAM_RATE "4"
+
+/* The next sample made up by test_source()
+ */
+static uint16_t test_next_sample = 0;
+
+/* test_source( mux channel )
+ * A ramp of odd steps, so swapped or lost samples show up.
+ */
+static uint16_t test_source( uint8_t channel ) {
+    uint16_t sample = test_next_sample;
+    test_next_sample = (test_next_sample + 7) & 0x3ff;
+    return sample;
+}
+
+/* test_hex_block( first sample, sequence number )
+ * Check that the reply is one hex block of samples from test_source(),
+ * starting with first.  Returns the sample after the block.
+ */
+static uint16_t test_hex_block( uint16_t first, uint16_t sequence ) {
+    char expected[TEST_REPLY_SIZE];
+    int length;
+    uint8_t count;
+    length = sprintf(expected, "s %x", sequence);
+    for (count = 0; count < ADCBLOCK_SIZE; count++) {
+        length += sprintf(&expected[length], " %x", first);
+        first = (first + 7) & 0x3ff;
+    }
+    strcat(expected, "\r\n");
+    TEST_CHECK(strcmp(test_reply, expected) == 0);
+    return first;
+}
+
+/* test_drain(void)
+ * Send the finished blocks and catch them in test_reply.
+ */
+static void test_drain(void) {
+    test_capture_start();
+    adc_stream_drain();
+    test_capture_end();
+}
+
+/* test_hex_stream(void)
+ * Each finished block is sent once, in order, and nothing is sent for
+ * a block that isn't finished.
+ */
+static void test_hex_stream(void) {
+    uint16_t first;
+    test_next_sample = 0;
+    TEST_CHECK(strcmp(test_command("stream " TEST_STREAM_RATE " 0"), "") == 0);
+    hal_linux_adc_trigger(ADCBLOCK_SIZE - 1);
+    test_drain();
+    TEST_CHECK(test_reply[0] == '\0');
+    hal_linux_adc_trigger(1);
+    test_drain();
+    first = test_hex_block(0, 0);
+    hal_linux_adc_trigger(ADCBLOCK_SIZE);
+    test_drain();
+    test_hex_block(first, 1);
+    TEST_CHECK(strcmp(test_command("streamstat?"),
+                      TEST_STREAM_RATE " 0x2 0x0\r\n") == 0);
+}
+
+/* test_overruns(void)
+ * Samples that arrive while the main loop holds every block are lost
+ * and counted, and the blocks it holds aren't touched.  The counts are
+ * still there after the stream stops, until it starts again.
+ */
+static void test_overruns(void) {
+    uint16_t first;
+    test_next_sample = 0;
+    TEST_CHECK(strcmp(test_command("stream " TEST_STREAM_RATE " 0"), "") == 0);
+    hal_linux_adc_trigger((ADCBLOCK_COUNT * ADCBLOCK_SIZE) + 5);
+    TEST_CHECK(strcmp(test_command("streamstat?"),
+                      TEST_STREAM_RATE " 0x0 0x5\r\n") == 0);
+    test_drain();
+    TEST_CHECK(strncmp(test_reply, "s 0 0 7 ", 8) == 0);
+    TEST_CHECK(strstr(test_reply, "\r\ns 1 ") != NULL);
+    first = (7 * ADCBLOCK_COUNT * ADCBLOCK_SIZE) & 0x3ff;
+    hal_linux_adc_trigger(ADCBLOCK_SIZE);
+    test_drain();
+    // The five lost samples leave a gap before the next block
+    test_hex_block((first + (7 * 5)) & 0x3ff, 2);
+
+    TEST_CHECK(strcmp(test_command("stream 0 0"), "") == 0);
+    TEST_CHECK(strcmp(test_command("streamstat?"), "0 0x3 0x5\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("stream " TEST_STREAM_RATE " 0"), "") == 0);
+    TEST_CHECK(strcmp(test_command("streamstat?"),
+                      TEST_STREAM_RATE " 0x0 0x0\r\n") == 0);
+    TEST_CHECK(strcmp(test_command("stream 0 0"), "") == 0);
+}
+
+/* test_binary_stream(void)
+ * A binary block is the sync byte, the sequence number, the sample
+ * count, the samples low byte first and a checksum of everything after
+ * the sync byte.
+ */
+static void test_binary_stream(void) {
+    uint8_t *frame = (uint8_t *)test_reply;
+    uint8_t checksum = 0;
+    uint16_t sample = 0x3f0;
+    uint8_t ok = 1;
+    uint8_t count;
+    test_next_sample = sample;
+    TEST_CHECK(strcmp(test_command("stream " TEST_STREAM_RATE " 1"), "") == 0);
+    hal_linux_adc_trigger(ADCBLOCK_SIZE);
+    test_drain();
+    TEST_CHECK(test_reply_length == (4 + (2 * ADCBLOCK_SIZE) + 1));
+    TEST_CHECK(frame[0] == ADC_STREAM_SYNC);
+    TEST_CHECK((frame[1] == 0) && (frame[2] == 0));
+    TEST_CHECK(frame[3] == ADCBLOCK_SIZE);
+    for (count = 0; count < ADCBLOCK_SIZE; count++) {
+        ok &= (frame[4 + (2 * count)] == (uint8_t)sample);
+        ok &= (frame[5 + (2 * count)] == (uint8_t)(sample >> 8));
+        sample = (sample + 7) & 0x3ff;
+    }
+    TEST_CHECK(ok);
+    for (count = 1; count < (test_reply_length - 1); count++) {
+        checksum += frame[count];
+    }
+    TEST_CHECK(checksum == frame[test_reply_length - 1]);
+    TEST_CHECK(strcmp(test_command("stream 0 0"), "") == 0);
+}
+
+/* test_filtered(void)
+ * While the stream runs, measurements that filter or average several
+ * reads are refused, since they would only see the stream's latest
+ * sample.  Unfiltered ones still work.
+ */
+static void test_filtered(void) {
+    test_next_sample = 0x123;
+    TEST_CHECK(strcmp(test_command("stream " TEST_STREAM_RATE " 0"), "") == 0);
+    hal_linux_adc_trigger(1);
+    TEST_CHECK(strcmp(test_command("filter 1 1 1"), "") == 0);
+    TEST_CHECK(strstr(test_command("vcounts?"), "is streaming") != NULL);
+    TEST_CHECK(strstr(test_command("vavg 4"), "is streaming") != NULL);
+    TEST_CHECK(strcmp(test_command("filter 0 0 1"), "") == 0);
+    TEST_CHECK(strcmp(test_command("vcounts?"), "0x123\r\n") == 0);
+    TEST_CHECK(strstr(test_command("vavg 4"), "is streaming") != NULL);
+    TEST_CHECK(strcmp(test_command("stream 0 0"), "") == 0);
+    test_drain();
+}
+
+int main(void) {
+    test_init();
+    hal_linux_adc_source = &test_source;
+    test_hex_stream();
+    test_overruns();
+    test_binary_stream();
+    test_filtered();
+    hal_linux_adc_source = NULL;
+    return test_done("stream");
+}
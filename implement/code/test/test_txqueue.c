@@ -0,0 +1,217 @@
+/* test_txqueue.c
+ *
+ * Tests the transmit queue's ordering and overflow policies, on its own
+ * and behind usart_putc(), and the txpolicy command.  Also prints the
+ * queue's throughput on this PC.
+ */
+
+// ----------------------- Include files ------------------------------
+/* time.h
+ * Provides clock() for the throughput numbers.
+ */
+#include <time.h>
+
+#include "bc_test.h"
+
+/* bc_txqueue.h
+ * The queue under test.
+ */
+#include "bc_txqueue.h"
+
+/* Define the number of characters sent for the throughput numbers
+ */
+#define TEST_THROUGHPUT_CHARS 20000000UL
+
+/* The transmit queue inside bc_usart.c
+ */
+extern txqueue_t *usart_txqueue_ptr;
+
+/* test_fill( pointer to queue, first character, number of characters )
+ * Put a run of counting characters in the queue.  Returns the number
+ * that were refused.
+ */
+static uint16_t test_fill( txqueue_t *queue_ptr, uint8_t first,
+                           uint16_t count ) {
+    uint16_t refused = 0;
+    while (count-- != 0) {
+        if (txqueue_put(queue_ptr, first++) == txqueue_status_FULL) {
+            refused++;
+        }
+    }
+    return refused;
+}
+
+/* test_order(void)
+ * Characters come out in the order they went in, across many trips
+ * around the ring.
+ */
+static void test_order(void) {
+    txqueue_t queue;
+    uint8_t data = 0;
+    uint16_t sent;
+    uint8_t expected = 0;
+    txqueue_init(&queue, txqueue_policy_BLOCK);
+    TEST_CHECK(txqueue_get(&queue, &data) == 1);
+    for (sent = 0; sent < 1000; sent++) {
+        TEST_CHECK(txqueue_put(&queue, (uint8_t)sent) ==
+                   txqueue_status_QUEUED);
+        if ((sent % 3) != 0) {
+            continue;
+        }
+        while (txqueue_get(&queue, &data) == 0) {
+            TEST_CHECK(data == expected);
+            expected++;
+        }
+    }
+    TEST_CHECK(txqueue_count(&queue) == 0);
+    TEST_CHECK(queue.highwater == 3);
+    TEST_CHECK(queue.dropped == 0);
+}
+
+/* test_block(void)
+ * A full queue refuses characters and keeps what it has.
+ */
+static void test_block(void) {
+    txqueue_t queue;
+    uint8_t data;
+    uint16_t index;
+    txqueue_init(&queue, txqueue_policy_BLOCK);
+    TEST_CHECK(test_fill(&queue, 0, TXQUEUE_SIZE + 10) == 10);
+    TEST_CHECK(txqueue_count(&queue) == TXQUEUE_SIZE);
+    TEST_CHECK(queue.highwater == TXQUEUE_SIZE);
+    TEST_CHECK(queue.dropped == 0);
+    for (index = 0; index < TXQUEUE_SIZE; index++) {
+        TEST_CHECK((txqueue_get(&queue, &data) == 0) && (data == index));
+    }
+}
+
+/* test_drop_newest(void)
+ * A full queue throws away the new characters and counts them.
+ */
+static void test_drop_newest(void) {
+    txqueue_t queue;
+    uint8_t data;
+    uint16_t index;
+    txqueue_init(&queue, txqueue_policy_DROP_NEWEST);
+    TEST_CHECK(test_fill(&queue, 0, TXQUEUE_SIZE) == 0);
+    TEST_CHECK(txqueue_put(&queue, 0xaa) == txqueue_status_DROPPED);
+    TEST_CHECK(test_fill(&queue, 0, 9) == 0);
+    TEST_CHECK(queue.dropped == 10);
+    for (index = 0; index < TXQUEUE_SIZE; index++) {
+        TEST_CHECK((txqueue_get(&queue, &data) == 0) && (data == index));
+    }
+    TEST_CHECK(txqueue_get(&queue, &data) == 1);
+}
+
+/* test_drop_oldest(void)
+ * A full queue throws away its oldest characters to make room, so it
+ * ends up holding the newest ones.
+ */
+static void test_drop_oldest(void) {
+    txqueue_t queue;
+    uint8_t data;
+    uint16_t index;
+    txqueue_init(&queue, txqueue_policy_DROP_OLDEST);
+    TEST_CHECK(test_fill(&queue, 0, TXQUEUE_SIZE) == 0);
+    TEST_CHECK(txqueue_put(&queue, TXQUEUE_SIZE) == txqueue_status_DROPPED);
+    TEST_CHECK(test_fill(&queue, TXQUEUE_SIZE + 1, 9) == 0);
+    TEST_CHECK(queue.dropped == 10);
+    TEST_CHECK(txqueue_count(&queue) == TXQUEUE_SIZE);
+    for (index = 10; index < (TXQUEUE_SIZE + 10); index++) {
+        TEST_CHECK((txqueue_get(&queue, &data) == 0) && (data == index));
+    }
+}
+
+/* test_usart_overflow(void)
+ * With interrupts off, usart_putc() under the block policy sends
+ * characters by hand instead of losing them.  Under drop newest, the
+ * characters past the end of the queue are counted and lost.
+ */
+static void test_usart_overflow(void) {
+    char *reply;
+    uint16_t index;
+    uint8_t ok = 1;
+    test_capture_start();
+    cli();
+    for (index = 0; index < 200; index++) {
+        usart_putc('a' + (index % 26));
+    }
+    reply = test_capture_end();
+    TEST_CHECK(strlen(reply) == 200);
+    for (index = 0; index < 200; index++) {
+        ok &= (reply[index] == ('a' + (index % 26)));
+    }
+    TEST_CHECK(ok);
+    TEST_CHECK(usart_txqueue_ptr -> dropped == 0);
+
+    usart_txpolicy(txqueue_policy_DROP_NEWEST);
+    test_capture_start();
+    cli();
+    for (index = 0; index < 200; index++) {
+        usart_putc('x');
+    }
+    reply = test_capture_end();
+    TEST_CHECK(strlen(reply) == TXQUEUE_SIZE);
+    TEST_CHECK(usart_txqueue_ptr -> dropped == (200 - TXQUEUE_SIZE));
+    usart_txpolicy(txqueue_policy_BLOCK);
+}
+
+/* test_txpolicy_command(void)
+ * txpolicy sets the policies it knows and refuses the rest.
+ */
+static void test_txpolicy_command(void) {
+    TEST_CHECK(strcmp(test_command("txpolicy 2"), "") == 0);
+    TEST_CHECK(usart_txqueue_ptr -> policy == txqueue_policy_DROP_OLDEST);
+    TEST_CHECK(strstr(test_command("txpolicy 7"), "not recognized") != NULL);
+    TEST_CHECK(usart_txqueue_ptr -> policy == txqueue_policy_DROP_OLDEST);
+    TEST_CHECK(strcmp(test_command("txpolicy 0"), "") == 0);
+    TEST_CHECK(usart_txqueue_ptr -> policy == txqueue_policy_BLOCK);
+}
+
+/* test_throughput(void)
+ * Print how fast characters go through the queue alone, and through
+ * usart_putc() and the data register empty interrupt.  These are PC
+ * numbers, only good for comparing builds on the same PC.
+ */
+static void test_throughput(void) {
+    txqueue_t queue;
+    uint8_t data = 0;
+    uint32_t sent;
+    clock_t start;
+    double seconds;
+    txqueue_init(&queue, txqueue_policy_BLOCK);
+    start = clock();
+    for (sent = 0; sent < TEST_THROUGHPUT_CHARS; sent++) {
+        txqueue_put(&queue, (uint8_t)sent);
+        if ((sent & 0x1f) == 0x1f) {
+            while (txqueue_get(&queue, &data) == 0);
+        }
+    }
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("txqueue: %.1f M characters/s through the queue\n",
+           TEST_THROUGHPUT_CHARS / seconds / 1e6);
+
+    hal_linux_tx_file = fopen("/dev/null", "w");
+    start = clock();
+    for (sent = 0; sent < (TEST_THROUGHPUT_CHARS / 10); sent++) {
+        usart_putc((char)sent);
+    }
+    hal_wait();
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    fclose(hal_linux_tx_file);
+    hal_linux_tx_file = NULL;
+    printf("txqueue: %.1f M characters/s through usart_putc()\n",
+           (TEST_THROUGHPUT_CHARS / 10) / seconds / 1e6);
+}
+
+int main(void) {
+    test_init();
+    test_order();
+    test_block();
+    test_drop_newest();
+    test_drop_oldest();
+    test_usart_overflow();
+    test_txpolicy_command();
+    test_throughput();
+    return test_done("txqueue");
+}